@@ -88,17 +88,29 @@
 // Default: 3600 (once every hour)
 #define RERESOLVE_INTERVAL 3600
 
+// Number of lines the asynchronous log writer can buffer (must be a power of two)
+// Lines are dropped (and counted) when the writer falls behind
+#define LOG_RING_SIZE 512
+
+// Longest log line passed through the ring buffer [bytes]
+// Longer lines are written synchronously
+#define LOG_LINE_LEN 512
+
+// How often does the log writer check if the log file has been rotated? [seconds]
+#define LOG_REOPEN_INTERVAL 1
+
 // FTLDNS enums
 enum { DATABASE_WRITE_TIMER, EXIT_TIMER, GC_TIMER, LISTS_TIMER, REGEX_TIMER, ARP_TIMER, LAST_TIMER };
-enum { QUERIES, FORWARDED, CLIENTS, DOMAINS, OVERTIME, WILDCARD };
+enum { QUERIES, FORWARDED, CLIENTS, DOMAINS, OVERTIME, WILDCARD, POSTINGS, CLIENTOVERTIME };
 enum { DNSSEC_UNSPECIFIED, DNSSEC_SECURE, DNSSEC_INSECURE, DNSSEC_BOGUS, DNSSEC_ABANDONED, DNSSEC_UNKNOWN };
-enum { QUERY_UNKNOWN, QUERY_GRAVITY, QUERY_FORWARDED, QUERY_CACHE, QUERY_WILDCARD, QUERY_BLACKLIST, QUERY_EXTERNAL_BLOCKED_IP, QUERY_EXTERNAL_BLOCKED_NULL, QUERY_EXTERNAL_BLOCKED_NXRA };
+enum { QUERY_UNKNOWN, QUERY_GRAVITY, QUERY_FORWARDED, QUERY_CACHE, QUERY_WILDCARD, QUERY_BLACKLIST, QUERY_EXTERNAL_BLOCKED_IP, QUERY_EXTERNAL_BLOCKED_NULL, QUERY_EXTERNAL_BLOCKED_NXRA, QUERY_CACHE_STALE, QUERY_STATUS_MAX };
 enum { TYPE_A = 1, TYPE_AAAA, TYPE_ANY, TYPE_SRV, TYPE_SOA, TYPE_PTR, TYPE_TXT, TYPE_MAX };
 enum { REPLY_UNKNOWN, REPLY_NODATA, REPLY_NXDOMAIN, REPLY_CNAME, REPLY_IP, REPLY_DOMAIN, REPLY_RRNAME, REPLY_SERVFAIL, REPLY_REFUSED, REPLY_NOTIMP, REPLY_OTHER };
 enum { PRIVACY_SHOW_ALL = 0, PRIVACY_HIDE_DOMAINS, PRIVACY_HIDE_DOMAINS_CLIENTS, PRIVACY_MAXIMUM, PRIVACY_NOSTATS };
 enum { MODE_IP, MODE_NX, MODE_NULL, MODE_IP_NODATA_AAAA, MODE_NODATA };
 enum { REGEX_UNKNOWN, REGEX_BLOCKED, REGEX_NOTBLOCKED };
 enum { BLOCKING_DISABLED, BLOCKING_ENABLED, BLOCKING_UNKNOWN };
+enum { SETUPVARS_EXCLUDE_DOMAINS, SETUPVARS_EXCLUDE_CLIENTS, SETUPVARS_LISTS };
 enum {
   DEBUG_DATABASE   = (1 << 0),  /* 00000000 00000001 */
   DEBUG_NETWORKING = (1 << 1),  /* 00000000 00000010 */
@@ -116,7 +128,7 @@ enum {
 };
 
 // Database table "ftl"
-enum { DB_VERSION, DB_LASTTIMESTAMP, DB_FIRSTCOUNTERTIMESTAMP };
+enum { DB_VERSION, DB_LASTTIMESTAMP, DB_FIRSTCOUNTERTIMESTAMP, DB_ROLLUPTIMESTAMP };
 // Database table "counters"
 enum { DB_TOTALQUERIES, DB_BLOCKEDQUERIES };
 
@@ -141,6 +153,7 @@ typedef struct {
 	char* blacklist;
 	char* gravity;
 	char* regexlist;
+	char* wildcardlist;
 	char* setupVars;
 	char* auditlist;
 } logFileNamesStruct;
@@ -167,6 +180,14 @@ typedef struct {
 	int reply_CNAME;
 	int reply_IP;
 	int reply_domain;
+	int cached_stale;
+	long long queries_removed;
+	int postings;
+	int postings_MAX;
+	int postings_free;
+	int clientOverTime;
+	int clientOverTime_MAX;
+	int clientOverTime_free;
 } countersStruct;
 
 typedef struct {
@@ -174,6 +195,7 @@ typedef struct {
 	int DBinterval;
 	int port;
 	int maxlogage;
+	int lockthreshold;
 	int16_t debug;
 	unsigned char privacylevel;
 	unsigned char blockingmode;
@@ -185,26 +207,32 @@ typedef struct {
 	bool analyze_only_A_AAAA;
 	bool DBimport;
 	bool parse_arp_cache;
+	bool hooktiming;
 } ConfigStruct;
 
 // Dynamic structs
+// Queries are the bulk of FTL's memory and are walked by most API requests
+// and the garbage collector, so they are kept small (28 bytes)
 typedef struct {
 	unsigned char magic;
-	unsigned char type;
-	unsigned char status;
-	unsigned char privacylevel;
-	unsigned char reply;
-	unsigned char dnssec;
-	time_t timestamp;
+	unsigned char type:4;
+	unsigned char status:4;
+	unsigned char reply:4;
+	unsigned char dnssec:3;
+	bool complete:1;
+	unsigned char timeidx; // less than OVERTIME_SLOTS
+	unsigned int timestamp; // unsigned 32 bit seconds last until 2106
 	int domainID;
 	int clientID;
 	int forwardID;
 	int id; // the ID is a (signed) int in dnsmasq, so no need for a long int here
-	unsigned long response; // saved in units of 1/10 milliseconds (1 = 0.1ms, 2 = 0.2ms, 2500 = 250.0ms, etc.)
-	int64_t db;
-	unsigned int timeidx;
-	bool complete;
+	// Saved in units of 1/10 milliseconds (1 = 0.1ms, 2 = 0.2ms, 2500 = 250.0ms, etc.)
+	// Until the query is answered, this is the time it was received relative to its timestamp
+	unsigned int response:26;
+	unsigned int privacylevel:3;
+	bool db:1; // stored in the long-term database
 } queriesDataStruct;
+_Static_assert(OVERTIME_SLOTS <= 256, "timeidx does not fit into queriesDataStruct");
 
 typedef struct {
 	unsigned char magic;
@@ -222,9 +250,13 @@ typedef struct {
 	time_t lastQuery;
 	int count;
 	int blockedcount;
-	int overTime[OVERTIME_SLOTS];
 	unsigned int numQueriesARP;
 	bool new;
+	bool localname;
+	int firstposting;
+	int lastposting;
+	int firstovertime;
+	int lastovertime;
 } clientsDataStruct;
 
 typedef struct {
@@ -233,8 +265,41 @@ typedef struct {
 	size_t domainpos;
 	int count;
 	int blockedcount;
+	int firstposting;
+	int lastposting;
 } domainsDataStruct;
 
+// Chunks of the per-client and per-domain lists of queries. The lists
+// hold query IDs (index + counters->queries_removed) in ascending order.
+// Chunk 0 is never used, it marks the end of a list
+#define POSTINGS_PER_CHUNK 14
+typedef struct {
+	int next;
+	int count;
+	long long id[POSTINGS_PER_CHUNK];
+} postingsDataStruct;
+
+// Chunks of the per-client query counts over time. Only slots the client
+// was active in are stored, ordered by their absolute slot number
+// (timestamp / OVERTIME_INTERVAL) so that they stay valid when overTime
+// is rotated. Chunk 0 is never used, it marks the end of a list
+#define CLIENT_OVERTIME_PER_CHUNK 7
+typedef struct {
+	int next;
+	int count;
+	unsigned int slot[CLIENT_OVERTIME_PER_CHUNK];
+	int queries[CLIENT_OVERTIME_PER_CHUNK];
+} clientOverTimeDataStruct;
+
+// Ring of recently answered queries (their IDs) for >stream subscribers.
+// head counts all queries ever added, subscribers keep their own position
+// and are told about queries they missed when falling behind
+#define STREAM_SLOTS 4096
+typedef struct {
+	unsigned long long head;
+	long long id[STREAM_SLOTS];
+} streamDataStruct;
+
 typedef struct {
 	unsigned char magic;
 	time_t timestamp;
@@ -276,6 +341,9 @@ extern forwardedDataStruct *forwarded;
 extern clientsDataStruct *clients;
 extern domainsDataStruct *domains;
 extern overTimeDataStruct *overTime;
+extern postingsDataStruct *postings;
+extern clientOverTimeDataStruct *clientOverTime;
+extern streamDataStruct *querystream;
 
 // Used in gc.c, memory.c, resolve.c, signals.c, and socket.c
 extern volatile sig_atomic_t killed;
@@ -295,6 +363,8 @@ extern bool DBdeleteoldqueries;
 extern bool ipv4telnet, ipv6telnet;
 // Used in api.c, and socket.c
 extern bool istelnet[MAXCONNS];
+// Used in dnsmasq_interface.c and resolve.c
+extern int dnsport;
 
 // Use out own memory handling functions that will detect possible errors
 // and report accordingly in the log. This will make debugging FTL crashs
@@ -10,7 +10,11 @@
 
 #include "FTL.h"
 #include "api.h"
+#include "shmem.h"
+#include "timing.h"
+#include "overTime.h"
 #include "version.h"
+#include <poll.h>
 // needed for sqlite3_libversion()
 #include "sqlite3.h"
 
@@ -109,14 +113,104 @@ void getStats(int *sock)
 	}
 	else
 		pack_uint8(*sock, blockingstatus);
+
+	// Send number of queries answered from expired cache entries (already included in queries_cached)
+	if(istelnet[*sock]) {
+		ssend(*sock, "queries_cached_stale %i\n", counters->cached_stale);
+	}
+	else
+		pack_int32(*sock, counters->cached_stale);
 }
 
-void getOverTime(int *sock)
+// Coarser resolutions beyond overTime: ">overTime resolution=<seconds>",
+// optionally limited by " from=<timestamp>" and " until=<timestamp>".
+// Returns the tier to be used and its first and last interval to be sent
+// or NULL if the 10 minute resolution of overTime itself is fine enough.
+// The tiers are only changed by garbage collection while the shared memory
+// is moved, so these listings are retried like the overTime ones
+static rollupTier *getRollupRange(const char *client_message, time_t *from, time_t *until)
+{
+	const char *arg;
+	int resolution = 0;
+	if((arg = strstr(client_message, " resolution=")) == NULL ||
+	   sscanf(arg, " resolution=%i", &resolution) != 1)
+		return NULL;
+
+	rollupTier *tier = get_rollup_tier(resolution);
+	if(tier == NULL)
+		return NULL;
+
+	const time_t now = time(NULL);
+	long long timestamp;
+	*until = now;
+	if((arg = strstr(client_message, " until=")) != NULL &&
+	   sscanf(arg, " until=%lli", &timestamp) == 1 && timestamp < now)
+		*until = timestamp;
+	*from = now - (time_t)(tier->slots - 1) * tier->interval;
+	if((arg = strstr(client_message, " from=")) != NULL &&
+	   sscanf(arg, " from=%lli", &timestamp) == 1 && timestamp > *from)
+		*from = timestamp;
+
+	// Start with the first interval holding data
+	rollupDataStruct sum;
+	*from -= *from % tier->interval;
+	while(*from <= *until && !get_rollup_sum(tier, *from, &sum))
+		*from += tier->interval;
+
+	return tier;
+}
+
+static void getRollupOverTime(rollupTier *tier, const time_t from, const time_t until, int *sock)
+{
+	if(from > until)
+		return;
+
+	const int interval = tier->interval;
+	rollupDataStruct sum;
+	if(istelnet[*sock])
+	{
+		for(time_t t = from; t <= until; t += interval)
+		{
+			get_rollup_sum(tier, t, &sum);
+			ssend(*sock, "%li %i %i\n", t + interval/2, sum.total, sum.blocked);
+		}
+	}
+	else
+	{
+		const int n = (int)(until / interval - from / interval) + 1;
+
+		// Send domains over time
+		pack_map16_start(*sock, (uint16_t) n);
+		for(time_t t = from; t <= until; t += interval) {
+			get_rollup_sum(tier, t, &sum);
+			pack_int32(*sock, t + interval/2);
+			pack_int32(*sock, sum.total);
+		}
+
+		// Send ads over time
+		pack_map16_start(*sock, (uint16_t) n);
+		for(time_t t = from; t <= until; t += interval) {
+			get_rollup_sum(tier, t, &sum);
+			pack_int32(*sock, t + interval/2);
+			pack_int32(*sock, sum.blocked);
+		}
+	}
+}
+
+void getOverTime(const char *client_message, int *sock)
 {
 	int i, from = 0, until = OVERTIME_SLOTS;
 	bool found = false;
 	time_t mintime = overTime[0].timestamp;
 
+	time_t rollupfrom, rollupuntil;
+	rollupTier *tier = getRollupRange(client_message, &rollupfrom, &rollupuntil);
+	if(tier != NULL)
+	{
+		getRollupOverTime(tier, rollupfrom, rollupuntil, sock);
+		return;
+	}
+
 	// Start with the first non-empty overTime slot
 	for(i=0; i < OVERTIME_SLOTS; i++)
 	{
@@ -173,7 +267,9 @@ void getOverTime(int *sock)
 
 void getTopDomains(const char *client_message, int *sock)
 {
-	int i, temparray[counters->domains][2], count=10, num;
+	// Read the counter once, the resolver may add domains while we work
+	const int ndomains = __atomic_load_n(&counters->domains, __ATOMIC_ACQUIRE);
+	int i, temparray[ndomains][2], count=10, num;
 	bool blocked, audit = false, asc = false;
 
 	blocked = command(client_message, ">top-ads");
@@ -205,7 +301,7 @@ void getTopDomains(const char *client_message, int *sock)
 	if(command(client_message, " asc"))
 		asc = true;
 
-	for(i=0; i < counters->domains; i++)
+	for(i=0; i < ndomains; i++)
 	{
 		validate_access("domains", i, true, __LINE__, __FUNCTION__, __FILE__);
 		temparray[i][0] = i;
@@ -218,9 +314,9 @@ void getTopDomains(const char *client_message, int *sock)
 
 	// Sort temporary array
 	if(asc)
-		qsort(temparray, counters->domains, sizeof(int[2]), cmpasc);
+		qsort(temparray, ndomains, sizeof(int[2]), cmpasc);
 	else
-		qsort(temparray, counters->domains, sizeof(int[2]), cmpdesc);
+		qsort(temparray, ndomains, sizeof(int[2]), cmpdesc);
 
 
 	// Get filter
@@ -240,16 +336,12 @@ void getTopDomains(const char *client_message, int *sock)
 	}
 	clearSetupVarsArray();
 
+	// Load (or refresh) the audit list
+	if(audit)
+		refresh_auditlist();
+
 	// Get domains which the user doesn't want to see
-	char * excludedomains = NULL;
-	if(!audit)
-	{
-		excludedomains = read_setupVarsconf("API_EXCLUDE_DOMAINS");
-		if(excludedomains != NULL)
-		{
-			getSetupVarsArray(excludedomains);
-		}
-	}
+	const bool excludedomains = !audit && getSetupVarsList(SETUPVARS_EXCLUDE_DOMAINS);
 
 	if(!istelnet[*sock])
 	{
@@ -261,18 +353,18 @@ void getTopDomains(const char *client_message, int *sock)
 	}
 
 	int n = 0;
-	for(i=0; i < counters->domains; i++)
+	for(i=0; i < ndomains; i++)
 	{
 		// Get sorted indices
 		int j = temparray[i][0];
 		validate_access("domains", j, true, __LINE__, __FUNCTION__, __FILE__);
 
 		// Skip this domain if there is a filter on it
-		if(excludedomains != NULL && insetupVarsArray(getstr(domains[j].domainpos)))
+		if(excludedomains && insetupVarsList(SETUPVARS_EXCLUDE_DOMAINS, getstr(domains[j].domainpos)))
 			continue;
 
 		// Skip this domain if already included in audit
-		if(audit && countlineswith(getstr(domains[j].domainpos), files.auditlist) > 0)
+		if(audit && in_auditlist(getstr(domains[j].domainpos)))
 			continue;
 
 		// Hidden domain, probably due to privacy level. Skip this in the top lists
@@ -328,14 +420,13 @@ void getTopDomains(const char *client_message, int *sock)
 		if(n == count)
 			break;
 	}
-
-	if(excludedomains != NULL)
-		clearSetupVarsArray();
 }
 
 void getTopClients(const char *client_message, int *sock)
 {
-	int i, temparray[counters->clients][2], count=10, num;
+	// Read the counter once, the resolver may add clients while we work
+	const int nclients = __atomic_load_n(&counters->clients, __ATOMIC_ACQUIRE);
+	int i, temparray[nclients][2], count=10, num;
 
 	// Exit before processing any data if requested via config setting
 	get_privacy_level(NULL);
@@ -368,7 +459,7 @@ void getTopClients(const char *client_message, int *sock)
 	if(command(client_message, " blocked"))
 		blockedonly = true;
 
-	for(i=0; i < counters->clients; i++)
+	for(i=0; i < nclients; i++)
 	{
 		validate_access("clients", i, true, __LINE__, __FUNCTION__, __FILE__);
 		temparray[i][0] = i;
@@ -384,16 +475,12 @@ void getTopClients(const char *client_message, int *sock)
 
 	// Sort temporary array
 	if(asc)
-		qsort(temparray, counters->clients, sizeof(int[2]), cmpasc);
+		qsort(temparray, nclients, sizeof(int[2]), cmpasc);
 	else
-		qsort(temparray, counters->clients, sizeof(int[2]), cmpdesc);
+		qsort(temparray, nclients, sizeof(int[2]), cmpdesc);
 
 	// Get clients which the user doesn't want to see
-	char * excludeclients = read_setupVarsconf("API_EXCLUDE_CLIENTS");
-	if(excludeclients != NULL)
-	{
-		getSetupVarsArray(excludeclients);
-	}
+	const bool excludeclients = getSetupVarsList(SETUPVARS_EXCLUDE_CLIENTS);
 
 	if(!istelnet[*sock])
 	{
@@ -402,7 +489,7 @@ void getTopClients(const char *client_message, int *sock)
 	}
 
 	int n = 0;
-	for(i=0; i < counters->clients; i++)
+	for(i=0; i < nclients; i++)
 	{
 		// Get sorted indices and counter values (may be either total or blocked count)
 		int j = temparray[i][0];
@@ -410,8 +497,9 @@ void getTopClients(const char *client_message, int *sock)
 		validate_access("clients", j, true, __LINE__, __FUNCTION__, __FILE__);
 
 		// Skip this client if there is a filter on it
-		if(excludeclients != NULL &&
-			(insetupVarsArray(getstr(clients[j].ippos)) || insetupVarsArray(getstr(clients[j].namepos))))
+		if(excludeclients &&
+			(insetupVarsList(SETUPVARS_EXCLUDE_CLIENTS, getstr(clients[j].ippos)) ||
+			 insetupVarsList(SETUPVARS_EXCLUDE_CLIENTS, getstr(clients[j].namepos))))
 			continue;
 
 		// Hidden client, probably due to privacy level. Skip this in the top lists
@@ -441,21 +529,20 @@ void getTopClients(const char *client_message, int *sock)
 		if(n == count)
 			break;
 	}
-
-	if(excludeclients != NULL)
-		clearSetupVarsArray();
 }
 
 
 void getForwardDestinations(const char *client_message, int *sock)
 {
 	bool sort = true;
-	int temparray[counters->forwarded][2], totalqueries = 0;
+	// Read the counter once, the resolver may add upstreams while we work
+	const int nforwarded = __atomic_load_n(&counters->forwarded, __ATOMIC_ACQUIRE);
+	int temparray[nforwarded][2], totalqueries = 0;
 
 	if(command(client_message, "unsorted"))
 		sort = false;
 
-	for(int i = 0; i < counters->forwarded; i++) {
+	for(int i = 0; i < nforwarded; i++) {
 		validate_access("forwarded", i, true, __LINE__, __FUNCTION__, __FILE__);
 		// If we want to print a sorted output, we fill the temporary array with
 		// the values we will use for sorting afterwards
@@ -468,13 +555,13 @@ void getForwardDestinations(const char *client_message, int *sock)
 	if(sort)
 	{
 		// Sort temporary array in descending order
-		qsort(temparray, counters->forwarded, sizeof(int[2]), cmpdesc);
+		qsort(temparray, nforwarded, sizeof(int[2]), cmpdesc);
 	}
 
 	totalqueries = counters->forwardedqueries + counters->cached + counters->blocked;
 
 	// Loop over available forward destinations
-	for(int i = -2; i < min(counters->forwarded, 8); i++)
+	for(int i = -2; i < min(nforwarded, 8); i++)
 	{
 		float percentage = 0.0f;
 		const char* ip, *name;
@@ -576,6 +663,68 @@ void getQueryTypes(int *sock)
 
 const char *querytypes[8] = {"A","AAAA","ANY","SRV","SOA","PTR","TXT","UNKN"};
 
+// Send a single row of the query log
+static bool sendQuery(const int *sock, const int i)
+{
+	const char *qtype = querytypes[queries[i].type - TYPE_A];
+
+	// Ask subroutine for domain. It may return "hidden" depending on
+	// the privacy settings at the time the query was made
+	const char *domain = getDomainString(i);
+	// Similarly for the client
+	const char *client;
+	if(strlen(getstr(clients[queries[i].clientID].namepos)) > 0)
+		client = getClientNameString(i);
+	else
+		client = getClientIPString(i);
+
+	unsigned long delay = queries[i].response;
+	// Check if received (delay should be smaller than 30min)
+	if(queries[i].reply == REPLY_UNKNOWN || delay > 1.8e7)
+		delay = 0;
+
+	if(istelnet[*sock])
+	{
+		ssend(*sock,"%u %s %s %s %i %i %i %lu",queries[i].timestamp,qtype,domain,client,queries[i].status,queries[i].dnssec,queries[i].reply,delay);
+		if(config.debug & DEBUG_API)
+			ssend(*sock, " %i", i);
+		ssend(*sock, "\n");
+	}
+	else
+	{
+		pack_int32(*sock, queries[i].timestamp);
+
+		// Use a fixstr because the length of qtype is always 4 (max is 31 for fixstr)
+		if(!pack_fixstr(*sock, qtype))
+			return false;
+
+		// Use str32 for domain and client because we have no idea how long they will be (max is 4294967295 for str32)
+		if(!pack_str32(*sock, domain) || !pack_str32(*sock, client))
+			return false;
+
+		pack_uint8(*sock, queries[i].status);
+		pack_uint8(*sock, queries[i].dnssec);
+	}
+
+	return true;
+}
+
+// Queries are stored in the order they arrived, so their timestamps are
+// (apart from clock adjustments) sorted. Return the first index in [lo, hi)
+// whose timestamp is not before t
+static int __attribute__((pure)) find_query_time(int lo, int hi, const time_t t)
+{
+	while(lo < hi)
+	{
+		const int mid = lo + (hi - lo) / 2;
+		if(queries[mid].timestamp < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
 void getAllQueries(const char *client_message, int *sock)
 {
 	// Exit before processing any data if requested via config setting
@@ -632,9 +781,10 @@ void getAllQueries(const char *client_message, int *sock)
 		{
 			// Iterate through all known forward destinations
 			int i;
-			validate_access("forwards", MAX(0,counters->forwarded-1), true, __LINE__, __FUNCTION__, __FILE__);
+			const int nforwarded = __atomic_load_n(&counters->forwarded, __ATOMIC_ACQUIRE);
+			validate_access("forwards", MAX(0,nforwarded-1), true, __LINE__, __FUNCTION__, __FILE__);
 			forwarddestid = -3;
-			for(i = 0; i < counters->forwarded; i++)
+			for(i = 0; i < nforwarded; i++)
 			{
 				// Try to match the requested string against their IP addresses and
 				// (if available) their host names
@@ -665,8 +815,9 @@ void getAllQueries(const char *client_message, int *sock)
 		filterdomainname = true;
 		// Iterate through all known domains
 		int i;
-		validate_access("domains", MAX(0,counters->domains-1), true, __LINE__, __FUNCTION__, __FILE__);
-		for(i = 0; i < counters->domains; i++)
+		const int ndomains = __atomic_load_n(&counters->domains, __ATOMIC_ACQUIRE);
+		validate_access("domains", MAX(0,ndomains-1), true, __LINE__, __FUNCTION__, __FILE__);
+		for(i = 0; i < ndomains; i++)
 		{
 			// Try to match the requested string
 			if(strcmp(getstr(domains[i].domainpos), domainname) == 0)
@@ -693,8 +844,9 @@ void getAllQueries(const char *client_message, int *sock)
 		filterclientname = true;
 		// Iterate through all known clients
 		int i;
-		validate_access("clients", MAX(0,counters->clients-1), true, __LINE__, __FUNCTION__, __FILE__);
-		for(i = 0; i < counters->clients; i++)
+		const int nclients = __atomic_load_n(&counters->clients, __ATOMIC_ACQUIRE);
+		validate_access("clients", MAX(0,nclients-1), true, __LINE__, __FUNCTION__, __FILE__);
+		for(i = 0; i < nclients; i++)
 		{
 			// Try to match the requested string
 			if(strcmp(getstr(clients[i].ippos), clientname) == 0 ||
@@ -714,17 +866,47 @@ void getAllQueries(const char *client_message, int *sock)
 		}
 	}
 
-	int ibeg = 0, num;
+	// Rows added while we are sending are not included
+	const int total = __atomic_load_n(&counters->queries, __ATOMIC_ACQUIRE);
+	int ibeg = 0, iend = total, num;
 	// Test for integer that specifies number of entries to be shown
 	if(sscanf(client_message, "%*[^(](%i)", &num) > 0)
 	{
 		// User wants a different number of requests
 		// Don't allow a start index that is smaller than zero
-		ibeg = counters->queries-num;
+		ibeg = total-num;
 		if(ibeg < 0)
 			ibeg = 0;
 	}
 
+	// Seek to the requested timeframe instead of filtering all queries
+	if(from != 0)
+		ibeg = find_query_time(ibeg, iend, from);
+	if(until != 0)
+		iend = find_query_time(ibeg, iend, (time_t)until + 1);
+
+	// Cursor-based pagination: >getallqueries after=<id> limit=<n>
+	// IDs stay the same when the garbage collector removes old queries.
+	// The ID of the last query looked at is returned as cursor to be
+	// passed as after=<id> to get the next page
+	const char *arg;
+	long long after = -1;
+	int limit = 0;
+	bool paginate = false;
+	if((arg = strstr(client_message, " after=")) != NULL &&
+	   sscanf(arg, " after=%lli", &after) == 1)
+	{
+		paginate = true;
+		const long long next = after + 1 - counters->queries_removed;
+		if(next > ibeg)
+			ibeg = next < iend ? (int)next : iend;
+	}
+	if((arg = strstr(client_message, " limit=")) != NULL &&
+	   sscanf(arg, " limit=%i", &limit) == 1 && limit > 0)
+		paginate = true;
+	else
+		limit = 0;
+
 	// Get potentially existing filtering flags
 	char * filter = read_setupVarsconf("API_QUERY_LOG_SHOW");
 	bool showpermitted = true, showblocked = true;
@@ -742,9 +924,29 @@ void getAllQueries(const char *client_message, int *sock)
 	}
 	clearSetupVarsArray();
 
-	int i;
-	for(i=ibeg; i < counters->queries; i++)
+	// Queries of a single client or domain are found through their lists
+	// instead of walking the whole log. Use the shorter list if both
+	// a client and a domain have been requested
+	const bool uselist = filterclientname || filterdomainname;
+	int chunk = 0, pos = 0;
+	if(filterclientname && (!filterdomainname || clients[clientid].count <= domains[domainid].count))
+		chunk = __atomic_load_n(&clients[clientid].firstposting, __ATOMIC_ACQUIRE);
+	else if(filterdomainname)
+		chunk = __atomic_load_n(&domains[domainid].firstposting, __ATOMIC_ACQUIRE);
+
+	int i = ibeg - 1, last = iend - 1, sent = 0;
+	while(true)
 	{
+		if(limit > 0 && sent >= limit)
+		{
+			last = i;
+			break;
+		}
+
+		i = uselist ? next_posting(&chunk, &pos, i + 1) : i + 1;
+		if(i < 0 || i >= iend)
+			break;
+
 		validate_access("queries", i, true, __LINE__, __FUNCTION__, __FILE__);
 		// Check if this query has been create while in maximum privacy mode
 		if(queries[i].privacylevel >= PRIVACY_MAXIMUM) continue;
@@ -752,20 +954,20 @@ void getAllQueries(const char *client_message, int *sock)
 		validate_access("domains", queries[i].domainID, true, __LINE__, __FUNCTION__, __FILE__);
 		validate_access("clients", queries[i].clientID, true, __LINE__, __FUNCTION__, __FILE__);
 
-		const char *qtype = querytypes[queries[i].type - TYPE_A];
-
 		// 1 = gravity.list, 4 = wildcard, 5 = black.list
 		if((queries[i].status == QUERY_GRAVITY ||
 		    queries[i].status == QUERY_WILDCARD ||
 		    queries[i].status == QUERY_BLACKLIST) && !showblocked)
 			continue;
-		// 2 = forwarded, 3 = cached
+		// 2 = forwarded, 3 = cached, 9 = cached (stale)
 		if((queries[i].status == QUERY_FORWARDED ||
-		    queries[i].status == QUERY_CACHE) && !showpermitted)
+		    queries[i].status == QUERY_CACHE ||
+		    queries[i].status == QUERY_CACHE_STALE) && !showpermitted)
 			continue;
 
 		// Skip those entries which so not meet the requested timeframe
-		if((from > queries[i].timestamp && from != 0) || (queries[i].timestamp > until && until != 0))
+		const time_t timestamp = queries[i].timestamp;
+		if((from > timestamp && from != 0) || (timestamp > until && until != 0))
 			continue;
 
 		// Skip if domain is not identical with what the user wants to see
@@ -788,50 +990,28 @@ void getAllQueries(const char *client_message, int *sock)
 			                       && queries[i].status != QUERY_BLACKLIST)
 				continue;
 			// Does the user want to see queries answered from local cache?
-			else if(forwarddestid == -1 && queries[i].status != QUERY_CACHE)
+			else if(forwarddestid == -1 && queries[i].status != QUERY_CACHE
+			                            && queries[i].status != QUERY_CACHE_STALE)
 				continue;
 			// Does the user want to see queries answered by an upstream server?
 			else if(forwarddestid >= 0 && forwarddestid != queries[i].forwardID)
 				continue;
 		}
 
-		// Ask subroutine for domain. It may return "hidden" depending on
-		// the privacy settings at the time the query was made
-		const char *domain = getDomainString(i);
-		// Similarly for the client
-		const char *client;
-		if(strlen(getstr(clients[queries[i].clientID].namepos)) > 0)
-			client = getClientNameString(i);
-		else
-			client = getClientIPString(i);
-
-		unsigned long delay = queries[i].response;
-		// Check if received (delay should be smaller than 30min)
-		if(delay > 1.8e7)
-			delay = 0;
+		sent++;
+		if(!sendQuery(sock, i))
+			return;
+	}
 
+	if(paginate)
+	{
+		// ID of the last query looked at (or of the one before the first
+		// query of this page if there was nothing to look at)
+		long long cursor = MAX(after, last + counters->queries_removed);
 		if(istelnet[*sock])
-		{
-			ssend(*sock,"%li %s %s %s %i %i %i %lu",queries[i].timestamp,qtype,domain,client,queries[i].status,queries[i].dnssec,queries[i].reply,delay);
-			if(config.debug & DEBUG_API)
-				ssend(*sock, " %i", i);
-			ssend(*sock, "\n");
-		}
+			ssend(*sock, "cursor %lli\n", cursor);
 		else
-		{
-			pack_int32(*sock, queries[i].timestamp);
-
-			// Use a fixstr because the length of qtype is always 4 (max is 31 for fixstr)
-			if(!pack_fixstr(*sock, qtype))
-				return;
-
-			// Use str32 for domain and client because we have no idea how long they will be (max is 4294967295 for str32)
-			if(!pack_str32(*sock, domain) || !pack_str32(*sock, client))
-				return;
-
-			pack_uint8(*sock, queries[i].status);
-			pack_uint8(*sock, queries[i].dnssec);
-		}
+			pack_int64(*sock, cursor);
 	}
 
 	// Free allocated memory
@@ -845,20 +1025,160 @@ void getAllQueries(const char *client_message, int *sock)
 		free(forwarddest);
 }
 
+// Interval (in milliseconds) in which >stream subscribers look for new queries
+#define STREAM_INTERVAL 100
+
+static void sendQueryStream(const int *sock, const long long *ids, const unsigned int n,
+                            const unsigned long long dropped, const bool showpermitted, const bool showblocked)
+{
+	if(dropped > 0)
+	{
+		// Tell the subscriber it fell behind instead of waiting for it
+		if(istelnet[*sock])
+			ssend(*sock, "dropped %llu\n", dropped);
+		else if(pack_fixstr(*sock, "dropped"))
+			pack_uint64(*sock, dropped);
+	}
+
+	const int total = __atomic_load_n(&counters->queries, __ATOMIC_ACQUIRE);
+	for(unsigned int k = 0; k < n; k++)
+	{
+		// Skip queries already removed by the garbage collector
+		const long long idx = ids[k] - counters->queries_removed;
+		if(idx < 0 || idx >= total)
+			continue;
+		const int i = (int)idx;
+
+		validate_access("queries", i, true, __LINE__, __FUNCTION__, __FILE__);
+		// Check if this query has been create while in maximum privacy mode
+		if(queries[i].privacylevel >= PRIVACY_MAXIMUM) continue;
+
+		validate_access("domains", queries[i].domainID, true, __LINE__, __FUNCTION__, __FILE__);
+		validate_access("clients", queries[i].clientID, true, __LINE__, __FUNCTION__, __FILE__);
+
+		// 1 = gravity.list, 4 = wildcard, 5 = black.list
+		if((queries[i].status == QUERY_GRAVITY ||
+		    queries[i].status == QUERY_WILDCARD ||
+		    queries[i].status == QUERY_BLACKLIST) && !showblocked)
+			continue;
+		// 2 = forwarded, 3 = cached, 9 = cached (stale)
+		if((queries[i].status == QUERY_FORWARDED ||
+		    queries[i].status == QUERY_CACHE ||
+		    queries[i].status == QUERY_CACHE_STALE) && !showpermitted)
+			continue;
+
+		if(!sendQuery(sock, i))
+			return;
+	}
+}
+
+void getQueryStream(const char *client_message, int *sock)
+{
+	// Exit before processing any data if requested via config setting
+	get_privacy_level(NULL);
+	if(config.privacylevel >= PRIVACY_MAXIMUM)
+		return;
+
+	// Nothing to stream if the client is about to disconnect
+	if(command(client_message, ">quit"))
+		return;
+
+	// Get potentially existing filtering flags
+	char * filter = read_setupVarsconf("API_QUERY_LOG_SHOW");
+	bool showpermitted = true, showblocked = true;
+	if(filter != NULL)
+	{
+		if((strcmp(filter, "permittedonly")) == 0)
+			showblocked = false;
+		else if((strcmp(filter, "blockedonly")) == 0)
+			showpermitted = false;
+		else if((strcmp(filter, "nothing")) == 0)
+		{
+			showpermitted = false;
+			showblocked = false;
+		}
+	}
+	clearSetupVarsArray();
+
+	long long *ids = calloc(STREAM_SLOTS, sizeof(long long));
+	if(ids == NULL)
+		return;
+
+	// Only queries answered from now on are sent
+	unsigned long long pos = __atomic_load_n(&querystream->head, __ATOMIC_ACQUIRE);
+	while(!killed)
+	{
+		// Any input ends the stream. It is processed as the next
+		// request (or the connection is closed) once we return
+		struct pollfd pfd = { .fd = *sock, .events = POLLIN };
+		if(poll(&pfd, 1, STREAM_INTERVAL) != 0)
+			break;
+
+		const unsigned long long head = __atomic_load_n(&querystream->head, __ATOMIC_ACQUIRE);
+		if(head == pos)
+			continue;
+
+		// Queries whose slots have already been re-used are lost
+		unsigned long long dropped = 0;
+		if(head - pos > STREAM_SLOTS)
+		{
+			dropped = head - pos - STREAM_SLOTS;
+			pos = head - STREAM_SLOTS;
+		}
+
+		// Copy the IDs, then check which of them may have been
+		// overwritten while copying
+		unsigned int n = 0;
+		for(unsigned long long p = pos; p < head; p++)
+			ids[n++] = querystream->id[p % STREAM_SLOTS];
+		const unsigned long long now = __atomic_load_n(&querystream->head, __ATOMIC_ACQUIRE);
+		unsigned int skip = 0;
+		if(now - pos > STREAM_SLOTS)
+		{
+			skip = now - pos - STREAM_SLOTS < n ? now - pos - STREAM_SLOTS : n;
+			dropped += skip;
+		}
+		pos = head;
+
+		// Format the queries without holding the lock. Nothing is sent
+		// before the output is complete, a slow subscriber only ever
+		// blocks its own thread
+		capture_output();
+		readSnapshot snapshot;
+		if(read_begin(&snapshot))
+		{
+			sendQueryStream(sock, ids + skip, n - skip, dropped, showpermitted, showblocked);
+			if(read_end(&snapshot, true))
+			{
+				flush_output(*sock);
+				continue;
+			}
+			discard_output();
+		}
+		lock_shm();
+		sendQueryStream(sock, ids + skip, n - skip, dropped, showpermitted, showblocked);
+		unlock_shm();
+		flush_output(*sock);
+	}
+
+	free(ids);
+}
+
 void getRecentBlocked(const char *client_message, int *sock)
 {
 	int num=1;
+	const int total = __atomic_load_n(&counters->queries, __ATOMIC_ACQUIRE);
 
 	// Test for integer that specifies number of entries to be shown
 	if(sscanf(client_message, "%*[^(](%i)", &num) > 0) {
 		// User wants a different number of requests
-		if(num >= counters->queries)
+		if(num >= total)
 			num = 0;
 	}
 
 	// Find most recently blocked query
 	int found = 0;
-	for(int i = counters->queries - 1; i > 0 ; i--)
+	for(int i = total - 1; i > 0 ; i--)
 	{
 		validate_access("queries", i, true, __LINE__, __FUNCTION__, __FILE__);
 
@@ -891,10 +1211,43 @@ void getClientID(int *sock)
 		pack_int32(*sock, *sock);
 }
 
-void getQueryTypesOverTime(int *sock)
+static void getRollupQueryTypesOverTime(rollupTier *tier, const time_t from, const time_t until, int *sock)
+{
+	const int interval = tier->interval;
+	rollupDataStruct r;
+	for(time_t t = from; t <= until; t += interval)
+	{
+		get_rollup_sum(tier, t, &r);
+		float percentageIPv4 = 0.0, percentageIPv6 = 0.0;
+		int sum = r.ipv4 + r.ipv6;
+
+		if(sum > 0) {
+			percentageIPv4 = (float) (1e2 * r.ipv4 / sum);
+			percentageIPv6 = (float) (1e2 * r.ipv6 / sum);
+		}
+
+		if(istelnet[*sock])
+			ssend(*sock, "%li %.2f %.2f\n", t + interval/2, percentageIPv4, percentageIPv6);
+		else {
+			pack_int32(*sock, t + interval/2);
+			pack_float(*sock, percentageIPv4);
+			pack_float(*sock, percentageIPv6);
+		}
+	}
+}
+
+void getQueryTypesOverTime(const char *client_message, int *sock)
 {
 	int i, from = -1, until = OVERTIME_SLOTS;
 	time_t mintime = overTime[0].timestamp;
+
+	time_t rollupfrom, rollupuntil;
+	rollupTier *tier = getRollupRange(client_message, &rollupfrom, &rollupuntil);
+	if(tier != NULL)
+	{
+		getRollupQueryTypesOverTime(tier, rollupfrom, rollupuntil, sock);
+		return;
+	}
 	for(i = 0; i < OVERTIME_SLOTS; i++)
 	{
 		if((overTime[i].total > 0 || overTime[i].blocked > 0) && overTime[i].timestamp >= mintime)
@@ -987,6 +1340,129 @@ void getVersion(int *sock)
 	}
 }
 
+static int __attribute__((pure)) cmplockhold(const void *a, const void *b)
+{
+	const unsigned long long x = ((const lockSite*)a)->hold.total_ns;
+	const unsigned long long y = ((const lockSite*)b)->hold.total_ns;
+	return (x < y) - (x > y);
+}
+
+static void sendLockTiming(const int *sock, const char *name, const lockTiming *timing)
+{
+	if(istelnet[*sock])
+	{
+		ssend(*sock, " %s %llu %.3f %.3f ", name, timing->count,
+		      1e-6*timing->total_ns, 1e-6*timing->max_ns);
+		for(int i = 0; i < LOCK_HIST_BINS; i++)
+			ssend(*sock, i > 0 ? ",%u" : "%u", timing->hist[i]);
+	}
+	else
+	{
+		pack_uint64(*sock, timing->count);
+		pack_uint64(*sock, timing->total_ns);
+		pack_uint64(*sock, timing->max_ns);
+		for(int i = 0; i < LOCK_HIST_BINS; i++)
+			pack_uint64(*sock, timing->hist[i]);
+	}
+}
+
+void getLockStats(int *sock)
+{
+	lockSite *sites = calloc(LOCK_SITES, sizeof(lockSite));
+	if(sites == NULL) return;
+
+	// Copy the statistics and send them without holding the lock
+	lock_shm();
+	const unsigned int n = get_lock_stats(sites);
+	unlock_shm();
+
+	// Sites holding the lock the longest first
+	qsort(sites, n, sizeof(lockSite), cmplockhold);
+
+	if(istelnet[*sock])
+		ssend(*sock, "# site function wait|hold count total_ms max_ms histogram (<1us,<2us,<4us,...)\n");
+
+	for(unsigned int i = 0; i < n; i++)
+	{
+		if(istelnet[*sock])
+			ssend(*sock, "%s:%i %s()", sites[i].file, sites[i].line, sites[i].function);
+		else
+		{
+			if(!pack_str32(*sock, sites[i].file) || !pack_str32(*sock, sites[i].function))
+				break;
+			pack_int32(*sock, sites[i].line);
+		}
+
+		sendLockTiming(sock, "wait", &sites[i].wait);
+		sendLockTiming(sock, "hold", &sites[i].hold);
+
+		if(istelnet[*sock])
+			ssend(*sock, "\n");
+	}
+
+	free(sites);
+}
+
+// Upper bound of the histogram bin containing the given percentile
+static unsigned long long __attribute__((pure)) timingPercentile(const timingStats *t, const double p)
+{
+	unsigned long long seen = 0;
+	const unsigned long long rank = (unsigned long long)(p * t->count);
+	for(int i = 0; i < TIMING_BINS; i++)
+	{
+		seen += t->hist[i];
+		if(seen > rank)
+			return i == 0 ? 0ULL : 1ULL << i;
+	}
+	return t->max_ns;
+}
+
+void getHookTiming(const char *client_message, int *sock)
+{
+	if(command(client_message, " enable") || command(client_message, " disable"))
+	{
+		config.hooktiming = command(client_message, " enable");
+		logg("Hook timing %s via API", config.hooktiming ? "enabled" : "disabled");
+	}
+
+	timingStats *timing = calloc(TIMING_MAX, sizeof(timingStats));
+	if(timing == NULL) return;
+	get_timing(timing);
+
+	if(istelnet[*sock])
+		ssend(*sock, "# hook count mean_ns p50_ns p90_ns p99_ns max_ns histogram (0ns,<2ns,<4ns,...)\n");
+
+	for(int i = 0; i < TIMING_MAX; i++)
+	{
+		const timingStats *t = &timing[i];
+		if(istelnet[*sock])
+		{
+			ssend(*sock, "%s %llu %llu %llu %llu %llu %llu ", timingnames[i], t->count,
+			      t->count > 0 ? t->total_ns / t->count : 0ULL, timingPercentile(t, 0.5),
+			      timingPercentile(t, 0.9), timingPercentile(t, 0.99), t->max_ns);
+			for(int j = 0; j < TIMING_BINS; j++)
+				ssend(*sock, j > 0 ? ",%llu" : "%llu", t->hist[j]);
+			ssend(*sock, "\n");
+		}
+		else
+		{
+			if(!pack_str32(*sock, timingnames[i]))
+				break;
+			pack_uint64(*sock, t->count);
+			pack_uint64(*sock, t->total_ns);
+			pack_uint64(*sock, t->max_ns);
+			for(int j = 0; j < TIMING_BINS; j++)
+				pack_uint64(*sock, t->hist[j]);
+		}
+	}
+
+	// Reset after reporting so no samples are lost
+	if(command(client_message, " reset"))
+		reset_timing();
+
+	free(timing);
+}
+
 void getDBstats(int *sock)
 {
 	// Get file details
@@ -1014,15 +1490,20 @@ void getDBstats(int *sock)
 	}
 }
 
-void getClientsOverTime(int *sock)
+void getClientsOverTime(const char *client_message, int *sock)
 {
-	int i, sendit = -1, until = OVERTIME_SLOTS;
+	int i, sendit = -1, until = OVERTIME_SLOTS, count = 0, num;
 
 	// Exit before processing any data if requested via config setting
 	get_privacy_level(NULL);
 	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS_CLIENTS)
 		return;
 
+	// Only send the most active clients?
+	// example: >ClientsoverTime (10)
+	if(sscanf(client_message, "%*[^(](%i)", &num) > 0 && num > 0)
+		count = num;
+
 	// Find minimum ID to send
 	for(i = 0; i < OVERTIME_SLOTS; i++)
 	{
@@ -1047,27 +1528,88 @@ void getClientsOverTime(int *sock)
 	}
 
 	// Get clients which the user doesn't want to see
-	char * excludeclients = read_setupVarsconf("API_EXCLUDE_CLIENTS");
+	const bool excludeclients = getSetupVarsList(SETUPVARS_EXCLUDE_CLIENTS);
 	// Array of clients to be skipped in the output
 	// if skipclient[i] == true then this client should be hidden from
 	// returned data. We initialize it with false
-	bool skipclient[counters->clients];
-	memset(skipclient, false, counters->clients*sizeof(bool));
+	// Read the counter once, the resolver may add clients while we work
+	const int nclients = __atomic_load_n(&counters->clients, __ATOMIC_ACQUIRE);
+	bool skipclient[nclients];
+	memset(skipclient, false, nclients*sizeof(bool));
 
-	if(excludeclients != NULL)
+	if(excludeclients)
 	{
-		getSetupVarsArray(excludeclients);
-
-		for(i=0; i < counters->clients; i++)
+		for(i=0; i < nclients; i++)
 		{
 			validate_access("clients", i, true, __LINE__, __FUNCTION__, __FILE__);
 			// Check if this client should be skipped
-			if(insetupVarsArray(getstr(clients[i].ippos)) ||
-			   insetupVarsArray(getstr(clients[i].namepos)))
+			if(insetupVarsList(SETUPVARS_EXCLUDE_CLIENTS, getstr(clients[i].ippos)) ||
+			   insetupVarsList(SETUPVARS_EXCLUDE_CLIENTS, getstr(clients[i].namepos)))
 				skipclient[i] = true;
 		}
 	}
 
+	// Clients to be sent (one column each) and the position
+	// in their overTime data
+	int columns = 0, column[nclients], chunk[nclients], pos[nclients];
+	if(count > 0)
+	{
+		// Sort the clients by their number of queries in the sent interval
+		int temparray[nclients][2], n = 0;
+		for(i = 0; i < nclients; i++)
+		{
+			if(skipclient[i])
+				continue;
+
+			int c = __atomic_load_n(&clients[i].firstovertime, __ATOMIC_ACQUIRE), p = 0, sum = 0;
+			for(int j = sendit; j < until; j++)
+				sum += get_client_overTime(&c, &p, j);
+
+			if(sum > 0)
+			{
+				temparray[n][0] = i;
+				temparray[n][1] = sum;
+				n++;
+			}
+		}
+		qsort(temparray, n, sizeof(int[2]), cmpdesc);
+
+		for(i = 0; i < n && i < count; i++)
+			column[columns++] = temparray[i][0];
+
+		// Tell which clients the columns belong to
+		if(istelnet[*sock])
+			ssend(*sock, "%i\n", columns);
+		else
+			pack_int32(*sock, columns);
+
+		for(i = 0; i < columns; i++)
+		{
+			const char *client_ip = getstr(clients[column[i]].ippos);
+			const char *client_name = getstr(clients[column[i]].namepos);
+
+			if(istelnet[*sock])
+				ssend(*sock, "%s %s\n", client_name, client_ip);
+			else {
+				pack_str32(*sock, client_name);
+				pack_str32(*sock, client_ip);
+			}
+		}
+	}
+	else
+	{
+		// All clients in the order of >client-names
+		for(i = 0; i < nclients; i++)
+			if(!skipclient[i])
+				column[columns++] = i;
+	}
+
+	for(i = 0; i < columns; i++)
+	{
+		chunk[i] = __atomic_load_n(&clients[column[i]].firstovertime, __ATOMIC_ACQUIRE);
+		pos[i] = 0;
+	}
+
 	// Main return loop
 	for(i = sendit; i < until; i++)
 	{
@@ -1076,13 +1618,10 @@ void getClientsOverTime(int *sock)
 		else
 			pack_int32(*sock, overTime[i].timestamp);
 
-		// Loop over forward destinations to generate output to be sent to the client
-		for(int j = 0; j < counters->clients; j++)
+		// Loop over clients to generate output to be sent to the client
+		for(int j = 0; j < columns; j++)
 		{
-			if(skipclient[j])
-				continue;
-
-			int thisclient = clients[j].overTime[i];
+			int thisclient = get_client_overTime(&chunk[j], &pos[j], i);
 
 			if(istelnet[*sock])
 				ssend(*sock, " %i", thisclient);
@@ -1095,9 +1634,6 @@ void getClientsOverTime(int *sock)
 		else
 			pack_int32(*sock, -1);
 	}
-
-	if(excludeclients != NULL)
-		clearSetupVarsArray();
 }
 
 void getClientNames(int *sock)
@@ -1110,29 +1646,29 @@ void getClientNames(int *sock)
 		return;
 
 	// Get clients which the user doesn't want to see
-	char * excludeclients = read_setupVarsconf("API_EXCLUDE_CLIENTS");
+	const bool excludeclients = getSetupVarsList(SETUPVARS_EXCLUDE_CLIENTS);
 	// Array of clients to be skipped in the output
 	// if skipclient[i] == true then this client should be hidden from
 	// returned data. We initialize it with false
-	bool skipclient[counters->clients];
-	memset(skipclient, false, counters->clients*sizeof(bool));
+	// Read the counter once, the resolver may add clients while we work
+	const int nclients = __atomic_load_n(&counters->clients, __ATOMIC_ACQUIRE);
+	bool skipclient[nclients];
+	memset(skipclient, false, nclients*sizeof(bool));
 
-	if(excludeclients != NULL)
+	if(excludeclients)
 	{
-		getSetupVarsArray(excludeclients);
-
-		for(i=0; i < counters->clients; i++)
+		for(i=0; i < nclients; i++)
 		{
 			validate_access("clients", i, true, __LINE__, __FUNCTION__, __FILE__);
 			// Check if this client should be skipped
-			if(insetupVarsArray(getstr(clients[i].ippos)) ||
-			   insetupVarsArray(getstr(clients[i].namepos)))
+			if(insetupVarsList(SETUPVARS_EXCLUDE_CLIENTS, getstr(clients[i].ippos)) ||
+			   insetupVarsList(SETUPVARS_EXCLUDE_CLIENTS, getstr(clients[i].namepos)))
 				skipclient[i] = true;
 		}
 	}
 
 	// Loop over clients to generate output to be sent to the client
-	for(i = 0; i < counters->clients; i++)
+	for(i = 0; i < nclients; i++)
 	{
 		validate_access("clients", i, true, __LINE__, __FUNCTION__, __FILE__);
 		if(skipclient[i])
@@ -1148,9 +1684,6 @@ void getClientNames(int *sock)
 			pack_str32(*sock, client_ip);
 		}
 	}
-
-	if(excludeclients != NULL)
-		clearSetupVarsArray();
 }
 
 void getUnknownQueries(int *sock)
@@ -1161,7 +1694,8 @@ void getUnknownQueries(int *sock)
 		return;
 
 	int i;
-	for(i=0; i < counters->queries; i++)
+	const int total = __atomic_load_n(&counters->queries, __ATOMIC_ACQUIRE);
+	for(i=0; i < total; i++)
 	{
 		validate_access("queries", i, true, __LINE__, __FUNCTION__, __FILE__);
 		if(queries[i].status != QUERY_UNKNOWN && queries[i].complete) continue;
@@ -1183,7 +1717,7 @@ void getUnknownQueries(int *sock)
 		const char *client = getstr(clients[queries[i].clientID].ippos);
 
 		if(istelnet[*sock])
-			ssend(*sock, "%li %i %i %s %s %s %i %s\n", queries[i].timestamp, i, queries[i].id, type, getstr(domains[queries[i].domainID].domainpos), client, queries[i].status, queries[i].complete ? "true" : "false");
+			ssend(*sock, "%u %i %i %s %s %s %i %s\n", queries[i].timestamp, i, queries[i].id, type, getstr(domains[queries[i].domainID].domainpos), client, queries[i].status, queries[i].complete ? "true" : "false");
 		else {
 			pack_int32(*sock, queries[i].timestamp);
 			pack_int32(*sock, queries[i].id);
@@ -1213,7 +1747,8 @@ void getDomainDetails(const char *client_message, int *sock)
 	}
 
 	int i;
-	for(i = 0; i < counters->domains; i++)
+	const int ndomains = __atomic_load_n(&counters->domains, __ATOMIC_ACQUIRE);
+	for(i = 0; i < ndomains; i++)
 	{
 		validate_access("domains", i, true, __LINE__, __FUNCTION__, __FILE__);
 		if(strcmp(getstr(domains[i].domainpos), domain) == 0)
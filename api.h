@@ -10,15 +10,16 @@
 
 // Statistic methods
 void getStats(int *sock);
-void getOverTime(int *sock);
+void getOverTime(const char *client_message, int *sock);
 void getTopDomains(const char *client_message, int *sock);
 void getTopClients(const char *client_message, int *sock);
 void getForwardDestinations(const char *client_message, int *sock);
 void getQueryTypes(int *sock);
 void getAllQueries(const char *client_message, int *sock);
+void getQueryStream(const char *client_message, int *sock);
 void getRecentBlocked(const char *client_message, int *sock);
-void getQueryTypesOverTime(int *sock);
-void getClientsOverTime(int *sock);
+void getQueryTypesOverTime(const char *client_message, int *sock);
+void getClientsOverTime(const char *client_message, int *sock);
 void getClientNames(int *sock);
 void getDomainDetails(const char *client_message, int *sock);
 
@@ -27,6 +28,8 @@ void getClientID(int *sock);
 void getVersion(int *sock);
 void getDBstats(int *sock);
 void getUnknownQueries(int *sock);
+void getLockStats(int *sock);
+void getHookTiming(const char *client_message, int *sock);
 
 // DNS resolver methods (dnsmasq_interface.c)
 void getCacheInformation(int *sock);
@@ -97,6 +97,13 @@ void parse_args(int argc, char* argv[])
 			ok = true;
 		}
 
+		// Check whether a domain is blocked by regex.list or wildcard.list
+		if(strcmp(argv[i], "regex-test") == 0 && i+1 < argc)
+		{
+			read_FTLconf();
+			exit(regex_test(argv[i+1]) ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+
 		// Implement dnsmasq's test function
 		if(strcmp(argv[i], "dnsmasq-test") == 0)
 		{
@@ -144,6 +151,9 @@ void parse_args(int argc, char* argv[])
 			printf("\t-h, help          Display this help and exit\n");
 			printf("\tdnsmasq-test      Test syntax of dnsmasq's\n");
 			printf("\t                  config files and exit\n");
+			printf("\tregex-test <domain>\n");
+			printf("\t                  Check domain against regex.list\n");
+			printf("\t                  and wildcard.list and exit\n");
 			printf("\n\nOnline help: https://github.com/pi-hole/FTL\n");
 			exit(EXIT_SUCCESS);
 		}
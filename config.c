@@ -15,7 +15,8 @@ static char *parse_FTLconf(FILE *fp, const char * key);
 static void release_config_memory(void);
 void getpath(FILE* fp, const char *option, const char *defaultloc, char **pointer);
 
-char *conflinebuffer = NULL;
+// Per thread as API readers parse the config without holding the lock
+static __thread char *conflinebuffer = NULL;
 
 void getLogFilePath(void)
 {
@@ -300,6 +301,9 @@ void read_FTLconf(void)
 	// REGEXLISTFILE
 	getpath(fp, "REGEXLISTFILE", "/etc/pihole/regex.list", &files.regexlist);
 
+	// WILDCARDLISTFILE
+	getpath(fp, "WILDCARDLISTFILE", "/etc/pihole/wildcard.list", &files.wildcardlist);
+
 	// SETUPVARSFILE
 	getpath(fp, "SETUPVARSFILE", "/etc/pihole/setupVars.conf", &files.setupVars);
 
@@ -322,6 +326,37 @@ void read_FTLconf(void)
 	else
 		logg("   PARSE_ARP_CACHE: Inactive");
 
+	// LOCK_THRESHOLD
+	// Log critical sections holding the shared memory lock for longer
+	// than this many milliseconds, 0 disables
+	// defaults to: 100 ms
+	config.lockthreshold = 100;
+	buffer = parse_FTLconf(fp, "LOCK_THRESHOLD");
+
+	value = 0;
+	if(buffer != NULL && sscanf(buffer, "%i", &value))
+		if(value >= 0)
+			config.lockthreshold = value;
+
+	if(config.lockthreshold > 0)
+		logg("   LOCK_THRESHOLD: Logging locks held for more than %i ms", config.lockthreshold);
+	else
+		logg("   LOCK_THRESHOLD: Not logging slow locks");
+
+	// HOOK_TIMING
+	// Record latency histograms of the resolver hooks (see >timing)
+	// defaults to: No
+	config.hooktiming = false;
+	buffer = parse_FTLconf(fp, "HOOK_TIMING");
+
+	if(buffer != NULL && strcasecmp(buffer, "yes") == 0)
+		config.hooktiming = true;
+
+	if(config.hooktiming)
+		logg("   HOOK_TIMING: Recording hook latencies");
+	else
+		logg("   HOOK_TIMING: Not recording hook latencies");
+
 	// Read DEBUG_... setting from pihole-FTL.conf
 	read_debuging_settings(fp);
 
@@ -10,12 +10,15 @@
 
 #include "FTL.h"
 #include "shmem.h"
+#include "overTime.h"
 #include "sqlite3.h"
 
 static sqlite3 *db;
 bool database = false;
 bool DBdeleteoldqueries = false;
 long int lastdbindex = 0;
+// Queries from here on are imported into overTime when starting
+static time_t import_from = 0;
 
 static pthread_mutex_t dblock;
 
@@ -74,6 +77,12 @@ bool dbopen(void)
 	return true;
 }
 
+// Connection opened by dbopen(), for prepared statements
+sqlite3 __attribute__((pure)) *dbhandle(void)
+{
+	return db;
+}
+
 bool dbquery(const char *format, ...)
 {
 	char *zErrMsg = NULL;
@@ -132,6 +141,197 @@ static bool create_counter_table(void)
 	return true;
 }
 
+static bool create_overtime_table(void)
+{
+	bool ret;
+	// Create overTime rollup table in the database (one row per interval of each tier)
+	ret = dbquery("CREATE TABLE overtime ( resolution INTEGER NOT NULL, timestamp INTEGER NOT NULL, total INTEGER NOT NULL, blocked INTEGER NOT NULL, ipv4 INTEGER NOT NULL, ipv6 INTEGER NOT NULL, PRIMARY KEY (resolution, timestamp) ) WITHOUT ROWID;");
+	if(!ret){ dbclose(); return false; }
+
+	// It is filled with the queries already stored in the database when
+	// the rollups are restored as there is no DB_ROLLUPTIMESTAMP yet
+
+	// Update database version to 4
+	ret = db_set_FTL_property(DB_VERSION, 4);
+	if(!ret){ dbclose(); return false; }
+
+	return true;
+}
+
+// Restore the overTime rollups kept in memory
+static void read_rollups_from_DB(void)
+{
+	sqlite3_stmt* stmt;
+	int rc = sqlite3_prepare_v2(db, "SELECT resolution,timestamp,total,blocked,ipv4,ipv6 FROM overtime ORDER BY resolution,timestamp", -1, &stmt, NULL);
+	if( rc ){
+		logg("read_rollups_from_DB() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
+		return;
+	}
+
+	int rows = 0;
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		const int resolution = sqlite3_column_int(stmt, 0);
+		rollupTier *tier = get_rollup_tier(resolution);
+		if(tier == NULL || tier->interval != resolution)
+			continue;
+
+		rollupDataStruct *r = get_rollup(tier, sqlite3_column_int64(stmt, 1), true);
+		if(r == NULL)
+			continue;
+
+		r->total = sqlite3_column_int(stmt, 2);
+		r->blocked = sqlite3_column_int(stmt, 3);
+		r->ipv4 = sqlite3_column_int(stmt, 4);
+		r->ipv6 = sqlite3_column_int(stmt, 5);
+		rows++;
+	}
+
+	if( rc != SQLITE_DONE ){
+		logg("read_rollups_from_DB() - SQL error step (%i): %s", rc, sqlite3_errmsg(db));
+		check_database(rc);
+	}
+	sqlite3_finalize(stmt);
+
+	if(config.debug & DEBUG_DATABASE) logg("Imported %i overTime rollup intervals", rows);
+
+	// Add the queries stored after the rollups were saved last which
+	// are not going to be imported into overTime below
+	long long from = db_get_FTL_property(DB_ROLLUPTIMESTAMP);
+	if(from == DB_FAILED)
+		return;
+	if(from == DB_NODATA)
+		from = import_from - (long long)rollups[ROLLUP_TIERS-1].slots * rollups[ROLLUP_TIERS-1].interval;
+	// Don't import queries into overTime which were already moved into the rollups
+	if(from >= import_from)
+		import_from = from + 1;
+
+	char *querystr = sqlite3_mprintf("SELECT timestamp - timestamp %% %i, COUNT(*), SUM(status IN (%i,%i,%i,%i,%i,%i)), " \
+	                                 "SUM(type = %i), SUM(type = %i) FROM queries WHERE timestamp > %lld AND timestamp < %lld GROUP BY 1;",
+	                                 OVERTIME_INTERVAL, QUERY_GRAVITY, QUERY_WILDCARD, QUERY_BLACKLIST, QUERY_EXTERNAL_BLOCKED_IP,
+	                                 QUERY_EXTERNAL_BLOCKED_NULL, QUERY_EXTERNAL_BLOCKED_NXRA, TYPE_A, TYPE_AAAA,
+	                                 from, (long long)import_from);
+	if(querystr == NULL)
+		return;
+
+	rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
+	sqlite3_free(querystr);
+	if( rc ){
+		logg("read_rollups_from_DB() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
+		return;
+	}
+
+	int added = 0;
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		rollup_add(sqlite3_column_int64(stmt, 0), sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2),
+		           sqlite3_column_int(stmt, 3), sqlite3_column_int(stmt, 4));
+		added += sqlite3_column_int(stmt, 1);
+	}
+
+	if( rc != SQLITE_DONE ){
+		logg("read_rollups_from_DB() - SQL error step (%i): %s", rc, sqlite3_errmsg(db));
+		check_database(rc);
+	}
+	else
+		rollup_until = import_from - 1;
+	sqlite3_finalize(stmt);
+
+	if(config.debug & DEBUG_DATABASE) logg("Added %i queries to the overTime rollups", added);
+}
+
+// Write the overTime rollup intervals changed since the last save
+static bool save_rollups_to_DB(void)
+{
+	for(int i = 0; i < ROLLUP_TIERS; i++)
+	{
+		rollupTier *tier = &rollups[i];
+		if(tier->dirty_from == 0)
+			continue;
+
+		// Older intervals are no longer held in memory
+		const time_t oldest = tier->dirty_until - (time_t)(tier->slots - 1) * tier->interval;
+		for(time_t t = MAX(tier->dirty_from, oldest); t <= tier->dirty_until; t += tier->interval)
+		{
+			const rollupDataStruct *r = get_rollup(tier, t, false);
+			if(r == NULL)
+				continue;
+
+			if(!dbquery("INSERT OR REPLACE INTO overtime VALUES (%i,%lld,%i,%i,%i,%i);",
+			            tier->interval, (long long)r->timestamp, r->total, r->blocked, r->ipv4, r->ipv6))
+				return false;
+		}
+
+		tier->dirty_from = 0;
+		tier->dirty_until = 0;
+	}
+
+	// Queries up to here do not have to be added when restoring the rollups
+	if(rollup_until > 0 && !db_set_FTL_property(DB_ROLLUPTIMESTAMP, (int)rollup_until))
+		return false;
+
+	return true;
+}
+
+// Number of domains kept per hour in hourly_domains, the others are summed
+// up in a row with an empty domain
+#define HOURLY_DOMAINS 100
+
+// Sum up the queries to the least queried domains of all complete hours
+// starting at from into a single row per hour
+static bool truncate_hourly_domains(const long long from, const long long until)
+{
+	const char *ranked = "SELECT hour, domain, count, ROW_NUMBER() OVER (PARTITION BY hour ORDER BY count DESC, domain) AS rank " \
+	                     "FROM hourly_domains WHERE hour >= %lld AND hour < %lld AND domain != ''";
+	char *rankedquery = sqlite3_mprintf(ranked, from, until);
+	if(rankedquery == NULL)
+		return false;
+
+	bool ret = dbquery("INSERT INTO hourly_domains (hour,domain,count) SELECT hour, '', SUM(count) FROM (%s) " \
+	                   "WHERE rank > %i GROUP BY hour ON CONFLICT(hour,domain) DO UPDATE SET count = count + excluded.count;",
+	                   rankedquery, HOURLY_DOMAINS);
+	if(ret)
+		ret = dbquery("DELETE FROM hourly_domains WHERE (hour,domain) IN (SELECT hour, domain FROM (%s) WHERE rank > %i);",
+		              rankedquery, HOURLY_DOMAINS);
+
+	sqlite3_free(rankedquery);
+	return ret;
+}
+
+static bool create_hourly_tables(void)
+{
+	bool ret;
+	// Create tables with the number of queries per hour (by status and type,
+	// client, domain and upstream server), hour is the start of the hour
+	ret = dbquery("CREATE TABLE hourly_counts ( hour INTEGER NOT NULL, status INTEGER NOT NULL, type INTEGER NOT NULL, count INTEGER NOT NULL, PRIMARY KEY (hour, status, type) ) WITHOUT ROWID;");
+	if(!ret){ dbclose(); return false; }
+	ret = dbquery("CREATE TABLE hourly_clients ( hour INTEGER NOT NULL, client TEXT NOT NULL, count INTEGER NOT NULL, PRIMARY KEY (hour, client) ) WITHOUT ROWID;");
+	if(!ret){ dbclose(); return false; }
+	ret = dbquery("CREATE TABLE hourly_domains ( hour INTEGER NOT NULL, domain TEXT NOT NULL, count INTEGER NOT NULL, PRIMARY KEY (hour, domain) ) WITHOUT ROWID;");
+	if(!ret){ dbclose(); return false; }
+	ret = dbquery("CREATE TABLE hourly_upstreams ( hour INTEGER NOT NULL, upstream TEXT NOT NULL, count INTEGER NOT NULL, PRIMARY KEY (hour, upstream) ) WITHOUT ROWID;");
+	if(!ret){ dbclose(); return false; }
+
+	// Fill them with the queries already stored in the database
+	ret = dbquery("INSERT INTO hourly_counts SELECT timestamp - timestamp %% 3600, status, type, COUNT(*) FROM queries GROUP BY 1, 2, 3;");
+	if(!ret){ dbclose(); return false; }
+	ret = dbquery("INSERT INTO hourly_clients SELECT timestamp - timestamp %% 3600, client, COUNT(*) FROM queries GROUP BY 1, 2;");
+	if(!ret){ dbclose(); return false; }
+	ret = dbquery("INSERT INTO hourly_domains SELECT timestamp - timestamp %% 3600, domain, COUNT(*) FROM queries GROUP BY 1, 2;");
+	if(!ret){ dbclose(); return false; }
+	ret = dbquery("INSERT INTO hourly_upstreams SELECT timestamp - timestamp %% 3600, forward, COUNT(*) FROM queries WHERE forward IS NOT NULL GROUP BY 1, 2;");
+	if(!ret){ dbclose(); return false; }
+	const long long now = time(NULL);
+	ret = truncate_hourly_domains(0, now - now % 3600);
+	if(!ret){ dbclose(); return false; }
+
+	// Update database version to 5
+	ret = db_set_FTL_property(DB_VERSION, 5);
+	if(!ret){ dbclose(); return false; }
+
+	return true;
+}
+
 static bool db_create(void)
 {
 	bool ret;
@@ -170,6 +370,16 @@ static bool db_create(void)
 	if(!create_network_table())
 		return false;
 
+	// Create overTime rollup table
+	// Will update DB version to 4
+	if(!create_overtime_table())
+		return false;
+
+	// Create hourly aggregate tables
+	// Will update DB version to 5
+	if(!create_hourly_tables())
+		return false;
+
 	return true;
 }
 
@@ -249,6 +459,43 @@ void db_init(void)
 		// Get updated version
 		dbversion = db_get_FTL_property(DB_VERSION);
 	}
+	// Update to version 4 if lower
+	if(dbversion < 4)
+	{
+		// Update to version 4: Create overTime rollup table
+		logg("Updating long-term database to version 4");
+		if (!create_overtime_table())
+		{
+			logg("overTime rollup table not initialized, database not available");
+			database = false;
+			return;
+		}
+		// Get updated version
+		dbversion = db_get_FTL_property(DB_VERSION);
+	}
+
+	// Update to version 5 if lower
+	if(dbversion < 5)
+	{
+		// Update to version 5: Create hourly aggregate tables
+		logg("Updating long-term database to version 5 (this may take a while)");
+		if (!create_hourly_tables())
+		{
+			logg("Hourly aggregate tables not initialized, database not available");
+			database = false;
+			return;
+		}
+		// Get updated version
+		dbversion = db_get_FTL_property(DB_VERSION);
+	}
+
+	// Queries imported into overTime when starting are not counted in the rollups
+	import_from = time(NULL);
+	if(config.DBimport && config.privacylevel < PRIVACY_NOSTATS)
+		import_from -= config.maxlogage;
+
+	// Restore the overTime rollups beyond the queries imported into overTime
+	read_rollups_from_DB();
 
 	// Close database to prevent having it opened all time
 	// we already closed the database when we returned earlier
@@ -411,6 +658,175 @@ int get_number_of_queries_in_DB(void)
 	return result;
 }
 
+// Queries saved in one go are summed up per hour (and client, domain or
+// upstream server) before the hourly tables are updated
+typedef struct {
+	sqlite3_stmt *stmt;
+	int *count; // indexed by ID
+	int *touched; // IDs with a non-zero count
+	int ntouched;
+	const char *(*name)(int ID);
+} hourlyCounts;
+
+typedef struct {
+	long long hour;
+	sqlite3_stmt *stmt;
+	int count[QUERY_STATUS_MAX][TYPE_MAX];
+	hourlyCounts clients;
+	hourlyCounts domains;
+	hourlyCounts upstreams;
+} hourlyAggregates;
+
+// The ID after the last client or domain counts the hidden ones
+static const char *hourly_client(int clientID)
+{
+	return clientID < counters->clients ? getstr(clients[clientID].ippos) : HIDDEN_CLIENT;
+}
+
+static const char *hourly_domain(int domainID)
+{
+	return domainID < counters->domains ? getstr(domains[domainID].domainpos) : HIDDEN_DOMAIN;
+}
+
+static const char *hourly_upstream(int forwardID)
+{
+	return getstr(forwarded[forwardID].ippos);
+}
+
+static bool hourly_counts_init(hourlyCounts *h, const char *table, const char *column, const int size, const char *(*name)(int ID))
+{
+	h->ntouched = 0;
+	h->name = name;
+	h->count = calloc(size, sizeof(int));
+	h->touched = calloc(size, sizeof(int));
+	if(h->count == NULL || h->touched == NULL)
+		return false;
+
+	char *sql = sqlite3_mprintf("INSERT INTO %s VALUES (?,?,?) ON CONFLICT(hour,%s) DO UPDATE SET count = count + excluded.count;", table, column);
+	if(sql == NULL)
+		return false;
+	const int rc = sqlite3_prepare_v2(db, sql, -1, &h->stmt, NULL);
+	sqlite3_free(sql);
+	return rc == SQLITE_OK;
+}
+
+static void hourly_counts_add(hourlyCounts *h, const int ID)
+{
+	if(h->count[ID]++ == 0)
+		h->touched[h->ntouched++] = ID;
+}
+
+static bool hourly_counts_flush(hourlyCounts *h, const long long hour)
+{
+	bool ok = true;
+	for(int i = 0; i < h->ntouched; i++)
+	{
+		const int ID = h->touched[i];
+		sqlite3_bind_int64(h->stmt, 1, hour);
+		sqlite3_bind_text(h->stmt, 2, h->name(ID), -1, SQLITE_STATIC);
+		sqlite3_bind_int(h->stmt, 3, h->count[ID]);
+		if(sqlite3_step(h->stmt) != SQLITE_DONE)
+			ok = false;
+		sqlite3_reset(h->stmt);
+		h->count[ID] = 0;
+	}
+	h->ntouched = 0;
+	return ok;
+}
+
+static void hourly_counts_free(hourlyCounts *h)
+{
+	if(h->stmt != NULL)
+		sqlite3_finalize(h->stmt);
+	if(h->count != NULL)
+		free(h->count);
+	if(h->touched != NULL)
+		free(h->touched);
+}
+
+static bool hourly_begin(hourlyAggregates *a)
+{
+	memset(a, 0, sizeof(*a));
+	if(sqlite3_prepare_v2(db, "INSERT INTO hourly_counts VALUES (?,?,?,?) ON CONFLICT(hour,status,type) DO UPDATE SET count = count + excluded.count;", -1, &a->stmt, NULL) != SQLITE_OK)
+		return false;
+
+	return hourly_counts_init(&a->clients, "hourly_clients", "client", counters->clients + 1, hourly_client) &&
+	       hourly_counts_init(&a->domains, "hourly_domains", "domain", counters->domains + 1, hourly_domain) &&
+	       hourly_counts_init(&a->upstreams, "hourly_upstreams", "upstream", counters->forwarded, hourly_upstream);
+}
+
+static bool hourly_flush(hourlyAggregates *a)
+{
+	bool ok = true;
+	for(int status = 0; status < QUERY_STATUS_MAX; status++)
+		for(int type = 0; type < TYPE_MAX; type++)
+		{
+			if(a->count[status][type] == 0)
+				continue;
+
+			sqlite3_bind_int64(a->stmt, 1, a->hour);
+			sqlite3_bind_int(a->stmt, 2, status);
+			sqlite3_bind_int(a->stmt, 3, type);
+			sqlite3_bind_int(a->stmt, 4, a->count[status][type]);
+			if(sqlite3_step(a->stmt) != SQLITE_DONE)
+				ok = false;
+			sqlite3_reset(a->stmt);
+			a->count[status][type] = 0;
+		}
+
+	ok &= hourly_counts_flush(&a->clients, a->hour);
+	ok &= hourly_counts_flush(&a->domains, a->hour);
+	ok &= hourly_counts_flush(&a->upstreams, a->hour);
+	return ok;
+}
+
+// Count a query saved to the database. Queries are saved in chronological
+// order, so the sums are written whenever the next hour begins
+static bool hourly_add(hourlyAggregates *a, const int queryID)
+{
+	bool ok = true;
+	const long long hour = queries[queryID].timestamp - queries[queryID].timestamp % 3600;
+	if(hour != a->hour)
+	{
+		ok = hourly_flush(a);
+		a->hour = hour;
+	}
+
+	// Status and type are stored as they are in the queries table,
+	// only known ones are counted
+	if(queries[queryID].status < QUERY_STATUS_MAX && queries[queryID].type < TYPE_MAX)
+		a->count[queries[queryID].status][queries[queryID].type]++;
+
+	if(queries[queryID].privacylevel < PRIVACY_HIDE_DOMAINS_CLIENTS)
+		hourly_counts_add(&a->clients, queries[queryID].clientID);
+	else
+		hourly_counts_add(&a->clients, counters->clients);
+
+	if(queries[queryID].privacylevel < PRIVACY_HIDE_DOMAINS)
+		hourly_counts_add(&a->domains, queries[queryID].domainID);
+	else
+		hourly_counts_add(&a->domains, counters->domains);
+
+	if(queries[queryID].status == QUERY_FORWARDED && queries[queryID].forwardID > -1)
+		hourly_counts_add(&a->upstreams, queries[queryID].forwardID);
+
+	return ok;
+}
+
+static void hourly_end(hourlyAggregates *a)
+{
+	if(a->stmt != NULL)
+		sqlite3_finalize(a->stmt);
+	hourly_counts_free(&a->clients);
+	hourly_counts_free(&a->domains);
+	hourly_counts_free(&a->upstreams);
+}
+
+// Hours before this one have their domains truncated to HOURLY_DOMAINS
+static long long hourly_truncated = 0;
+// Hours before this one are complete in the hourly tables, set by save_to_DB()
+static long long hourly_complete = 0;
+
 void save_to_DB(void)
 {
 	// Don't save anything to the database if in PRIVACY_NOSTATS mode
@@ -451,6 +867,17 @@ void save_to_DB(void)
 		return;
 	}
 
+	hourlyAggregates hourly;
+	if(!hourly_begin(&hourly))
+	{
+		logg("save_to_DB() - error in preparing hourly aggregates: %s", sqlite3_errmsg(db));
+		hourly_end(&hourly);
+		sqlite3_finalize(stmt);
+		dbclose();
+		return;
+	}
+	bool hourly_ok = true;
+
 	int total = 0, blocked = 0;
 	time_t currenttimestamp = time(NULL);
 	time_t newlasttimestamp = 0;
@@ -530,24 +957,45 @@ void save_to_DB(void)
 		}
 
 		saved++;
-		// Mark this query as saved in the database by setting the corresponding ID
-		queries[i].db = ++lastID;
+		// Mark this query as saved in the database
+		queries[i].db = true;
+		lastID++;
 
 		// Total counter information (delta computation)
 		total++;
-		if(queries[i].status == QUERY_GRAVITY ||
-		   queries[i].status == QUERY_BLACKLIST ||
-		   queries[i].status == QUERY_WILDCARD ||
-		   queries[i].status == QUERY_EXTERNAL_BLOCKED_IP ||
-		   queries[i].status == QUERY_EXTERNAL_BLOCKED_NULL ||
-		   queries[i].status == QUERY_EXTERNAL_BLOCKED_NXRA)
+		const bool isblocked = queries[i].status == QUERY_GRAVITY ||
+		                       queries[i].status == QUERY_BLACKLIST ||
+		                       queries[i].status == QUERY_WILDCARD ||
+		                       queries[i].status == QUERY_EXTERNAL_BLOCKED_IP ||
+		                       queries[i].status == QUERY_EXTERNAL_BLOCKED_NULL ||
+		                       queries[i].status == QUERY_EXTERNAL_BLOCKED_NXRA;
+		if(isblocked)
 			blocked++;
 
+		// Count query in the hourly aggregate tables
+		hourly_ok &= hourly_add(&hourly, i);
+
 		// Update lasttimestamp variable with timestamp of the latest stored query
 		if(queries[i].timestamp > newlasttimestamp)
 			newlasttimestamp = queries[i].timestamp;
 	}
 
+	// Store the remaining hourly sums. The domains of the hours which
+	// are complete now are truncated later, without holding the SHM lock
+	hourly_ok &= hourly_flush(&hourly);
+	hourly_end(&hourly);
+	if(hourly_ok)
+	{
+		const time_t complete = currenttimestamp - 2;
+		hourly_complete = complete - complete % 3600;
+	}
+	else
+		logg("save_to_DB() - failed to update hourly aggregates");
+
+	// Store the changed overTime rollups along with the queries
+	if(!save_rollups_to_DB())
+		logg("save_to_DB() - failed to store overTime rollups");
+
 	// Finish prepared statement
 	ret = dbquery("END TRANSACTION");
 	int ret2 = sqlite3_finalize(stmt);
@@ -579,6 +1027,36 @@ void save_to_DB(void)
 	}
 }
 
+// Sum up the least queried domains of the hours completed since the last call
+static void truncate_hourly_aggregates(void)
+{
+	if(hourly_complete == 0)
+		return;
+	if(hourly_truncated == 0)
+		hourly_truncated = hourly_complete - 86400;
+	if(hourly_complete <= hourly_truncated)
+		return;
+
+	if(!dbopen())
+	{
+		logg("truncate_hourly_aggregates() - failed to open DB");
+		return;
+	}
+
+	// Summing up and deleting the rows have to happen together
+	if(dbquery("BEGIN TRANSACTION"))
+	{
+		if(truncate_hourly_domains(hourly_truncated, hourly_complete) && dbquery("COMMIT"))
+			hourly_truncated = hourly_complete;
+		else
+			dbquery("ROLLBACK");
+	}
+	if(hourly_truncated != hourly_complete)
+		logg("truncate_hourly_aggregates() - failed to truncate hourly domains");
+
+	dbclose();
+}
+
 static void delete_old_queries_in_DB(void)
 {
 	// Open database
@@ -588,9 +1066,11 @@ static void delete_old_queries_in_DB(void)
 		return;
 	}
 
+	// Delete whole hours only to keep the hourly aggregates consistent
 	int timestamp = time(NULL) - config.maxDBdays * 86400;
+	timestamp -= timestamp % 3600;
 
-	if(!dbquery("DELETE FROM queries WHERE timestamp <= %i", timestamp))
+	if(!dbquery("DELETE FROM queries WHERE timestamp < %i", timestamp))
 	{
 		dbclose();
 		logg("delete_old_queries_in_DB(): Deleting queries due to age of entries failed!");
@@ -601,6 +1081,20 @@ static void delete_old_queries_in_DB(void)
 	// Get how many rows have been affected (deleted)
 	int affected = sqlite3_changes(db);
 
+	if(!dbquery("DELETE FROM hourly_counts WHERE hour < %i", timestamp) ||
+	   !dbquery("DELETE FROM hourly_clients WHERE hour < %i", timestamp) ||
+	   !dbquery("DELETE FROM hourly_domains WHERE hour < %i", timestamp) ||
+	   !dbquery("DELETE FROM hourly_upstreams WHERE hour < %i", timestamp))
+		logg("delete_old_queries_in_DB(): Deleting old hourly aggregates failed!");
+
+	// overTime rollups are kept for as long as their tier covers
+	for(int i = 0; i < ROLLUP_TIERS; i++)
+	{
+		const long long mintime = time(NULL) - (long long)rollups[i].slots * rollups[i].interval;
+		if(!dbquery("DELETE FROM overtime WHERE resolution = %i AND timestamp < %lld", rollups[i].interval, mintime))
+			logg("delete_old_queries_in_DB(): Deleting old overTime rollups failed!");
+	}
+
 	// Print final message only if there is a difference
 	if((config.debug & DEBUG_DATABASE) || affected)
 		logg("Notice: Database size is %.2f MB, deleted %i rows", get_db_filesize(), affected);
@@ -639,6 +1133,9 @@ void *DB_thread(void *val)
 			// Release data lock
 			unlock_shm();
 
+			// Doesn't need FTL's data structures
+			truncate_hourly_aggregates();
+
 			// Check if GC should be done on the database
 			if(DBdeleteoldqueries)
 			{
@@ -673,9 +1170,9 @@ void read_data_from_DB(void)
 
 	// Prepare request
 	char *rstr = NULL;
-	// Get time stamp 24 hours in the past
+	// Get time stamp 24 hours in the past (when the database was initialized)
 	time_t now = time(NULL);
-	time_t mintime = now - config.maxlogage;
+	time_t mintime = import_from;
 	int rc = asprintf(&rstr, "SELECT * FROM queries WHERE timestamp >= %li", mintime);
 	if(rc < 1)
 	{
@@ -698,7 +1195,6 @@ void read_data_from_DB(void)
 	// Loop through returned database rows
 	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
 	{
-		sqlite3_int64 dbid = sqlite3_column_int64(stmt, 0);
 		time_t queryTimeStamp = sqlite3_column_int(stmt, 1);
 		// 1483228800 = 01/01/2017 @ 12:00am (UTC)
 		if(queryTimeStamp < 1483228800)
@@ -726,9 +1222,9 @@ void read_data_from_DB(void)
 		}
 
 		int status = sqlite3_column_int(stmt, 3);
-		if(status < QUERY_UNKNOWN || status > QUERY_EXTERNAL_BLOCKED_NXRA)
+		if(status < QUERY_UNKNOWN || status >= QUERY_STATUS_MAX)
 		{
-			logg("DB warn: STATUS should be within [%i,%i] but is %i", QUERY_UNKNOWN, QUERY_EXTERNAL_BLOCKED_NXRA, status);
+			logg("DB warn: STATUS should be within [%i,%i] but is %i", QUERY_UNKNOWN, QUERY_STATUS_MAX-1, status);
 			continue;
 		}
 
@@ -789,7 +1285,7 @@ void read_data_from_DB(void)
 		queries[queryIndex].clientID = clientID;
 		queries[queryIndex].forwardID = forwardID;
 		queries[queryIndex].timeidx = timeidx;
-		queries[queryIndex].db = dbid;
+		queries[queryIndex].db = true;
 		queries[queryIndex].id = 0;
 		queries[queryIndex].complete = true; // Mark as all information is available
 		queries[queryIndex].response = 0;
@@ -810,10 +1306,13 @@ void read_data_from_DB(void)
 		// Update overTime data
 		overTime[timeidx].total++;
 		// Update overTime data structure with the new client
-		clients[clientID].overTime[timeidx]++;
+		add_client_overTime(clientID, timeidx, 1);
 
-		// Increase DNS queries counter
-		counters->queries++;
+		// List query for its client and domain
+		add_query_postings(queryIndex);
+
+		// Increase DNS queries counter after the row is filled in
+		__atomic_store_n(&counters->queries, counters->queries + 1, __ATOMIC_RELEASE);
 
 		// Increment status counters
 		switch(status)
@@ -847,6 +1346,13 @@ void read_data_from_DB(void)
 				overTime[timeidx].cached++;
 				break;
 
+			case QUERY_CACHE_STALE: // Expired cache entry (serve-stale)
+				counters->cached++;
+				counters->cached_stale++;
+				// Update overTime data structure
+				overTime[timeidx].cached++;
+				break;
+
 			default:
 				logg("Error: Found unknown status %i in long term database!", status);
 				logg("       Timestamp: %li", queryTimeStamp);
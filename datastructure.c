@@ -9,6 +9,7 @@
 *  Please see LICENSE file for your rights under this license. */
 
 #include "FTL.h"
+#include "shmem.h"
 
 // converts upper to lower case, and leaves other characters unchanged
 void strtolower(char *str)
@@ -57,8 +58,8 @@ int findForwardID(const char * forward, bool count)
 	// to be done separately to be non-blocking
 	forwarded[forwardID].new = true;
 	forwarded[forwardID].namepos = 0; // 0 -> string with length zero
-	// Increase counter by one
-	counters->forwarded++;
+	// Increase counter by one, publishing the new row to readers without the lock
+	__atomic_store_n(&counters->forwarded, counters->forwarded + 1, __ATOMIC_RELEASE);
 
 	return forwardID;
 }
@@ -100,8 +101,11 @@ int findDomainID(const char *domain)
 	domains[domainID].domainpos = addstr(domain);
 	// RegEx needs to be evaluated for this new domain
 	domains[domainID].regexmatch = REGEX_UNKNOWN;
-	// Increase counter by one
-	counters->domains++;
+	// No queries listed yet
+	domains[domainID].firstposting = 0;
+	domains[domainID].lastposting = 0;
+	// Increase counter by one, publishing the new row to readers without the lock
+	__atomic_store_n(&counters->domains, counters->domains + 1, __ATOMIC_RELEASE);
 
 	return domainID;
 }
@@ -153,16 +157,23 @@ int findClientID(const char *client, bool count)
 	// to be done separately to be non-blocking
 	clients[clientID].new = true;
 	clients[clientID].namepos = 0;
+	clients[clientID].localname = false;
 	// No query seen so far
 	clients[clientID].lastQuery = 0;
 	clients[clientID].numQueriesARP = 0;
+	// No queries listed yet
+	clients[clientID].firstposting = 0;
+	clients[clientID].lastposting = 0;
 
-	// Initialize client-specific overTime data
-	for(int i = 0; i < OVERTIME_SLOTS; i++)
-		clients[clientID].overTime[i] = 0;
+	// No overTime data yet
+	clients[clientID].firstovertime = 0;
+	clients[clientID].lastovertime = 0;
 
-	// Increase counter by one
-	counters->clients++;
+	// Increase counter by one, publishing the new row to readers without the lock
+	__atomic_store_n(&counters->clients, counters->clients + 1, __ATOMIC_RELEASE);
+
+	// Use a name from the DHCP leases or hosts files right away
+	apply_local_name(clientID);
 
 	return clientID;
 }
@@ -217,3 +228,126 @@ const char *getClientNameString(int queryID)
 	else
 		return HIDDEN_CLIENT;
 }
+
+static int new_postings_chunk(void)
+{
+	int chunk = counters->postings_free;
+	if(chunk == 0)
+	{
+		memory_check(POSTINGS);
+		chunk = counters->postings++;
+		postings[chunk].next = 0;
+		postings[chunk].count = 0;
+		return chunk;
+	}
+
+	// Re-use a chunk released by the garbage collector. Listings
+	// which may still hold it have to start over
+	move_shm_begin();
+	counters->postings_free = postings[chunk].next;
+	postings[chunk].next = 0;
+	postings[chunk].count = 0;
+	move_shm_end();
+	return chunk;
+}
+
+static void append_posting(int *first, int *last, const long long id)
+{
+	if(*last == 0 || postings[*last].count >= POSTINGS_PER_CHUNK)
+	{
+		const int chunk = new_postings_chunk();
+		// Link the initialized chunk for readers without the lock
+		if(*last == 0)
+			__atomic_store_n(first, chunk, __ATOMIC_RELEASE);
+		else
+			__atomic_store_n(&postings[*last].next, chunk, __ATOMIC_RELEASE);
+		*last = chunk;
+	}
+
+	postingsDataStruct *chunk = &postings[*last];
+	chunk->id[chunk->count] = id;
+	// Readers without the lock see the new count only after the ID
+	__atomic_store_n(&chunk->count, chunk->count + 1, __ATOMIC_RELEASE);
+}
+
+// Add a new query to the lists of its client and its domain. Call this
+// before the query is counted in counters->queries
+void add_query_postings(int queryID)
+{
+	const long long id = queryID + counters->queries_removed;
+	const int domainID = queries[queryID].domainID;
+	const int clientID = queries[queryID].clientID;
+	append_posting(&domains[domainID].firstposting, &domains[domainID].lastposting, id);
+	append_posting(&clients[clientID].firstposting, &clients[clientID].lastposting, id);
+}
+
+// Advance through a list of queries. chunk and pos have to be initialized
+// with the first chunk of the list and zero, respectively. Returns the
+// index of the next listed query not before ibeg or -1 at the end
+int next_posting(int *chunk, int *pos, int ibeg)
+{
+	const long long removed = counters->queries_removed;
+	while(*chunk > 0 && *chunk < counters->postings)
+	{
+		const postingsDataStruct *c = &postings[*chunk];
+		int count = __atomic_load_n(&c->count, __ATOMIC_ACQUIRE);
+		if(count > POSTINGS_PER_CHUNK)
+			count = POSTINGS_PER_CHUNK;
+
+		// Skip whole chunks ending before the requested start
+		if(*pos == 0 && count > 0 && c->id[count-1] - removed < ibeg)
+			*pos = count;
+
+		while(*pos < count)
+		{
+			const long long idx = c->id[(*pos)++] - removed;
+			if(idx >= ibeg)
+				return (int)idx;
+		}
+
+		// The last chunk of a list may still grow
+		const int next = __atomic_load_n(&c->next, __ATOMIC_ACQUIRE);
+		if(next == 0)
+			break;
+		*chunk = next;
+		*pos = 0;
+	}
+	return -1;
+}
+
+static void gc_list(int *first, int *last, const long long minid)
+{
+	while(*first != 0)
+	{
+		postingsDataStruct *chunk = &postings[*first];
+		if(chunk->count > 0 && chunk->id[chunk->count-1] >= minid)
+			break;
+
+		// All queries in this chunk have been removed
+		const int next = chunk->next;
+		chunk->next = counters->postings_free;
+		counters->postings_free = *first;
+		*first = next;
+	}
+	if(*first == 0)
+		*last = 0;
+}
+
+// Hand an answered query to the >stream subscribers. Subscribers read
+// without the lock, the ID has to be in place before head moves on
+void stream_query(int queryID)
+{
+	const unsigned long long head = querystream->head;
+	querystream->id[head % STREAM_SLOTS] = queryID + counters->queries_removed;
+	__atomic_store_n(&querystream->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Release list chunks only holding queries removed by the garbage collector
+void gc_postings(void)
+{
+	const long long minid = counters->queries_removed;
+	for(int i = 0; i < counters->domains; i++)
+		gc_list(&domains[i].firstposting, &domains[i].lastposting, minid);
+	for(int i = 0; i < counters->clients; i++)
+		gc_list(&clients[i].firstposting, &clients[i].lastposting, minid);
+}
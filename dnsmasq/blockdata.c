@@ -18,135 +18,75 @@
 
 #ifdef HAVE_DNSSEC
 
-static struct blockdata *keyblock_free;
-static unsigned int blockdata_count, blockdata_hwm, blockdata_alloced;
+/* Pi-hole modification: each blob is a single, refcounted allocation
+   instead of a chain of KEYBLOCK_LEN sized blocks, so key material can
+   be handed to the crypto code without copying it back together first,
+   and shared between users without copying it at all. */
 
-static void blockdata_expand(int n)
-{
-  struct blockdata *new = whine_malloc(n * sizeof(struct blockdata));
-
-  if (new)
-    {
-      int i;
-
-      new[n-1].next = keyblock_free;
-      keyblock_free = new;
-
-      for (i = 0; i < n - 1; i++)
-	new[i].next = &new[i+1];
-
-      blockdata_alloced += n;
-    }
-}
+static size_t blockdata_bytes, blockdata_hwm;
 
-/* Preallocate some blocks, proportional to cachesize, to reduce heap fragmentation. */
 void blockdata_init(void)
 {
-  keyblock_free = NULL;
-  blockdata_alloced = 0;
-  blockdata_count = 0;
+  blockdata_bytes = 0;
   blockdata_hwm = 0;
-
-  /* Note that daemon->cachesize is enforced to have non-zero size if OPT_DNSSEC_VALID is set */
-  if (option_bool(OPT_DNSSEC_VALID))
-    blockdata_expand(daemon->cachesize);
 }
 
 void blockdata_report(void)
 {
   if (option_bool(OPT_DNSSEC_VALID))
-    my_syslog(LOG_INFO, _("DNSSEC memory in use %u, max %u, allocated %u"), 
-	      blockdata_count * sizeof(struct blockdata),  
-	      blockdata_hwm * sizeof(struct blockdata),  
-	      blockdata_alloced * sizeof(struct blockdata));
-} 
+    my_syslog(LOG_INFO, _("DNSSEC memory in use %u, max %u"),
+	      (unsigned int)blockdata_bytes, (unsigned int)blockdata_hwm);
+}
 
 struct blockdata *blockdata_alloc(char *data, size_t len)
 {
-  struct blockdata *block, *ret = NULL;
-  struct blockdata **prev = &ret;
-  size_t blen;
+  struct blockdata *block;
 
-  while (len > 0)
-    {
-      if (!keyblock_free)
-	blockdata_expand(50);
-      
-      if (keyblock_free)
-	{
-	  block = keyblock_free;
-	  keyblock_free = block->next;
-	  blockdata_count++; 
-	}
-      else
-	{
-	  /* failed to alloc, free partial chain */
-	  blockdata_free(ret);
-	  return NULL;
-	}
-       
-      if (blockdata_hwm < blockdata_count)
-	blockdata_hwm = blockdata_count; 
-      
-      blen = len > KEYBLOCK_LEN ? KEYBLOCK_LEN : len;
-      memcpy(block->key, data, blen);
-      data += blen;
-      len -= blen;
-      *prev = block;
-      prev = &block->next;
-      block->next = NULL;
-    }
-  
-  return ret;
+  if (!(block = whine_malloc(sizeof(struct blockdata) + len)))
+    return NULL;
+
+  block->refcount = 1;
+  block->len = len;
+  memcpy(block->data, data, len);
+
+  blockdata_bytes += sizeof(struct blockdata) + len;
+  if (blockdata_hwm < blockdata_bytes)
+    blockdata_hwm = blockdata_bytes;
+
+  return block;
 }
 
+/* Another user of the same data, release with blockdata_free() */
+struct blockdata *blockdata_ref(struct blockdata *block)
+{
+  if (block)
+    block->refcount++;
 
-void blockdata_free(struct blockdata *blocks)
+  return block;
+}
+
+void blockdata_free(struct blockdata *block)
 {
-  struct blockdata *tmp;
-  
-  if (blocks)
+  if (block && --block->refcount == 0)
     {
-      for (tmp = blocks; tmp->next; tmp = tmp->next)
-	blockdata_count--;
-      tmp->next = keyblock_free;
-      keyblock_free = blocks; 
-      blockdata_count--;
+      blockdata_bytes -= sizeof(struct blockdata) + block->len;
+      free(block);
     }
 }
 
-/* if data == NULL, return pointer to static block of sufficient size */
+/* if data == NULL, return pointer to the stored data itself, which
+   must not be modified. */
 void *blockdata_retrieve(struct blockdata *block, size_t len, void *data)
 {
-  size_t blen;
-  struct  blockdata *b;
-  void *new, *d;
-  
-  static unsigned int buff_len = 0;
-  static unsigned char *buff = NULL;
-   
+  if (!block || len > block->len)
+    return NULL;
+
   if (!data)
-    {
-      if (len > buff_len)
-	{
-	  if (!(new = whine_malloc(len)))
-	    return NULL;
-	  if (buff)
-	    free(buff);
-	  buff = new;
-	}
-      data = buff;
-    }
-  
-  for (d = data, b = block; len > 0 && b;  b = b->next)
-    {
-      blen = len > KEYBLOCK_LEN ? KEYBLOCK_LEN : len;
-      memcpy(d, b->key, blen);
-      d += blen;
-      len -= blen;
-    }
+    return block->data;
+
+  memcpy(data, block->data, len);
 
   return data;
 }
- 
+
 #endif
@@ -17,16 +17,30 @@
 #include "dnsmasq.h"
 #include "../dnsmasq_interface.h"
 
-static struct crec *cache_head = NULL, *cache_tail = NULL, **hash_table = NULL;
+/* Pi-hole modification: cache records live in one slab allocated at
+   startup. Unused records are kept on cache_free_list, records in use
+   are reclaimed by a CLOCK sweep over the slab instead of maintaining
+   an LRU list on every lookup. The hash table is one array split into
+   CACHE_SHARDS partitions of shard_size buckets each. */
+static struct crec *cache_slab = NULL, *cache_free_list = NULL, **hash_table = NULL;
+static int clock_hand = 0;
+static struct cache_shard shards[CACHE_SHARDS];
 #ifdef HAVE_DHCP
 static struct crec *dhcp_spare = NULL;
 #endif
 static struct crec *new_chain = NULL;
 static int insert_error;
 static union bigname *big_free = NULL;
-static int bignames_left, hash_size;
+static int bignames_left, hash_size, shard_size;
+
+/* Values of crec->clock for slab records */
+#define CLOCK_REF     1 /* looked up since the hand last passed */
+#define CLOCK_PENDING 2 /* on new_chain, not yet committed to the cache */
 
 static void make_non_terminals(struct crec *source);
+static int is_outdated_cname_pointer(struct crec *crecp);
+static struct crec *cache_scan_free(char *name, struct all_addr *addr, time_t now, unsigned short flags,
+				    struct crec **target_crec, unsigned int *target_uid);
 
 /* type->string mapping: this is also used by the name-hash function as a mixing table. */
 static const struct {
@@ -76,10 +90,8 @@ static const struct {
 };
 
 static void cache_free(struct crec *crecp);
-static void cache_unlink(struct crec *crecp);
-static void cache_link(struct crec *crecp);
 void rehash(int size);
-static void cache_hash(struct crec *crecp);
+static unsigned int cache_hash(struct crec *crecp);
 
 void next_uid(struct crec *crecp)
 {
@@ -106,13 +118,17 @@ void cache_init(void)
 
   if (daemon->cachesize > 0)
     {
-      crecp = safe_malloc(daemon->cachesize*sizeof(struct crec));
+      cache_slab = safe_malloc(daemon->cachesize*sizeof(struct crec));
 
-      for (i=0; i < daemon->cachesize; i++, crecp++)
+      /* Build the free list backwards so that the slab gets used in order */
+      for (i = daemon->cachesize - 1; i >= 0; i--)
 	{
-	  cache_link(crecp);
+	  crecp = &cache_slab[i];
 	  crecp->flags = 0;
+	  crecp->clock = 0;
 	  crecp->uid = UID_NONE;
+	  crecp->next = cache_free_list;
+	  cache_free_list = crecp;
 	}
     }
 
@@ -129,7 +145,7 @@ void rehash(int size)
   struct crec **new, **old, *p, *tmp;
   int i, new_size, old_size;
 
-  /* hash_size is a power of two. */
+  /* hash_size is a power of two, and so is shard_size. */
   for (new_size = 64; new_size < size/10; new_size = new_size << 1);
 
   /* must succeed in getting first instance, failure later is non-fatal */
@@ -145,6 +161,7 @@ void rehash(int size)
   old_size = hash_size;
   hash_table = new;
   hash_size = new_size;
+  shard_size = new_size / CACHE_SHARDS;
 
   if (old)
     {
@@ -158,7 +175,7 @@ void rehash(int size)
     }
 }
 
-static struct crec **hash_bucket(char *name)
+static unsigned int hash_name(char *name)
 {
   unsigned int c, val = 017465; /* Barker code - minimum self-correlation in cyclic shift */
   const unsigned char *mix_tab = (const unsigned char*)typestr;
@@ -171,18 +188,59 @@ static struct crec **hash_bucket(char *name)
       val = ((val << 7) | (val >> (32 - 7))) + (mix_tab[(val + c) & 0x3F] ^ c);
     }
 
-  /* hash_size is a power of two */
-  return hash_table + ((val ^ (val >> 16)) & (hash_size - 1));
+  return val ^ (val >> 16);
+}
+
+/* The low bits of the hash select the shard, the next ones the bucket
+   within it. shard_size is a power of two */
+static struct crec **hash_chain(unsigned int hash)
+{
+  return hash_table + (hash & (CACHE_SHARDS - 1)) * shard_size +
+    ((hash >> CACHE_SHARD_BITS) & (shard_size - 1));
+}
+
+static struct cache_shard *hash_shard(unsigned int hash)
+{
+  return &shards[hash & (CACHE_SHARDS - 1)];
+}
+
+static struct crec **hash_bucket(char *name)
+{
+  return hash_chain(hash_name(name));
+}
+
+const struct cache_shard *cache_get_shard(int shard)
+{
+  if (shard < 0 || shard >= CACHE_SHARDS)
+    return NULL;
+
+  return &shards[shard];
 }
 
-static void cache_hash(struct crec *crecp)
+/* Remove a record from its hash chain, returns 0 if it wasn't hashed. */
+static int cache_unhash(struct crec *crecp, unsigned int hash)
+{
+  struct crec **up;
+
+  for (up = hash_chain(hash); *up; up = &(*up)->hash_next)
+    if (*up == crecp)
+      {
+	*up = crecp->hash_next;
+	return 1;
+      }
+
+  return 0;
+}
+
+static unsigned int cache_hash(struct crec *crecp)
 {
   /* maintain an invariant that all entries with F_REVERSE set
      are at the start of the hash-chain  and all non-reverse
      immortal entries are at the end of the hash-chain.
      This allows reverse searches and garbage collection to be optimised */
 
-  struct crec **up = hash_bucket(cache_get_name(crecp));
+  unsigned int hash = hash_name(cache_get_name(crecp));
+  struct crec **up = hash_chain(hash);
 
   if (!(crecp->flags & F_REVERSE))
     {
@@ -195,6 +253,8 @@ static void cache_hash(struct crec *crecp)
     }
   crecp->hash_next = *up;
   *up = crecp;
+
+  return hash;
 }
 
 #ifdef HAVE_DNSSEC
@@ -207,19 +267,13 @@ static void cache_blockdata_free(struct crec *crecp)
 }
 #endif
 
-static void cache_free(struct crec *crecp)
+/* Invalidate a record without putting it on the free list */
+static void cache_release(struct crec *crecp)
 {
   crecp->flags &= ~F_FORWARD;
   crecp->flags &= ~F_REVERSE;
   crecp->uid = UID_NONE; /* invalidate CNAMES pointing to this. */
-
-  if (cache_tail)
-    cache_tail->next = crecp;
-  else
-    cache_head = crecp;
-  crecp->prev = cache_tail;
-  crecp->next = NULL;
-  cache_tail = crecp;
+  crecp->clock = 0;
 
   /* retrieve big name for further use. */
   if (crecp->flags & F_BIGNAME)
@@ -234,30 +288,82 @@ static void cache_free(struct crec *crecp)
 #endif
 }
 
-/* insert a new cache entry at the head of the list (youngest entry) */
-static void cache_link(struct crec *crecp)
+static void cache_free_push(struct crec *crecp)
 {
-  if (cache_head) /* check needed for init code */
-    cache_head->prev = crecp;
-  crecp->next = cache_head;
-  crecp->prev = NULL;
-  cache_head = crecp;
-  if (!cache_tail)
-    cache_tail = crecp;
+  crecp->next = cache_free_list;
+  cache_free_list = crecp;
 }
 
-/* remove an arbitrary cache entry for promotion */
-static void cache_unlink (struct crec *crecp)
+static void cache_free(struct crec *crecp)
 {
-  if (crecp->prev)
-    crecp->prev->next = crecp->next;
-  else
-    cache_head = crecp->next;
+  cache_release(crecp);
+  cache_free_push(crecp);
+}
 
-  if (crecp->next)
-    crecp->next->prev = crecp->prev;
-  else
-    cache_tail = crecp->prev;
+/* CLOCK sweep: find a slab record to reuse when the free list is empty.
+   Expired and stale records are taken immediately, live records get a
+   second chance if they were looked up since the hand last passed.
+   A live record takes the rest of its RRset with it, like the LRU
+   eviction did, so no partial (possibly validated) RRset is kept. */
+static struct crec *cache_clock_evict(time_t now)
+{
+  int i;
+
+  for (i = 0; i < 2 * daemon->cachesize; i++)
+    {
+      struct crec *crecp = &cache_slab[clock_hand];
+      unsigned int hash;
+
+      if (++clock_hand == daemon->cachesize)
+	clock_hand = 0;
+
+      if ((crecp->clock & CLOCK_PENDING) || !(crecp->flags & (F_FORWARD | F_REVERSE)))
+	continue;
+
+      if (!cache_is_stale(now, crecp) && !is_outdated_cname_pointer(crecp))
+	{
+	  struct all_addr free_addr = crecp->addr.addr;
+	  char name[MAXDNAME];
+
+	  if (crecp->clock & CLOCK_REF)
+	    {
+	      crecp->clock &= ~CLOCK_REF;
+	      continue;
+	    }
+
+	  hash = hash_name(cache_get_name(crecp));
+#ifdef HAVE_DNSSEC
+	  /* For DNSSEC records, addr holds class. */
+	  if (crecp->flags & (F_DS | F_DNSKEY))
+	    free_addr.addr.dnssec.class = crecp->uid;
+#endif
+	  /* Freeing a long name reuses its memory, scan with a copy */
+	  strncpy(name, cache_get_name(crecp), MAXDNAME - 1);
+	  name[MAXDNAME - 1] = '\0';
+	  cache_scan_free(name, &free_addr, now, crecp->flags, NULL, NULL);
+
+	  /* The whole RRset counts as one eviction */
+	  if ((crecp = cache_free_list))
+	    {
+	      cache_free_list = crecp->next;
+	      daemon->metrics[METRIC_DNS_CACHE_LIVE_FREED]++;
+	      hash_shard(hash)->evictions++;
+	      return crecp;
+	    }
+
+	  /* Nothing was freed, the sweep continues */
+	  continue;
+	}
+      else
+	hash = hash_name(cache_get_name(crecp));
+
+      /* Reused right away, so it never goes on the free list */
+      cache_unhash(crecp, hash);
+      cache_release(crecp);
+      return crecp;
+    }
+
+  return NULL;
 }
 
 char *cache_get_name(struct crec *crecp)
@@ -318,7 +424,20 @@ static int is_outdated_cname_pointer(struct crec *crecp)
   return 1;
 }
 
-static int is_expired(time_t now, struct crec *crecp)
+/* Pi-hole modification: serve-stale (RFC 8767). Expired forward address
+   records are kept for up to --use-stale-cache seconds after their TTL ran
+   out so that they can be served while an upstream refresh is in flight.
+   DNSSEC key material is never kept beyond its TTL. */
+static int can_be_stale(struct crec *crecp)
+{
+  return daemon->cache_max_stale != 0 &&
+    (crecp->flags & F_FORWARD) &&
+    (crecp->flags & (F_IPV4 | F_IPV6 | F_CNAME)) &&
+    !(crecp->flags & (F_DNSKEY | F_DS | F_HOSTS | F_DHCP | F_CONFIG));
+}
+
+/* Entry has outlived its TTL, it may still be within the stale grace period */
+int cache_is_stale(time_t now, struct crec *crecp)
 {
   if (crecp->flags & F_IMMORTAL)
     return 0;
@@ -329,6 +448,17 @@ static int is_expired(time_t now, struct crec *crecp)
   return 1;
 }
 
+static int is_expired(time_t now, struct crec *crecp)
+{
+  if (!cache_is_stale(now, crecp))
+    return 0;
+
+  if (can_be_stale(crecp) && difftime(now, crecp->ttd) < (double)daemon->cache_max_stale)
+    return 0;
+
+  return 1;
+}
+
 static struct crec *cache_scan_free(char *name, struct all_addr *addr, time_t now, unsigned short flags,
 				    struct crec **target_crec, unsigned int *target_uid)
 {
@@ -337,7 +467,8 @@ static struct crec *cache_scan_free(char *name, struct all_addr *addr, time_t no
      entries but only in the same hash bucket as name.
      If (flags & F_REVERSE) then remove any reverse entries for addr and any expired
      entries in the whole cache.
-     If (flags == 0) remove any expired entries in the whole cache.
+     If (flags == 0) remove any expired entries in the whole cache,
+     including those kept for serve-stale.
 
      In the flags & F_FORWARD case, the return code is valid, and returns a non-NULL pointer
      to a cache entry if the name exists in the cache as a HOSTS or DHCP entry (these are never deleted)
@@ -366,15 +497,22 @@ static struct crec *cache_scan_free(char *name, struct all_addr *addr, time_t no
 		  /* If this record is for the name we're inserting and is the target
 		     of a CNAME record. Make the new record for the same name, in the same
 		     crec, with the same uid to avoid breaking the existing CNAME. */
-		  if (crecp->uid != UID_NONE)
+		  if (crecp->uid != UID_NONE && target_crec)
 		    {
-		      if (target_crec)
-			*target_crec = crecp;
+		      /* The caller reuses it, so keep it off the free list */
+		      if (*target_crec)
+			cache_free_push(*target_crec);
+		      *target_crec = crecp;
 		      if (target_uid)
 			*target_uid = crecp->uid;
+		      cache_release(crecp);
+		    }
+		  else
+		    {
+		      if (crecp->uid != UID_NONE && target_uid)
+			*target_uid = crecp->uid;
+		      cache_free(crecp);
 		    }
-		  cache_unlink(crecp);
-		  cache_free(crecp);
 		  continue;
 		}
 
@@ -385,7 +523,6 @@ static struct crec *cache_scan_free(char *name, struct all_addr *addr, time_t no
 		  if (crecp->flags & F_CONFIG)
 		    return crecp;
 		  *up = crecp->hash_next;
-		  cache_unlink(crecp);
 		  cache_free(crecp);
 		  continue;
 		}
@@ -396,10 +533,7 @@ static struct crec *cache_scan_free(char *name, struct all_addr *addr, time_t no
 	    {
 	      *up = crecp->hash_next;
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
-		{
-		  cache_unlink(crecp);
-		  cache_free(crecp);
-		}
+		cache_free(crecp);
 	      continue;
 	    }
 
@@ -418,14 +552,12 @@ static struct crec *cache_scan_free(char *name, struct all_addr *addr, time_t no
 	for (crecp = hash_table[i], up = &hash_table[i];
 	     crecp && ((crecp->flags & F_REVERSE) || !(crecp->flags & F_IMMORTAL));
 	     crecp = crecp->hash_next)
-	  if (is_expired(now, crecp))
+	  /* When making space (flags == 0), stale entries go before live ones */
+	  if (is_expired(now, crecp) || (flags == 0 && cache_is_stale(now, crecp)))
 	    {
 	      *up = crecp->hash_next;
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
-		{
-		  cache_unlink(crecp);
-		  cache_free(crecp);
-		}
+		cache_free(crecp);
 	    }
 	  else if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)) &&
 		   (flags & crecp->flags & F_REVERSE) &&
@@ -433,7 +565,6 @@ static struct crec *cache_scan_free(char *name, struct all_addr *addr, time_t no
 		   memcmp(&crecp->addr.addr, addr, addrlen) == 0)
 	    {
 	      *up = crecp->hash_next;
-	      cache_unlink(crecp);
 	      cache_free(crecp);
 	    }
 	  else
@@ -471,8 +602,6 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
 {
   struct crec *new, *target_crec = NULL;
   union bigname *big_name = NULL;
-  int freed_all = flags & F_REVERSE;
-  int free_avail = 0;
   unsigned int target_uid;
 
   /* Don't log DNSSEC records here, done elsewhere */
@@ -495,6 +624,10 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
      are currently inserting. */
   if ((new = cache_scan_free(name, addr, now, flags, &target_crec, &target_uid)))
     {
+      /* A CNAME target freed on the way is not going to be reused */
+      if (target_crec)
+	cache_free_push(target_crec);
+
       /* We're trying to insert a record over one from
 	 /etc/hosts or DHCP, or other config. If the
 	 existing record is for an A or AAAA and
@@ -516,58 +649,16 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
       return NULL;
     }
 
-  /* Now get a cache entry from the end of the LRU list */
-  if (!target_crec)
-    while (1) {
-      if (!(new = cache_tail)) /* no entries left - cache is too small, bail */
-	{
-	  insert_error = 1;
-	  return NULL;
-	}
-
-      /* Free entry at end of LRU list, use it. */
-      if (!(new->flags & (F_FORWARD | F_REVERSE)))
-	break;
-
-      /* End of LRU list is still in use: if we didn't scan all the hash
-	 chains for expired entries do that now. If we already tried that
-	 then it's time to start spilling things. */
-
-      /* If free_avail set, we believe that an entry has been freed.
-	 Bugs have been known to make this not true, resulting in
-	 a tight loop here. If that happens, abandon the
-	 insert. Once in this state, all inserts will probably fail. */
-      if (free_avail)
-	{
-	  static int warned = 0;
-	  if (!warned)
-	    {
-	      my_syslog(LOG_ERR, _("Internal error in cache."));
-	      warned = 1;
-	    }
-	  insert_error = 1;
-	  return NULL;
-	}
-
-      if (freed_all)
-	{
-	  struct all_addr free_addr = new->addr.addr;;
-
-#ifdef HAVE_DNSSEC
-	  /* For DNSSEC records, addr holds class. */
-	  if (new->flags & (F_DS | F_DNSKEY))
-	    free_addr.addr.dnssec.class = new->uid;
-#endif
-
-	  free_avail = 1; /* Must be free space now. */
-	  cache_scan_free(cache_get_name(new), &free_addr, now, new->flags, NULL, NULL);
-	  daemon->metrics[METRIC_DNS_CACHE_LIVE_FREED]++;
-	}
-      else
-	{
-	  cache_scan_free(NULL, NULL, now, 0, NULL, NULL);
-	  freed_all = 1;
-	}
+  /* Now get a cache entry: the CNAME target freed above, an unused one
+     from the free list, or reclaim one with the CLOCK sweep. */
+  if (target_crec)
+    new = target_crec;
+  else if ((new = cache_free_list))
+    cache_free_list = new->next;
+  else if (!(new = cache_clock_evict(now))) /* cache is too small, bail */
+    {
+      insert_error = 1;
+      return NULL;
     }
 
   /* Check if we need to and can allocate extra memory for a long name.
@@ -582,6 +673,8 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
       else if ((bignames_left == 0 && !(flags & (F_DS | F_DNSKEY))) ||
 	       !(big_name = (union bigname *)whine_malloc(sizeof(union bigname))))
 	{
+	  /* not in use yet, just hand it back */
+	  cache_free_push(new);
 	  insert_error = 1;
 	  return NULL;
 	}
@@ -590,17 +683,13 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
 
     }
 
-  /* If we freed a cache entry for our name which was a CNAME target, use that.
+  /* If we freed a cache entry for our name which was a CNAME target, we use that
      and preserve the uid, so that existing CNAMES are not broken. */
   if (target_crec)
-    {
-      new = target_crec;
-      new->uid = target_uid;
-    }
+    new->uid = target_uid;
 
   /* Got the rest: finally grab entry. */
-  cache_unlink(new);
-
+  new->clock = CLOCK_PENDING;
   new->flags = flags;
   if (big_name)
     {
@@ -644,9 +733,10 @@ void cache_end_insert(void)
 	cache_free(new_chain);
       else
 	{
-	  cache_hash(new_chain);
-	  cache_link(new_chain);
+	  unsigned int hash = cache_hash(new_chain);
+	  new_chain->clock = CLOCK_REF;
 	  daemon->metrics[METRIC_DNS_CACHE_INSERTED]++;
+	  hash_shard(hash)->insertions++;
 	}
       new_chain = tmp;
     }
@@ -659,7 +749,7 @@ int cache_find_non_terminal(char *name, time_t now)
 
   for (crecp = *hash_bucket(name); crecp; crecp = crecp->hash_next)
     if (!is_outdated_cname_pointer(crecp) &&
-	!is_expired(now, crecp) &&
+	!cache_is_stale(now, crecp) &&
 	(crecp->flags & F_FORWARD) &&
 	hostname_isequal(name, cache_get_name(crecp)))
       return 1;
@@ -671,8 +761,9 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 {
   struct crec *ans;
   int no_rr = prot & F_NO_RR;
+  int use_stale = prot & F_STALE;
 
-  prot &= ~F_NO_RR;
+  prot &= ~(F_NO_RR | F_STALE);
 
   if (crecp) /* iterating */
     ans = crecp->next;
@@ -682,27 +773,26 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 	 also free anything which has expired */
       struct crec *next, **up, **insert = NULL, **chainp = &ans;
       unsigned short ins_flags = 0;
+      unsigned int hash = hash_name(name);
 
-      for (up = hash_bucket(name), crecp = *up; crecp; crecp = next)
+      for (up = hash_chain(hash), crecp = *up; crecp; crecp = next)
 	{
 	  next = crecp->hash_next;
 
 	  if (!is_expired(now, crecp) && !is_outdated_cname_pointer(crecp))
 	    {
-	      if ((crecp->flags & F_FORWARD) &&
+	      if (!use_stale && cache_is_stale(now, crecp))
+		/* case : within stale grace period, but caller wants fresh data only */
+		up = &crecp->hash_next;
+	      else if ((crecp->flags & F_FORWARD) &&
 		  (crecp->flags & prot) &&
 		  hostname_isequal(cache_get_name(crecp), name))
 		{
-		  if (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG))
-		    {
-		      *chainp = crecp;
-		      chainp = &crecp->next;
-		    }
-		  else
-		    {
-		      cache_unlink(crecp);
-		      cache_link(crecp);
-		    }
+		  /* chain the results through ->next, cached records
+		     get a second chance in the next CLOCK sweep */
+		  *chainp = crecp;
+		  chainp = &crecp->next;
+		  crecp->clock |= CLOCK_REF;
 
 		  /* Move all but the first entry up the hash chain
 		     this implements round-robin.
@@ -735,19 +825,22 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 	      /* expired entry, free it */
 	      *up = crecp->hash_next;
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
-		{
-		  cache_unlink(crecp);
-		  cache_free(crecp);
-		}
+		cache_free(crecp);
 	    }
 	}
 
-      *chainp = cache_head;
+      *chainp = NULL;
+
+      if (ans)
+	hash_shard(hash)->hits++;
+      else
+	hash_shard(hash)->misses++;
     }
 
   if (ans &&
       (ans->flags & F_FORWARD) &&
       (ans->flags & prot) &&
+      (use_stale || !cache_is_stale(now, ans)) &&
       hostname_isequal(cache_get_name(ans), name))
     return ans;
 
@@ -784,16 +877,9 @@ struct crec *cache_find_by_addr(struct crec *crecp, struct all_addr *addr,
 	       if ((crecp->flags & prot) &&
 		   memcmp(&crecp->addr.addr, addr, addrlen) == 0)
 		 {
-		   if (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG))
-		     {
-		       *chainp = crecp;
-		       chainp = &crecp->next;
-		     }
-		   else
-		     {
-		       cache_unlink(crecp);
-		       cache_link(crecp);
-		     }
+		   *chainp = crecp;
+		   chainp = &crecp->next;
+		   crecp->clock |= CLOCK_REF;
 		 }
 	       up = &crecp->hash_next;
 	     }
@@ -801,13 +887,10 @@ struct crec *cache_find_by_addr(struct crec *crecp, struct all_addr *addr,
 	     {
 	       *up = crecp->hash_next;
 	       if (!(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
-		 {
-		   cache_unlink(crecp);
-		   cache_free(crecp);
-		 }
+		 cache_free(crecp);
 	     }
 
-       *chainp = cache_head;
+       *chainp = NULL;
     }
 
   if (ans &&
@@ -972,6 +1055,7 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
   unsigned short flags = 0;
   struct all_addr addr;
   int atnl, addrlen = 0;
+  int named = 0;
 
   if (!f)
     {
@@ -1011,6 +1095,7 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
 	}
 
       addr_count++;
+      named = 0;
 
       /* rehash every 1000 names. */
       if (rhash && ((name_count - cache_size) > 1000))
@@ -1052,6 +1137,12 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
 		  add_hosts_entry(cache, &addr, addrlen, index, rhash, hashsz);
 		  name_count++;
 		}
+	      /* Pi-hole modification: the first name of an address names the client */
+	      if (!named)
+		{
+		  FTL_local_name(canon, (flags & F_IPV4) ? AF_INET : AF_INET6, &addr, 0);
+		  named = 1;
+		}
 	      free(canon);
 
 	    }
@@ -1085,6 +1176,10 @@ void cache_reload(void)
 
   daemon->metrics[METRIC_DNS_CACHE_INSERTED] = 0;
   daemon->metrics[METRIC_DNS_CACHE_LIVE_FREED] = 0;
+  memset(shards, 0, sizeof(shards));
+
+  /* Pi-hole modification: client names from the hosts files are re-read below */
+  FTL_local_names_reload(0);
 
   for (i=0; i<hash_size; i++)
     for (cache = hash_table[i], up = &hash_table[i]; cache; cache = tmp)
@@ -1106,7 +1201,12 @@ void cache_reload(void)
 		cache->name.bname->next = big_free;
 		big_free = cache->name.bname;
 	      }
+	    /* back to the free list, blockdata has been released above */
 	    cache->flags = 0;
+	    cache->clock = 0;
+	    cache->uid = UID_NONE;
+	    cache->next = cache_free_list;
+	    cache_free_list = cache;
 	  }
 	else
 	  up = &cache->hash_next;
@@ -1165,6 +1265,8 @@ void cache_reload(void)
 	    cache->ttd = hr->ttl;
 	    cache->flags = F_HOSTS | F_IMMORTAL | F_FORWARD | F_REVERSE | F_IPV4 | F_NAMEP | F_CONFIG;
 	    add_hosts_entry(cache, (struct all_addr *)&hr->addr, INADDRSZ, SRC_CONFIG, (struct crec **)daemon->packet, revhashsz);
+	    /* Pi-hole modification */
+	    FTL_local_name(nl->name, AF_INET, (struct all_addr *)&hr->addr, 0);
 	  }
 #ifdef HAVE_IPV6
 	if (!IN6_IS_ADDR_UNSPECIFIED(&hr->addr6) &&
@@ -1174,6 +1276,8 @@ void cache_reload(void)
 	    cache->ttd = hr->ttl;
 	    cache->flags = F_HOSTS | F_IMMORTAL | F_FORWARD | F_REVERSE | F_IPV6 | F_NAMEP | F_CONFIG;
 	    add_hosts_entry(cache, (struct all_addr *)&hr->addr6, IN6ADDRSZ, SRC_CONFIG, (struct crec **)daemon->packet, revhashsz);
+	    /* Pi-hole modification */
+	    FTL_local_name(nl->name, AF_INET6, (struct all_addr *)&hr->addr6, 0);
 	  }
 #endif
       }
@@ -1221,6 +1325,9 @@ void cache_unhash_dhcp(void)
   struct crec *cache, **up;
   int i;
 
+  /* Pi-hole modification: client names from the leases are re-added next */
+  FTL_local_names_reload(1);
+
   for (i=0; i<hash_size; i++)
     for (cache = hash_table[i], up = &hash_table[i]; cache; cache = cache->hash_next)
       if (cache->flags & F_DHCP)
@@ -1322,6 +1429,9 @@ void cache_add_dhcp_entry(char *host_name, int prot,
       return;
     }
 
+  /* Pi-hole modification: name the client right away */
+  FTL_local_name(host_name, prot, host_address, 1);
+
   if ((crec = cache_find_by_addr(NULL, (struct all_addr *)host_address, 0, flags)))
     {
       if (crec->flags & F_NEG)
@@ -18,11 +18,14 @@
 #define MAX_PROCS 20 /* max no children for TCP requests */
 #define CHILD_LIFETIME 150 /* secs 'till terminated (RFC1035 suggests > 120s) */
 #define TCP_MAX_QUERIES 100 /* Maximum number of queries per incoming TCP connection */
+#define TCP_MAX_CONNS 100 /* default for --tcp-multiplex: connections served without forking */
+#define TCP_IDLE_TIME 10 /* secs an idle multiplexed TCP connection is kept open, see RFC 7766 */
+#define TCP_PIPELINE 32 /* stop reading from a multiplexed TCP connection with this many queries in progress */
 #define TCP_BACKLOG 32  /* kernel backlog limit for TCP connections */
 #define EDNS_PKTSZ 4096 /* default max EDNS.0 UDP packet from RFC5625 */
 #define SAFE_PKTSZ 1280 /* "go anywhere" UDP packet size */
-#define KEYBLOCK_LEN 40 /* choose to minimise fragmentation when storing DNSSEC keys */
 #define DNSSEC_WORK 50 /* Max number of queries to validate one question */
+#define VERIFY_MEMO_SIZE 256 /* remembered DNSSEC signature checks, must be a power of two */
 #define TIMEOUT 10 /* drop UDP queries after TIMEOUT seconds */
 #define FORWARD_TEST 1000 /* try all servers every 1000 queries */
 #define FORWARD_TIME 600 /* or 10 minutes */
@@ -33,12 +36,16 @@
 #define LEASE_RETRY 60 /* on error, retry writing leasefile after LEASE_RETRY seconds */
 #define CACHESIZ 150 /* default cache size */
 #define TTL_FLOOR_LIMIT 3600 /* don't allow --min-cache-ttl to raise TTL above this under any circumstances */
+#define STALE_TTL 30 /* TTL of answers served from expired cache entries, see RFC 8767 */
+#define STALE_GRACE 86400 /* default for --use-stale-cache: keep expired entries for at most one day */
 #define MAXLEASES 1000 /* maximum number of DHCP leases */
 #define PING_WAIT 3 /* wait for ping address-in-use test */
 #define PING_CACHE_TIME 30 /* Ping test assumed to be valid this long. */
 #define DECLINE_BACKOFF 600 /* disable DECLINEd static addresses for this long */
 #define DHCP_PACKET_MAX 16384 /* hard limit on DHCP packet size */
 #define SMALLDNAME 50 /* most domain names are smaller than this */
+#define CACHE_SHARD_BITS 4 /* split the cache hash table into 2^CACHE_SHARD_BITS shards */
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS)
 #define CNAME_CHAIN 10 /* chains longer than this atr dropped for loop protection */
 #define HOSTSFILE "/etc/hosts"
 #define ETHERSFILE "/etc/ethers"
@@ -131,6 +138,13 @@ HAVE_LOOP
 HAVE_INOTIFY
    use the Linux inotify facility to efficiently re-read configuration files.
 
+HAVE_EPOLL
+   use Linux epoll() with persistent registrations instead of poll() in the
+   main loop. Only worthwhile with many open sockets, eg. a large
+   --dns-forward-max or --tcp-multiplex limit. Add it to DNSMASQOPTS in
+   the Makefile, or pass CFLAGS=-DHAVE_EPOLL. "make pollbench" compares
+   both backends. (Pi-hole modification)
+
 NO_ID
    Don't report *.bind CHAOS info to clients, forward such requests upstream instead.
 NO_IPV6
@@ -381,6 +395,12 @@ HAVE_SOCKADDR_SA_LEN
 #define HAVE_INOTIFY
 #endif
 
+/**** Pi-hole modification ****/
+#if defined(HAVE_EPOLL) && !defined(HAVE_LINUX_NETWORK)
+#undef HAVE_EPOLL
+#endif
+/******************************/
+
 /* Define a string indicating which options are in use.
    DNSMASQ_COMPILE_OPTS is only defined in dnsmasq.c */
 
@@ -466,6 +486,9 @@ static char *compile_opts =
 "no-"
 #endif
 "inotify "
+#ifdef HAVE_EPOLL
+"epoll "
+#endif
 #ifndef HAVE_DUMPFILE
 "no-"
 #endif
@@ -25,6 +25,7 @@
 #include <nettle/eddsa.h>
 #include <nettle/nettle-meta.h>
 #include <nettle/bignum.h>
+#include <nettle/sha2.h>
 
 /* Implement a "hash-function" to the nettle API, which simply returns
    the input data, concatenated into a single, statically maintained, buffer.
@@ -392,19 +393,72 @@ static int (*verify_func(int algo))(struct blockdata *key_data, unsigned int key
   return NULL;
 }
 
-int verify(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
+/* Pi-hole modification: remember recent verify() results. The same
+   RRSIGs are checked again every time a signed answer which isn't in the
+   cache is validated, and the public key operation is by far the most
+   expensive part of that. Entries are found by key tag and a SHA-256 over
+   algorithm, key, signature and signed data, so a hit is as good as
+   running the algorithm again. */
+struct verify_memo {
+  unsigned char hash[SHA256_DIGEST_SIZE];
+  unsigned short keytag;
+  unsigned char algo, valid; /* algo == 0: empty */
+};
+
+static struct verify_memo verify_memo[VERIFY_MEMO_SIZE];
+
+int verify(struct blockdata *key_data, unsigned int key_len, int keytag, unsigned char *sig, size_t sig_len,
 	   unsigned char *digest, size_t digest_len, int algo)
 {
 
   int (*func)(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
 	      unsigned char *digest, size_t digest_len, int algo);
+  struct sha256_ctx ctx;
+  struct verify_memo *memo;
+  unsigned char hash[SHA256_DIGEST_SIZE], head[5], *key;
+  int valid;
 
   func = verify_func(algo);
 
-  if (!func)
+  if (!func || !(key = blockdata_retrieve(key_data, key_len, NULL)))
     return 0;
 
-  return (*func)(key_data, key_len, sig, sig_len, digest, digest_len, algo);
+  head[0] = algo;
+  head[1] = key_len >> 8;
+  head[2] = key_len & 0xff;
+  head[3] = sig_len >> 8;
+  head[4] = sig_len & 0xff;
+
+  sha256_init(&ctx);
+  sha256_update(&ctx, sizeof(head), head);
+  sha256_update(&ctx, key_len, key);
+  sha256_update(&ctx, sig_len, sig);
+  /* EdDSA signs the data itself, see null_hash above */
+  if (func == dnsmasq_eddsa_verify && digest_len == sizeof(struct null_hash_digest))
+    sha256_update(&ctx, ((struct null_hash_digest *)digest)->len, ((struct null_hash_digest *)digest)->buff);
+  else
+    sha256_update(&ctx, digest_len, digest);
+  sha256_digest(&ctx, SHA256_DIGEST_SIZE, hash);
+
+  memo = &verify_memo[((hash[0] << 8) | hash[1]) & (VERIFY_MEMO_SIZE - 1)];
+
+  if (memo->algo == algo && memo->keytag == keytag &&
+      memcmp(memo->hash, hash, SHA256_DIGEST_SIZE) == 0)
+    {
+      daemon->metrics[METRIC_DNSSEC_VERIFY_HITS]++;
+      return memo->valid;
+    }
+
+  daemon->metrics[METRIC_DNSSEC_VERIFY_MISSES]++;
+
+  valid = (*func)(key_data, key_len, sig, sig_len, digest, digest_len, algo);
+
+  memcpy(memo->hash, hash, SHA256_DIGEST_SIZE);
+  memo->keytag = keytag;
+  memo->algo = algo;
+  memo->valid = valid;
+
+  return valid;
 }
 
 /* Note the ds_digest_name(), algo_digest_name() and nsec3_digest_name()
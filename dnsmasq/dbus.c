@@ -128,6 +128,7 @@ static void remove_watch(DBusWatch *watch, void *data)
       if (w->watch == watch)
 	{
 	  *up = tmp;
+	  poll_forget(dbus_watch_get_unix_fd(watch));
 	  free(w);
 	}
       else
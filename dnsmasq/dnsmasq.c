@@ -957,6 +957,10 @@ int main_dnsmasq (int argc, char **argv)
 	  (option_bool(OPT_DBUS) && !daemon->dbus))
 	timeout = 250;
 
+      /* Pi-hole modification: wake every second to time out idle TCP connections */
+      else if (daemon->tcp_conns)
+	timeout = 1000;
+
       /* Wake every second whilst waiting for DAD to complete */
       else if (is_dad_listeners())
 	timeout = 1000;
@@ -1412,6 +1416,8 @@ static void async_event(int pipe, time_t now)
 	   we leave them logging to the old file. */
 	if (daemon->log_file != NULL)
 	  log_reopen(daemon->log_file);
+	/* Pi-hole modification */
+	FTL_reopen_log();
 	break;
 
       case EVENT_NEWADDR:
@@ -1601,6 +1607,9 @@ static int set_dns_listeners(time_t now)
   if (daemon->port != 0)
     get_new_frec(now, &wait, 0);
 
+  /* Pi-hole modification */
+  tcp_set_listeners();
+
   for (serverfdp = daemon->sfds; serverfdp; serverfdp = serverfdp->next)
     poll_listen(serverfdp->fd, POLLIN);
 
@@ -1616,10 +1625,11 @@ static int set_dns_listeners(time_t now)
 	poll_listen(listener->fd, POLLIN);
 
       /* death of a child goes through the select loop, so
-	 we don't need to explicitly arrange to wake up here */
+	 we don't need to explicitly arrange to wake up here.
+	 Pi-hole modification: multiplexed connections need no child */
       if  (listener->tcpfd != -1)
 	for (i = 0; i < MAX_PROCS; i++)
-	  if (daemon->tcp_pids[i] == 0)
+	  if (daemon->tcp_pids[i] == 0 || daemon->tcp_conn_count < daemon->tcp_max_conns)
 	    {
 	      poll_listen(listener->tcpfd, POLLIN);
 	      break;
@@ -1743,6 +1753,18 @@ static void check_dns_listeners(time_t now)
 	      shutdown(confd, SHUT_RDWR);
 	      while (retry_send(close(confd)));
 	    }
+	  /* Pi-hole modification: serve the connection from this process
+	     when we can, fork as before when there are too many of them. */
+	  else if (daemon->tcp_conn_count < daemon->tcp_max_conns)
+	    {
+	      struct in_addr netmask;
+	      netmask.s_addr = 0;
+
+	      if (iface)
+		netmask = iface->netmask;
+
+	      tcp_conn_new(confd, &tcp_addr, netmask, iface ? iface->dns_auth : 0, now);
+	    }
 #ifndef NO_FORK
 	  else if (!option_bool(OPT_DEBUG) && (p = fork()) != 0)
 	    {
@@ -1798,7 +1820,7 @@ static void check_dns_listeners(time_t now)
 	      if ((flags = fcntl(confd, F_GETFL, 0)) != -1)
 		fcntl(confd, F_SETFL, flags & ~O_NONBLOCK);
 
-	      buff = tcp_request(confd, now, &tcp_addr, netmask, auth_dns);
+	      buff = tcp_request(confd, now, &tcp_addr, netmask, auth_dns, NULL, 0);
 
 	      shutdown(confd, SHUT_RDWR);
 	      while (retry_send(close(confd)));
@@ -1822,6 +1844,10 @@ static void check_dns_listeners(time_t now)
 	    }
 	}
     }
+
+  /* Pi-hole modification: after reply_query(), answers for multiplexed
+     TCP connections can go out in this round */
+  check_tcp_conns(now);
 }
 
 #ifdef HAVE_DHCP
@@ -1888,6 +1914,7 @@ int icmp_ping(struct in_addr addr)
   gotreply = delay_dhcp(dnsmasq_time(), PING_WAIT, fd, addr.s_addr, id);
 
 #if defined(HAVE_LINUX_NETWORK) || defined(HAVE_SOLARIS_NETWORK)
+  poll_forget(fd);
   while (retry_send(close(fd)));
 #else
   opt = 1;
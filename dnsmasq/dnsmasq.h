@@ -406,12 +406,13 @@ union bigname {
 };
 
 struct blockdata {
-  struct blockdata *next;
-  unsigned char key[KEYBLOCK_LEN];
+  unsigned int refcount; /* Pi-hole modification: one shared, contiguous blob */
+  size_t len;
+  unsigned char data[];
 };
 
 struct crec {
-  struct crec *next, *prev, *hash_next;
+  struct crec *next, *hash_next;
   /* union is 16 bytes when doing IPv6, 8 bytes on 32 bit machines without IPv6 */
   union {
     struct all_addr addr;
@@ -438,6 +439,7 @@ struct crec {
   /* used as class if DNSKEY/DS, index to source for F_HOSTS */
   unsigned int uid;
   unsigned short flags;
+  unsigned char clock; /* CLOCK eviction state of slab entries, see cache.c */
   union {
     char sname[SMALLDNAME];
     union bigname *bname;
@@ -445,6 +447,12 @@ struct crec {
   } name;
 };
 
+/* Pi-hole modification: the hash table is split into CACHE_SHARDS
+   equally sized partitions, each with its own lookup counters. */
+struct cache_shard {
+  unsigned int hits, misses, insertions, evictions;
+};
+
 #define SIZEOF_BARE_CREC (sizeof(struct crec) - SMALLDNAME)
 #define SIZEOF_POINTER_CREC (sizeof(struct crec) + sizeof(char *) - SMALLDNAME)
 
@@ -481,6 +489,8 @@ struct crec {
 #define F_NOEXTRA   (1u<<27)
 #define F_SERVFAIL  (1u<<28)
 #define F_RCODE     (1u<<29)
+/* Pi-hole modification: answer served from an expired cache entry */
+#define F_STALE     (1u<<30)
 
 #define UID_NONE      0
 /* Values of uid in crecs with F_CONFIG bit set. */
@@ -656,6 +666,8 @@ struct hostsfile {
 #define FREC_ADDED_PHEADER    128
 #define FREC_TEST_PKTSZ       256
 #define FREC_HAS_EXTRADATA    512
+#define FREC_STALE_REFRESH   1024 /* Pi-hole modification */
+#define FREC_TCP_CONN        2048 /* Pi-hole modification */
 
 #ifdef HAVE_DNSSEC
 #define HASH_SIZE 20 /* SHA-1 digest size */
@@ -676,6 +688,7 @@ struct frec {
   int log_id, fd, forwardall, flags;
   time_t time;
   unsigned char *hash[HASH_SIZE];
+  unsigned int tcp_serial; /* Pi-hole modification: multiplexed TCP connection awaiting the answer */
 #ifdef HAVE_DNSSEC
   int class, work_counter;
   struct blockdata *stash; /* Saved reply, whilst we validate */
@@ -972,6 +985,41 @@ struct tftp_transfer {
   struct tftp_transfer *next;
 };
 
+/* Pi-hole modification: multiplexed TCP connections, see tcp.c */
+#define TCP_CONN_LEN    0 /* waiting for the two-byte length of the next query */
+#define TCP_CONN_BODY   1 /* have the length, waiting for the rest of the query */
+#define TCP_CONN_DRAIN  2 /* no more queries, send outstanding answers and close */
+
+struct tcp_query {
+  unsigned short id;
+  int log_id, fd; /* fd != -1: handed to a fallback child, reading its answer */
+  int hashed; /* hash of the question is known, answers are matched on it and id */
+  unsigned char hash[HASH_SIZE];
+  size_t len, rlen;
+  unsigned char *rbuf;
+  struct tcp_query *next;
+  unsigned char data[]; /* query as received, including two-byte length */
+};
+
+struct tcp_reply {
+  size_t len, sent;
+  struct tcp_reply *next;
+  unsigned char data[]; /* answer including two-byte length */
+};
+
+struct tcp_conn {
+  int fd, state, auth_dns, served, pending, queued;
+  unsigned int serial;
+  time_t last_active;
+  union mysockaddr peer, local;
+  struct in_addr netmask;
+  unsigned char *inbuf;
+  size_t inlen, insize;
+  struct tcp_query *inflight; /* queries forwarded upstream, answer not yet sent */
+  struct tcp_reply *replies;
+  struct tcp_conn *next;
+};
+
 struct addr_list {
   struct in_addr addr;
   struct addr_list *next;
@@ -1032,6 +1080,8 @@ extern struct daemon {
   int cachesize, ftabsize;
   int port, query_port, min_port, max_port;
   unsigned long local_ttl, neg_ttl, max_ttl, min_cache_ttl, max_cache_ttl, auth_ttl, dhcp_ttl, use_dhcp_ttl;
+  unsigned long cache_max_stale; /* Pi-hole modification: serve-stale grace period, 0 = disabled */
+  int tcp_max_conns; /* Pi-hole modification: multiplexed TCP connections, 0 = fork per connection */
   char *dns_client_id;
   struct hostsfile *addn_hosts;
   struct dhcp_context *dhcp, *dhcp6;
@@ -1136,6 +1186,11 @@ extern struct daemon {
   /* TFTP stuff */
   struct tftp_transfer *tftp_trans, *tftp_done_trans;
 
+  /* Pi-hole modification: multiplexed TCP connections */
+  struct tcp_conn *tcp_conns;
+  int tcp_conn_count;
+  unsigned char *tcp_packet;
+
   /* utility string buffer, hold max sized IP address as string */
   char *addrbuff;
   char *addrbuff2; /* only allocated when OPT_EXTRALOG */
@@ -1153,6 +1208,7 @@ void log_query(unsigned int flags, char *name, struct all_addr *addr, char *arg)
 char *record_source(unsigned int index);
 char *querystr(char *desc, unsigned short type);
 int cache_find_non_terminal(char *name, time_t now);
+int cache_is_stale(time_t now, struct crec *crecp);
 struct crec *cache_find_by_addr(struct crec *crecp,
 				struct all_addr *addr, time_t now,
 				unsigned int prot);
@@ -1172,6 +1228,7 @@ int cache_make_stat(struct txt_record *t);
 #endif
 char *cache_get_name(struct crec *crecp);
 char *cache_get_cname_target(struct crec *crecp);
+const struct cache_shard *cache_get_shard(int shard);
 struct crec *cache_enumerate(int init);
 int read_hostsfile(char *filename, unsigned int index, int cache_size,
 		   struct crec **rhash, int hashsz);
@@ -1181,8 +1238,9 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size,
 void blockdata_init(void);
 void blockdata_report(void);
 struct blockdata *blockdata_alloc(char *data, size_t len);
+struct blockdata *blockdata_ref(struct blockdata *block);
 void *blockdata_retrieve(struct blockdata *block, size_t len, void *data);
-void blockdata_free(struct blockdata *blocks);
+void blockdata_free(struct blockdata *block);
 #endif
 
 /* domain.c */
@@ -1209,7 +1267,7 @@ int extract_addresses(struct dns_header *header, size_t qlen, char *name,
 		      int no_cache_dnssec, int secure, int *doctored);
 size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 		      struct in_addr local_addr, struct in_addr local_netmask,
-		      time_t now, int ad_reqd, int do_bit, int have_pseudoheader);
+		      time_t now, int ad_reqd, int do_bit, int have_pseudoheader, int *stale);
 int check_for_bogus_wildcard(struct dns_header *header, size_t qlen, char *name,
 			     struct bogus_addr *baddr, time_t now);
 int check_for_ignored_address(struct dns_header *header, size_t qlen, struct bogus_addr *baddr);
@@ -1245,7 +1303,7 @@ int setup_timestamp(void);
 /* crypto.c */
 const struct nettle_hash *hash_find(char *name);
 int hash_init(const struct nettle_hash *hash, void **ctxp, unsigned char **digestp);
-int verify(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
+int verify(struct blockdata *key_data, unsigned int key_len, int keytag, unsigned char *sig, size_t sig_len,
 	   unsigned char *digest, size_t digest_len, int algo);
 char *ds_digest_name(int digest);
 char *algo_digest_name(int algo);
@@ -1317,7 +1375,11 @@ int option_read_dynfile(char *file, int flags);
 void reply_query(int fd, int family, time_t now);
 void receive_query(struct listener *listen, time_t now);
 unsigned char *tcp_request(int confd, time_t now,
-			   union mysockaddr *local_addr, struct in_addr netmask, int auth_dns);
+			   union mysockaddr *local_addr, struct in_addr netmask, int auth_dns,
+			   union mysockaddr *handoff_peer, int handoff_id);
+int tcp_local_service(union mysockaddr *peer_addr);
+int forward_tcp_query(struct tcp_conn *conn, struct dns_header *header, size_t plen,
+		      time_t now, int ad_reqd, int do_bit);
 void server_gone(struct server *server);
 struct frec *get_new_frec(time_t now, int *wait, int force);
 int send_from(int fd, int nowild, char *packet, size_t len,
@@ -1517,6 +1579,15 @@ void check_tftp_listeners(time_t now);
 int do_tftp_script_run(void);
 #endif
 
+/* tcp.c */
+void tcp_conn_new(int confd, union mysockaddr *local_addr, struct in_addr netmask,
+		  int auth_dns, time_t now);
+void tcp_set_listeners(void);
+void check_tcp_conns(time_t now);
+void tcp_conn_answer(unsigned int serial, struct dns_header *header, size_t len, void *hash);
+void tcp_conn_truncated(unsigned int serial, struct dns_header *header, size_t len, void *hash, time_t now);
+void tcp_conn_fail(unsigned int serial, unsigned short id, void *hash);
+
 /* conntrack.c */
 #ifdef HAVE_CONNTRACK
 int get_incoming_mark(union mysockaddr *peer_addr, struct all_addr *local_addr,
@@ -1635,6 +1706,7 @@ void set_dynamic_inotify(int flag, int total_size, struct crec **rhash, int revh
 void poll_reset(void);
 int poll_check(int fd, short event);
 void poll_listen(int fd, short event);
+void poll_forget(int fd);
 int do_poll(int timeout);
 
 /* rrfilter.c */
@@ -621,7 +621,7 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
       if (key)
 	{
 	  if (algo_in == algo && keytag_in == key_tag &&
-	      verify(key, keylen, sig, sig_len, digest, hash->digest_size, algo))
+	      verify(key, keylen, keytag_in, sig, sig_len, digest, hash->digest_size, algo))
 	    return STAT_SECURE;
 	}
       else
@@ -631,7 +631,7 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
 	    if (crecp->addr.key.algo == algo &&
 		crecp->addr.key.keytag == key_tag &&
 		crecp->uid == (unsigned int)class &&
-		verify(crecp->addr.key.keydata, crecp->addr.key.keylen, sig, sig_len, digest, hash->digest_size, algo))
+		verify(crecp->addr.key.keydata, crecp->addr.key.keylen, key_tag, sig, sig_len, digest, hash->digest_size, algo))
 	      return (labels < name_labels) ? STAT_SECURE_WILDCARD : STAT_SECURE;
 	}
     }
@@ -654,7 +654,8 @@ int dnssec_validate_by_ds(time_t now, struct dns_header *header, size_t plen, ch
   unsigned char *psave, *p = (unsigned char *)(header+1);
   struct crec *crecp, *recp1;
   int rc, j, qtype, qclass, ttl, rdlen, flags, algo, valid, keytag;
-  struct blockdata *key;
+  struct blockdata *key, *vkey = NULL;
+  int vkeytag = 0, vkeyalgo = 0, vkeylen = 0;
   struct all_addr a;
 
   if (ntohs(header->qdcount) != 1 ||
@@ -759,7 +760,18 @@ int dnssec_validate_by_ds(time_t now, struct dns_header *header, size_t plen, ch
 		}
 	    }
 	}
-      blockdata_free(key);
+
+      /* Pi-hole modification: hold on to the key which matched a DS,
+	 the cache can share it below. */
+      if (valid)
+	{
+	  vkey = key;
+	  vkeytag = keytag;
+	  vkeyalgo = algo;
+	  vkeylen = rdlen - 4;
+	}
+      else
+	blockdata_free(key);
     }
 
   if (valid)
@@ -773,7 +785,7 @@ int dnssec_validate_by_ds(time_t now, struct dns_header *header, size_t plen, ch
 	{
 	  /* Ensure we have type, class  TTL and length */
 	  if (!(rc = extract_name(header, plen, &p, name, 0, 10)))
-	    return STAT_BOGUS; /* bad packet */
+	    goto bad_packet;
 
 	  GETSHORT(qtype, p);
 	  GETSHORT(qclass, p);
@@ -781,7 +793,7 @@ int dnssec_validate_by_ds(time_t now, struct dns_header *header, size_t plen, ch
 	  GETSHORT(rdlen, p);
 
 	  if (!CHECK_LEN(header, p, plen, rdlen))
-	    return STAT_BOGUS; /* bad packet */
+	    goto bad_packet;
 
 	  if (qclass == class && rc == 1)
 	    {
@@ -790,23 +802,29 @@ int dnssec_validate_by_ds(time_t now, struct dns_header *header, size_t plen, ch
 	      if (qtype == T_DNSKEY)
 		{
 		  if (rdlen < 4)
-		    return STAT_BOGUS; /* bad packet */
+		    goto bad_packet;
 
 		  GETSHORT(flags, p);
 		  if (*p++ != 3)
-		    return STAT_BOGUS;
+		    goto bad_packet;
 		  algo = *p++;
 		  keytag = dnskey_keytag(algo, flags, p, rdlen - 4);
 
 		  /* Cache needs to known class for DNSSEC stuff */
 		  a.addr.dnssec.class = class;
 
-		  if ((key = blockdata_alloc((char*)p, rdlen - 4)))
+		  if (vkey && keytag == vkeytag && algo == vkeyalgo && rdlen - 4 == vkeylen &&
+		      memcmp(vkey->data, p, vkeylen) == 0)
+		    key = blockdata_ref(vkey);
+		  else
+		    key = blockdata_alloc((char*)p, rdlen - 4);
+
+		  if (key)
 		    {
 		      if (!(recp1 = cache_insert(name, &a, now, ttl, F_FORWARD | F_DNSKEY | F_DNSSECOK)))
 			{
 			  blockdata_free(key);
-			  return STAT_BOGUS;
+			  goto bad_packet;
 			}
 		      else
 			{
@@ -830,12 +848,17 @@ int dnssec_validate_by_ds(time_t now, struct dns_header *header, size_t plen, ch
 	    }
 
 	  if (!ADD_RDLEN(header, p, plen, rdlen))
-	    return STAT_BOGUS; /* bad packet */
+	    goto bad_packet;
 	}
 
       /* commit cache insert. */
       cache_end_insert();
+      blockdata_free(vkey);
       return STAT_OK;
+
+    bad_packet:
+      blockdata_free(vkey);
+      return STAT_BOGUS;
     }
 
   log_query(F_NOEXTRA | F_UPSTREAM, name, NULL, "BOGUS DNSKEY");
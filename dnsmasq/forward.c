@@ -21,6 +21,7 @@ static struct frec *lookup_frec(unsigned short id, void *hash);
 static struct frec *lookup_frec_by_sender(unsigned short id,
 					  union mysockaddr *addr,
 					  void *hash);
+static struct frec *lookup_stale_refresh(void *hash);
 static unsigned short get_id(void);
 static void free_frec(struct frec *f);
 
@@ -263,7 +264,8 @@ static unsigned int search_servers(time_t now, struct all_addr **addrpp, unsigne
 static int forward_query(int udpfd, union mysockaddr *udpaddr,
 			 struct all_addr *dst_addr, unsigned int dst_iface,
 			 struct dns_header *header, size_t plen, time_t now,
-			 struct frec *forward, int ad_reqd, int do_bit)
+			 struct frec *forward, int ad_reqd, int do_bit, int stale_refresh,
+			 unsigned int tcp_serial)
 {
   char *domain = NULL;
   int type = SERV_DO_DNSSEC, norebind = 0;
@@ -281,8 +283,9 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
   unsigned char *oph = find_pseudoheader(header, plen, NULL, NULL, NULL, NULL);
   (void)do_bit;
 
-  /* may be no servers available. */
-  if (forward || (hash && (forward = lookup_frec_by_sender(ntohs(header->id), udpaddr, hash))))
+  /* may be no servers available. TCP clients do not retransmit, an
+     identical query from them is a new one (Pi-hole modification) */
+  if (forward || (hash && !tcp_serial && (forward = lookup_frec_by_sender(ntohs(header->id), udpaddr, hash))))
     {
       /* If we didn't get an answer advertising a maximal packet in EDNS,
 	 fall back to 1280, which should work everywhere on IPv6.
@@ -358,6 +361,10 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
     }
   else
     {
+      /* Pi-hole modification: one background refresh per stale question is enough */
+      if (stale_refresh && hash && lookup_stale_refresh(hash))
+	return 0;
+
       if (gotname)
 	flags = search_servers(now, &addrp, gotname, daemon->namebuff, &type, &domain, &norebind);
 
@@ -387,6 +394,11 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 	    forward->flags |= FREC_CHECKING_DISABLED;
 	  if (ad_reqd)
 	    forward->flags |= FREC_AD_QUESTION;
+	  if (stale_refresh)
+	    forward->flags |= FREC_STALE_REFRESH;
+	  forward->tcp_serial = tcp_serial;
+	  if (tcp_serial)
+	    forward->flags |= FREC_TCP_CONN;
 #ifdef HAVE_DNSSEC
 	  forward->work_counter = DNSSEC_WORK;
 	  if (do_bit)
@@ -455,6 +467,11 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 	}
 #endif
 
+      /* Pi-hole modification: a TCP client takes any size, so ask for
+	 as much as we can receive to avoid truncated answers. */
+      if ((forward->flags & FREC_TCP_CONN) && !find_pseudoheader(header, plen, NULL, NULL, NULL, NULL))
+	plen = add_pseudoheader(header, plen, ((unsigned char *)header) + PACKETSZ, daemon->edns_pktsz, 0, NULL, 0, 0, 0);
+
       if (find_pseudoheader(header, plen, &edns0_len, &pheader, NULL, NULL))
 	{
 	  /* If there wasn't a PH before, and there is now, we added it. */
@@ -468,6 +485,10 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 	  /* Reduce udp size on retransmits. */
 	  if (forward->flags & FREC_TEST_PKTSZ)
 	    PUTSHORT(SAFE_PKTSZ, pheader);
+
+	  /* Pi-hole modification: TCP client, see above */
+	  if ((forward->flags & (FREC_TCP_CONN | FREC_TEST_PKTSZ)) == FREC_TCP_CONN)
+	    PUTSHORT(daemon->edns_pktsz, pheader);
 	}
 
       while (1)
@@ -587,6 +608,7 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 
       /* could not send on, prepare to return */
       header->id = htons(forward->orig_id);
+      forward->tcp_serial = 0; /* Pi-hole modification: answered below */
       free_frec(forward); /* cancel */
     }
 
@@ -598,6 +620,14 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 	plen = add_pseudoheader(header, plen, ((unsigned char *) header) + PACKETSZ, daemon->edns_pktsz, 0, NULL, 0, do_bit, 0);
       send_from(udpfd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND), (char *)header, plen, udpaddr, dst_addr, dst_iface);
     }
+  else if (tcp_serial)
+    {
+      /* Pi-hole modification: answer on the multiplexed TCP connection */
+      plen = setup_reply(header, plen, addrp, flags, daemon->local_ttl);
+      if (oph)
+	plen = add_pseudoheader(header, plen, ((unsigned char *) header) + PACKETSZ, daemon->edns_pktsz, 0, NULL, 0, do_bit, 0);
+      tcp_conn_answer(tcp_serial, header, plen, hash);
+    }
 
   return 0;
 }
@@ -961,7 +991,7 @@ void reply_query(int fd, int family, time_t now)
 		header->hb4 |= HB4_AD;
 	      if (forward->flags & FREC_DO_QUESTION)
 		add_do_bit(header, nn,  (unsigned char *)pheader + plen);
-	      forward_query(-1, NULL, NULL, 0, header, nn, now, forward, forward->flags & FREC_AD_QUESTION, forward->flags & FREC_DO_QUESTION);
+	      forward_query(-1, NULL, NULL, 0, header, nn, now, forward, forward->flags & FREC_AD_QUESTION, forward->flags & FREC_DO_QUESTION, 0, 0);
 	      return;
 	    }
 	}
@@ -1088,6 +1118,7 @@ void reply_query(int fd, int family, time_t now)
 		      *new = *forward; /* copy everything, then overwrite */
 		      new->next = next;
 		      new->blocking_query = NULL;
+		      new->tcp_serial = 0; /* Pi-hole modification: forward answers the client */
 
 		      /* Find server to forward to. This will normally be the
 			 same as for the original query, but may be another if
@@ -1273,7 +1304,8 @@ void reply_query(int fd, int family, time_t now)
 	  /* We added an EDNSO header for the purpose of getting DNSSEC RRs, and set the value of the UDP payload size
 	     greater than the no-EDNS0-implied 512 to have space for the RRSIGS. If, having stripped them and the EDNS0
              header, the answer is still bigger than 512, truncate it and mark it so. The client then retries with TCP. */
-	  if (option_bool(OPT_DNSSEC_VALID) && (forward->flags & FREC_ADDED_PHEADER) && (nn > PACKETSZ))
+	  if (option_bool(OPT_DNSSEC_VALID) && (forward->flags & FREC_ADDED_PHEADER) && (nn > PACKETSZ) &&
+	      !(forward->flags & FREC_TCP_CONN))
 	    {
 	      header->ancount = htons(0);
 	      header->nscount = htons(0);
@@ -1287,8 +1319,21 @@ void reply_query(int fd, int family, time_t now)
 	  dump_packet(DUMP_REPLY, daemon->packet, (size_t)nn, NULL, &forward->source);
 #endif
 
-	  send_from(forward->fd, option_bool(OPT_NOWILD) || option_bool (OPT_CLEVERBIND), daemon->packet, nn,
-		    &forward->source, &forward->dest, forward->iface);
+	  /* Pi-hole modification: queries from multiplexed TCP connections
+	     are answered there, truncated answers are retried over TCP */
+	  if (forward->flags & FREC_TCP_CONN)
+	    {
+	      if (header->hb3 & HB3_TC)
+		tcp_conn_truncated(forward->tcp_serial, header, nn, forward->hash, now);
+	      else
+		tcp_conn_answer(forward->tcp_serial, header, nn, forward->hash);
+	      forward->tcp_serial = 0;
+	    }
+	  /* Pi-hole modification: the client already got a stale answer,
+	     this reply only refreshed the cache */
+	  else if (!(forward->flags & FREC_STALE_REFRESH))
+	    send_from(forward->fd, option_bool(OPT_NOWILD) || option_bool (OPT_CLEVERBIND), daemon->packet, nn,
+		      &forward->source, &forward->dest, forward->iface);
 	}
       free_frec(forward); /* cancel */
     }
@@ -1624,25 +1669,45 @@ void receive_query(struct listener *listen, time_t now)
   else
 #endif
     {
-      int ad_reqd = do_bit;
+      int ad_reqd = do_bit, stale = 0;
+      unsigned char *saved_question = NULL;
        /* RFC 6840 5.7 */
       if (header->hb4 & HB4_AD)
 	ad_reqd = 1;
 
+      /* Pi-hole modification: answer_request() overwrites the query, keep
+	 a copy in case we answer from stale data and need to refresh it. */
+      if (daemon->cache_max_stale != 0 && (saved_question = whine_malloc((size_t)n)))
+	memcpy(saved_question, header, (size_t)n);
+
       m = answer_request(header, ((char *) header) + udp_size, (size_t)n,
-			 dst_addr_4, netmask, now, ad_reqd, do_bit, have_pseudoheader);
+			 dst_addr_4, netmask, now, ad_reqd, do_bit, have_pseudoheader,
+			 saved_question ? &stale : NULL);
 
       if (m >= 1)
 	{
 	  send_from(listen->fd, option_bool(OPT_NOWILD) || option_bool(OPT_CLEVERBIND),
 		    (char *)header, m, &source_addr, &dst_addr, if_index);
 	  daemon->metrics[METRIC_DNS_LOCAL_ANSWERED]++;
+
+	  /* Answer was (partly) expired: ask upstream in the background,
+	     the reply only updates the cache and is not sent to the client. */
+	  if (stale)
+	    {
+	      daemon->metrics[METRIC_DNS_STALE_ANSWERED]++;
+	      memcpy(header, saved_question, (size_t)n);
+	      forward_query(listen->fd, &source_addr, &dst_addr, if_index,
+			    header, (size_t)n, now, NULL, ad_reqd, do_bit, 1, 0);
+	    }
 	}
       else if (forward_query(listen->fd, &source_addr, &dst_addr, if_index,
-			     header, (size_t)n, now, NULL, ad_reqd, do_bit))
+			     header, (size_t)n, now, NULL, ad_reqd, do_bit, 0, 0))
 	daemon->metrics[METRIC_DNS_QUERIES_FORWARDED]++;
       else
 	daemon->metrics[METRIC_DNS_LOCAL_ANSWERED]++;
+
+      if (saved_question)
+	free(saved_question);
     }
 }
 
@@ -1805,8 +1870,51 @@ static int tcp_key_recurse(time_t now, int status, struct dns_header *header, si
    blocking as necessary, and then return. Note, need to be a bit careful
    about resources for debug mode, when the fork is suppressed: that's
    done by the caller. */
+/* We can be configured to only accept queries from at-most-one-hop-away addresses.
+   Pi-hole modification: factored out of tcp_request() for use by tcp.c */
+int tcp_local_service(union mysockaddr *peer_addr)
+{
+  struct addrlist *addr;
+
+  if (!option_bool(OPT_LOCAL_SERVICE))
+    return 1;
+
+#ifdef HAVE_IPV6
+  if (peer_addr->sa.sa_family == AF_INET6)
+    {
+      for (addr = daemon->interface_addrs; addr; addr = addr->next)
+	if ((addr->flags & ADDRLIST_IPV6) &&
+	    is_same_net6(&addr->addr.addr.addr6, &peer_addr->in6.sin6_addr, addr->prefixlen))
+	  break;
+    }
+  else
+#endif
+    {
+      struct in_addr netmask;
+      for (addr = daemon->interface_addrs; addr; addr = addr->next)
+	{
+	  netmask.s_addr = htonl(~(in_addr_t)0 << (32 - addr->prefixlen));
+	  if (!(addr->flags & ADDRLIST_IPV6) &&
+	      is_same_net(addr->addr.addr.addr4, peer_addr->in.sin_addr, netmask))
+	    break;
+	}
+    }
+
+  if (!addr)
+    {
+      my_syslog(LOG_WARNING, _("Ignoring query from non-local network"));
+      return 0;
+    }
+
+  return 1;
+}
+
+/* Pi-hole modification: with handoff_peer set, confd carries a single
+   query from a multiplexed TCP connection (see tcp.c) which the main
+   process already logged as handoff_id. */
 unsigned char *tcp_request(int confd, time_t now,
-			   union mysockaddr *local_addr, struct in_addr netmask, int auth_dns)
+			   union mysockaddr *local_addr, struct in_addr netmask, int auth_dns,
+			   union mysockaddr *handoff_peer, int handoff_id)
 {
   size_t size = 0;
   int norebind = 0;
@@ -1837,7 +1945,9 @@ unsigned char *tcp_request(int confd, time_t now,
   (void)mark;
   (void)have_mark;
 
-  if (getpeername(confd, (struct sockaddr *)&peer_addr, &peer_len) == -1)
+  if (handoff_peer)
+    peer_addr = *handoff_peer;
+  else if (getpeername(confd, (struct sockaddr *)&peer_addr, &peer_len) == -1)
     return packet;
 
 #ifdef HAVE_CONNTRACK
@@ -1857,35 +1967,8 @@ unsigned char *tcp_request(int confd, time_t now,
 #endif
 
   /* We can be configured to only accept queries from at-most-one-hop-away addresses. */
-  if (option_bool(OPT_LOCAL_SERVICE))
-    {
-      struct addrlist *addr;
-#ifdef HAVE_IPV6
-      if (peer_addr.sa.sa_family == AF_INET6)
-	{
-	  for (addr = daemon->interface_addrs; addr; addr = addr->next)
-	    if ((addr->flags & ADDRLIST_IPV6) &&
-		is_same_net6(&addr->addr.addr.addr6, &peer_addr.in6.sin6_addr, addr->prefixlen))
-	      break;
-	}
-      else
-#endif
-	{
-	  struct in_addr netmask;
-	  for (addr = daemon->interface_addrs; addr; addr = addr->next)
-	    {
-	      netmask.s_addr = htonl(~(in_addr_t)0 << (32 - addr->prefixlen));
-	      if (!(addr->flags & ADDRLIST_IPV6) &&
-		  is_same_net(addr->addr.addr.addr4, peer_addr.in.sin_addr, netmask))
-		break;
-	    }
-	}
-      if (!addr)
-	{
-	  my_syslog(LOG_WARNING, _("Ignoring query from non-local network"));
-	  return packet;
-	}
-    }
+  if (!tcp_local_service(&peer_addr))
+    return packet;
 
   while (1)
     {
@@ -1907,7 +1990,7 @@ unsigned char *tcp_request(int confd, time_t now,
 
       /* log_query gets called indirectly all over the place, so
 	 pass these in global variables - sorry. */
-      daemon->log_display_id = ++daemon->log_id;
+      daemon->log_display_id = handoff_peer ? handoff_id : ++daemon->log_id;
       daemon->log_source_addr = &peer_addr;
 
       /* save state of "cd" flag in query */
@@ -1921,7 +2004,9 @@ unsigned char *tcp_request(int confd, time_t now,
 #endif
 	  char *types = querystr(auth_dns ? "auth" : "query", qtype);
 
-	  if (peer_addr.sa.sa_family == AF_INET)
+	  if (handoff_peer)
+	    ; /* already logged */
+	  else if (peer_addr.sa.sa_family == AF_INET)
 	  {
 	    log_query(F_QUERY | F_IPV4 | F_FORWARD, daemon->namebuff,
 		      (struct all_addr *)&peer_addr.in.sin_addr, types);
@@ -1984,7 +2069,7 @@ unsigned char *tcp_request(int confd, time_t now,
 
 	   /* m > 0 if answered from cache */
 	   m = answer_request(header, ((char *) header) + 65536, (size_t)size,
-			      dst_addr_4, netmask, now, ad_reqd, do_bit, have_pseudoheader);
+			      dst_addr_4, netmask, now, ad_reqd, do_bit, have_pseudoheader, NULL);
 
 	  /* Do this by steam now we're not in the select() loop */
 	  check_log_writer(1);
@@ -2213,6 +2298,25 @@ unsigned char *tcp_request(int confd, time_t now,
     }
 }
 
+/* Pi-hole modification: forward a query read from a multiplexed TCP
+   connection. The answer is delivered to the connection by reply_query(),
+   or straight away if the query cannot be sent on. */
+int forward_tcp_query(struct tcp_conn *conn, struct dns_header *header, size_t plen,
+		      time_t now, int ad_reqd, int do_bit)
+{
+  struct all_addr dst_addr;
+
+#ifdef HAVE_IPV6
+  if (conn->local.sa.sa_family == AF_INET6)
+    dst_addr.addr.addr6 = conn->local.in6.sin6_addr;
+  else
+#endif
+    dst_addr.addr.addr4 = conn->local.in.sin_addr;
+
+  return forward_query(-1, &conn->peer, &dst_addr, 0, header, plen, now, NULL,
+		       ad_reqd, do_bit, 0, conn->serial);
+}
+
 static struct frec *allocate_frec(time_t now)
 {
   struct frec *f;
@@ -2277,11 +2381,20 @@ struct randfd *allocate_rfd(int family)
 void free_rfd(struct randfd *rfd)
 {
   if (rfd && --(rfd->refcount) == 0)
-    close(rfd->fd);
+    {
+      poll_forget(rfd->fd);
+      close(rfd->fd);
+    }
 }
 
 static void free_frec(struct frec *f)
 {
+  /* Pi-hole modification: a multiplexed TCP client doesn't retry,
+     tell it the query failed instead of leaving it waiting. */
+  if (f->tcp_serial)
+    tcp_conn_fail(f->tcp_serial, f->orig_id, f->hash);
+  f->tcp_serial = 0;
+
   free_rfd(f->rfd4);
   f->rfd4 = NULL;
   f->sentto = NULL;
@@ -2418,6 +2531,7 @@ static struct frec *lookup_frec_by_sender(unsigned short id,
   for(f = daemon->frec_list; f; f = f->next)
     if (f->sentto &&
 	f->orig_id == id &&
+	!(f->flags & FREC_TCP_CONN) &&
 	memcmp(hash, f->hash, HASH_SIZE) == 0 &&
 	sockaddr_isequal(&f->source, addr))
       return f;
@@ -2425,6 +2539,20 @@ static struct frec *lookup_frec_by_sender(unsigned short id,
   return NULL;
 }
 
+/* Pi-hole modification: find an in-flight serve-stale refresh for this question */
+static struct frec *lookup_stale_refresh(void *hash)
+{
+  struct frec *f;
+
+  for(f = daemon->frec_list; f; f = f->next)
+    if (f->sentto &&
+	(f->flags & FREC_STALE_REFRESH) &&
+	memcmp(hash, f->hash, HASH_SIZE) == 0)
+      return f;
+
+  return NULL;
+}
+
 /* Send query packet again, if we can. */
 void resend_query()
 {
@@ -37,6 +37,11 @@ const char * metric_names[] = {
     "leases_pruned_4",
     "leases_allocated_6",
     "leases_pruned_6",
+    "dns_stale_answered",
+    "dns_tcp_multiplexed",
+    "dns_tcp_fallback",
+    "dnssec_verify_hits",
+    "dnssec_verify_misses",
 };
 
 const char* get_metric_name(int i) {
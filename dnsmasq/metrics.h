@@ -36,6 +36,11 @@ enum {
   METRIC_LEASES_PRUNED_4,
   METRIC_LEASES_ALLOCATED_6,
   METRIC_LEASES_PRUNED_6,
+  METRIC_DNS_STALE_ANSWERED,
+  METRIC_DNS_TCP_MULTIPLEXED,
+  METRIC_DNS_TCP_FALLBACK,
+  METRIC_DNSSEC_VERIFY_HITS,
+  METRIC_DNSSEC_VERIFY_MISSES,
 
   __METRIC_MAX,
 };
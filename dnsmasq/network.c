@@ -668,11 +668,20 @@ int enumerate_interfaces(int reset)
 	      l->iface->done = 0;
 
 	      if (l->fd != -1)
-		close(l->fd);
+		{
+		  poll_forget(l->fd);
+		  close(l->fd);
+		}
 	      if (l->tcpfd != -1)
-		close(l->tcpfd);
+		{
+		  poll_forget(l->tcpfd);
+		  close(l->tcpfd);
+		}
 	      if (l->tftpfd != -1)
-		close(l->tftpfd);
+		{
+		  poll_forget(l->tftpfd);
+		  close(l->tftpfd);
+		}
 
 	      free(l);
 	    }
@@ -1607,6 +1616,7 @@ void check_servers(void)
        if (!sfd->used)
 	{
 	  *up = sfd->next;
+	  poll_forget(sfd->fd);
 	  close(sfd->fd);
 	  free(sfd);
 	}
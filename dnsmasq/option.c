@@ -166,6 +166,8 @@ struct myoption {
 #define LOPT_UBUS          354
 #define LOPT_NAME_MATCH    355
 #define LOPT_CAA           356
+#define LOPT_STALE_CACHE   357
+#define LOPT_TCP_MULTIPLEX 358
 
 #ifdef HAVE_GETOPT_LONG
 static const struct option opts[] =
@@ -337,6 +339,8 @@ static const struct myoption opts[] =
     { "dhcp-rapid-commit", 0, 0, LOPT_RAPID_COMMIT },
     { "dumpfile", 1, 0, LOPT_DUMPFILE },
     { "dumpmask", 1, 0, LOPT_DUMPMASK },
+    { "use-stale-cache", 2, 0 , LOPT_STALE_CACHE },
+    { "tcp-multiplex", 2, 0 , LOPT_TCP_MULTIPLEX },
     { NULL, 0, 0, 0 }
   };
 
@@ -515,6 +519,8 @@ static struct {
   { LOPT_RAPID_COMMIT, OPT_RAPID_COMMIT, NULL, gettext_noop("Enables DHCPv4 Rapid Commit option."), NULL },
   { LOPT_DUMPFILE, ARG_ONE, "<path>", gettext_noop("Path to debug packet dump file"), NULL },
   { LOPT_DUMPMASK, ARG_ONE, "<hex>", gettext_noop("Mask which packets to dump"), NULL },
+  { LOPT_STALE_CACHE, ARG_ONE, "[=<max_expired>]", gettext_noop("Serve expired cache data for up to <max_expired> seconds while refreshing it."), NULL },
+  { LOPT_TCP_MULTIPLEX, ARG_ONE, "[=<connections>]", gettext_noop("Serve up to <connections> TCP connections from the main process instead of forking."), NULL },
   { 0, 0, NULL, NULL, NULL }
 };
 
@@ -2696,6 +2702,24 @@ static int one_opt(int option, char *arg, char *errstr, char *gen_err, int comma
 	break;
       }
 
+    case LOPT_STALE_CACHE: /* --use-stale-cache */
+      {
+	int max_expired = STALE_GRACE;
+	if (arg && (!atoi_check(arg, &max_expired) || max_expired <= 0))
+	  ret_err(gen_err);
+	daemon->cache_max_stale = (unsigned long)max_expired;
+	break;
+      }
+
+    case LOPT_TCP_MULTIPLEX: /* --tcp-multiplex */
+      {
+	int conns = TCP_MAX_CONNS;
+	if (arg && (!atoi_check(arg, &conns) || conns <= 0))
+	  ret_err(gen_err);
+	daemon->tcp_max_conns = conns;
+	break;
+      }
+
 #ifdef HAVE_DHCP
     case 'X': /* --dhcp-lease-max */
       if (!atoi_check(arg, &daemon->dhcp_max))
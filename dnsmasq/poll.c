@@ -37,8 +37,213 @@
     .
 
     event is OR of POLLIN, POLLOUT, POLLERR, etc
+
+   poll_forget(fd) must be called before closing a file descriptor
+   which may have been passed to poll_listen().
 */
 
+/* Pi-hole modification: optional epoll() backend. The callers still
+   rebuild their interest set every round, but the kernel registrations
+   persist between rounds and only fds whose wanted events changed cost
+   an epoll_ctl() call. The EPOLL* event bits are identical to the POLL*
+   bits on Linux, so events are passed through unchanged. */
+#ifdef HAVE_EPOLL
+
+#include <sys/epoll.h>
+
+struct epoll_slot {
+  unsigned int want_round, event_round;
+  short want, armed, revents;
+};
+
+static int epfd = -1;
+static unsigned int poll_round = 1;
+static struct epoll_slot *slots = NULL;
+static int nslots = 0;
+/* fds listened to this round, and fds registered with the kernel. */
+static int *listened = NULL, *registered = NULL;
+static int nlistened, nregistered, listsize = 0;
+static struct epoll_event *events = NULL;
+static int nevents = 0;
+
+static struct epoll_slot *fd_slot(int fd)
+{
+  if (fd < 0)
+    return NULL;
+
+  if (fd >= nslots)
+    {
+      int newsize = (nslots == 0) ? 64 : nslots;
+      struct epoll_slot *new;
+
+      while (newsize <= fd)
+	newsize *= 2;
+
+      if (!(new = whine_malloc(newsize * sizeof(struct epoll_slot))))
+	return NULL;
+
+      if (slots)
+	{
+	  memcpy(new, slots, nslots * sizeof(struct epoll_slot));
+	  free(slots);
+	}
+
+      slots = new;
+      nslots = newsize;
+    }
+
+  return &slots[fd];
+}
+
+void poll_reset(void)
+{
+  /* Round 0 is never current, so zeroed slots are stale. */
+  if (++poll_round == 0)
+    poll_round = 1;
+  nlistened = 0;
+}
+
+int do_poll(int timeout)
+{
+  int i, n, ret;
+
+  if (epfd == -1 && (epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    return -1;
+
+  /* Drop registrations no longer wanted. */
+  for (i = 0; i < nregistered; i++)
+    {
+      struct epoll_slot *slot = &slots[registered[i]];
+
+      if (slot->armed != 0 && slot->want_round != poll_round)
+	{
+	  epoll_ctl(epfd, EPOLL_CTL_DEL, registered[i], NULL);
+	  slot->armed = 0;
+	}
+    }
+
+  /* Add or modify those whose wanted events changed. */
+  for (i = 0; i < nlistened; i++)
+    {
+      int fd = listened[i];
+      struct epoll_slot *slot = &slots[fd];
+
+      if (slot->armed != slot->want)
+	{
+	  struct epoll_event ev;
+
+	  memset(&ev, 0, sizeof(ev));
+	  ev.events = (unsigned short)slot->want;
+	  ev.data.fd = fd;
+
+	  if (slot->armed == 0 ||
+	      (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1 && errno == ENOENT))
+	    {
+	      /* A descriptor closed without poll_forget() has been dropped
+		 by the kernel, so register it afresh. */
+	      if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1 && errno == EEXIST)
+		epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+	    }
+
+	  slot->armed = slot->want;
+	}
+    }
+
+  /* The fds listened to this round are exactly those now registered. */
+  memcpy(registered, listened, nlistened * sizeof(int));
+  nregistered = nlistened;
+
+  if (nevents < nlistened)
+    {
+      struct epoll_event *new;
+
+      if (!(new = whine_malloc(listsize * sizeof(struct epoll_event))))
+	return -1;
+
+      free(events);
+      events = new;
+      nevents = listsize;
+    }
+
+  if ((ret = n = epoll_wait(epfd, events, nlistened > 0 ? nlistened : 1, timeout)) > 0)
+    for (i = 0; i < n; i++)
+      {
+	struct epoll_slot *slot = &slots[events[i].data.fd];
+
+	slot->revents = (short)events[i].events;
+	slot->event_round = poll_round;
+      }
+
+  return ret;
+}
+
+int poll_check(int fd, short event)
+{
+  if (fd >= 0 && fd < nslots && slots[fd].event_round == poll_round)
+    return slots[fd].revents & event;
+
+  return 0;
+}
+
+void poll_listen(int fd, short event)
+{
+  struct epoll_slot *slot = fd_slot(fd);
+
+  if (!slot)
+    return;
+
+  if (slot->want_round == poll_round)
+    {
+      slot->want |= event;
+      return;
+    }
+
+  if (nlistened == listsize)
+    {
+      int newsize = (listsize == 0) ? 64 : listsize * 2;
+      int *newl, *newr;
+
+      if (!(newl = whine_malloc(newsize * sizeof(int))) ||
+	  !(newr = whine_malloc(newsize * sizeof(int))))
+	{
+	  free(newl);
+	  return;
+	}
+
+      if (listened)
+	{
+	  memcpy(newl, listened, nlistened * sizeof(int));
+	  memcpy(newr, registered, nregistered * sizeof(int));
+	  free(listened);
+	  free(registered);
+	}
+
+      listened = newl;
+      registered = newr;
+      listsize = newsize;
+    }
+
+  slot->want_round = poll_round;
+  slot->want = event;
+  slot->event_round = 0;
+  listened[nlistened++] = fd;
+}
+
+void poll_forget(int fd)
+{
+  if (fd >= 0 && fd < nslots)
+    {
+      if (slots[fd].armed != 0 && epfd != -1)
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+
+      slots[fd].armed = 0;
+      slots[fd].want_round = slots[fd].event_round = 0;
+    }
+}
+
+#else
+
+
 static struct pollfd *pollfds = NULL;
 static nfds_t nfds, arrsize = 0;
 
@@ -123,3 +328,11 @@ void poll_listen(int fd, short event)
        nfds++;
      }
 }
+
+void poll_forget(int fd)
+{
+  /* Nothing is kept between rounds. */
+  (void)fd;
+}
+
+#endif
@@ -1268,6 +1268,10 @@ static unsigned long crec_ttl(struct crec *crecp, time_t now)
   if (crecp->flags & F_IMMORTAL)
     return crecp->ttd;
 
+  /* Pi-hole modification: expired entries served during the stale grace period */
+  if (difftime(now, crecp->ttd) >= 0)
+    return STALE_TTL;
+
   /* Return the Max TTL value if it is lower than the actual TTL */
   if (daemon->max_ttl == 0 || ((unsigned)(crecp->ttd - now) < daemon->max_ttl))
     return crecp->ttd - now;
@@ -1279,7 +1283,7 @@ static unsigned long crec_ttl(struct crec *crecp, time_t now)
 /* return zero if we can't answer from cache, or packet size if we can */
 size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 		      struct in_addr local_addr, struct in_addr local_netmask,
-		      time_t now, int ad_reqd, int do_bit, int have_pseudoheader)
+		      time_t now, int ad_reqd, int do_bit, int have_pseudoheader, int *stale)
 {
   char *name = daemon->namebuff;
   unsigned char *p, *ansp;
@@ -1290,9 +1294,15 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
   int q, ans, anscount = 0, addncount = 0;
   int dryrun = 0;
   struct crec *crecp;
+  unsigned int crec_stale = 0;
   int nxdomain = 0, auth = 1, trunc = 0, sec_data = 1;
   struct mx_srv_record *rec;
   size_t len;
+  /* Pi-hole modification: only callers which can refresh in the background get stale data */
+  unsigned int stale_flag = (stale && daemon->cache_max_stale != 0) ? F_STALE : 0;
+
+  if (stale)
+    *stale = 0;
 
   /* never answer queries with RD unset, to avoid cache snooping. */
   if (!(header->hb3 & HB3_RD) ||
@@ -1661,7 +1671,7 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 		}
 
 	    cname_restart:
-	      if ((crecp = cache_find_by_name(NULL, name, now, flag | F_CNAME | (dryrun ? F_NO_RR : 0))))
+	      if ((crecp = cache_find_by_name(NULL, name, now, flag | F_CNAME | stale_flag | (dryrun ? F_NO_RR : 0))))
 		{
 		  int localise = 0;
 
@@ -1677,7 +1687,7 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 			    localise = 1;
 			    break;
 			  }
-			} while ((crecp = cache_find_by_name(crecp, name, now, flag | F_CNAME)));
+			} while ((crecp = cache_find_by_name(crecp, name, now, flag | F_CNAME | stale_flag)));
 		      crecp = save;
 		    }
 
@@ -1695,6 +1705,11 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 			if (!(crecp->flags & F_DNSSECOK))
 			  sec_data = 0;
 
+			/* Pi-hole modification: tell FTL and our caller about expired data */
+			crec_stale = cache_is_stale(now, crecp) ? F_STALE : 0;
+			if (crec_stale && stale && !dryrun)
+			  *stale = 1;
+
 			if (crecp->flags & F_CNAME)
 			  {
 			    char *cname_target = cache_get_cname_target(crecp);
@@ -1702,7 +1717,7 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 			    if (!dryrun)
 			      {
 				log_query(crecp->flags, name, NULL, record_source(crecp->uid));
-				FTL_cache(crecp->flags, name, NULL, record_source(crecp->uid), daemon->log_display_id);
+				FTL_cache(crecp->flags | crec_stale, name, NULL, record_source(crecp->uid), daemon->log_display_id);
 				if (add_resource_record(header, limit, &trunc, nameoffset, &ansp,
 							crec_ttl(crecp, now), &nameoffset,
 							T_CNAME, C_IN, "d", cname_target))
@@ -1728,7 +1743,7 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 			      // Pi-hole modification: Added record_source(crecp->uid) such that the subroutines know
 			      //                       where the reply dame from (e.g. gravity.list)
 			      log_query(crecp->flags, name, NULL, record_source(crecp->uid));
-			      FTL_cache(crecp->flags, name, NULL, record_source(crecp->uid), daemon->log_display_id);
+			      FTL_cache(crecp->flags | crec_stale, name, NULL, record_source(crecp->uid), daemon->log_display_id);
 			    }
 			  }
 			else
@@ -1748,7 +1763,7 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 			      {
 				log_query(crecp->flags & ~F_REVERSE, name, &crecp->addr.addr,
 					  record_source(crecp->uid));
-				FTL_cache(crecp->flags & ~F_REVERSE, name, &crecp->addr.addr,
+				FTL_cache((crecp->flags & ~F_REVERSE) | crec_stale, name, &crecp->addr.addr,
 				                     record_source(crecp->uid),
 				                     daemon->log_display_id);
 
@@ -1758,7 +1773,7 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 				  anscount++;
 			      }
 			  }
-		      } while ((crecp = cache_find_by_name(crecp, name, now, flag | F_CNAME)));
+		      } while ((crecp = cache_find_by_name(crecp, name, now, flag | F_CNAME | stale_flag)));
 		}
 	      else if (is_name_synthetic(flag, name, &addr))
 		{
@@ -0,0 +1,664 @@
+/* dnsmasq is Copyright (c) 2000-2018 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991, or
+   (at your option) version 3 dated 29 June, 2007.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Pi-hole modification: serve DNS over TCP without forking.
+
+   With --tcp-multiplex, accepted connections are kept on daemon->tcp_conns
+   and driven from the main poll() loop, like TFTP transfers. Each one
+   reads length-prefixed queries into its own buffer; every complete query
+   is handled at once, so a client may pipeline many of them (RFC 7766)
+   and answers go back in the order they become available. Local answers
+   never leave the main process, everything else is forwarded over UDP by
+   forward_query() and comes back through reply_query(). Only if upstream
+   truncates the answer even at our full EDNS0 size is the query handed
+   to a child running tcp_request() over a socketpair. */
+
+#include "dnsmasq.h"
+#include "../dnsmasq_interface.h"
+
+static int tcp_conn_read(struct tcp_conn *conn, time_t now);
+static int tcp_conn_write(struct tcp_conn *conn, time_t now);
+static void tcp_conn_query(struct tcp_conn *conn, unsigned char *query, size_t size, time_t now);
+static void tcp_fallback_read(struct tcp_conn *conn, struct tcp_query *q);
+static void queue_reply(struct tcp_conn *conn, unsigned char *packet, size_t len);
+static struct tcp_conn *lookup_tcp_conn(unsigned int serial);
+static struct tcp_query *lookup_inflight(struct tcp_conn *conn, unsigned short id, void *hash);
+static void answer_inflight(struct tcp_conn *conn, struct tcp_query *q, struct dns_header *header, size_t len);
+static void free_tcp_query(struct tcp_conn *conn, struct tcp_query *q);
+static void free_tcp_conn(struct tcp_conn *conn);
+
+/* Max TCP packet + slop */
+#define TCP_PACKET_SZ (65536 + MAXDNAME + RRFIXEDSZ)
+
+static unsigned int tcp_serial = 0;
+
+void tcp_conn_new(int confd, union mysockaddr *local_addr, struct in_addr netmask,
+		  int auth_dns, time_t now)
+{
+  struct tcp_conn *conn = NULL;
+  union mysockaddr peer_addr;
+  socklen_t peer_len = sizeof(union mysockaddr);
+
+  /* One work buffer serves all connections, queries are handled one at a time. */
+  if (!daemon->tcp_packet)
+    daemon->tcp_packet = whine_malloc(TCP_PACKET_SZ);
+
+  if (!daemon->tcp_packet ||
+      getpeername(confd, (struct sockaddr *)&peer_addr, &peer_len) == -1 ||
+      !tcp_local_service(&peer_addr) ||
+      !fix_fd(confd) ||
+      !(conn = whine_malloc(sizeof(struct tcp_conn))) ||
+      !(conn->inbuf = whine_malloc(PACKETSZ + sizeof(u16))))
+    {
+      if (conn)
+	free(conn);
+      shutdown(confd, SHUT_RDWR);
+      while (retry_send(close(confd)));
+      return;
+    }
+
+  conn->fd = confd;
+  conn->state = TCP_CONN_LEN;
+  conn->auth_dns = auth_dns;
+  conn->insize = PACKETSZ + sizeof(u16);
+  conn->peer = peer_addr;
+  conn->local = *local_addr;
+  conn->netmask = netmask;
+  conn->last_active = now;
+
+  /* Never 0, that means "not from a TCP connection" in struct frec. */
+  if (++tcp_serial == 0)
+    tcp_serial = 1;
+  conn->serial = tcp_serial;
+
+  conn->next = daemon->tcp_conns;
+  daemon->tcp_conns = conn;
+  daemon->tcp_conn_count++;
+  daemon->metrics[METRIC_DNS_TCP_MULTIPLEXED]++;
+}
+
+void tcp_set_listeners(void)
+{
+  struct tcp_conn *conn;
+  struct tcp_query *q;
+
+  for (conn = daemon->tcp_conns; conn; conn = conn->next)
+    {
+      /* Stop reading when the client has enough queries in progress,
+	 or doesn't read its answers. */
+      if (conn->state != TCP_CONN_DRAIN && conn->pending + conn->queued < TCP_PIPELINE)
+	poll_listen(conn->fd, POLLIN);
+
+      if (conn->replies)
+	poll_listen(conn->fd, POLLOUT);
+
+      for (q = conn->inflight; q; q = q->next)
+	if (q->fd != -1)
+	  poll_listen(q->fd, POLLIN);
+    }
+}
+
+void check_tcp_conns(time_t now)
+{
+  struct tcp_conn *conn, *tmp, **up;
+  struct tcp_query *q, *qtmp;
+
+  for (up = &daemon->tcp_conns, conn = daemon->tcp_conns; conn; conn = tmp)
+    {
+      int ok = 1;
+
+      tmp = conn->next;
+
+      for (q = conn->inflight; q; q = qtmp)
+	{
+	  qtmp = q->next;
+	  if (q->fd != -1 && poll_check(q->fd, POLLIN | POLLHUP | POLLERR))
+	    tcp_fallback_read(conn, q);
+	}
+
+      if (poll_check(conn->fd, POLLIN | POLLHUP | POLLERR))
+	ok = tcp_conn_read(conn, now);
+
+      /* Answers may also have been queued by reply_query(), so don't
+	 wait for POLLOUT: the socket is nearly always writable. */
+      if (ok && conn->replies)
+	ok = tcp_conn_write(conn, now);
+
+      if (ok && conn->state == TCP_CONN_DRAIN && conn->pending == 0 && !conn->replies)
+	ok = 0;
+
+      /* Idle connections go after TCP_IDLE_TIME, busy ones as long
+	 as a forked TCP child would have lived. */
+      if (ok && difftime(now, conn->last_active) > (conn->pending ? CHILD_LIFETIME : TCP_IDLE_TIME))
+	ok = 0;
+
+      if (ok)
+	up = &conn->next;
+      else
+	{
+	  *up = tmp;
+	  free_tcp_conn(conn);
+	}
+    }
+}
+
+/* Called from forward_query() and reply_query(): answer query on the
+   connection with serial, if both are still there. hash identifies the
+   question, clients may reuse an id for another one. len == 0 means give
+   up on the query. */
+void tcp_conn_answer(unsigned int serial, struct dns_header *header, size_t len, void *hash)
+{
+  struct tcp_conn *conn;
+  struct tcp_query *q;
+
+  if ((conn = lookup_tcp_conn(serial)) &&
+      (q = lookup_inflight(conn, ntohs(header->id), hash)))
+    answer_inflight(conn, q, header, len);
+}
+
+/* Called from free_frec(): the query was cancelled, timed out or its
+   record recycled before an answer came. The client doesn't retry on
+   TCP, so answer SERVFAIL rather than keep it waiting. */
+void tcp_conn_fail(unsigned int serial, unsigned short id, void *hash)
+{
+  struct tcp_conn *conn;
+  struct tcp_query *q;
+  struct dns_header *header;
+  unsigned char *p;
+
+  if (!(conn = lookup_tcp_conn(serial)) ||
+      !(q = lookup_inflight(conn, id, hash)))
+    return;
+
+  /* The stored query is going anyway, turn it into the answer. */
+  header = (struct dns_header *)(q->data + sizeof(u16));
+  if (!(p = skip_questions(header, q->len)))
+    {
+      header->qdcount = htons(0);
+      p = (unsigned char *)(header + 1);
+    }
+
+  header->hb3 = (header->hb3 & ~(HB3_AA | HB3_TC)) | HB3_QR;
+  header->hb4 |= HB4_RA;
+  header->ancount = htons(0);
+  header->nscount = htons(0);
+  header->arcount = htons(0);
+  SET_RCODE(header, SERVFAIL);
+
+  answer_inflight(conn, q, header, p - (unsigned char *)header);
+}
+
+/* The answer didn't fit into a UDP packet: get a child to repeat the
+   query over TCP with tcp_request(), and read its answer from a
+   socketpair. If that's not possible, the client gets the truncated
+   answer. */
+void tcp_conn_truncated(unsigned int serial, struct dns_header *header, size_t len, void *hash, time_t now)
+{
+  struct tcp_conn *conn;
+  struct tcp_query *q;
+  int sv[2], i;
+#ifndef NO_FORK
+  pid_t p = 0;
+#endif
+
+  if (!(conn = lookup_tcp_conn(serial)) ||
+      !(q = lookup_inflight(conn, ntohs(header->id), hash)))
+    return;
+
+  for (i = 0; i < MAX_PROCS; i++)
+    if (daemon->tcp_pids[i] == 0)
+      break;
+
+  if (i == MAX_PROCS ||
+      !(q->rbuf = whine_malloc(65536 + sizeof(u16))))
+    {
+      answer_inflight(conn, q, header, len);
+      return;
+    }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    {
+      answer_inflight(conn, q, header, len);
+      return;
+    }
+
+  /* The query fits into the socket buffer, so this doesn't block. */
+  if (!read_write(sv[0], q->data, q->len + sizeof(u16), 0))
+    {
+      close(sv[0]);
+      close(sv[1]);
+      answer_inflight(conn, q, header, len);
+      return;
+    }
+
+  /* tcp_request() sees EOF after the one query. */
+  shutdown(sv[0], SHUT_WR);
+
+#ifndef NO_FORK
+  if (!option_bool(OPT_DEBUG) && (p = fork()) == -1)
+    {
+      close(sv[0]);
+      close(sv[1]);
+      answer_inflight(conn, q, header, len);
+      return;
+    }
+
+  if (p != 0)
+    daemon->tcp_pids[i] = p;
+  else
+#endif
+    {
+      unsigned char *buff;
+      struct server *s;
+
+#ifndef NO_FORK
+      /* Arrange for SIGALRM after CHILD_LIFETIME seconds to
+	 terminate the process. */
+      if (!option_bool(OPT_DEBUG))
+	{
+	  close(sv[0]);
+	  alarm(CHILD_LIFETIME);
+	}
+#endif
+
+      /* start with no upstream connections. */
+      for (s = daemon->servers; s; s = s->next)
+	s->tcpfd = -1;
+
+      buff = tcp_request(sv[1], now, &conn->local, conn->netmask, conn->auth_dns,
+			 &conn->peer, q->log_id);
+
+      if (buff)
+	free(buff);
+
+      for (s = daemon->servers; s; s = s->next)
+	if (s->tcpfd != -1)
+	  {
+	    shutdown(s->tcpfd, SHUT_RDWR);
+	    while (retry_send(close(s->tcpfd)));
+	  }
+
+#ifndef NO_FORK
+      if (!option_bool(OPT_DEBUG))
+	{
+	  flush_log();
+	  _exit(0);
+	}
+#endif
+    }
+
+  close(sv[1]);
+  fix_fd(sv[0]);
+  q->fd = sv[0];
+  daemon->metrics[METRIC_DNS_TCP_FALLBACK]++;
+}
+
+/* Returns 0 if the connection is to be closed. */
+static int tcp_conn_read(struct tcp_conn *conn, time_t now)
+{
+  ssize_t n;
+
+  while ((n = read(conn->fd, conn->inbuf + conn->inlen, conn->insize - conn->inlen)) == -1 && errno == EINTR);
+
+  if (n == -1)
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+
+  conn->last_active = now;
+
+  if (n == 0)
+    {
+      /* Client is done sending, answer what we have. */
+      conn->state = TCP_CONN_DRAIN;
+      return 1;
+    }
+
+  conn->inlen += n;
+
+  while (conn->state != TCP_CONN_DRAIN && conn->inlen >= sizeof(u16))
+    {
+      size_t size = (conn->inbuf[0] << 8) | conn->inbuf[1];
+
+      if (size == 0 || conn->served == TCP_MAX_QUERIES)
+	{
+	  conn->state = TCP_CONN_DRAIN;
+	  break;
+	}
+
+      if (conn->inlen < size + sizeof(u16))
+	{
+	  if (conn->insize < size + sizeof(u16))
+	    {
+	      unsigned char *new = realloc(conn->inbuf, size + sizeof(u16));
+
+	      if (!new)
+		return 0;
+
+	      conn->inbuf = new;
+	      conn->insize = size + sizeof(u16);
+	    }
+
+	  conn->state = TCP_CONN_BODY;
+	  break;
+	}
+
+      conn->served++;
+      tcp_conn_query(conn, conn->inbuf + sizeof(u16), size, now);
+
+      conn->inlen -= size + sizeof(u16);
+      memmove(conn->inbuf, conn->inbuf + size + sizeof(u16), conn->inlen);
+      conn->state = TCP_CONN_LEN;
+    }
+
+  return 1;
+}
+
+/* Returns 0 if the connection is to be closed. */
+static int tcp_conn_write(struct tcp_conn *conn, time_t now)
+{
+  struct tcp_reply *r;
+  ssize_t n;
+
+  while ((r = conn->replies))
+    {
+      while ((n = write(conn->fd, r->data + r->sent, r->len - r->sent)) == -1 && errno == EINTR);
+
+      if (n == -1)
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+
+      conn->last_active = now;
+
+      if ((r->sent += n) < r->len)
+	break;
+
+      conn->replies = r->next;
+      conn->queued--;
+      free(r);
+    }
+
+  return 1;
+}
+
+/* Like tcp_request(), except that queries which need upstream are
+   forwarded over UDP and answered later. */
+static void tcp_conn_query(struct tcp_conn *conn, unsigned char *query, size_t size, time_t now)
+{
+  struct dns_header *header = (struct dns_header *)daemon->tcp_packet;
+  unsigned char *limit = daemon->tcp_packet + 65536;
+  int auth_dns = conn->auth_dns, do_bit = 0, have_pseudoheader = 0;
+#ifdef HAVE_AUTH
+  int local_auth = 0;
+#endif
+  unsigned char *pheader;
+  unsigned short qtype;
+  unsigned int gotname;
+  struct in_addr dst_addr_4;
+  size_t m;
+
+  if (size < sizeof(struct dns_header))
+    return;
+
+  memcpy(daemon->tcp_packet, query, size);
+  /* Clear buffer beyond request to avoid risk of
+     information disclosure. */
+  memset(daemon->tcp_packet + size, 0, 65536 - size);
+
+  /* log_query gets called indirectly all over the place, so
+     pass these in global variables - sorry. */
+  daemon->log_display_id = ++daemon->log_id;
+  daemon->log_source_addr = &conn->peer;
+
+  if ((gotname = extract_request(header, (unsigned int)size, daemon->namebuff, &qtype)))
+    {
+#ifdef HAVE_AUTH
+      struct auth_zone *zone;
+#endif
+      char *types = querystr(auth_dns ? "auth" : "query", qtype);
+
+      if (conn->peer.sa.sa_family == AF_INET)
+	{
+	  log_query(F_QUERY | F_IPV4 | F_FORWARD, daemon->namebuff,
+		    (struct all_addr *)&conn->peer.in.sin_addr, types);
+	  FTL_new_query(F_QUERY | F_IPV4 | F_FORWARD, daemon->namebuff,
+			(struct all_addr *)&conn->peer.in.sin_addr, types, daemon->log_display_id, TCP);
+	}
+#ifdef HAVE_IPV6
+      else
+	{
+	  log_query(F_QUERY | F_IPV6 | F_FORWARD, daemon->namebuff,
+		    (struct all_addr *)&conn->peer.in6.sin6_addr, types);
+	  FTL_new_query(F_QUERY | F_IPV6 | F_FORWARD, daemon->namebuff,
+			(struct all_addr *)&conn->peer.in6.sin6_addr, types, daemon->log_display_id, TCP);
+	}
+#endif
+
+#ifdef HAVE_AUTH
+      /* find queries for zones we're authoritative for, and answer them directly */
+      if (!auth_dns && !option_bool(OPT_LOCALISE))
+	for (zone = daemon->auth_zones; zone; zone = zone->next)
+	  if (in_zone(zone, daemon->namebuff, NULL))
+	    {
+	      auth_dns = 1;
+	      local_auth = 1;
+	      break;
+	    }
+#endif
+    }
+
+  if (conn->local.sa.sa_family == AF_INET)
+    dst_addr_4 = conn->local.in.sin_addr;
+  else
+    dst_addr_4.s_addr = 0;
+
+  if (find_pseudoheader(header, size, NULL, &pheader, NULL, NULL))
+    {
+      unsigned short flags;
+
+      have_pseudoheader = 1;
+      pheader += 4; /* udp_size, ext_rcode */
+      GETSHORT(flags, pheader);
+
+      if (flags & 0x8000)
+	do_bit = 1; /* do bit */
+    }
+
+#ifdef HAVE_AUTH
+  if (auth_dns)
+    m = answer_auth(header, (char *)limit, size, now, &conn->peer,
+		    local_auth, do_bit, have_pseudoheader);
+  else
+#endif
+    {
+      int ad_reqd = do_bit;
+      /* RFC 6840 5.7 */
+      if (header->hb4 & HB4_AD)
+	ad_reqd = 1;
+
+      /* m > 0 if answered from cache */
+      m = answer_request(header, (char *)limit, size,
+			 dst_addr_4, conn->netmask, now, ad_reqd, do_bit, have_pseudoheader, NULL);
+
+      if (m == 0)
+	{
+	  /* Keep the query as received, in case the answer comes back
+	     truncated and has to be fetched over TCP. */
+	  struct tcp_query *q = whine_malloc(sizeof(struct tcp_query) + size + sizeof(u16));
+#ifdef HAVE_DNSSEC
+	  void *hash;
+#else
+	  unsigned int crc;
+	  void *hash = &crc;
+#endif
+
+	  if (!q)
+	    return;
+
+	  /* Same question hash as forward_query() keeps in the frec. */
+#ifdef HAVE_DNSSEC
+	  hash = hash_questions(header, size, daemon->namebuff);
+#else
+	  crc = questions_crc(header, size, daemon->namebuff);
+#endif
+	  if ((q->hashed = (hash != NULL)))
+	    memcpy(q->hash, hash, HASH_SIZE);
+
+	  q->id = ntohs(header->id);
+	  q->log_id = daemon->log_display_id;
+	  q->fd = -1;
+	  q->len = size;
+	  memcpy(q->data, query - sizeof(u16), size + sizeof(u16));
+	  q->next = conn->inflight;
+	  conn->inflight = q;
+	  conn->pending++;
+
+	  if (forward_tcp_query(conn, header, size, now, ad_reqd, do_bit))
+	    daemon->metrics[METRIC_DNS_QUERIES_FORWARDED]++;
+	  else
+	    daemon->metrics[METRIC_DNS_LOCAL_ANSWERED]++;
+
+	  return;
+	}
+    }
+
+  daemon->metrics[METRIC_DNS_LOCAL_ANSWERED]++;
+  queue_reply(conn, (unsigned char *)header, m);
+}
+
+static void tcp_fallback_read(struct tcp_conn *conn, struct tcp_query *q)
+{
+  ssize_t n;
+
+  while ((n = read(q->fd, q->rbuf + q->rlen, 65536 + sizeof(u16) - q->rlen)) == -1 && errno == EINTR);
+
+  if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+
+  if (n > 0)
+    {
+      size_t len;
+
+      q->rlen += n;
+
+      if (q->rlen < sizeof(u16))
+	return;
+
+      len = (q->rbuf[0] << 8) | q->rbuf[1];
+
+      if (q->rlen < len + sizeof(u16))
+	return;
+
+      if (len != 0)
+	queue_reply(conn, q->rbuf + sizeof(u16), len);
+    }
+
+  /* Answer complete, or the child gave up without one. */
+  free_tcp_query(conn, q);
+}
+
+static void queue_reply(struct tcp_conn *conn, unsigned char *packet, size_t len)
+{
+  struct tcp_reply *r, **up;
+
+  if (!(r = whine_malloc(sizeof(struct tcp_reply) + len + sizeof(u16))))
+    return;
+
+  r->data[0] = len >> 8;
+  r->data[1] = len & 0xff;
+  memcpy(r->data + sizeof(u16), packet, len);
+  r->len = len + sizeof(u16);
+
+  for (up = &conn->replies; *up; up = &(*up)->next);
+  *up = r;
+  conn->queued++;
+}
+
+static struct tcp_conn *lookup_tcp_conn(unsigned int serial)
+{
+  struct tcp_conn *conn;
+
+  for (conn = daemon->tcp_conns; conn; conn = conn->next)
+    if (conn->serial == serial)
+      return conn;
+
+  return NULL;
+}
+
+/* Queries handed to a fallback child are answered by that. */
+static struct tcp_query *lookup_inflight(struct tcp_conn *conn, unsigned short id, void *hash)
+{
+  struct tcp_query *q;
+
+  for (q = conn->inflight; q; q = q->next)
+    if (q->id == id && q->fd == -1 &&
+	(!hash || !q->hashed || memcmp(q->hash, hash, HASH_SIZE) == 0))
+      return q;
+
+  return NULL;
+}
+
+/* Queue the answer first, header may point into q. */
+static void answer_inflight(struct tcp_conn *conn, struct tcp_query *q, struct dns_header *header, size_t len)
+{
+  if (len != 0)
+    queue_reply(conn, (unsigned char *)header, len);
+
+  free_tcp_query(conn, q);
+}
+
+static void free_tcp_query(struct tcp_conn *conn, struct tcp_query *q)
+{
+  struct tcp_query **up;
+
+  for (up = &conn->inflight; *up; up = &(*up)->next)
+    if (*up == q)
+      {
+	*up = q->next;
+	break;
+      }
+
+  if (q->fd != -1)
+    {
+      poll_forget(q->fd);
+      close(q->fd);
+    }
+
+  if (q->rbuf)
+    free(q->rbuf);
+
+  free(q);
+  conn->pending--;
+}
+
+static void free_tcp_conn(struct tcp_conn *conn)
+{
+  struct tcp_reply *r, *tmp;
+
+  while (conn->inflight)
+    free_tcp_query(conn, conn->inflight);
+
+  for (r = conn->replies; r; r = tmp)
+    {
+      tmp = r->next;
+      free(r);
+    }
+
+  poll_forget(conn->fd);
+  shutdown(conn->fd, SHUT_RDWR);
+  while (retry_send(close(conn->fd)));
+
+  free(conn->inbuf);
+  free(conn);
+  daemon->tcp_conn_count--;
+}
@@ -652,6 +652,7 @@ void check_tftp_listeners(time_t now)
 
 static void free_transfer(struct tftp_transfer *transfer)
 {
+  poll_forget(transfer->sockfd);
   close(transfer->sockfd);
   if (transfer->file && (--transfer->file->refcount) == 0)
     {
@@ -64,6 +64,7 @@ void check_ubus_listeners()
 
   if (poll_check(ubus->sock.fd, POLLHUP))
     {
+      poll_forget(ubus->sock.fd);
       ubus_free(ubus);
       ubus = NULL;
     }
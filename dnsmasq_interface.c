@@ -14,6 +14,7 @@
 #include "FTL.h"
 #include "dnsmasq_interface.h"
 #include "shmem.h"
+#include "timing.h"
 // Prototype of getCacheInformation()
 #include "api.h"
 
@@ -26,9 +27,10 @@ static void query_externally_blocked(int i, unsigned char status);
 static int findQueryID(int id);
 
 unsigned char* pihole_privacylevel = &config.privacylevel;
-char flagnames[28][12] = {"F_IMMORTAL ", "F_NAMEP ", "F_REVERSE ", "F_FORWARD ", "F_DHCP ", "F_NEG ", "F_HOSTS ", "F_IPV4 ", "F_IPV6 ", "F_BIGNAME ", "F_NXDOMAIN ", "F_CNAME ", "F_DNSKEY ", "F_CONFIG ", "F_DS ", "F_DNSSECOK ", "F_UPSTREAM ", "F_RRNAME ", "F_SERVER ", "F_QUERY ", "F_NOERR ", "F_AUTH ", "F_DNSSEC ", "F_KEYTAG ", "F_SECSTAT ", "F_NO_RR ", "F_IPSET ", "F_NOEXTRA "};
+int dnsport = 0;
+char flagnames[31][12] = {"F_IMMORTAL ", "F_NAMEP ", "F_REVERSE ", "F_FORWARD ", "F_DHCP ", "F_NEG ", "F_HOSTS ", "F_IPV4 ", "F_IPV6 ", "F_BIGNAME ", "F_NXDOMAIN ", "F_CNAME ", "F_DNSKEY ", "F_CONFIG ", "F_DS ", "F_DNSSECOK ", "F_UPSTREAM ", "F_RRNAME ", "F_SERVER ", "F_QUERY ", "F_NOERR ", "F_AUTH ", "F_DNSSEC ", "F_KEYTAG ", "F_SECSTAT ", "F_NO_RR ", "F_IPSET ", "F_NOEXTRA ", "F_SERVFAIL ", "F_RCODE ", "F_STALE "};
 
-void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char *types, int id, char type, const char* file, const int line)
+static void query_new(unsigned int flags, char *name, struct all_addr *addr, char *types, int id, char type, const char* file, const int line)
 {
 	// Don't analyze anything if in PRIVACY_NOSTATS mode
 	if(config.privacylevel >= PRIVACY_NOSTATS)
@@ -81,8 +83,10 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 	int queryID = counters->queries;
 
 	// Convert domain to lower case
+	unsigned long long stage = timing_start();
 	char *domain = strdup(name);
 	strtolower(domain);
+	timing_stop(TIMING_LOWERCASE, stage);
 
 	// If domain is "pi.hole" we skip this query
 	if(strcmp(domain, "pi.hole") == 0)
@@ -124,8 +128,10 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 	counters->querytype[querytype-1]++;
 
 	// Update overTime
+	stage = timing_start();
 	unsigned int timeidx = getOverTimeID(querytimestamp);
 	overTime[timeidx].querytypedata[querytype-1]++;
+	timing_stop(TIMING_OVERTIME, stage);
 
 	// Skip rest of the analysis if this query is not of type A or AAAA
 	// but user wants to see only A and AAAA queries (pre-v4.1 behavior)
@@ -141,10 +147,14 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 	}
 
 	// Go through already knows domains and see if it is one of them
+	stage = timing_start();
 	int domainID = findDomainID(domain);
+	timing_stop(TIMING_DOMAIN_LOOKUP, stage);
 
 	// Go through already knows clients and see if it is one of them
+	stage = timing_start();
 	int clientID = findClientID(client, true);
+	timing_stop(TIMING_CLIENT_LOOKUP, stage);
 
 	// Save everything
 	validate_access("queries", queryID, false, __LINE__, __FUNCTION__, __FILE__);
@@ -155,11 +165,12 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 	queries[queryID].domainID = domainID;
 	queries[queryID].clientID = clientID;
 	queries[queryID].timeidx = timeidx;
-	// Initialize database rowID with zero, will be set when the query is stored in the long-term DB
-	queries[queryID].db = 0;
+	// Not yet stored in the long-term DB
+	queries[queryID].db = false;
 	queries[queryID].id = id;
 	queries[queryID].complete = false;
-	queries[queryID].response = converttimeval(request);
+	queries[queryID].response = request.tv_sec >= querytimestamp ?
+	                            converttimeval(request) - querytimestamp*10000UL : 0;
 	// Initialize reply type
 	queries[queryID].reply = REPLY_UNKNOWN;
 	// Store DNSSEC result for this domain
@@ -171,8 +182,12 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 	get_privacy_level(NULL);
 	queries[queryID].privacylevel = config.privacylevel;
 
-	// Increase DNS queries counter
-	counters->queries++;
+	// List query for its client and domain
+	add_query_postings(queryID);
+
+	// Increase DNS queries counter. Readers without the lock
+	// must not see the new count before the row is filled in
+	__atomic_store_n(&counters->queries, counters->queries + 1, __ATOMIC_RELEASE);
 	// Count this query as unknown as long as no reply has
 	// been found and analyzed
 	counters->unknown++;
@@ -180,7 +195,7 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 	// Update overTime data
 	overTime[timeidx].total++;
 	// Update overTime data structure with the new client
-	clients[clientID].overTime[timeidx]++;
+	add_client_overTime(clientID, timeidx, 1);
 
 	// Set lastQuery timer and add one query for network table
 	clients[clientID].lastQuery = querytimestamp;
@@ -200,6 +215,7 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 		// of a specific domain. The logic herein is:
 		// If matched, then compare against whitelist
 		// If in whitelist, negate matched so this function returns: not-to-be-blocked
+		stage = timing_start();
 		if(match_regex(domainbuffer) && !in_whitelist(domainbuffer))
 		{
 			// We have to block this domain
@@ -212,6 +228,7 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 			// next time we see this domain
 			domains[domainID].regexmatch = REGEX_NOTBLOCKED;
 		}
+		timing_stop(TIMING_REGEX, stage);
 	}
 
 	// Free allocated memory
@@ -223,6 +240,13 @@ void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char
 	unlock_shm();
 }
 
+void _FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char *types, int id, char type, const char* file, const int line)
+{
+	const unsigned long long start = timing_start();
+	query_new(flags, name, addr, types, id, type, file, line);
+	timing_stop(TIMING_NEW_QUERY, start);
+}
+
 static int findQueryID(int id)
 {
 	// Loop over all queries - we loop in reverse order (start from the most recent query and
@@ -247,7 +271,7 @@ static int findQueryID(int id)
 	return -1;
 }
 
-void _FTL_forwarded(unsigned int flags, char *name, struct all_addr *addr, int id, const char* file, const int line)
+static void query_forwarded(unsigned int flags, char *name, struct all_addr *addr, int id, const char* file, const int line)
 {
 	// Don't analyze anything if in PRIVACY_NOSTATS mode
 	if(config.privacylevel >= PRIVACY_NOSTATS)
@@ -327,7 +351,8 @@ void _FTL_forwarded(unsigned int flags, char *name, struct all_addr *addr, int i
 		gettimeofday(&response, 0);
 		// Reset timer, shift slightly into the past to acknowledge the time
 		// FTLDNS needed to look up the CNAME in its cache
-		queries[i].response = converttimeval(response) - queries[i].response;
+		queries[i].response = converttimeval(response) -
+		                      (queries[i].timestamp*10000UL + queries[i].response);
 	}
 	else
 	{
@@ -355,6 +380,13 @@ void _FTL_forwarded(unsigned int flags, char *name, struct all_addr *addr, int i
 	unlock_shm();
 }
 
+void _FTL_forwarded(unsigned int flags, char *name, struct all_addr *addr, int id, const char* file, const int line)
+{
+	const unsigned long long start = timing_start();
+	query_forwarded(flags, name, addr, id, file, line);
+	timing_stop(TIMING_FORWARDED, start);
+}
+
 void FTL_dnsmasq_reload(void)
 {
 	// This function is called by the dnsmasq code on receive of SIGHUP
@@ -390,7 +422,34 @@ void FTL_dnsmasq_reload(void)
 		check_capabilities();
 }
 
-void _FTL_reply(unsigned short flags, char *name, struct all_addr *addr, int id, const char* file, const int line)
+void FTL_local_name(const char *name, const int prot, const struct all_addr *addr, const int dhcp)
+{
+	// Called by dnsmasq for every name it adds for an address from
+	// the hosts files (including host-record) or the DHCP leases
+	char ip[ADDRSTRLEN];
+	if(inet_ntop(prot, addr, ip, sizeof(ip)) == NULL)
+		return;
+
+	lock_shm();
+	set_local_name(ip, name, dhcp);
+	unlock_shm();
+}
+
+void FTL_local_names_reload(const int dhcp)
+{
+	// Called by dnsmasq before re-reading the hosts files or the DHCP leases
+	lock_shm();
+	clear_local_names(dhcp);
+	unlock_shm();
+}
+
+void FTL_reopen_log(void)
+{
+	// dnsmasq received SIGUSR2, the log files may have been rotated
+	reopen_FTL_log();
+}
+
+static void query_reply(unsigned short flags, char *name, struct all_addr *addr, int id, const char* file, const int line)
 {
 	// Don't analyze anything if in PRIVACY_NOSTATS mode
 	if(config.privacylevel >= PRIVACY_NOSTATS)
@@ -525,6 +584,13 @@ void _FTL_reply(unsigned short flags, char *name, struct all_addr *addr, int id,
 	unlock_shm();
 }
 
+void _FTL_reply(unsigned short flags, char *name, struct all_addr *addr, int id, const char* file, const int line)
+{
+	const unsigned long long start = timing_start();
+	query_reply(flags, name, addr, id, file, line);
+	timing_stop(TIMING_REPLY, start);
+}
+
 static void detect_blocked_IP(unsigned short flags, const char* answer, int queryID)
 {
 	if(flags & F_HOSTS)
@@ -651,7 +717,7 @@ static void query_externally_blocked(int i, unsigned char status)
 	queries[i].status = status;
 }
 
-void _FTL_cache(unsigned int flags, char *name, struct all_addr *addr, char *arg, int id, const char* file, const int line)
+static void query_cache(unsigned int flags, char *name, struct all_addr *addr, char *arg, int id, const char* file, const int line)
 {
 	// Don't analyze anything if in PRIVACY_NOSTATS mode
 	if(config.privacylevel >= PRIVACY_NOSTATS)
@@ -717,6 +783,8 @@ void _FTL_cache(unsigned int flags, char *name, struct all_addr *addr, char *arg
 		}
 		else if((flags & F_NAMEP) && (flags & F_DHCP)) // DHCP server reply
 			requesttype = QUERY_CACHE;
+		else if((flags & F_FORWARD) && (flags & F_STALE)) // expired answer served while refreshing
+			requesttype = QUERY_CACHE_STALE;
 		else if(flags & F_FORWARD) // cached answer to previously forwarded request
 			requesttype = QUERY_CACHE;
 		else if(flags & F_REVERSE) // cached answer to reverse request (PTR)
@@ -777,6 +845,11 @@ void _FTL_cache(unsigned int flags, char *name, struct all_addr *addr, char *arg
 				counters->cached++;
 				overTime[timeidx].cached++;
 				break;
+			case QUERY_CACHE_STALE: // served from expired cache entry
+				counters->cached++;
+				counters->cached_stale++;
+				overTime[timeidx].cached++;
+				break;
 			case QUERY_EXTERNAL_BLOCKED_IP:
 			case QUERY_EXTERNAL_BLOCKED_NULL:
 			case QUERY_EXTERNAL_BLOCKED_NXRA:
@@ -799,7 +872,14 @@ void _FTL_cache(unsigned int flags, char *name, struct all_addr *addr, char *arg
 	unlock_shm();
 }
 
-void _FTL_dnssec(int status, int id, const char* file, const int line)
+void _FTL_cache(unsigned int flags, char *name, struct all_addr *addr, char *arg, int id, const char* file, const int line)
+{
+	const unsigned long long start = timing_start();
+	query_cache(flags, name, addr, arg, id, file, line);
+	timing_stop(TIMING_CACHE, start);
+}
+
+static void query_dnssec(int status, int id, const char* file, const int line)
 {
 	// Don't analyze anything if in PRIVACY_NOSTATS mode
 	if(config.privacylevel >= PRIVACY_NOSTATS)
@@ -835,7 +915,14 @@ void _FTL_dnssec(int status, int id, const char* file, const int line)
 	unlock_shm();
 }
 
-void _FTL_upstream_error(unsigned int rcode, int id, const char* file, const int line)
+void _FTL_dnssec(int status, int id, const char* file, const int line)
+{
+	const unsigned long long start = timing_start();
+	query_dnssec(status, id, file, line);
+	timing_stop(TIMING_DNSSEC, start);
+}
+
+static void query_upstream_error(unsigned int rcode, int id, const char* file, const int line)
 {
 	// Process upstream errors
 	// Queries with error are those where the RCODE
@@ -855,7 +942,17 @@ void _FTL_upstream_error(unsigned int rcode, int id, const char* file, const int
 		unlock_shm();
 		return;
 	}
+
+	// The client already got a stale answer from cache, errors
+	// of the background refresh do not change what it received
+	if(queries[i].status == QUERY_CACHE_STALE)
+	{
+		unlock_shm();
+		return;
+	}
+
 	// Translate dnsmasq's rcode into something we can use
+	const bool answered = queries[i].reply != REPLY_UNKNOWN;
 	const char *rcodestr = NULL;
 	switch(rcode)
 	{
@@ -889,9 +986,23 @@ void _FTL_upstream_error(unsigned int rcode, int id, const char* file, const int
 		}
 	}
 
+	if(!answered)
+	{
+		// No response time is known for failed queries
+		queries[i].response = 0;
+		stream_query(i);
+	}
+
 	unlock_shm();
 }
 
+void _FTL_upstream_error(unsigned int rcode, int id, const char* file, const int line)
+{
+	const unsigned long long start = timing_start();
+	query_upstream_error(rcode, id, file, line);
+	timing_stop(TIMING_UPSTREAM_ERROR, start);
+}
+
 void _FTL_header_analysis(const unsigned char header4, const unsigned int rcode, const int id, const char* file, const int line)
 {
 	// Don't analyze anything if in PRIVACY_NOSTATS mode
@@ -922,6 +1033,14 @@ void _FTL_header_analysis(const unsigned char header4, const unsigned int rcode,
 		return;
 	}
 
+	// Background refresh of a stale cache answer, the client
+	// has already been replied to
+	if(queries[queryID].status == QUERY_CACHE_STALE)
+	{
+		unlock_shm();
+		return;
+	}
+
 	if(config.debug & DEBUG_QUERIES)
 	{
 		int domainID = queries[queryID].domainID;
@@ -954,7 +1073,7 @@ void print_flags(unsigned int flags)
 
 	unsigned int i;
 	char *flagstr = calloc(256,sizeof(char));
-	for(i = 0; i < sizeof(flags)*8; i++)
+	for(i = 0; i < sizeof(flagnames)/sizeof(flagnames[0]); i++)
 		if(flags & (1u << i))
 			strcat(flagstr, flagnames[i]);
 	logg("     Flags: %s", flagstr);
@@ -965,6 +1084,7 @@ void save_reply_type(unsigned int flags, int queryID, struct timeval response)
 {
 	// Iterate through possible values
 	validate_access("queries", queryID, false, __LINE__, __FUNCTION__, __FILE__);
+	const bool answered = queries[queryID].reply != REPLY_UNKNOWN;
 	if(flags & F_NEG)
 	{
 		if(flags & F_NXDOMAIN)
@@ -1004,9 +1124,16 @@ void save_reply_type(unsigned int flags, int queryID, struct timeval response)
 		counters->reply_IP++;
 	}
 
-	// Save response time (relative time)
-	queries[queryID].response = converttimeval(response) -
-	                            queries[queryID].response;
+	// Only the first answer record completes the query: later records
+	// would otherwise subtract from the already relative response time
+	if(!answered)
+	{
+		// Save response time (relative time)
+		queries[queryID].response = converttimeval(response) -
+		                            (queries[queryID].timestamp*10000UL + queries[queryID].response);
+
+		stream_query(queryID);
+	}
 }
 
 pthread_t telnet_listenthreadv4;
@@ -1023,6 +1150,9 @@ void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 	else
 		savepid();
 
+	// Start the asynchronous log writer in the process that keeps running
+	start_log_writer();
+
 	// We will use the attributes object later to start all threads in detached mode
 	pthread_attr_t attr;
 	// Initialize thread attributes object with default attribute values
@@ -1070,6 +1200,8 @@ void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 	}
 
 	// Start thread that will stay in the background until host names needs to be resolved
+	// Host names are looked up through our own DNS server
+	dnsport = daemon->port;
 	if(pthread_create( &DNSclientthread, &attr, DNSclient_thread, NULL ) != 0)
 	{
 		logg("Unable to open DNS client thread. Exiting...");
@@ -1090,18 +1222,34 @@ void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 // int cache_inserted, cache_live_freed are defined in dnsmasq/cache.c
 void getCacheInformation(int *sock)
 {
-	ssend(*sock,"cache-size: %i\ncache-live-freed: %i\ncache-inserted: %i\n",
+	ssend(*sock,"cache-size: %i\ncache-live-freed: %i\ncache-inserted: %i\ncache-stale-answered: %i\n",
 	            daemon->cachesize,
 	            daemon->metrics[METRIC_DNS_CACHE_LIVE_FREED],
-	            daemon->metrics[METRIC_DNS_CACHE_INSERTED]);
+	            daemon->metrics[METRIC_DNS_CACHE_INSERTED],
+	            daemon->metrics[METRIC_DNS_STALE_ANSWERED]);
 	// cache-size is obvious
 	// It means the resolver handled <cache-inserted> names lookups that needed to be sent to
 	// upstream severes and that <cache-live-freed> was thrown out of the cache
 	// before reaching the end of its time-to-live, to make room for a newer name.
 	// For <cache-live-freed>, smaller is better.
 	// New queries are always cached. If the cache is full with entries
-	// which haven't reached the end of their time-to-live, then the entry
-	// which hasn't been looked up for the longest time is evicted.
+	// which haven't reached the end of their time-to-live, then the CLOCK
+	// sweep evicts the next entry which hasn't been looked up since the
+	// sweep passed it the last time.
+
+	// Per-shard lookup statistics of the cache hash table
+	for(int i = 0; i < CACHE_SHARDS; i++)
+	{
+		const struct cache_shard *shard = cache_get_shard(i);
+		ssend(*sock, "cache-shard-%i: hits %u misses %u inserted %u evicted %u\n",
+		      i, shard->hits, shard->misses, shard->insertions, shard->evictions);
+	}
+
+	// Signature checks answered from the DNSSEC verification memo
+	// instead of running the public key algorithm again
+	ssend(*sock, "dnssec-verify-hits: %i\ndnssec-verify-misses: %i\n",
+	      daemon->metrics[METRIC_DNSSEC_VERIFY_HITS],
+	      daemon->metrics[METRIC_DNSSEC_VERIFY_MISSES]);
 }
 
 void _FTL_forwarding_failed(struct server *server, const char* file, const int line)
@@ -36,5 +36,8 @@ void _FTL_forwarding_failed(struct server *server, const char* file, const int l
 void _FTL_upstream_error(unsigned int rcode, int id, const char* file, const int line);
 
 void FTL_dnsmasq_reload(void);
+void FTL_reopen_log(void);
+void FTL_local_name(const char *name, const int prot, const struct all_addr *addr, const int dhcp);
+void FTL_local_names_reload(const int dhcp);
 void FTL_fork_and_bind_sockets(struct passwd *ent_pw);
 int FTL_listsfile(char* filename, unsigned int index, FILE *f, int cache_size, struct crec **rhash, int hashsz);
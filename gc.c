@@ -10,6 +10,7 @@
 
 #include "FTL.h"
 #include "shmem.h"
+#include "overTime.h"
 
 bool doGC = false;
 
@@ -33,6 +34,9 @@ void *GC_thread(void *val)
 			// Lock FTL's data structure, since it is likely that it will be changed here
 			// Requests should not be processed/answered when data is about to change
 			lock_shm();
+			// Queries and overTime data are moved below, API listings
+			// running without the lock have to start over
+			move_shm_begin();
 
 			// Get minimum time stamp to keep
 			time_t mintime = (time(NULL) - GCdelay) - MAXLOGAGE*3600;
@@ -65,7 +69,7 @@ void *GC_thread(void *val)
 				int timeidx = queries[i].timeidx;
 				overTime[timeidx].total--;
 				// Adjust corresponding overTime counters
-				clients[clientID].overTime[timeidx]--;
+				add_client_overTime(clientID, timeidx, -1);
 
 				// Adjust domain counter (no overTime information)
 				int domainID = queries[i].domainID;
@@ -73,6 +77,7 @@ void *GC_thread(void *val)
 				domains[domainID].count--;
 
 				// Change other counters according to status of this query
+				bool blocked = false;
 				switch(queries[i].status)
 				{
 					case QUERY_UNKNOWN:
@@ -91,6 +96,12 @@ void *GC_thread(void *val)
 						counters->cached--;
 						overTime[timeidx].cached--;
 						break;
+					case QUERY_CACHE_STALE:
+						// Answered from expired cache entry
+						counters->cached--;
+						counters->cached_stale--;
+						overTime[timeidx].cached--;
+						break;
 					case QUERY_GRAVITY: // Blocked by Pi-hole's blocking lists (fall through)
 					case QUERY_BLACKLIST: // Exact blocked (fall through)
 					case QUERY_WILDCARD: // Regex blocked (fall through)
@@ -101,12 +112,16 @@ void *GC_thread(void *val)
 						overTime[timeidx].blocked--;
 						domains[domainID].blockedcount--;
 						clients[clientID].blockedcount--;
+						blocked = true;
 						break;
 					default:
 						/* That cannot happen */
 						break;
 				}
 
+				// The query leaves overTime, keep it in the coarser rollups
+				rollup_query(queries[i].timestamp, queries[i].type, blocked);
+
 				// Update reply counters
 				switch(queries[i].reply)
 				{
@@ -155,18 +170,26 @@ void *GC_thread(void *val)
 
 			// Update queries counter
 			counters->queries -= removed;
+			// Keep the IDs used by the paginated query log stable
+			counters->queries_removed += removed;
+			gc_postings();
 			// Update DB index as total number of queries reduced
 			lastdbindex -= removed;
 
 			// Zero out remaining memory (marked as "F" in the above example)
 			memset(&queries[counters->queries], 0, (counters->queries_MAX - counters->queries)*sizeof(*queries));
 
+			// All queries up to mintime are counted in the rollups now
+			if(mintime > rollup_until)
+				rollup_until = mintime;
+
 			// Determine if overTime memory needs to get moved
 			moveOverTimeMemory(mintime);
 
 			if(config.debug & DEBUG_GC) logg("Notice: GC removed %i queries (took %.2f ms)", removed, timer_elapsed_msec(GC_TIMER));
 
 			// Release thread lock
+			move_shm_end();
 			unlock_shm();
 
 			// After storing data in the database for the next time,
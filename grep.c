@@ -9,6 +9,7 @@
 *  Please see LICENSE file for your rights under this license. */
 
 #include "FTL.h"
+#include "hash.h"
 
 char ** wildcarddomains = NULL;
 unsigned char blockingstatus = 2;
@@ -45,62 +46,145 @@ int countlines(const char* fname)
 	return lines;
 }
 
-int countlineswith(const char* str, const char* fname)
+// The audit list is kept in memory: exact entries in an open-addressing
+// hash set, wildcard entries ("*example.com" matching any domain ending
+// in "example.com") in a trie over the reversed suffixes. The index is
+// rebuilt when the file changes. The SHM lock does not protect it:
+// getTopDomains() refreshes and searches it while reading the shared
+// memory without the lock. It is only accessed by API threads, which
+// all hold api_lock (request.c) while answering a top-* request.
+typedef struct auditNode {
+	struct auditNode *child;
+	struct auditNode *sibling;
+	char c;
+	bool terminal;
+} auditNode;
+
+static struct {
+	hashSet exact;
+	auditNode *suffixes;
+	struct stat st;
+	bool valid;
+} audit = { HASH_SET(hashKey, NULL, NULL), NULL, { 0 }, false };
+
+static void free_auditNode(auditNode *node)
 {
-	FILE *fp;
-	int found = 0;
-	char *buffer = NULL;
-	size_t size = 0;
+	while(node != NULL)
+	{
+		auditNode *sibling = node->sibling;
+		free_auditNode(node->child);
+		free(node);
+		node = sibling;
+	}
+}
 
-	if((fp = fopen(fname, "r")) == NULL) {
-		return -1;
+static void free_auditlist(void)
+{
+	hash_set_free(&audit.exact);
+	free_auditNode(audit.suffixes);
+	audit.suffixes = NULL;
+	audit.valid = false;
+}
+
+static void add_audit_suffix(const char *suffix)
+{
+	// Insert the suffix back to front
+	auditNode **level = &audit.suffixes, *node = NULL;
+	for(const char *c = suffix + strlen(suffix); c-- > suffix;)
+	{
+		for(node = *level; node != NULL && node->c != *c; node = node->sibling);
+		if(node == NULL)
+		{
+			if((node = calloc(1, sizeof(auditNode))) == NULL)
+				return;
+			node->c = *c;
+			node->sibling = *level;
+			*level = node;
+		}
+		level = &node->child;
 	}
 
-	// Search through file
-	// getline reads a string from the specified file up to either a
-	// newline character or EOF
+	// A bare "*" has no suffix and matches nothing
+	if(node != NULL)
+		node->terminal = true;
+}
+
+static void load_auditlist(const struct stat *st)
+{
+	free_auditlist();
+
+	FILE *fp;
+	if((fp = fopen(files.auditlist, "r")) == NULL)
+		return;
+
+	char *buffer = NULL;
+	size_t size = 0;
 	while(getline(&buffer, &size, fp) != -1)
 	{
 		// Strip potential newline character at the end of line we just read
-		if(buffer[strlen(buffer)-1] == '\n')
-			buffer[strlen(buffer)-1] = '\0';
+		buffer[strcspn(buffer, "\n")] = '\0';
 
-		// Search for exact match
-		if(strcmp(buffer, str) == 0)
-		{
-			found++;
-			continue;
-		}
-
-		// If line starts with *, search for partial match of
-		// needle "buffer+1" in haystack "str"
+		bool added;
 		if(buffer[0] == '*')
-		{
-			char * buf = strstr(str, buffer+1);
-			// The  strstr() function finds the first occurrence of
-			// the substring buffer+1 in the string str.
-			// These functions return a pointer to the beginning of
-			// the located substring, or NULL if the substring is not
-			// found. Hence, we compare the length of the substring to
-			// the wildcard entry to rule out the possiblity that
-			// there is anything behind the wildcard. This avoids that given
-			// "*example.com" "example.com.xxxxx" would also match.
-			if(buf != NULL && strlen(buf) == strlen(buffer+1))
-				found++;
-		}
+			add_audit_suffix(buffer+1);
+		else if(buffer[0] != '\0')
+			hash_set_insert(&audit.exact, buffer, &added);
 	}
 
-	// Free allocated memory
 	if(buffer != NULL)
-	{
 		free(buffer);
-		buffer = NULL;
+	fclose(fp);
+
+	audit.st = *st;
+	audit.valid = true;
+}
+
+// Reload the audit list if the file changed since we last read it.
+// The caller has to hold api_lock (request.c)
+void refresh_auditlist(void)
+{
+	struct stat st;
+	if(stat(files.auditlist, &st) != 0)
+	{
+		if(audit.valid || audit.exact.size > 0)
+			free_auditlist();
+		return;
 	}
 
-	// Close the file
-	fclose(fp);
+	if(audit.valid &&
+	   st.st_ino == audit.st.st_ino && st.st_dev == audit.st.st_dev &&
+	   st.st_size == audit.st.st_size &&
+	   st.st_mtim.tv_sec == audit.st.st_mtim.tv_sec &&
+	   st.st_mtim.tv_nsec == audit.st.st_mtim.tv_nsec)
+		return;
+
+	load_auditlist(&st);
+}
+
+bool __attribute__((pure)) in_auditlist(const char *domain)
+{
+	if(!audit.valid)
+		return false;
+
+	// Search for exact match
+	if(hash_set_find(&audit.exact, domain) != NULL)
+		return true;
+
+	// Walk the suffix trie from the end of the domain. Any terminal
+	// node we reach corresponds to a wildcard entry the domain ends with
+	const auditNode *level = audit.suffixes;
+	for(const char *c = domain + strlen(domain); c-- > domain;)
+	{
+		const auditNode *node;
+		for(node = level; node != NULL && node->c != *c; node = node->sibling);
+		if(node == NULL)
+			return false;
+		if(node->terminal)
+			return true;
+		level = node->child;
+	}
 
-	return found;
+	return false;
 }
 
 void check_blocking_status(void)
@@ -0,0 +1,182 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2019 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  String hashing header
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// FNV-1a, used by all of FTL's open addressing hash tables
+#define HASH_FNV_OFFSET 2166136261U
+#define HASH_FNV_PRIME 16777619U
+
+/// Add one more byte to a hash started with HASH_FNV_OFFSET
+static inline unsigned int __attribute__((const)) hash_byte(const unsigned int hash, const unsigned char c)
+{
+	return (hash ^ c) * HASH_FNV_PRIME;
+}
+
+/// Add the bytes of a string (without its terminating zero) to a hash
+static inline unsigned int __attribute__((pure)) hash_append(unsigned int hash, const char *str)
+{
+	while(*str)
+		hash = hash_byte(hash, (unsigned char)*str++);
+	return hash;
+}
+
+/// Hash a zero-terminated string
+static inline unsigned int __attribute__((pure)) hash_string(const char *str)
+{
+	return hash_append(HASH_FNV_OFFSET, str);
+}
+
+/// Every entry of a hashSet starts with its key, a copy owned by the set
+typedef struct {
+	char *str;
+	unsigned int hash;
+} hashKey;
+
+/// Open addressing hash set of strings, kept at a load factor of at most
+/// 0.5. Entries are structs of entrysize bytes starting with a hashKey, the
+/// rest is payload of the caller which is zeroed when the entry is added.
+/// If set, stale() is asked for every entry when the table grows and
+/// release() frees the payload of entries which are dropped
+typedef struct {
+	unsigned char *slots;
+	unsigned int size;
+	unsigned int count;
+	size_t entrysize;
+	bool (*stale)(const void *entry);
+	void (*release)(void *entry);
+} hashSet;
+
+#define HASH_SET(type, stale, release) { NULL, 0, 0, sizeof(type), stale, release }
+
+/// Entry in slot i of the table, its key is NULL if the slot is empty
+static inline void * __attribute__((pure)) hash_set_entry(const hashSet *set, const unsigned int i)
+{
+	return set->slots + i*set->entrysize;
+}
+
+/// Slot holding the key or the empty slot where it would be added
+static inline hashKey * __attribute__((pure)) hash_set_probe(const hashSet *set, const char *str, const unsigned int hash)
+{
+	unsigned int i = hash & (set->size - 1);
+	hashKey *key;
+	while((key = hash_set_entry(set, i))->str != NULL)
+	{
+		if(key->hash == hash && strcmp(key->str, str) == 0)
+			break;
+		i = (i + 1) & (set->size - 1);
+	}
+	return key;
+}
+
+static inline void * __attribute__((pure)) hash_set_find(const hashSet *set, const char *str)
+{
+	if(set->size == 0)
+		return NULL;
+
+	hashKey *key = hash_set_probe(set, str, hash_string(str));
+	return key->str != NULL ? key : NULL;
+}
+
+static inline void hash_set_drop(const hashSet *set, hashKey *key)
+{
+	if(set->release != NULL)
+		set->release(key);
+	free(key->str);
+}
+
+/// Rebuild the table with room for one more entry, dropping stale entries
+static inline bool hash_set_grow(hashSet *set)
+{
+	unsigned int live = 0;
+	for(unsigned int i = 0; i < set->size; i++)
+	{
+		const hashKey *key = hash_set_entry(set, i);
+		if(key->str != NULL && (set->stale == NULL || !set->stale(key)))
+			live++;
+	}
+
+	unsigned int size = 64;
+	while(size < 2*(live + 1))
+		size *= 2;
+
+	unsigned char *slots = calloc(size, set->entrysize);
+	if(slots == NULL)
+		return false;
+
+	hashSet grown = *set;
+	grown.slots = slots;
+	grown.size = size;
+	grown.count = live;
+	for(unsigned int i = 0; i < set->size; i++)
+	{
+		hashKey *key = hash_set_entry(set, i);
+		if(key->str == NULL)
+			continue;
+		if(set->stale != NULL && set->stale(key))
+		{
+			hash_set_drop(set, key);
+			continue;
+		}
+		memcpy(hash_set_probe(&grown, key->str, key->hash), key, set->entrysize);
+	}
+
+	if(set->slots != NULL)
+		free(set->slots);
+	*set = grown;
+	return true;
+}
+
+/// Find the entry of a string or add one. Returns NULL if out of memory,
+/// *added tells if the entry is new
+static inline void *hash_set_insert(hashSet *set, const char *str, bool *added)
+{
+	const unsigned int hash = hash_string(str);
+	*added = false;
+	hashKey *key = set->size > 0 ? hash_set_probe(set, str, hash) : NULL;
+	if(key != NULL && key->str != NULL)
+		return key;
+
+	if(2U*(set->count + 1) > set->size)
+	{
+		if(!hash_set_grow(set))
+			return NULL;
+		key = hash_set_probe(set, str, hash);
+	}
+
+	if((key->str = strdup(str)) == NULL)
+		return NULL;
+	key->hash = hash;
+	set->count++;
+	*added = true;
+	return key;
+}
+
+static inline void hash_set_free(hashSet *set)
+{
+	for(unsigned int i = 0; i < set->size; i++)
+	{
+		hashKey *key = hash_set_entry(set, i);
+		if(key->str != NULL)
+			hash_set_drop(set, key);
+	}
+	if(set->slots != NULL)
+		free(set->slots);
+	set->slots = NULL;
+	set->size = 0;
+	set->count = 0;
+}
+
+#endif //HASH_H
@@ -10,14 +10,214 @@
 
 #include "FTL.h"
 #include "version.h"
+#include <fcntl.h>
 
-pthread_mutex_t lock;
-FILE *logfile = NULL;
+// Lines travel from logg() to the writer thread through a bounded
+// lock-free multi-producer/multi-consumer ring: every slot carries a
+// sequence number telling producers and consumers whose turn it is.
+typedef struct {
+	unsigned int seq;
+	unsigned int len;
+	char line[LOG_LINE_LEN];
+} logSlot;
 
-static void close_FTL_log(void)
+static logSlot ring[LOG_RING_SIZE];
+static unsigned int ring_head = 0, ring_tail = 0;
+static unsigned int dropped = 0;
+
+// Persistent descriptor of the log file
+static int logfd = -1;
+
+static pthread_t logthread;
+static pthread_mutex_t logmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logcond = PTHREAD_COND_INITIALIZER;
+static pid_t writerpid = 0;
+static volatile bool writer_running = false, writer_stop = false, synchronous = true;
+static volatile bool reopen_requested = false;
+
+static bool ring_push(const char *line, const size_t len)
+{
+	unsigned int pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	while(true)
+	{
+		logSlot *slot = &ring[pos % LOG_RING_SIZE];
+		const int diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if(diff == 0)
+		{
+			// Slot is free, try to claim it
+			if(__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, true,
+			                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				memcpy(slot->line, line, len);
+				slot->len = len;
+				__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+				return true;
+			}
+		}
+		else if(diff < 0)
+			// Ring is full
+			return false;
+		else
+			pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	}
+}
+
+// Copies the oldest line into buffer (which has room for LOG_LINE_LEN
+// bytes) and returns its length, or 0 if the ring is empty
+static unsigned int ring_pop(char *buffer)
+{
+	unsigned int pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+	while(true)
+	{
+		logSlot *slot = &ring[pos % LOG_RING_SIZE];
+		const int diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if(diff == 0)
+		{
+			if(__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, true,
+			                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				const unsigned int len = slot->len;
+				memcpy(buffer, slot->line, len);
+				// Hand the slot back to the producers of the next lap
+				__atomic_store_n(&slot->seq, pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+				return len;
+			}
+		}
+		else if(diff < 0)
+			// Ring is empty
+			return 0;
+		else
+			pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+	}
+}
+
+static void write_all(const char *buffer, size_t len)
+{
+	while(len > 0 && logfd != -1)
+	{
+		const ssize_t ret = write(logfd, buffer, len);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+		{
+			if(!daemonmode)
+				printf("!!! WARNING: Writing to FTL\'s log file failed!\n");
+			syslog(LOG_ERR, "Writing to FTL\'s log file failed!");
+			return;
+		}
+		buffer += ret;
+		len -= ret;
+	}
+}
+
+// (Re-)open the log file. The descriptor number is kept stable such that
+// concurrent writers never see a closed or reused descriptor
+static bool reopen_logfd(void)
+{
+	const int fd = open(FTLfiles.log, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if(fd < 0)
+		return false;
+
+	if(logfd == -1)
+		logfd = fd;
+	else
+	{
+		dup2(fd, logfd);
+		close(fd);
+	}
+
+	return true;
+}
+
+// Reopen the log file if it has been moved away or deleted (logrotate)
+static void check_rotation(void)
+{
+	struct stat path_st, fd_st;
+	if(!reopen_requested && logfd != -1 &&
+	   stat(FTLfiles.log, &path_st) == 0 && fstat(logfd, &fd_st) == 0 &&
+	   path_st.st_dev == fd_st.st_dev && path_st.st_ino == fd_st.st_ino)
+		return;
+
+	reopen_requested = false;
+	reopen_logfd();
+}
+
+static void get_timestr(char *timestring)
+{
+	struct timeval tv;
+	struct tm tm;
+	gettimeofday(&tv, NULL);
+	localtime_r(&tv.tv_sec, &tm);
+	int millisec = tv.tv_usec/1000;
+
+	sprintf(timestring,"%d-%02d-%02d %02d:%02d:%02d.%03i", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, millisec);
+}
+
+// Write everything queued so far in batches, returns the number of lines written
+static unsigned int drain_ring(void)
+{
+	char batch[16*LOG_LINE_LEN];
+	unsigned int lines = 0;
+	size_t len = 0, linelen;
+
+	while((linelen = ring_pop(batch + len)) > 0)
+	{
+		len += linelen;
+		lines++;
+		if(len > sizeof(batch) - LOG_LINE_LEN)
+		{
+			write_all(batch, len);
+			len = 0;
+		}
+	}
+
+	const unsigned int lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+	if(lost > 0)
+	{
+		char timestring[84] = "";
+		get_timestr(timestring);
+		len += snprintf(batch + len, LOG_LINE_LEN, "[%s %ld] WARNING: Log buffer full, dropped %u messages\n",
+		                timestring, (long)getpid(), lost);
+	}
+
+	if(len > 0)
+		write_all(batch, len);
+
+	return lines;
+}
+
+static void *log_writer_thread(void *val)
 {
-	if(logfile != NULL)
-		fclose(logfile);
+	prctl(PR_SET_NAME,"logger",0,0,0);
+
+	time_t lastcheck = time(NULL);
+	while(!writer_stop)
+	{
+		if(drain_ring() == 0)
+		{
+			// Nothing to do, sleep until a producer wakes us up
+			// (the timeout covers wake-ups lost in between)
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += 100000000;
+			if(until.tv_nsec >= 1000000000)
+			{
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			pthread_mutex_lock(&logmutex);
+			pthread_cond_timedwait(&logcond, &logmutex, &until);
+			pthread_mutex_unlock(&logmutex);
+		}
+
+		if(reopen_requested || time(NULL) - lastcheck >= LOG_REOPEN_INTERVAL)
+		{
+			check_rotation();
+			lastcheck = time(NULL);
+		}
+	}
+
+	return NULL;
 }
 
 void open_FTL_log(bool test)
@@ -26,86 +226,137 @@ void open_FTL_log(bool test)
 	{
 		// Obtain log file location
 		getLogFilePath();
+
+		// Initialize the sequence numbers of the ring
+		for(unsigned int i = 0; i < LOG_RING_SIZE; i++)
+			ring[i].seq = i;
 	}
 
 	// Open the log file in append/create mode
-	logfile = fopen(FTLfiles.log, "a+");
-	if((logfile == NULL) && test){
+	if(!reopen_logfd() && test){
 		syslog(LOG_ERR, "Opening of FTL\'s log file failed!");
 		printf("FATAL: Opening of FTL log (%s) failed!\n",FTLfiles.log);
 		printf("       Make sure it exists and is writeable by user %s\n", username);
 		// Return failure
 		exit(EXIT_FAILURE);
 	}
+}
 
-	if(test)
+// Start the background writer. Must be called in the process that
+// keeps running (i.e., after forking into the background)
+void start_log_writer(void)
+{
+	writer_stop = false;
+	writerpid = getpid();
+	if(pthread_create(&logthread, NULL, log_writer_thread, NULL) != 0)
 	{
-		if (pthread_mutex_init(&lock, NULL) != 0)
-		{
-			printf("FATAL: Log mutex init failed\n");
-			// Return failure
-			exit(EXIT_FAILURE);
-		}
-		close_FTL_log();
+		logg("WARNING: Unable to start log writer thread, logging synchronously");
+		return;
+	}
+	writer_running = true;
+	synchronous = false;
+
+	// Don't lose pending lines when exiting from elsewhere
+	static bool registered = false;
+	if(!registered)
+	{
+		atexit(stop_log_writer);
+		registered = true;
 	}
 }
 
-static void get_timestr(char *timestring)
+// Flush all pending lines from the calling thread and log synchronously
+// from now on. Used on fatal errors when the writer may not run any more
+void flush_FTL_log(void)
 {
-	time_t t = time(NULL);
-	struct tm tm = *localtime(&t);
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	int millisec = tv.tv_usec/1000;
+	synchronous = true;
+	drain_ring();
+}
 
-	sprintf(timestring,"%d-%02d-%02d %02d:%02d:%02d.%03i", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, millisec);
+// Stop the background writer after it has written all pending lines
+void stop_log_writer(void)
+{
+	if(!writer_running || getpid() != writerpid)
+		return;
+
+	writer_stop = true;
+	pthread_cond_signal(&logcond);
+	if(!pthread_equal(pthread_self(), logthread))
+		pthread_join(logthread, NULL);
+	writer_running = false;
+	flush_FTL_log();
+}
+
+// Request reopening the log file (e.g., on SIGUSR2 after log rotation)
+void reopen_FTL_log(void)
+{
+	if(writer_running && !synchronous)
+	{
+		reopen_requested = true;
+		pthread_cond_signal(&logcond);
+	}
+	else
+		reopen_logfd();
 }
 
 void __attribute__ ((format (gnu_printf, 1, 2))) logg(const char *format, ...)
 {
 	char timestring[84] = "";
+	char line[LOG_LINE_LEN];
+	char *longline = NULL;
 	va_list args;
 
-	pthread_mutex_lock(&lock);
-
 	get_timestr(timestring);
 
 	// Get and log PID of current process to avoid ambiguities when more than one
 	// pihole-FTL instance is logging into the same file
 	long pid = (long)getpid();
 
-	// Print to stdout before writing to file
-	if(!daemonmode)
+	int prefixlen = snprintf(line, sizeof(line), "[%s %ld] ", timestring, pid);
+	va_start(args, format);
+	int len = prefixlen + vsnprintf(line + prefixlen, sizeof(line) - prefixlen, format, args);
+	va_end(args);
+
+	// Lines not fitting into a ring slot (including the newline) are
+	// formatted again into a sufficiently large buffer
+	if(len + 1 >= (int)sizeof(line))
 	{
-		printf("[%s %ld] ", timestring, pid);
+		if((longline = malloc(len + 2)) == NULL)
+			return;
+		memcpy(longline, line, prefixlen);
 		va_start(args, format);
-		vprintf(format, args);
+		vsnprintf(longline + prefixlen, len + 1 - prefixlen, format, args);
 		va_end(args);
-		printf("\n");
 	}
+	char *out = longline != NULL ? longline : line;
+	out[len++] = '\n';
+	out[len] = '\0';
 
-	// Open log file
-	open_FTL_log(false);
+	// Print to stdout before writing to file
+	if(!daemonmode)
+		fputs(out, stdout);
 
-	// Write to log file
-	if(logfile != NULL)
+	// Queue the line for the writer thread. Forked children (e.g., TCP
+	// workers) don't have a writer thread and log synchronously
+	if(longline == NULL && !synchronous && writer_running && pid == writerpid)
 	{
-		fprintf(logfile, "[%s %ld] ", timestring, pid);
-		va_start(args, format);
-		vfprintf(logfile, format, args);
-		va_end(args);
-		fputc('\n',logfile);
-	}
-	else if(!daemonmode)
-	{
-		printf("!!! WARNING: Writing to FTL\'s log file failed!\n");
-		syslog(LOG_ERR, "Writing to FTL\'s log file failed!");
+		if(ring_push(out, len))
+		{
+			pthread_cond_signal(&logcond);
+			return;
+		}
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
 	}
 
-	// Close log file
-	close_FTL_log();
+	// Synchronous path: a single write() with O_APPEND does not
+	// interleave with batches written by the writer thread
+	if(logfd == -1)
+		reopen_logfd();
+	write_all(out, len);
 
-	pthread_mutex_unlock(&lock);
+	if(longline != NULL)
+		free(longline);
 }
 
 void format_memory_size(char *prefix, unsigned long int bytes, double *formated)
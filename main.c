@@ -97,5 +97,8 @@ int main (int argc, char* argv[])
 	//Remove PID file
 	removepid();
 	logg("########## FTL terminated after %.1f ms! ##########", timer_elapsed_msec(EXIT_TIMER));
+
+	// Write all pending log lines
+	stop_log_writer();
 	return EXIT_SUCCESS;
 }
@@ -30,6 +30,7 @@ logFileNamesStruct files = {
 	NULL,
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
@@ -43,6 +44,9 @@ forwardedDataStruct *forwarded = NULL;
 clientsDataStruct *clients = NULL;
 domainsDataStruct *domains = NULL;
 overTimeDataStruct *overTime = NULL;
+postingsDataStruct *postings = NULL;
+clientOverTimeDataStruct *clientOverTime = NULL;
+streamDataStruct *querystream = NULL;
 
 void memory_check(int which)
 {
@@ -96,6 +100,30 @@ void memory_check(int which)
 				}
 			}
 		break;
+		case POSTINGS:
+			if(counters->postings >= counters->postings_MAX-1)
+			{
+				// Have to reallocate shared memory
+				postings = enlarge_shmem_struct(POSTINGS);
+				if(postings == NULL)
+				{
+					logg("FATAL: Memory allocation failed! Exiting");
+					exit(EXIT_FAILURE);
+				}
+			}
+		break;
+		case CLIENTOVERTIME:
+			if(counters->clientOverTime >= counters->clientOverTime_MAX-1)
+			{
+				// Have to reallocate shared memory
+				clientOverTime = enlarge_shmem_struct(CLIENTOVERTIME);
+				if(clientOverTime == NULL)
+				{
+					logg("FATAL: Memory allocation failed! Exiting");
+					exit(EXIT_FAILURE);
+				}
+			}
+		break;
 		default:
 			/* That cannot happen */
 			logg("Fatal error in memory_check(%i)", which);
@@ -9,6 +9,7 @@
 *  Please see LICENSE file for your rights under this license. */
 
 #include "FTL.h"
+#include "hash.h"
 #include "shmem.h"
 #include "sqlite3.h"
 #define ARPCACHE "/proc/net/arp"
@@ -38,7 +39,251 @@ bool create_network_table(void)
 	return true;
 }
 
-// Read kernel's ARP cache using procfs
+// The network table is mirrored in memory so that only devices which
+// changed since the last run have to be written to the database. Rows are
+// indexed by IP and hardware address in a hash set. Only
+// used by parse_arp_cache() which runs in the database thread
+typedef struct {
+	char *ip;
+	char *hwaddr;
+	char *name;
+	int id; // 0 = not yet in the database
+	int clientID; // -1 = not (yet) known to FTL
+	int clientsscanned; // clients already compared to this device
+	time_t lastQuery;
+	unsigned int numQueries;
+	int numQueriesARP; // taken from the client in this run, given back if not written
+	bool dirty;
+} networkDevice;
+
+typedef struct {
+	hashKey key;
+	int device;
+} deviceIndex;
+
+static struct {
+	networkDevice *devices;
+	int count;
+	int size;
+	hashSet index;
+	bool loaded;
+} network = { NULL, 0, 0, HASH_SET(deviceIndex, NULL, NULL), false };
+
+// IP and hardware addresses are at most 99 characters long (see
+// parse_arp_cache()) and contain no space, the key is "<IP> <hwaddr>"
+#define DEVICE_KEY_LEN 200
+static const char *device_key(char key[DEVICE_KEY_LEN], const char *ip, const char *hwaddr)
+{
+	snprintf(key, DEVICE_KEY_LEN, "%s %s", ip, hwaddr);
+	return key;
+}
+
+static void free_network_mirror(void)
+{
+	for(int i = 0; i < network.count; i++)
+	{
+		free(network.devices[i].ip);
+		free(network.devices[i].hwaddr);
+		free(network.devices[i].name);
+	}
+	if(network.devices != NULL)
+		free(network.devices);
+	hash_set_free(&network.index);
+	network.devices = NULL;
+	network.count = network.size = 0;
+	network.loaded = false;
+}
+
+static networkDevice __attribute__((pure)) *find_device(const char *ip, const char *hwaddr)
+{
+	char key[DEVICE_KEY_LEN];
+	const deviceIndex *index = hash_set_find(&network.index, device_key(key, ip, hwaddr));
+	return index != NULL ? &network.devices[index->device] : NULL;
+}
+
+static networkDevice *add_device(const int id, const char *ip, const char *hwaddr, const char *name)
+{
+	if(network.count == network.size)
+	{
+		const int size = network.size > 0 ? 2*network.size : 64;
+		networkDevice *devices = realloc(network.devices, size*sizeof(networkDevice));
+		if(devices == NULL)
+			return NULL;
+		network.devices = devices;
+		network.size = size;
+	}
+
+	networkDevice *device = &network.devices[network.count];
+	device->ip = strdup(ip);
+	device->hwaddr = strdup(hwaddr);
+	device->name = strdup(name);
+	if(device->ip == NULL || device->hwaddr == NULL || device->name == NULL)
+	{
+		if(device->ip != NULL) free(device->ip);
+		if(device->hwaddr != NULL) free(device->hwaddr);
+		if(device->name != NULL) free(device->name);
+		return NULL;
+	}
+	device->id = id;
+	device->clientID = -1;
+	device->clientsscanned = 0;
+	device->lastQuery = 0;
+	device->numQueries = 0;
+	device->numQueriesARP = 0;
+	device->dirty = false;
+
+	char key[DEVICE_KEY_LEN];
+	bool added;
+	deviceIndex *index = hash_set_insert(&network.index, device_key(key, ip, hwaddr), &added);
+	if(index == NULL)
+	{
+		free(device->ip);
+		free(device->hwaddr);
+		free(device->name);
+		return NULL;
+	}
+	// Duplicate rows in the database stay with the first one
+	if(added)
+		index->device = network.count;
+	network.count++;
+
+	return device;
+}
+
+// Read the network table into memory
+static bool load_network_mirror(sqlite3 *netdb)
+{
+	free_network_mirror();
+
+	sqlite3_stmt* stmt;
+	int rc = sqlite3_prepare_v2(netdb, "SELECT id,ip,hwaddr,lastQuery,numQueries,name FROM network;", -1, &stmt, NULL);
+	if( rc ){
+		logg("load_network_mirror() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(netdb));
+		return false;
+	}
+
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		const char *name = (const char*)sqlite3_column_text(stmt, 5);
+		networkDevice *device = add_device(sqlite3_column_int(stmt, 0),
+		                                   (const char*)sqlite3_column_text(stmt, 1),
+		                                   (const char*)sqlite3_column_text(stmt, 2),
+		                                   name != NULL ? name : "");
+		if(device == NULL)
+			break;
+		device->lastQuery = sqlite3_column_int64(stmt, 3);
+		device->numQueries = sqlite3_column_int(stmt, 4);
+	}
+	sqlite3_finalize(stmt);
+
+	if(rc != SQLITE_DONE)
+	{
+		logg("load_network_mirror() - SQL error step (%i): %s", rc, sqlite3_errmsg(netdb));
+		free_network_mirror();
+		return false;
+	}
+
+	network.loaded = true;
+	return true;
+}
+
+// Returns the ID of the client with the IP address of this device. Only
+// clients added since the last call are compared as clients are never
+// removed. Needs the SHM lock
+static int device_clientID(networkDevice *device)
+{
+	if(device->clientID >= 0)
+		return device->clientID;
+
+	for(; device->clientsscanned < counters->clients; device->clientsscanned++)
+	{
+		if(strcmp(getstr(clients[device->clientsscanned].ippos), device->ip) == 0)
+		{
+			device->clientID = device->clientsscanned;
+			break;
+		}
+	}
+
+	return device->clientID;
+}
+
+// Write all changed devices to the database in one transaction
+static int flush_network_mirror(sqlite3 *netdb, char **ifaces, const int ifacessize)
+{
+	sqlite3_stmt *insert = NULL, *update = NULL;
+	int rc = sqlite3_prepare_v2(netdb, "INSERT INTO network "\
+	                                   "(ip,hwaddr,interface,firstSeen,lastQuery,numQueries,name,macVendor) "\
+	                                   "VALUES (?,?,?,?,?,?,?,?);", -1, &insert, NULL);
+	if(rc == SQLITE_OK)
+		rc = sqlite3_prepare_v2(netdb, "UPDATE network SET lastQuery = ?, numQueries = ?, name = ? WHERE id = ?;", -1, &update, NULL);
+	if( rc ){
+		logg("parse_arp_cache() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(netdb));
+		sqlite3_finalize(insert);
+		// Nothing was written, start over from the database next time
+		network.loaded = false;
+		return 0;
+	}
+
+	const time_t now = time(NULL);
+	int changed = 0;
+	sqlite3_exec(netdb, "BEGIN TRANSACTION", NULL, NULL, NULL);
+	for(int i = 0; i < network.count; i++)
+	{
+		networkDevice *device = &network.devices[i];
+		if(!device->dirty)
+			continue;
+
+		if(device->id > 0)
+		{
+			sqlite3_bind_int64(update, 1, device->lastQuery);
+			sqlite3_bind_int(update, 2, device->numQueries);
+			sqlite3_bind_text(update, 3, device->name, -1, SQLITE_STATIC);
+			sqlite3_bind_int(update, 4, device->id);
+			rc = sqlite3_step(update);
+			sqlite3_reset(update);
+			// The row still exists
+			if(rc != SQLITE_DONE || sqlite3_changes(netdb) > 0)
+			{
+				device->dirty = rc != SQLITE_DONE;
+				changed++;
+				continue;
+			}
+		}
+
+		// New device (or its row was deleted behind our back)
+		char* macVendor = getMACVendor(device->hwaddr);
+		sqlite3_bind_text(insert, 1, device->ip, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert, 2, device->hwaddr, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert, 3, i < ifacessize && ifaces[i] != NULL ? ifaces[i] : "", -1, SQLITE_STATIC);
+		sqlite3_bind_int64(insert, 4, now);
+		sqlite3_bind_int64(insert, 5, device->lastQuery);
+		sqlite3_bind_int(insert, 6, device->numQueries);
+		sqlite3_bind_text(insert, 7, device->name, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert, 8, macVendor, -1, SQLITE_STATIC);
+		rc = sqlite3_step(insert);
+		sqlite3_reset(insert);
+		free(macVendor);
+		if(rc == SQLITE_DONE)
+		{
+			device->id = sqlite3_last_insert_rowid(netdb);
+			device->dirty = false;
+			changed++;
+		}
+	}
+	rc = sqlite3_exec(netdb, "COMMIT", NULL, NULL, NULL);
+	if( rc ){
+		logg("parse_arp_cache() - SQL error commit (%i): %s", rc, sqlite3_errmsg(netdb));
+		// Everything is written again next time
+		network.loaded = false;
+	}
+
+	sqlite3_finalize(insert);
+	sqlite3_finalize(update);
+	return changed;
+}
+
+// Read kernel's ARP cache using procfs and update the network table with
+// everything that changed since the last run
 void parse_arp_cache(void)
 {
 	FILE* arpfp = NULL;
@@ -50,7 +295,8 @@ void parse_arp_cache(void)
 		return;
 	}
 
-	// Open database file
+	// Open database file. The database is not kept open while
+	// collecting below: save_to_DB() takes the SHM lock first
 	if(!dbopen())
 	{
 		logg("read_arp_cache() - Failed to open DB");
@@ -61,18 +307,41 @@ void parse_arp_cache(void)
 	// Start ARP timer
 	if(config.debug & DEBUG_ARP) timer_start(ARP_TIMER);
 
+	// (Re-)load the mirror if the table was changed by someone else,
+	// e.g., flushed by the user
+	if(network.loaded)
+	{
+		sqlite3_stmt* stmt;
+		if(sqlite3_prepare_v2(dbhandle(), "SELECT COUNT(*) FROM network;", -1, &stmt, NULL) == SQLITE_OK)
+		{
+			if(sqlite3_step(stmt) != SQLITE_ROW || sqlite3_column_int(stmt, 0) != network.count)
+				network.loaded = false;
+			sqlite3_finalize(stmt);
+		}
+	}
+	const bool loaded = network.loaded || load_network_mirror(dbhandle());
+	dbclose();
+	if(!loaded)
+	{
+		fclose(arpfp);
+		return;
+	}
+
 	// Prepare buffers
 	char * linebuffer = NULL;
 	size_t linebuffersize = 0;
 	char ip[100], mask[100], hwaddr[100], iface[100];
 	int type, flags, entries = 0;
-	time_t now = time(NULL);
 
-	// Start collecting database commands
-	dbquery("BEGIN TRANSACTION");
+	// Interfaces of the devices seen in this run (only needed for new rows)
+	char **ifaces = calloc(network.count + 64, sizeof(char*));
+	int ifacessize = network.count + 64;
+
+	// Collect changes while holding the lock only once
+	lock_shm();
 
 	// Read ARP cache line by line
-	while(getline(&linebuffer, &linebuffersize, arpfp) != -1)
+	while(ifaces != NULL && getline(&linebuffer, &linebuffersize, arpfp) != -1)
 	{
 		int num = sscanf(linebuffer, "%99s 0x%x 0x%x %99s %99s %99s\n",
 		                 ip, &type, &flags, hwaddr, mask, iface);
@@ -85,182 +354,334 @@ void parse_arp_cache(void)
 		if(!(flags & 0x02))
 			continue;
 
-		// Get ID of this device in our network database. If it cannot be found, then this is a new device
 		// We match both IP *and* MAC address
 		// Same MAC, two IPs: Non-deterministic DHCP server, treat as two entries
 		// Same IP, two MACs: Either non-deterministic DHCP server or (almost) full DHCP address pool
-		// We can run this SELECT inside the currently active transaction as only the
-		// changed to the database are collected for latter commitment. Read-only access
-		// such as this SELECT command will be executed immediately on the database.
-		char* querystr = NULL;
-		int ret = asprintf(&querystr, "SELECT id FROM network WHERE ip = \'%s\' AND hwaddr = \'%s\';", ip, hwaddr);
-		if(querystr == NULL || ret < 0)
+		networkDevice *device = find_device(ip, hwaddr);
+		if(device == NULL)
 		{
-			logg("Memory allocation failed in parse_arp_cache (%i)", ret);
-			break;
+			// Device not in database, add new entry
+			if((device = add_device(0, ip, hwaddr, "")) == NULL)
+				break;
+			device->dirty = true;
 		}
 
-		// Perform SQL query
-		int dbID = db_query_int(querystr);
-		free(querystr);
-
-		if(dbID == DB_FAILED)
+		// Remember the interface for new entries
+		const int n = device - network.devices;
+		if(n >= ifacessize)
 		{
-			// SQLite error
-			break;
+			char **grown = realloc(ifaces, (n + 64)*sizeof(char*));
+			if(grown == NULL)
+				break;
+			memset(&grown[ifacessize], 0, (n + 64 - ifacessize)*sizeof(char*));
+			ifaces = grown;
+			ifacessize = n + 64;
 		}
+		if(device->id == 0 && ifaces[n] == NULL)
+			ifaces[n] = strdup(iface);
 
-		// If we reach this point, we can check if this client
-		// is known to pihole-FTL
-		// false = do not create a new record if the client is
-		//         unknown (only DNS requesting clients do this)
-		lock_shm();
-		int clientID = findClientID(ip, false);
-
-		// This client is known (by its IP address) to pihole-FTL if
-		// findClientID() returned a non-negative index
-		bool clientKnown = clientID >= 0;
-
-		// Get hostname of this client if the client is known
-		const char *hostname = "";
-		if(clientKnown)
+		// Check if this client is known to pihole-FTL
+		const int clientID = device_clientID(device);
+		if(clientID >= 0)
 		{
 			validate_access("clients", clientID, true, __LINE__, __FUNCTION__, __FILE__);
-			hostname = getstr(clients[clientID].namepos);
-		}
+			clientsDataStruct *client = &clients[clientID];
 
-		// Device not in database, add new entry
-		if(dbID == DB_NODATA)
-		{
-			char* macVendor = getMACVendor(hwaddr);
-			dbquery("INSERT INTO network "\
-			        "(ip,hwaddr,interface,firstSeen,lastQuery,numQueries,name,macVendor) "\
-			        "VALUES (\'%s\',\'%s\',\'%s\',%lu, %ld, %u, \'%s\', \'%s\');",\
-			        ip, hwaddr, iface, now,
-			        clientKnown ? clients[clientID].lastQuery : 0L,
-			        clientKnown ? clients[clientID].numQueriesARP : 0u,
-			        hostname,
-			        macVendor);
-			free(macVendor);
-		}
-		// Device in database AND client known to Pi-hole
-		else if(clientKnown)
-		{
 			// Update lastQuery. Only use new value if larger
 			// clients[clientID].lastQuery may be zero if this
 			// client is only known from a database entry but has
 			// not been seen since then
-			dbquery("UPDATE network "\
-			        "SET lastQuery = MAX(lastQuery, %ld) "\
-			        "WHERE id = %i;",\
-			        clients[clientID].lastQuery, dbID);
-
-			// Update numQueries. Add queries seen since last update
-			// and reset counter afterwards
-			dbquery("UPDATE network "\
-			        "SET numQueries = numQueries + %u "\
-			        "WHERE id = %i;",\
-			        clients[clientID].numQueriesARP, dbID);
-			clients[clientID].numQueriesARP = 0;
+			if(client->lastQuery > device->lastQuery)
+			{
+				device->lastQuery = client->lastQuery;
+				device->dirty = true;
+			}
+
+			// Add queries seen since last update and reset counter afterwards
+			if(client->numQueriesARP > 0)
+			{
+				device->numQueries += client->numQueriesARP;
+				device->numQueriesARP += client->numQueriesARP;
+				client->numQueriesARP = 0;
+				device->dirty = true;
+			}
 
 			// Store hostname if available
-			if(strlen(hostname) > 0)
+			const char *hostname = getstr(client->namepos);
+			if(strlen(hostname) > 0 && strcmp(hostname, device->name) != 0)
 			{
-				// Store host name
-				dbquery("UPDATE network "\
-				        "SET name = \'%s\' "\
-				        "WHERE id = %i;",\
-				        hostname, dbID);
+				char *name = strdup(hostname);
+				if(name != NULL)
+				{
+					free(device->name);
+					device->name = name;
+					device->dirty = true;
+				}
 			}
 		}
 		// else:
 		// Device in database but not known to Pi-hole: No action required
 
-		unlock_shm();
-
 		// Count number of processed ARP cache entries
 		entries++;
 	}
 
+	unlock_shm();
+
 	// Actually update the database
-	dbquery("COMMIT");
+	int changed = 0;
+	if(ifaces != NULL)
+	{
+		if(dbopen())
+		{
+			changed = flush_network_mirror(dbhandle(), ifaces, ifacessize);
+			dbclose();
+		}
+		else
+			network.loaded = false;
+
+		for(int i = 0; i < ifacessize; i++)
+			if(ifaces[i] != NULL)
+				free(ifaces[i]);
+		free(ifaces);
+	}
+	else
+		network.loaded = false;
+
+	// If writing failed, the mirror is reloaded from the database next
+	// time. Give the queries taken from the clients back so they are
+	// counted again then
+	if(!network.loaded)
+	{
+		lock_shm();
+		for(int i = 0; i < network.count; i++)
+		{
+			const networkDevice *device = &network.devices[i];
+			if(device->numQueriesARP == 0)
+				continue;
+			validate_access("clients", device->clientID, true, __LINE__, __FUNCTION__, __FILE__);
+			clients[device->clientID].numQueriesARP += device->numQueriesARP;
+		}
+		unlock_shm();
+	}
+	for(int i = 0; i < network.count; i++)
+		network.devices[i].numQueriesARP = 0;
 
 	// Debug logging
-	if(config.debug & DEBUG_ARP) logg("ARP table processing (%i entries) took %.1f ms", entries, timer_elapsed_msec(ARP_TIMER));
+	if(config.debug & DEBUG_ARP) logg("ARP table processing (%i entries, %i changed) took %.1f ms", entries, changed, timer_elapsed_msec(ARP_TIMER));
+
+	if(linebuffer != NULL)
+		free(linebuffer);
 
 	// Close file handle
 	fclose(arpfp);
-
-	// Close database connection
-	dbclose();
 }
 
-static char* getMACVendor(const char* hwaddr)
-{
+// The OUI prefixes of macvendor.db are kept in memory, sorted by prefix
+// length and prefix. Besides the usual 24 bit OUIs this covers the longer
+// MA-M (28 bit) and MA-S (36 bit) assignments. The table is reloaded when
+// the file changes. Used by the database and the socket threads
+typedef struct {
+	unsigned long long key; // Prefix length in nibbles << 48 | prefix
+	unsigned int vendor; // Offset into oui.vendors
+} ouiEntry;
+
+static struct {
+	ouiEntry *entries;
+	unsigned int count;
+	char *vendors;
+	unsigned int vendorsize;
+	unsigned int lengths; // Bit n set if there are prefixes of n nibbles
 	struct stat st;
-	if(stat(FTLfiles.macvendordb, &st) != 0)
+} oui = { NULL, 0, NULL, 0, 0, { 0 } };
+static pthread_mutex_t ouilock = PTHREAD_MUTEX_INITIALIZER;
+
+// Parse the leading hex digits of a MAC address (any separators) into a
+// prefix of at most 12 nibbles. A trailing "/bits" limits the prefix length
+static bool parse_mac_prefix(const char *mac, unsigned long long *prefix, int *nibbles)
+{
+	*prefix = 0;
+	*nibbles = 0;
+	const char *c;
+	for(c = mac; *c != '\0' && *c != '/'; c++)
 	{
-		// File does not exist
-		if(config.debug & DEBUG_ARP) logg("getMACVenor(%s): %s does not exist", hwaddr, FTLfiles.macvendordb);
-		return strdup("");
+		if(!isxdigit((unsigned char)*c))
+			continue;
+		if(*nibbles == 12)
+			return false;
+		const int digit = isdigit((unsigned char)*c) ? *c - '0' : tolower((unsigned char)*c) - 'a' + 10;
+		*prefix = (*prefix << 4) | digit;
+		(*nibbles)++;
 	}
-	else if(strlen(hwaddr) != 17)
+
+	if(*c == '/')
 	{
-		// MAC address is incomplete
-		if(config.debug & DEBUG_ARP) logg("getMACVenor(%s): MAC invalid (length %zu)", hwaddr, strlen(hwaddr));
-		return strdup("");
+		const int bits = atoi(c + 1);
+		if(bits <= 0 || bits % 4 != 0 || bits/4 > *nibbles)
+			return false;
+		*prefix >>= 4*(*nibbles - bits/4);
+		*nibbles = bits/4;
 	}
 
+	return *nibbles > 0;
+}
+
+static int ouicmp(const void *a, const void *b)
+{
+	const ouiEntry *x = a, *y = b;
+	if(x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	// Keep the first vendor given for a prefix
+	return x->vendor < y->vendor ? -1 : x->vendor > y->vendor;
+}
+
+static void free_oui(void)
+{
+	if(oui.entries != NULL)
+		free(oui.entries);
+	if(oui.vendors != NULL)
+		free(oui.vendors);
+	oui.entries = NULL;
+	oui.vendors = NULL;
+	oui.count = oui.vendorsize = 0;
+	oui.lengths = 0;
+}
+
+static void load_oui(const struct stat *st)
+{
+	free_oui();
+	oui.st = *st;
+
 	sqlite3 *macdb;
 	int rc = sqlite3_open_v2(FTLfiles.macvendordb, &macdb, SQLITE_OPEN_READONLY, NULL);
 	if( rc ){
-		logg("getMACVendor(%s) - SQL error (%i): %s", hwaddr, rc, sqlite3_errmsg(macdb));
+		logg("load_oui() - SQL error (%i): %s", rc, sqlite3_errmsg(macdb));
 		sqlite3_close(macdb);
-		return strdup("");
-	}
-
-	char *querystr = NULL;
-	// Only keep "XX:YY:ZZ" (8 characters)
-	char * hwaddrshort = strdup(hwaddr);
-	hwaddrshort[8] = '\0';
-	rc = asprintf(&querystr, "SELECT vendor FROM macvendor WHERE mac LIKE \'%s\';", hwaddrshort);
-	if(rc < 1)
-	{
-		logg("getMACVendor(%s) - Allocation error (%i)", hwaddr, rc);
-		sqlite3_close(macdb);
-		return strdup("");
+		return;
 	}
-	free(hwaddrshort);
 
 	sqlite3_stmt* stmt;
-	rc = sqlite3_prepare_v2(macdb, querystr, -1, &stmt, NULL);
+	rc = sqlite3_prepare_v2(macdb, "SELECT mac,vendor FROM macvendor;", -1, &stmt, NULL);
 	if( rc ){
-		logg("getMACVendor(%s) - SQL error prepare (%s, %i): %s", hwaddr, querystr, rc, sqlite3_errmsg(macdb));
+		logg("load_oui() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(macdb));
 		sqlite3_close(macdb);
-		return strdup("");
+		return;
 	}
-	free(querystr);
 
-	char *vendor = NULL;
-	rc = sqlite3_step(stmt);
-	if(rc == SQLITE_ROW)
+	unsigned int size = 0, poolsize = 0;
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
 	{
-		vendor = strdup((char*)sqlite3_column_text(stmt, 0));
+		const char *mac = (const char*)sqlite3_column_text(stmt, 0);
+		const char *vendor = (const char*)sqlite3_column_text(stmt, 1);
+		unsigned long long prefix;
+		int nibbles;
+		if(mac == NULL || vendor == NULL || !parse_mac_prefix(mac, &prefix, &nibbles))
+			continue;
+
+		const unsigned int len = strlen(vendor) + 1;
+		if(oui.count == size || oui.vendorsize + len > poolsize)
+		{
+			size = oui.count == size ? (size > 0 ? 2*size : 1024) : size;
+			while(oui.vendorsize + len > poolsize)
+				poolsize = poolsize > 0 ? 2*poolsize : 65536;
+			ouiEntry *entries = realloc(oui.entries, size*sizeof(ouiEntry));
+			if(entries != NULL)
+				oui.entries = entries;
+			char *vendors = realloc(oui.vendors, poolsize);
+			if(vendors != NULL)
+				oui.vendors = vendors;
+			if(entries == NULL || vendors == NULL)
+				break;
+		}
+
+		oui.entries[oui.count].key = (unsigned long long)nibbles << 48 | prefix;
+		oui.entries[oui.count].vendor = oui.vendorsize;
+		memcpy(&oui.vendors[oui.vendorsize], vendor, len);
+		oui.vendorsize += len;
+		oui.lengths |= 1U << nibbles;
+		oui.count++;
 	}
-	else
+	if(rc != SQLITE_DONE)
+		logg("load_oui() - SQL error step (%i): %s", rc, sqlite3_errmsg(macdb));
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(macdb);
+
+	if(oui.count > 0)
+		qsort(oui.entries, oui.count, sizeof(ouiEntry), ouicmp);
+
+	if(config.debug & DEBUG_ARP)
+		logg("Loaded %u MAC vendor prefixes from %s", oui.count, FTLfiles.macvendordb);
+}
+
+// Returns the vendor with the longest matching prefix, or "" if unknown.
+// Needs ouilock
+static const char * __attribute__((pure)) find_oui(const unsigned long long mac)
+{
+	for(int nibbles = 12; nibbles > 0; nibbles--)
 	{
-		// Not found
-		vendor = strdup("");
+		if(!(oui.lengths & (1U << nibbles)))
+			continue;
+
+		const unsigned long long key = (unsigned long long)nibbles << 48 | mac >> 4*(12 - nibbles);
+		unsigned int lo = 0, hi = oui.count;
+		while(lo < hi)
+		{
+			const unsigned int mid = lo + (hi - lo)/2;
+			if(oui.entries[mid].key < key)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if(lo < oui.count && oui.entries[lo].key == key)
+			return &oui.vendors[oui.entries[lo].vendor];
 	}
 
-	if(rc != SQLITE_DONE && rc != SQLITE_ROW)
+	return "";
+}
+
+// Make sure the in-memory copy of macvendor.db is up to date. Returns false
+// if the file does not exist. Needs ouilock
+static bool refresh_oui(void)
+{
+	struct stat st;
+	if(stat(FTLfiles.macvendordb, &st) != 0)
 	{
-		// Error
-		logg("getMACVendor(%s) - SQL error step (%i): %s", hwaddr, rc, sqlite3_errmsg(macdb));
+		free_oui();
+		memset(&oui.st, 0, sizeof(oui.st));
+		return false;
 	}
 
-	sqlite3_finalize(stmt);
-	sqlite3_close(macdb);
+	if(st.st_ino != oui.st.st_ino || st.st_size != oui.st.st_size ||
+	   st.st_mtime != oui.st.st_mtime)
+		load_oui(&st);
+
+	return true;
+}
+
+static char* getMACVendor(const char* hwaddr)
+{
+	pthread_mutex_lock(&ouilock);
+	if(!refresh_oui())
+	{
+		// File does not exist
+		pthread_mutex_unlock(&ouilock);
+		if(config.debug & DEBUG_ARP) logg("getMACVenor(%s): %s does not exist", hwaddr, FTLfiles.macvendordb);
+		return strdup("");
+	}
+
+	unsigned long long mac;
+	int nibbles;
+	if(strlen(hwaddr) != 17 || !parse_mac_prefix(hwaddr, &mac, &nibbles) || nibbles != 12)
+	{
+		// MAC address is incomplete
+		pthread_mutex_unlock(&ouilock);
+		if(config.debug & DEBUG_ARP) logg("getMACVenor(%s): MAC invalid (length %zu)", hwaddr, strlen(hwaddr));
+		return strdup("");
+	}
+
+	char *vendor = strdup(find_oui(mac));
+	pthread_mutex_unlock(&ouilock);
 
 	return vendor;
 }
@@ -284,7 +705,7 @@ void updateMACVendorRecords()
 	}
 
 	sqlite3_stmt* stmt;
-	const char* selectstr = "SELECT id,hwaddr FROM network;";
+	const char* selectstr = "SELECT id,hwaddr,macVendor FROM network;";
 	rc = sqlite3_prepare_v2(db, selectstr, -1, &stmt, NULL);
 	if( rc ){
 		logg("updateMACVendorRecords() - SQL error prepare (%s, %i): %s", selectstr, rc, sqlite3_errmsg(db));
@@ -292,46 +713,77 @@ void updateMACVendorRecords()
 		return;
 	}
 
+	// Collect the rows whose vendor changed
+	int *ids = NULL;
+	char **vendors = NULL;
+	int changed = 0, size = 0;
 	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
 	{
-		const int id = sqlite3_column_int(stmt, 0);
-		char* hwaddr = strdup((char*)sqlite3_column_text(stmt, 1));
+		const char *hwaddr = (const char*)sqlite3_column_text(stmt, 1);
+		const char *oldvendor = (const char*)sqlite3_column_text(stmt, 2);
 
 		// Get vendor for MAC
-		char* vendor = getMACVendor(hwaddr);
-		free(hwaddr);
-		hwaddr = NULL;
-
-		// Prepare UPDATE statement
-		char *updatestr = NULL;
-		if(asprintf(&updatestr, "UPDATE network SET macVendor = \'%s\' WHERE id = %i", vendor, id) < 1)
+		char* vendor = getMACVendor(hwaddr != NULL ? hwaddr : "");
+		if(vendor == NULL)
+			break;
+		if(oldvendor != NULL && strcmp(vendor, oldvendor) == 0)
 		{
-			logg("updateMACVendorRecords() - Allocation error 2");
 			free(vendor);
-			break;
+			continue;
 		}
 
-		// Execute prepared statement
-		char *zErrMsg = NULL;
-		rc = sqlite3_exec(db, updatestr, NULL, NULL, &zErrMsg);
-		if( rc != SQLITE_OK ){
-			logg("updateMACVendorRecords() - SQL exec error: %s (%i): %s", updatestr, rc, zErrMsg);
-			sqlite3_free(zErrMsg);
-			free(updatestr);
-			free(vendor);
-			break;
+		if(changed == size)
+		{
+			size = size > 0 ? 2*size : 64;
+			int *grownids = realloc(ids, size*sizeof(int));
+			if(grownids != NULL)
+				ids = grownids;
+			char **grownvendors = realloc(vendors, size*sizeof(char*));
+			if(grownvendors != NULL)
+				vendors = grownvendors;
+			if(grownids == NULL || grownvendors == NULL)
+			{
+				logg("updateMACVendorRecords() - Allocation error");
+				free(vendor);
+				break;
+			}
 		}
-
-		// Free allocated memory
-		free(updatestr);
-		free(vendor);
+		ids[changed] = sqlite3_column_int(stmt, 0);
+		vendors[changed++] = vendor;
 	}
 	if(rc != SQLITE_DONE)
 	{
 		// Error
 		logg("updateMACVendorRecords() - SQL error step (%i): %s", rc, sqlite3_errmsg(db));
 	}
-
 	sqlite3_finalize(stmt);
+
+	// Store them in a single transaction
+	if(changed > 0 && sqlite3_prepare_v2(db, "UPDATE network SET macVendor = ? WHERE id = ?;", -1, &stmt, NULL) == SQLITE_OK)
+	{
+		sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+		for(int i = 0; i < changed; i++)
+		{
+			sqlite3_bind_text(stmt, 1, vendors[i], -1, SQLITE_STATIC);
+			sqlite3_bind_int(stmt, 2, ids[i]);
+			if((rc = sqlite3_step(stmt)) != SQLITE_DONE)
+				logg("updateMACVendorRecords() - SQL error step (%i): %s", rc, sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
+		}
+		rc = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+		if( rc )
+			logg("updateMACVendorRecords() - SQL error commit (%i): %s", rc, sqlite3_errmsg(db));
+		sqlite3_finalize(stmt);
+	}
+
+	for(int i = 0; i < changed; i++)
+		free(vendors[i]);
+	if(ids != NULL)
+		free(ids);
+	if(vendors != NULL)
+		free(vendors);
+
+	if(config.debug & DEBUG_ARP) logg("updateMACVendorRecords(): updated %i devices", changed);
+
 	sqlite3_close(db);
 }
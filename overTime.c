@@ -9,6 +9,24 @@
 *  Please see LICENSE file for your rights under this license. */
 
 #include "FTL.h"
+#include "shmem.h"
+#include "overTime.h"
+
+#define ROLLUP_HOURLY_SLOTS (30*24)
+#define ROLLUP_DAILY_SLOTS 366
+
+static rollupDataStruct rollup_hourly[ROLLUP_HOURLY_SLOTS];
+static rollupDataStruct rollup_daily[ROLLUP_DAILY_SLOTS];
+
+// Filled by garbage collection with the queries leaving overTime, so
+// they are only changed while the shared memory is locked and moved
+rollupTier rollups[ROLLUP_TIERS] = {
+	{ .interval = 3600, .slots = ROLLUP_HOURLY_SLOTS, .data = rollup_hourly },
+	{ .interval = 86400, .slots = ROLLUP_DAILY_SLOTS, .data = rollup_daily },
+};
+
+// Timestamp of the newest query counted in the rollups
+time_t rollup_until = 0;
 
 /**
  * Initialize the overTime slot
@@ -33,9 +51,7 @@ static void initSlot(unsigned int index, time_t timestamp)
 	for(unsigned int queryType = 0; queryType < TYPE_MAX-1; queryType++)
 		overTime[index].querytypedata[queryType] = 0;
 
-	// Zero overTime counter for all known clients
-	for(int clientID = 0; clientID < counters->clients; clientID++)
-		clients[clientID].overTime[index] = 0;
+	// Clients only store the slots they were active in, nothing to zero here
 }
 
 void initOverTime(void)
@@ -92,6 +108,200 @@ unsigned int getOverTimeID(time_t timestamp)
 	return (unsigned int) id;
 }
 
+// Absolute number of an overTime slot, it does not change when the slots are moved
+static unsigned int __attribute__((pure)) overTimeSlot(unsigned int timeidx)
+{
+	return (unsigned int)(overTime[timeidx].timestamp / OVERTIME_INTERVAL);
+}
+
+static int new_client_overTime_chunk(void)
+{
+	int chunk = counters->clientOverTime_free;
+	if(chunk == 0)
+	{
+		memory_check(CLIENTOVERTIME);
+		chunk = counters->clientOverTime++;
+		clientOverTime[chunk].next = 0;
+		clientOverTime[chunk].count = 0;
+		return chunk;
+	}
+
+	// Re-use a chunk released when moving the overTime slots. Listings
+	// which may still hold it have to start over
+	move_shm_begin();
+	counters->clientOverTime_free = clientOverTime[chunk].next;
+	clientOverTime[chunk].next = 0;
+	clientOverTime[chunk].count = 0;
+	move_shm_end();
+	return chunk;
+}
+
+static void append_client_overTime(int clientID, const unsigned int slot, const int amount)
+{
+	int last = clients[clientID].lastovertime;
+	if(last == 0 || clientOverTime[last].count >= CLIENT_OVERTIME_PER_CHUNK)
+	{
+		const int chunk = new_client_overTime_chunk();
+		// Link the initialized chunk for readers without the lock
+		if(last == 0)
+			__atomic_store_n(&clients[clientID].firstovertime, chunk, __ATOMIC_RELEASE);
+		else
+			__atomic_store_n(&clientOverTime[last].next, chunk, __ATOMIC_RELEASE);
+		clients[clientID].lastovertime = last = chunk;
+	}
+
+	clientOverTimeDataStruct *chunk = &clientOverTime[last];
+	chunk->slot[chunk->count] = slot;
+	chunk->queries[chunk->count] = amount;
+	// Readers without the lock see the new count only after the entry
+	__atomic_store_n(&chunk->count, chunk->count + 1, __ATOMIC_RELEASE);
+}
+
+// Insert a slot in front of position pos of a chunk, splitting the chunk if it is full
+static void insert_client_overTime(int clientID, int chunk, int pos, const unsigned int slot, const int amount)
+{
+	// If entries are moved around, readers without the lock have to
+	// retry. Filling a free place at the end of a chunk moves nothing
+	const bool moving = clientOverTime[chunk].count >= CLIENT_OVERTIME_PER_CHUNK ||
+	                    pos < clientOverTime[chunk].count;
+	if(moving)
+		move_shm_begin();
+
+	if(clientOverTime[chunk].count >= CLIENT_OVERTIME_PER_CHUNK)
+	{
+		const int split = new_client_overTime_chunk();
+		clientOverTimeDataStruct *c = &clientOverTime[chunk];
+		clientOverTimeDataStruct *s = &clientOverTime[split];
+		const int half = CLIENT_OVERTIME_PER_CHUNK / 2;
+
+		// Move the upper half of the entries into the new chunk
+		s->count = c->count - half;
+		memcpy(s->slot, &c->slot[half], s->count*sizeof(*s->slot));
+		memcpy(s->queries, &c->queries[half], s->count*sizeof(*s->queries));
+		c->count = half;
+		s->next = c->next;
+		c->next = split;
+		if(clients[clientID].lastovertime == chunk)
+			clients[clientID].lastovertime = split;
+
+		if(pos > half)
+		{
+			chunk = split;
+			pos -= half;
+		}
+	}
+
+	clientOverTimeDataStruct *c = &clientOverTime[chunk];
+	memmove(&c->slot[pos+1], &c->slot[pos], (c->count-pos)*sizeof(*c->slot));
+	memmove(&c->queries[pos+1], &c->queries[pos], (c->count-pos)*sizeof(*c->queries));
+	c->slot[pos] = slot;
+	c->queries[pos] = amount;
+	c->count++;
+
+	if(moving)
+		move_shm_end();
+}
+
+/**
+ * Add to the number of queries of a client in an overTime slot
+ *
+ * @param clientID The client
+ * @param timeidx The overTime slot index
+ * @param amount The number of queries to add (negative to remove queries)
+ */
+void add_client_overTime(int clientID, unsigned int timeidx, int amount)
+{
+	const unsigned int slot = overTimeSlot(timeidx);
+
+	// Queries arrive in order, so usually the newest slot of the client is
+	// either the one to update or older than the one to add
+	const int last = clients[clientID].lastovertime;
+	if(last == 0 || clientOverTime[last].slot[clientOverTime[last].count-1] < slot)
+	{
+		if(amount > 0)
+			append_client_overTime(clientID, slot, amount);
+		return;
+	}
+
+	// Find the chunk holding this slot (or the next later one)
+	int chunk = clients[clientID].firstovertime, prev = 0;
+	while(clientOverTime[chunk].slot[clientOverTime[chunk].count-1] < slot)
+	{
+		prev = chunk;
+		chunk = clientOverTime[chunk].next;
+	}
+
+	clientOverTimeDataStruct *c = &clientOverTime[chunk];
+	int pos = 0;
+	while(c->slot[pos] < slot)
+		pos++;
+
+	if(c->slot[pos] == slot)
+		c->queries[pos] += amount;
+	else if(amount > 0)
+	{
+		// A slot between two chunks goes to the end of the earlier
+		// one if there is room, so nothing has to be moved
+		if(pos == 0 && prev != 0 && clientOverTime[prev].count < CLIENT_OVERTIME_PER_CHUNK)
+			insert_client_overTime(clientID, prev, clientOverTime[prev].count, slot, amount);
+		else
+			insert_client_overTime(clientID, chunk, pos, slot, amount);
+	}
+}
+
+/**
+ * Get the number of queries of a client in an overTime slot. Slots have to be
+ * requested in ascending order, chunk and pos have to be initialized with the
+ * first chunk of the client's list and zero, respectively
+ *
+ * @param chunk Current chunk of the client's list
+ * @param pos Current position within this chunk
+ * @param timeidx The overTime slot index
+ */
+int get_client_overTime(int *chunk, int *pos, unsigned int timeidx)
+{
+	const unsigned int slot = overTimeSlot(timeidx);
+	while(*chunk > 0 && *chunk < counters->clientOverTime)
+	{
+		const clientOverTimeDataStruct *c = &clientOverTime[*chunk];
+		int count = __atomic_load_n(&c->count, __ATOMIC_ACQUIRE);
+		if(count > CLIENT_OVERTIME_PER_CHUNK)
+			count = CLIENT_OVERTIME_PER_CHUNK;
+
+		while(*pos < count && c->slot[*pos] < slot)
+			(*pos)++;
+
+		if(*pos < count)
+			return c->slot[*pos] == slot ? c->queries[*pos] : 0;
+
+		*chunk = __atomic_load_n(&c->next, __ATOMIC_ACQUIRE);
+		*pos = 0;
+	}
+	return 0;
+}
+
+// Release list chunks only holding slots which are no longer covered by overTime
+static void gc_client_overTime(const unsigned int firstslot)
+{
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		int *first = &clients[clientID].firstovertime;
+		while(*first != 0)
+		{
+			clientOverTimeDataStruct *chunk = &clientOverTime[*first];
+			if(chunk->slot[chunk->count-1] >= firstslot)
+				break;
+
+			const int next = chunk->next;
+			chunk->next = counters->clientOverTime_free;
+			counters->clientOverTime_free = *first;
+			*first = next;
+		}
+		if(*first == 0)
+			clients[clientID].lastovertime = 0;
+	}
+}
+
 // This routine is called by garbage collection to rearrange the overTime structure for the next hour
 void moveOverTimeMemory(time_t mintime)
 {
@@ -138,11 +348,9 @@ void moveOverTimeMemory(time_t mintime)
 			}
 		}
 
-		// Move client-specific overTime memory
-		for(int clientID = 0; clientID < counters->clients; clientID++)
-		{
-			memmove(&clients[clientID].overTime[0], &clients[clientID].overTime[moveOverTime], remainingSlots*sizeof(int));
-		}
+		// Client-specific overTime data is indexed by absolute slot numbers
+		// and doesn't need to be moved, only expired chunks are released
+		gc_client_overTime(overTimeSlot(0));
 
 		// Iterate over new overTime region and initialize it
 		for(unsigned int timeidx = remainingSlots; timeidx < OVERTIME_SLOTS ; timeidx++)
@@ -153,3 +361,98 @@ void moveOverTimeMemory(time_t mintime)
 		}
 	}
 }
+
+rollupTier * __attribute__((pure)) get_rollup_tier(int resolution)
+{
+	if(resolution <= OVERTIME_INTERVAL)
+		return NULL;
+
+	for(int i = 0; i < ROLLUP_TIERS; i++)
+		if(rollups[i].interval >= resolution)
+			return &rollups[i];
+
+	// Nothing coarser available
+	return &rollups[ROLLUP_TIERS-1];
+}
+
+rollupDataStruct *get_rollup(rollupTier *tier, time_t timestamp, bool create)
+{
+	const time_t center = timestamp - timestamp % tier->interval + tier->interval / 2;
+	rollupDataStruct *r = &tier->data[(timestamp / tier->interval) % tier->slots];
+
+	if(r->timestamp == center)
+		return r;
+	// Unused, or an interval which has already been replaced by a newer one
+	if(!create || r->timestamp > center)
+		return NULL;
+
+	r->timestamp = center;
+	r->total = 0;
+	r->blocked = 0;
+	r->ipv4 = 0;
+	r->ipv6 = 0;
+	return r;
+}
+
+bool get_rollup_sum(rollupTier *tier, time_t timestamp, rollupDataStruct *sum)
+{
+	const time_t start = timestamp - timestamp % tier->interval;
+	bool found = false;
+
+	const rollupDataStruct *r = get_rollup(tier, start, false);
+	if(r != NULL)
+	{
+		*sum = *r;
+		found = true;
+	}
+	else
+	{
+		sum->timestamp = start + tier->interval / 2;
+		sum->total = sum->blocked = sum->ipv4 = sum->ipv6 = 0;
+	}
+
+	// Add the slots of this interval still covered by overTime
+	const time_t first = overTime[0].timestamp - OVERTIME_INTERVAL / 2;
+	int timeidx = start > first ? (int)((start - first) / OVERTIME_INTERVAL) : 0;
+	for(; timeidx < OVERTIME_SLOTS && overTime[timeidx].timestamp < start + tier->interval; timeidx++)
+	{
+		const overTimeDataStruct *slot = &overTime[timeidx];
+		if(slot->total <= 0)
+			continue;
+
+		sum->total += slot->total;
+		sum->blocked += slot->blocked;
+		sum->ipv4 += slot->querytypedata[TYPE_A-1];
+		sum->ipv6 += slot->querytypedata[TYPE_AAAA-1];
+		found = true;
+	}
+
+	return found;
+}
+
+void rollup_add(time_t timestamp, int total, int blocked, int ipv4, int ipv6)
+{
+	for(int i = 0; i < ROLLUP_TIERS; i++)
+	{
+		rollupTier *tier = &rollups[i];
+		rollupDataStruct *r = get_rollup(tier, timestamp, true);
+		if(r == NULL)
+			continue;
+
+		r->total += total;
+		r->blocked += blocked;
+		r->ipv4 += ipv4;
+		r->ipv6 += ipv6;
+
+		// Remember to save this interval to the database
+		if(tier->dirty_from == 0 || r->timestamp < tier->dirty_from)
+			tier->dirty_from = r->timestamp;
+		if(r->timestamp > tier->dirty_until)
+			tier->dirty_until = r->timestamp;
+	}
+}
+
+void rollup_query(time_t timestamp, int type, bool blocked)
+{
+	rollup_add(timestamp, 1, blocked ? 1 : 0, type == TYPE_A ? 1 : 0, type == TYPE_AAAA ? 1 : 0);
+}
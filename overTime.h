@@ -0,0 +1,63 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2019 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  overTime rollups header
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#ifndef OVERTIME_H
+#define OVERTIME_H
+
+/// Coarser tiers kept beyond the 24 hours covered by overTime itself:
+/// hourly intervals for 30 days and daily intervals for a year
+#define ROLLUP_TIERS 2
+
+typedef struct {
+	time_t timestamp; // center of the interval
+	int total;
+	int blocked;
+	int ipv4;
+	int ipv6;
+} rollupDataStruct;
+
+typedef struct {
+	int interval;
+	int slots;
+	/// Intervals changed since they were last saved to the database
+	time_t dirty_from;
+	time_t dirty_until;
+	/// Ring indexed by (timestamp / interval) % slots
+	rollupDataStruct *data;
+} rollupTier;
+
+extern rollupTier rollups[ROLLUP_TIERS];
+/// Timestamp of the newest query counted in the rollups, newer
+/// ones are still counted in overTime
+extern time_t rollup_until;
+
+/// Find the finest tier with an interval of at least resolution seconds
+///
+/// \return NULL if overTime itself is fine enough
+rollupTier *get_rollup_tier(int resolution);
+
+/// Get the interval of a tier containing timestamp
+///
+/// \param create start the interval if it has no data yet
+/// \return NULL if the interval has no data or is no longer covered by the tier
+rollupDataStruct *get_rollup(rollupTier *tier, time_t timestamp, bool create);
+
+/// Sum up an interval of a tier and the overTime slots still covering it
+///
+/// \return false if there is no data for this interval
+bool get_rollup_sum(rollupTier *tier, time_t timestamp, rollupDataStruct *sum);
+
+/// Add queries to the interval containing timestamp in all tiers
+void rollup_add(time_t timestamp, int total, int blocked, int ipv4, int ipv6);
+
+/// Count a query removed from overTime in all tiers
+void rollup_query(time_t timestamp, int type, bool blocked);
+
+#endif //OVERTIME_H
@@ -9,6 +9,7 @@
 *  Please see LICENSE file for your rights under this license. */
 
 #include "FTL.h"
+#include "hash.h"
 #include <regex.h>
 
 static int num_regex;
@@ -47,6 +48,179 @@ static bool init_regex(const char *regexin, int index)
 	return true;
 }
 
+// Pure suffix rules are not run through regexec() but kept in a hash set
+// of domains. They come from wildcard.list (one domain per line, blocking
+// the domain and all its subdomains) and from regex.list lines of the forms
+//   (^|\.)example\.com$   the domain and its subdomains
+//   \.example\.com$       only the subdomains
+//   ^example\.com$        only the domain itself
+// A query is checked by looking up each of its suffixes starting at a
+// label boundary, i.e., once per label
+#define WILDCARD_EXACT 1
+#define WILDCARD_SUBDOMAINS 2
+typedef struct {
+	hashKey domain;
+	unsigned char match;
+	int line; // line in regex.list, 0 = wildcard.list
+} wildcardEntry;
+
+static hashSet wildcards = HASH_SET(wildcardEntry, NULL, NULL);
+
+static void add_wildcard(const char *domain, const unsigned char match, const int line)
+{
+	bool added;
+	wildcardEntry *entry = hash_set_insert(&wildcards, domain, &added);
+	if(entry == NULL)
+		return;
+
+	// Several rules for the same domain
+	entry->match |= match;
+	if(added)
+		entry->line = line;
+}
+
+static const wildcardEntry * __attribute__((pure)) match_wildcard(const char *domain)
+{
+	for(const char *suffix = domain; suffix != NULL; suffix = strchr(suffix, '.'))
+	{
+		if(suffix != domain)
+			suffix++;
+
+		const wildcardEntry *entry = hash_set_find(&wildcards, suffix);
+		if(entry != NULL && (entry->match & (suffix == domain ? WILDCARD_EXACT : WILDCARD_SUBDOMAINS)))
+			return entry;
+	}
+	return NULL;
+}
+
+// Non-empty labels of letters, digits, hyphens and underscores separated by dots
+static bool __attribute__((pure)) valid_domain(const char *domain)
+{
+	size_t label = 0;
+	for(const char *c = domain; *c != '\0'; c++)
+	{
+		if(*c == '.')
+		{
+			// No empty labels
+			if(label == 0)
+				return false;
+			label = 0;
+		}
+		else if(isalnum((unsigned char)*c) || *c == '-' || *c == '_')
+			label++;
+		else
+			return false;
+	}
+	return label > 0;
+}
+
+// Returns the domain if the regex is a pure suffix rule (see above) and
+// stores which names it matches, NULL otherwise
+static char *suffix_rule(const char *regexin, unsigned char *match)
+{
+	const char *c = regexin;
+	if(strncmp(c, "(^|\\.)", 6) == 0 || strncmp(c, "(\\.|^)", 6) == 0)
+	{
+		*match = WILDCARD_EXACT | WILDCARD_SUBDOMAINS;
+		c += 6;
+	}
+	else if(strncmp(c, "\\.", 2) == 0)
+	{
+		*match = WILDCARD_SUBDOMAINS;
+		c += 2;
+	}
+	else if(*c == '^')
+	{
+		*match = WILDCARD_EXACT;
+		c++;
+	}
+	else
+		return NULL;
+
+	// The rest has to be labels of literal characters separated by
+	// escaped dots, anchored at the end
+	const size_t len = strlen(c);
+	if(len < 2 || c[len-1] != '$')
+		return NULL;
+	char *domain = calloc(len, sizeof(char));
+	if(domain == NULL)
+		return NULL;
+
+	size_t n = 0;
+	for(; *c != '$'; c++)
+	{
+		if(c[0] == '\\' && c[1] == '.')
+		{
+			domain[n++] = '.';
+			c++;
+		}
+		else if(*c == '.' || *c == '\\')
+			break;
+		else
+			domain[n++] = *c;
+	}
+
+	if(c[0] != '$' || c[1] != '\0' || !valid_domain(domain))
+	{
+		free(domain);
+		return NULL;
+	}
+	return domain;
+}
+
+// Strip surrounding white space (including CRs of files edited on Windows)
+// and the dot of a fully qualified domain name from a line of wildcard.list
+static char *trim_wildcard(char *line)
+{
+	while(isspace((unsigned char)*line))
+		line++;
+	size_t len = strlen(line);
+	while(len > 0 && isspace((unsigned char)line[len-1]))
+		line[--len] = '\0';
+	if(len > 1 && line[len-1] == '.')
+		line[--len] = '\0';
+	return line;
+}
+
+static void read_wildcards_from_file(void)
+{
+	FILE *fp;
+	char *buffer = NULL;
+	size_t size = 0;
+
+	if((fp = fopen(files.wildcardlist, "r")) == NULL)
+		return;
+
+	// Each line is a domain to be blocked including all its subdomains
+	int line = 0;
+	while(getline(&buffer, &size, fp) != -1)
+	{
+		line++;
+		char *domain = trim_wildcard(buffer);
+
+		// Skip empty lines and comments
+		if(strlen(domain) < 1 || domain[0] == '#')
+			continue;
+
+		// Same domains as accepted for suffix rules in regex.list
+		if(!valid_domain(domain))
+		{
+			logg("Skipping invalid wildcard domain on line %i: \"%s\"", line, domain);
+			continue;
+		}
+
+		strtolower(domain);
+		add_wildcard(domain, WILDCARD_EXACT | WILDCARD_SUBDOMAINS, 0);
+	}
+
+	// Free allocated memory
+	if(buffer != NULL)
+		free(buffer);
+
+	// Close the file
+	fclose(fp);
+}
+
 bool __attribute__((pure)) in_whitelist(char *domain)
 {
 	bool found = false;
@@ -84,7 +258,24 @@ bool match_regex(char *input)
 
 	// Start matching timer
 	timer_start(REGEX_TIMER);
-	for(index = 0; index < num_regex; index++)
+
+	// Pure suffix rules need no regexec()
+	const wildcardEntry *wildcard = match_wildcard(input);
+	if(wildcard != NULL)
+	{
+		matched = true;
+
+		// Print match message when in regex debug mode
+		if(config.debug & DEBUG_REGEX)
+		{
+			if(wildcard->line > 0)
+				logg("Regex in line %i (suffix \"%s\") matches \"%s\"", wildcard->line, wildcard->domain.str, input);
+			else
+				logg("Wildcard \"%s\" matches \"%s\"", wildcard->domain.str, input);
+		}
+	}
+
+	for(index = 0; !matched && index < num_regex; index++)
 	{
 		// Only check regex which have been successfully compiled
 		if(!regexconfigured[index])
@@ -122,6 +313,19 @@ bool match_regex(char *input)
 
 void free_regex(void)
 {
+	// Free suffix rules and whitelisted domains also without any regex
+	hash_set_free(&wildcards);
+	free_whitelist_domains();
+
+	// Must reevaluate regex filters after having reread the regex filter
+	// We reset all regex status to unknown to have them being reevaluated
+	if(counters->domains > 0)
+		validate_access("domains", counters->domains-1, false, __LINE__, __FUNCTION__, __FILE__);
+	for(int i=0; i < counters->domains; i++)
+	{
+		domains[i].regexmatch = REGEX_UNKNOWN;
+	}
+
 	// Return early if we don't use any regex
 	if(regex == NULL)
 		return;
@@ -150,18 +354,6 @@ void free_regex(void)
 
 	// Reset counter for number of regex
 	num_regex = 0;
-
-	// Must reevaluate regex filters after having reread the regex filter
-	// We reset all regex status to unknown to have them being reevaluated
-	if(counters->domains > 0)
-		validate_access("domains", counters->domains-1, false, __LINE__, __FUNCTION__, __FILE__);
-	for(int i=0; i < counters->domains; i++)
-	{
-		domains[i].regexmatch = REGEX_UNKNOWN;
-	}
-
-	// Also free array of whitelisted domains
-	free_whitelist_domains();
 }
 
 static void read_whitelist_from_file(void)
@@ -221,17 +413,24 @@ void read_regex_from_file(void)
 	FILE *fp;
 	char *buffer = NULL;
 	size_t size = 0;
-	int errors = 0, skipped = 0;
+	int errors = 0, skipped = 0, suffixes = 0;
 
 	// Start timer for regex compilation analysis
 	timer_start(REGEX_TIMER);
 
+	// Read wildcard and whitelisted domains from file
+	read_wildcards_from_file();
+	const unsigned int wildcardlines = wildcards.count;
+	read_whitelist_from_file();
+
 	// Get number of lines in the regex file
 	num_regex = countlines(files.regexlist);
 
 	if(num_regex < 0)
 	{
 		logg("INFO: No Regex file found");
+		if(wildcardlines > 0)
+			logg("Read %u wildcard domains", wildcardlines);
 		return;
 	}
 
@@ -284,6 +483,18 @@ void read_regex_from_file(void)
 			continue;
 		}
 
+		// Pure suffix rules are matched without the regex engine
+		unsigned char match;
+		char *domain = suffix_rule(buffer, &match);
+		if(domain != NULL)
+		{
+			add_wildcard(domain, match, i+1);
+			free(domain);
+			regexconfigured[i] = false;
+			suffixes++;
+			continue;
+		}
+
 		// Compile this regex
 		regexconfigured[i] = init_regex(buffer, i);
 	}
@@ -298,8 +509,82 @@ void read_regex_from_file(void)
 	// Close the file
 	fclose(fp);
 
-	// Read whitelisted domains from file
-	read_whitelist_from_file();
+	logg("Compiled %i Regex filters (%i of them suffix rules), %u wildcard domains and %i whitelisted domains in %.1f msec (%i errors)", (num_regex-skipped), suffixes, wildcardlines, whitelist.count > 0 ? whitelist.count : 0, timer_elapsed_msec(REGEX_TIMER), errors);
+}
+
+// Match a single regular expression without any shortcut
+static bool regexec_matches(const char *regexin, const char *input)
+{
+	regex_t re;
+	if(regcomp(&re, regexin, REG_EXTENDED) != 0)
+		return false;
+	const bool matched = regexec(&re, input, 0, NULL, 0) == 0;
+	regfree(&re);
+	return matched;
+}
+
+// "pihole-FTL regex-test <domain>": Match a domain like FTL does and once
+// more with every line of regex.list and wildcard.list going through
+// regexec(). Returns whether both agree
+bool regex_test(const char *domain)
+{
+	char *input = strdup(domain);
+	if(input == NULL)
+		return false;
+	strtolower(input);
+
+	read_regex_from_file();
+	const bool matched = match_regex(input);
+
+	bool reference = false;
+	FILE *fp;
+	char *buffer = NULL;
+	size_t size = 0;
+	if((fp = fopen(files.regexlist, "r")) != NULL)
+	{
+		while(!reference && getline(&buffer, &size, fp) != -1)
+		{
+			if(buffer[strlen(buffer)-1] == '\n')
+				buffer[strlen(buffer)-1] = '\0';
+			if(strlen(buffer) > 0 && buffer[0] != '#')
+				reference = regexec_matches(buffer, input);
+		}
+		fclose(fp);
+	}
+
+	// Wildcard domains block themselves and all their subdomains
+	if((fp = fopen(files.wildcardlist, "r")) != NULL)
+	{
+		while(!reference && getline(&buffer, &size, fp) != -1)
+		{
+			const char *wildcard = trim_wildcard(buffer);
+			if(!valid_domain(wildcard))
+				continue;
+
+			char *regexin = calloc(2*strlen(wildcard) + 8, sizeof(char));
+			if(regexin == NULL)
+				break;
+			strcpy(regexin, "(^|\\.)");
+			size_t n = strlen(regexin);
+			for(const char *c = wildcard; *c != '\0'; c++)
+			{
+				if(*c == '.')
+					regexin[n++] = '\\';
+				regexin[n++] = (char)tolower((unsigned char)*c);
+			}
+			regexin[n] = '$';
+
+			reference = regexec_matches(regexin, input);
+			free(regexin);
+		}
+		fclose(fp);
+	}
+
+	printf("%s %s\n", matched ? "match" : "no-match", reference ? "match" : "no-match");
+
+	if(buffer != NULL)
+		free(buffer);
+	free(input);
 
-	logg("Compiled %i Regex filters and %i whitelisted domains in %.1f msec (%i errors)", (num_regex-skipped), whitelist.count > 0 ? whitelist.count : 0, timer_elapsed_msec(REGEX_TIMER), errors);
+	return matched == reference;
 }
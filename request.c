@@ -16,130 +16,157 @@ bool __attribute__((pure)) command(const char *client_message, const char* cmd)
 	return strstr(client_message, cmd) != NULL;
 }
 
-void process_request(const char *client_message, int *sock)
+// Number of attempts to answer a request without the lock before
+// falling back to locking the shared memory
+#define READ_ATTEMPTS 5
+
+// API threads serialize among each other, but not with the resolver
+static pthread_mutex_t api_lock = PTHREAD_MUTEX_INITIALIZER;
+
+enum { READ_NONE, READ_SNAPSHOT, READ_LISTING };
+
+// Requests only reading from the shared memory. Snapshots of the counters
+// have to be consistent with each other, listings tolerate rows being
+// updated while they are read but not rows being moved or removed
+static int __attribute__((pure)) read_type(const char *client_message)
 {
-	char EOT[2];
-	EOT[0] = 0x04;
-	EOT[1] = 0x00;
-	bool processed = false;
+	if(command(client_message, ">stats") ||
+	   command(client_message, ">querytypes") ||
+	   command(client_message, ">clientID"))
+		return READ_SNAPSHOT;
 
+	if(command(client_message, ">overTime") ||
+	   command(client_message, ">top-domains") ||
+	   command(client_message, ">top-ads") ||
+	   command(client_message, ">top-clients") ||
+	   command(client_message, ">forward-dest") ||
+	   command(client_message, ">forward-names") ||
+	   command(client_message, ">getallqueries") ||
+	   command(client_message, ">recentBlocked") ||
+	   command(client_message, ">QueryTypesoverTime") ||
+	   command(client_message, ">ClientsoverTime") ||
+	   command(client_message, ">client-names") ||
+	   command(client_message, ">unknown") ||
+	   command(client_message, ">domain"))
+		return READ_LISTING;
+
+	return READ_NONE;
+}
+
+static void read_request(const char *client_message, int *sock)
+{
 	if(command(client_message, ">stats"))
-	{
-		processed = true;
-		lock_shm();
 		getStats(sock);
-		unlock_shm();
-	}
 	else if(command(client_message, ">overTime"))
-	{
-		processed = true;
-		lock_shm();
-		getOverTime(sock);
-		unlock_shm();
-	}
+		getOverTime(client_message, sock);
 	else if(command(client_message, ">top-domains") || command(client_message, ">top-ads"))
-	{
-		processed = true;
-		lock_shm();
 		getTopDomains(client_message, sock);
-		unlock_shm();
-	}
 	else if(command(client_message, ">top-clients"))
-	{
-		processed = true;
-		lock_shm();
 		getTopClients(client_message, sock);
-		unlock_shm();
-	}
 	else if(command(client_message, ">forward-dest"))
-	{
-		processed = true;
-		lock_shm();
 		getForwardDestinations(client_message, sock);
-		unlock_shm();
-	}
 	else if(command(client_message, ">forward-names"))
-	{
-		processed = true;
-		lock_shm();
 		getForwardDestinations(">forward-dest unsorted", sock);
-		unlock_shm();
-	}
 	else if(command(client_message, ">querytypes"))
-	{
-		processed = true;
-		lock_shm();
 		getQueryTypes(sock);
-		unlock_shm();
-	}
 	else if(command(client_message, ">getallqueries"))
-	{
-		processed = true;
-		lock_shm();
 		getAllQueries(client_message, sock);
-		unlock_shm();
-	}
 	else if(command(client_message, ">recentBlocked"))
-	{
-		processed = true;
-		lock_shm();
 		getRecentBlocked(client_message, sock);
-		unlock_shm();
-	}
 	else if(command(client_message, ">clientID"))
-	{
-		processed = true;
-		lock_shm();
 		getClientID(sock);
-		unlock_shm();
-	}
 	else if(command(client_message, ">QueryTypesoverTime"))
+		getQueryTypesOverTime(client_message, sock);
+	else if(command(client_message, ">ClientsoverTime"))
+		getClientsOverTime(client_message, sock);
+	else if(command(client_message, ">client-names"))
+		getClientNames(sock);
+	else if(command(client_message, ">unknown"))
+		getUnknownQueries(sock);
+	else if(command(client_message, ">domain"))
+		getDomainDetails(client_message, sock);
+}
+
+// Answer a read-only request without holding the lock. The output is held
+// back until it is known that no conflicting write happened while reading
+static void process_read_request(const char *client_message, int *sock, const int type)
+{
+	pthread_mutex_lock(&api_lock);
+
+	for(int attempt = 0; attempt < READ_ATTEMPTS; attempt++)
 	{
-		processed = true;
-		lock_shm();
-		getQueryTypesOverTime(sock);
-		unlock_shm();
+		readSnapshot snapshot;
+		if(!read_begin(&snapshot))
+			break;
+
+		capture_output();
+		read_request(client_message, sock);
+		if(read_end(&snapshot, type == READ_LISTING))
+		{
+			flush_output(*sock);
+			pthread_mutex_unlock(&api_lock);
+			return;
+		}
+
+		// Data changed while reading, start over
+		discard_output();
+		sched_yield();
 	}
-	else if(command(client_message, ">version"))
+	flush_output(*sock);
+
+	// Too much going on or mappings about to move, read under the lock
+	lock_shm();
+	read_request(client_message, sock);
+	unlock_shm();
+
+	pthread_mutex_unlock(&api_lock);
+}
+
+void process_request(const char *client_message, int *sock)
+{
+	char EOT[2];
+	EOT[0] = 0x04;
+	EOT[1] = 0x00;
+	bool processed = false;
+
+	const int type = read_type(client_message);
+	if(type != READ_NONE)
 	{
 		processed = true;
-		// No lock required
-		getVersion(sock);
+		process_read_request(client_message, sock, type);
 	}
-	else if(command(client_message, ">dbstats"))
+	else if(command(client_message, ">stream"))
 	{
 		processed = true;
-		// No lock required. Access to the database
-		// is guaranteed to be atomic
-		getDBstats(sock);
+		// Locking is done internally, the stream only ends
+		// when the client sends something or disconnects
+		getQueryStream(client_message, sock);
 	}
-	else if(command(client_message, ">ClientsoverTime"))
+	else if(command(client_message, ">version"))
 	{
 		processed = true;
-		lock_shm();
-		getClientsOverTime(sock);
-		unlock_shm();
+		// No lock required
+		getVersion(sock);
 	}
-	else if(command(client_message, ">client-names"))
+	else if(command(client_message, ">lockstats"))
 	{
 		processed = true;
-		lock_shm();
-		getClientNames(sock);
-		unlock_shm();
+		// Locking is done internally, only while
+		// copying the statistics
+		getLockStats(sock);
 	}
-	else if(command(client_message, ">unknown"))
+	else if(command(client_message, ">timing"))
 	{
 		processed = true;
-		lock_shm();
-		getUnknownQueries(sock);
-		unlock_shm();
+		// No lock required, the counters are updated atomically
+		getHookTiming(client_message, sock);
 	}
-	else if(command(client_message, ">domain"))
+	else if(command(client_message, ">dbstats"))
 	{
 		processed = true;
-		lock_shm();
-		getDomainDetails(client_message, sock);
-		unlock_shm();
+		// No lock required. Access to the database
+		// is guaranteed to be atomic
+		getDBstats(sock);
 	}
 	else if(command(client_message, ">cacheinfo"))
 	{
@@ -155,8 +182,7 @@ void process_request(const char *client_message, int *sock)
 		// Important: Don't obtain a lock for this request
 		//            Locking will be done internally when needed
 		// onlynew=false -> reresolve all host names
-		resolveClients(false);
-		resolveForwardDestinations(false);
+		resolveNames(false);
 		logg("Done re-resolving host names");
 	}
 	else if(command(client_message, ">recompile-regex"))
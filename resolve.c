@@ -9,7 +9,41 @@
 *  Please see LICENSE file for your rights under this license. */
 
 #include "FTL.h"
+#include "hash.h"
 #include "shmem.h"
+#include <poll.h>
+
+// Maximum number of PTR queries waiting for a reply at the same time
+#define PTR_INFLIGHT 32
+// Time to wait for a reply before a PTR query is sent again [milliseconds]
+#define PTR_TIMEOUT 1000
+// Number of times a PTR query is sent before giving up
+#define PTR_TRIES 3
+// Host names which could not be looked up (timeouts, server failures)
+// are tried again after this time [seconds]
+#define PTR_RETRY 300
+// Large enough for any PTR query and for replies to queries without EDNS
+#define PTR_PACKETSIZE 1500
+
+// A client or upstream server host name to be looked up
+typedef struct {
+	bool client;
+	bool done;
+	bool found; // name is valid (may be empty if there is none)
+	unsigned short dnsid;
+	int ID;
+	int tries;
+	int ttl;
+	unsigned long long sent;
+	char *name;
+	char ip[INET6_ADDRSTRLEN];
+} ptrJob;
+
+// Names are kept until their TTL expires, indexed by client and upstream
+// server ID. Only used by resolveNames() which serializes itself
+static time_t *clientexpiry = NULL, *forwardexpiry = NULL;
+static int clientexpirysize = 0, forwardexpirysize = 0;
+static pthread_mutex_t resolvelock = PTHREAD_MUTEX_INITIALIZER;
 
 static char *resolveHostname(const char *addr)
 {
@@ -63,119 +97,557 @@ static char *resolveHostname(const char *addr)
 	return hostname;
 }
 
-// Resolve upstream destination host names
-static size_t resolveAndAddHostname(size_t ippos, size_t oldnamepos)
+static unsigned long long ptr_clock(void)
 {
-	// Get IP and host name strings. They are cloned in case shared memory is
-	// resized before the next lock
-	lock_shm();
-	char* ipaddr = strdup(getstr(ippos));
-	char* oldname = strdup(getstr(oldnamepos));
-	unlock_shm();
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
 
-	// Important: Don't hold a lock while resolving as the main thread
-	// (dnsmasq) needs to be operable during the call to resolveHostname()
-	char* newname = resolveHostname(ipaddr);
+static int add_label(unsigned char *buf, int len, const char *label)
+{
+	const size_t l = strlen(label);
+	buf[len++] = (unsigned char)l;
+	memcpy(&buf[len], label, l);
+	return len + (int)l;
+}
 
-	// Only store new newname if it is valid and differs from oldname
-	// We do not need to check for oldname == NULL as names are
-	// always initialized with an empty string at position 0
-	if(newname != NULL && strcmp(oldname, newname) != 0)
+// Build the PTR query for an IPv4 or IPv6 address, returns its length
+// or -1 if the address is invalid
+static int build_ptr_query(const char *ip, const unsigned short dnsid, unsigned char *buf)
+{
+	// Header: ID, recursion desired, one question
+	memset(buf, 0, 12);
+	buf[0] = dnsid >> 8;
+	buf[1] = dnsid & 0xff;
+	buf[2] = 0x01;
+	buf[5] = 1;
+	int len = 12;
+
+	char label[4];
+	struct in6_addr addr6;
+	struct in_addr addr4;
+	if(inet_pton(AF_INET6, ip, &addr6) == 1)
 	{
-		lock_shm();
-		size_t newnamepos = addstr(newname);
-		// newname has already been checked against NULL
-		// so we can safely free it
-		free(newname);
-		free(ipaddr);
-		free(oldname);
-		unlock_shm();
-		return newnamepos;
+		// Nibbles in reverse order below ip6.arpa
+		for(int i = 15; i >= 0; i--)
+		{
+			snprintf(label, sizeof(label), "%x", addr6.s6_addr[i] & 0x0f);
+			len = add_label(buf, len, label);
+			snprintf(label, sizeof(label), "%x", addr6.s6_addr[i] >> 4);
+			len = add_label(buf, len, label);
+		}
+		len = add_label(buf, len, "ip6");
 	}
-	else if(config.debug & DEBUG_SHMEM)
+	else if(inet_pton(AF_INET, ip, &addr4) == 1)
 	{
-		// Debugging output
-		logg("Not adding \"%s\" to buffer (unchanged)", oldname);
+		// Octets in reverse order below in-addr.arpa
+		const unsigned char *octet = (const unsigned char *)&addr4.s_addr;
+		for(int i = 3; i >= 0; i--)
+		{
+			snprintf(label, sizeof(label), "%u", octet[i]);
+			len = add_label(buf, len, label);
+		}
+		len = add_label(buf, len, "in-addr");
 	}
+	else
+		return -1;
+
+	len = add_label(buf, len, "arpa");
+	buf[len++] = 0;
 
-	free(ipaddr);
-	free(oldname);
+	// QTYPE PTR, QCLASS IN
+	buf[len++] = 0;
+	buf[len++] = 12;
+	buf[len++] = 0;
+	buf[len++] = 1;
 
-	// Not changed, return old namepos
-	return oldnamepos;
+	return len;
 }
 
-// Resolve client host names
-void resolveClients(bool onlynew)
+// Skip a (possibly compressed) name, returns the position after it or -1
+static int __attribute__((pure)) skip_name(const unsigned char *pkt, const int len, int pos)
 {
-	// Lock counter access here, we use a copy in the following loop
-	lock_shm();
-	int clientscount = counters->clients;
-	unlock_shm();
-	for(int clientID = 0; clientID < clientscount; clientID++)
+	while(pos < len)
+	{
+		if(pkt[pos] == 0)
+			return pos + 1;
+		if((pkt[pos] & 0xc0) == 0xc0)
+			return pos + 2 <= len ? pos + 2 : -1;
+		pos += pkt[pos] + 1;
+	}
+	return -1;
+}
+
+// Decompress the name at pos into out
+static bool read_name(const unsigned char *pkt, const int len, int pos, char *out, const size_t outlen)
+{
+	size_t n = 0;
+	for(int jumps = 0; pos < len && jumps < 32; )
+	{
+		const unsigned char l = pkt[pos];
+		if(l == 0)
+		{
+			// Strip the final dot
+			out[n > 0 ? n - 1 : 0] = '\0';
+			return true;
+		}
+		if((l & 0xc0) == 0xc0)
+		{
+			if(pos + 1 >= len)
+				return false;
+			pos = ((l & 0x3f) << 8) | pkt[pos + 1];
+			jumps++;
+			continue;
+		}
+		if(pos + 1 + l > len || n + l + 1 >= outlen)
+			return false;
+		memcpy(&out[n], &pkt[pos + 1], l);
+		n += l;
+		out[n++] = '.';
+		pos += l + 1;
+	}
+	return false;
+}
+
+static int clamp_ttl(const long ttl)
+{
+	if(ttl < RESOLVE_INTERVAL)
+		return RESOLVE_INTERVAL;
+	if(ttl > RERESOLVE_INTERVAL)
+		return RERESOLVE_INTERVAL;
+	return (int)ttl;
+}
+
+// Take the host name from a reply. Names which don't exist are cached
+// for as long as the SOA of the reverse zone says
+static void parse_ptr_reply(ptrJob *job, const unsigned char *pkt, const int len, int pos)
+{
+	const int rcode = pkt[3] & 0x0f;
+	if(rcode != 0 && rcode != 3)
+		// Server failure, refused, ...
+		return;
+
+	const int ancount = (pkt[6] << 8) | pkt[7];
+	const int nscount = (pkt[8] << 8) | pkt[9];
+	long negttl = RERESOLVE_INTERVAL;
+	char name[256];
+
+	for(int i = 0; i < ancount + nscount; i++)
+	{
+		if((pos = skip_name(pkt, len, pos)) < 0 || pos + 10 > len)
+			break;
+
+		const int type = (pkt[pos] << 8) | pkt[pos + 1];
+		const long ttl = ((long)pkt[pos + 4] << 24) | (pkt[pos + 5] << 16) | (pkt[pos + 6] << 8) | pkt[pos + 7];
+		const int rdlen = (pkt[pos + 8] << 8) | pkt[pos + 9];
+		pos += 10;
+		if(pos + rdlen > len)
+			break;
+
+		if(i < ancount && type == 12 && read_name(pkt, len, pos, name, sizeof(name)))
+		{
+			strtolower(name);
+			job->name = strdup(name);
+			job->ttl = clamp_ttl(ttl);
+			job->found = job->name != NULL;
+			return;
+		}
+		else if(i >= ancount && type == 6 && rdlen >= 20)
+		{
+			// Negative caching: SOA MINIMUM, limited by the SOA's TTL
+			const unsigned char *min = &pkt[pos + rdlen - 4];
+			const long minimum = ((long)min[0] << 24) | (min[1] << 16) | (min[2] << 8) | min[3];
+			negttl = minimum < ttl ? minimum : ttl;
+		}
+		pos += rdlen;
+	}
+
+	// No host name known for this address
+	job->name = strdup("");
+	job->ttl = clamp_ttl(negttl);
+	job->found = job->name != NULL;
+}
+
+// Returns false if nobody is listening on the resolver's port
+static bool send_ptr_query(const int fd, ptrJob *job, const unsigned short dnsid)
+{
+	unsigned char query[PTR_PACKETSIZE];
+	job->dnsid = dnsid;
+	const int len = build_ptr_query(job->ip, job->dnsid, query);
+	if(len < 0)
+	{
+		job->done = true;
+		return true;
+	}
+
+	// Other failures are handled like lost packets
+	if(send(fd, query, len, 0) < 0)
+	{
+		if(errno == ECONNREFUSED)
+			return false;
+		if(config.debug & DEBUG_NETWORKING)
+			logg("Sending PTR query for %s failed: %s", job->ip, strerror(errno));
+	}
+	job->sent = ptr_clock();
+	job->tries++;
+	return true;
+}
+
+// Look up the host names of all jobs with at most PTR_INFLIGHT queries to
+// our own resolver waiting for a reply at the same time. Returns false if
+// the resolver refused the queries or did not answer any of them
+static bool lookup_names(ptrJob *jobs, const int n)
+{
+	const int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	struct sockaddr_in server;
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(dnsport);
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(fd < 0 || connect(fd, (struct sockaddr *)&server, sizeof(server)) != 0)
+	{
+		logg("WARN: Cannot connect to local resolver for host name lookups: %s", strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	static unsigned short nextid = 0;
+	if(nextid == 0)
+		nextid = (unsigned short)(time(NULL) ^ getpid());
+
+	int inflight[PTR_INFLIGHT], ninflight = 0, next = 0, sent = 0, replies = 0;
+	bool refused = false;
+	unsigned char pkt[PTR_PACKETSIZE], query[PTR_PACKETSIZE];
+	while((next < n || ninflight > 0) && !killed && !refused)
 	{
-		// Memory validation
-		validate_access("clients", clientID, true, __LINE__, __FUNCTION__, __FILE__);
+		// Keep up to PTR_INFLIGHT queries going
+		while(ninflight < PTR_INFLIGHT && next < n && !refused)
+		{
+			ptrJob *job = &jobs[next];
+			if(!job->done)
+			{
+				refused = !send_ptr_query(fd, job, nextid++);
+				sent++;
+			}
+			if(!job->done)
+				inflight[ninflight++] = next;
+			next++;
+		}
+
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		poll(&pfd, 1, 100);
+
+		// Match replies to queries by their ID and question
+		ssize_t len;
+		while((len = recv(fd, pkt, sizeof(pkt), 0)) >= 12)
+		{
+			replies++;
+			const unsigned short dnsid = (pkt[0] << 8) | pkt[1];
+			for(int k = 0; k < ninflight; k++)
+			{
+				ptrJob *job = &jobs[inflight[k]];
+				const int qlen = build_ptr_query(job->ip, job->dnsid, query);
+				if(job->dnsid != dnsid || qlen > len || memcmp(&pkt[12], &query[12], qlen - 12) != 0)
+					continue;
+
+				parse_ptr_reply(job, pkt, (int)len, qlen);
+				job->done = true;
+				inflight[k] = inflight[--ninflight];
+				break;
+			}
+		}
+		if(len < 0 && errno == ECONNREFUSED)
+			refused = true;
+
+		// Send again or give up after timeouts
+		const unsigned long long now = ptr_clock();
+		for(int k = ninflight - 1; k >= 0; k--)
+		{
+			ptrJob *job = &jobs[inflight[k]];
+			if(now - job->sent < PTR_TIMEOUT)
+				continue;
+
+			if(job->tries < PTR_TRIES)
+				refused |= !send_ptr_query(fd, job, nextid++);
+			else
+			{
+				job->done = true;
+				inflight[k] = inflight[--ninflight];
+			}
+		}
+	}
+
+	close(fd);
 
-		// Memory access needs to get locked
-		lock_shm();
-		bool newflag = clients[clientID].new;
-		size_t ippos = clients[clientID].ippos;
-		size_t oldnamepos = clients[clientID].namepos;
-		unlock_shm();
+	if(refused)
+		logg("WARN: Local resolver refused host name lookups, using the system resolver");
+	else if(sent > 0 && replies == 0 && !killed)
+		logg("WARN: Local resolver did not answer host name lookups, using the system resolver");
 
-		// If onlynew flag is set, we will only resolve new clients
-		// If not, we will try to re-resolve all known clients
-		if(onlynew && !newflag)
+	return !refused && (sent == 0 || replies > 0 || killed);
+}
+
+// Look up the names not found so far with the system's resolver
+static void resolve_with_system(ptrJob *jobs, const int n)
+{
+	for(int i = 0; i < n && !killed; i++)
+	{
+		if(jobs[i].found)
 			continue;
+		if(jobs[i].name != NULL)
+			free(jobs[i].name);
+		jobs[i].name = resolveHostname(jobs[i].ip);
+		jobs[i].found = jobs[i].name != NULL;
+		jobs[i].ttl = RERESOLVE_INTERVAL;
+	}
+}
 
-		// Obtain/update hostname of this client
-		size_t newnamepos = resolveAndAddHostname(ippos, oldnamepos);
+static time_t *expiry_slot(time_t **expiry, int *size, const int ID)
+{
+	if(ID >= *size)
+	{
+		const int newsize = ID + 1024;
+		time_t *grown = realloc(*expiry, newsize * sizeof(time_t));
+		if(grown == NULL)
+			return NULL;
+		memset(&grown[*size], 0, (newsize - *size) * sizeof(time_t));
+		*expiry = grown;
+		*size = newsize;
+	}
+	return &(*expiry)[ID];
+}
 
-		lock_shm();
-		// Store obtained host name (may be unchanged)
-		clients[clientID].namepos = newnamepos;
+// Host names dnsmasq knows itself from its DHCP leases and from the hosts
+// files (including host-record). Kept in an open-addressing hash table
+// indexed by IP address. Entries are marked stale instead of being removed
+// when their source is reloaded so that the client an address belongs to
+// need not be searched again when the same lease or line reappears. Only
+// accessed while holding the SHM lock
+typedef struct {
+	hashKey ip;
+	char *name;
+	int clientID; // -1 while no client with this address was seen
+	bool dhcp;
+	bool stale;
+} localName;
 
-		// Mark entry as not new
-		clients[clientID].new = false;
-		unlock_shm();
+static bool __attribute__((pure)) local_name_stale(const void *entry)
+{
+	return ((const localName*)entry)->stale;
+}
+
+static void release_local_name(void *entry)
+{
+	localName *local = entry;
+	if(local->name != NULL)
+		free(local->name);
+}
+
+// Stale entries are dropped when the table grows
+static hashSet localnames = HASH_SET(localName, local_name_stale, release_local_name);
+
+static void use_local_name(const int clientID, const char *name)
+{
+	if(strcmp(getstr(clients[clientID].namepos), name) != 0)
+		clients[clientID].namepos = addstr(name);
+	clients[clientID].localname = true;
+	clients[clientID].new = false;
+}
+
+// Called for every address in the hosts files and every DHCP lease with a
+// host name. Like dnsmasq's own reverse lookups, names from the hosts files
+// take precedence over DHCP names and the first name of an address wins
+// until its source is reloaded
+void set_local_name(const char *ip, const char *name, const bool dhcp)
+{
+	bool added;
+	localName *entry = hash_set_insert(&localnames, ip, &added);
+	if(entry == NULL)
+		return;
+
+	if(added)
+	{
+		// Not used before it has a name
+		entry->clientID = -1;
+		entry->stale = true;
 	}
+	else if(!entry->stale && (dhcp || !entry->dhcp))
+		return;
+
+	if(entry->name == NULL || strcmp(entry->name, name) != 0)
+	{
+		char *copy = strdup(name);
+		if(copy == NULL)
+			return;
+		strtolower(copy);
+		if(entry->name != NULL)
+			free(entry->name);
+		entry->name = copy;
+	}
+	entry->dhcp = dhcp;
+	entry->stale = false;
+
+	// Only search for the client if this address has not been seen before
+	if(entry->clientID < 0)
+		entry->clientID = findClientID(ip, false);
+	if(entry->clientID >= 0)
+		use_local_name(entry->clientID, entry->name);
 }
 
-// Resolve upstream destination host names
-void resolveForwardDestinations(bool onlynew)
+// Called before dnsmasq re-reads its hosts files or DHCP leases
+void clear_local_names(const bool dhcp)
 {
-	// Lock counter access here, we use a copy in the following loop
+	for(unsigned int i = 0; i < localnames.size; i++)
+	{
+		localName *entry = hash_set_entry(&localnames, i);
+		if(entry->ip.str != NULL && entry->dhcp == dhcp)
+			entry->stale = true;
+	}
+}
+
+// Called for new clients
+void apply_local_name(const int clientID)
+{
+	const char *ip = getstr(clients[clientID].ippos);
+	localName *entry = hash_set_find(&localnames, ip);
+	if(entry == NULL || entry->stale)
+		return;
+
+	entry->clientID = clientID;
+	use_local_name(clientID, entry->name);
+}
+
+static bool __attribute__((pure)) has_local_name(const int clientID)
+{
+	const char *ip = getstr(clients[clientID].ippos);
+	const localName *entry = hash_set_find(&localnames, ip);
+	return entry != NULL && !entry->stale;
+}
+
+static void add_job(ptrJob *job, const bool client, const int ID, const char *ip)
+{
+	job->client = client;
+	job->ID = ID;
+	strncpy(job->ip, ip, sizeof(job->ip) - 1);
+
+	// Hidden clients and address families not to be resolved need no query
+	const bool IPv6 = strstr(ip, ":") != NULL;
+	if(strcmp(ip, "0.0.0.0") == 0)
+		job->name = strdup("hidden");
+	else if((IPv6 && !config.resolveIPv6) || (!IPv6 && !config.resolveIPv4))
+		job->name = strdup("");
+	else
+		return;
+
+	job->done = true;
+	job->found = job->name != NULL;
+	job->ttl = RERESOLVE_INTERVAL;
+}
+
+// Resolve client and upstream server host names. Names are looked up when
+// they are new or their cached name expired, or always unless onlynew is set.
+// The lock is only taken to collect the addresses and to store changed names
+void resolveNames(bool onlynew)
+{
+	pthread_mutex_lock(&resolvelock);
+	const time_t now = time(NULL);
+
 	lock_shm();
-	int forwardedcount = counters->forwarded;
+	const int clientscount = counters->clients;
+	const int forwardedcount = counters->forwarded;
+	ptrJob *jobs = calloc(clientscount + forwardedcount + 1, sizeof(ptrJob));
+	int n = 0;
+	for(int clientID = 0; jobs != NULL && clientID < clientscount; clientID++)
+	{
+		// Clients named by the DHCP leases or hosts files need no lookup
+		// unless their local name went away
+		if(clients[clientID].localname)
+		{
+			if(has_local_name(clientID))
+				continue;
+			clients[clientID].localname = false;
+			clients[clientID].new = true;
+		}
+		time_t *expiry = expiry_slot(&clientexpiry, &clientexpirysize, clientID);
+		if(expiry != NULL && onlynew && !clients[clientID].new && *expiry > now)
+			continue;
+		add_job(&jobs[n++], true, clientID, getstr(clients[clientID].ippos));
+	}
+	for(int forwardID = 0; jobs != NULL && forwardID < forwardedcount; forwardID++)
+	{
+		time_t *expiry = expiry_slot(&forwardexpiry, &forwardexpirysize, forwardID);
+		if(expiry != NULL && onlynew && !forwarded[forwardID].new && *expiry > now)
+			continue;
+		add_job(&jobs[n++], false, forwardID, getstr(forwarded[forwardID].ippos));
+	}
 	unlock_shm();
-	for(int forwardID = 0; forwardID < forwardedcount; forwardID++)
+
+	if(jobs == NULL)
 	{
-		// Memory validation
-		validate_access("forwarded", forwardID, true, __LINE__, __FUNCTION__, __FILE__);
+		pthread_mutex_unlock(&resolvelock);
+		return;
+	}
 
-		// Memory access needs to get locked
-		lock_shm();
-		bool newflag = forwarded[forwardID].new;
-		size_t ippos = forwarded[forwardID].ippos;
-		size_t oldnamepos = forwarded[forwardID].namepos;
-		unlock_shm();
+	// Important: Don't hold a lock while resolving as the main thread
+	// (dnsmasq) needs to be operable during the lookups
+	// Without a DNS server of our own, or if it doesn't answer, fall back
+	// to the system's resolver
+	if(dnsport <= 0 || !lookup_names(jobs, n))
+		resolve_with_system(jobs, n);
 
-		// If onlynew flag is set, we will only resolve new upstream destinations
-		// If not, we will try to re-resolve all known upstream destinations
-		if(onlynew && !newflag)
+	// Store changed names
+	int changed = 0, failed = 0;
+	lock_shm();
+	for(int i = 0; i < n; i++)
+	{
+		ptrJob *job = &jobs[i];
+		// A local name may have shown up while looking up the address
+		if(job->client && clients[job->ID].localname)
+		{
+			if(job->name != NULL)
+				free(job->name);
 			continue;
+		}
+		size_t *namepos = job->client ? &clients[job->ID].namepos : &forwarded[job->ID].namepos;
+		time_t *expiry = job->client ? expiry_slot(&clientexpiry, &clientexpirysize, job->ID) :
+		                               expiry_slot(&forwardexpiry, &forwardexpirysize, job->ID);
 
-		// Obtain/update hostname of this client
-		size_t newnamepos = resolveAndAddHostname(ippos, oldnamepos);
+		if(job->found)
+		{
+			if(strcmp(getstr(*namepos), job->name) != 0)
+			{
+				*namepos = addstr(job->name);
+				changed++;
+			}
+			if(expiry != NULL)
+				*expiry = now + job->ttl;
+		}
+		else
+		{
+			// Keep the old name and try again later
+			failed++;
+			if(expiry != NULL)
+				*expiry = now + PTR_RETRY;
+		}
 
-		lock_shm();
-		// Store obtained host name (may be unchanged)
-		forwarded[forwardID].namepos = newnamepos;
 		// Mark entry as not new
-		forwarded[forwardID].new = false;
-		unlock_shm();
+		if(job->client)
+			clients[job->ID].new = false;
+		else
+			forwarded[job->ID].new = false;
+
+		if(job->name != NULL)
+			free(job->name);
 	}
+	unlock_shm();
+	free(jobs);
+
+	if(config.debug & DEBUG_NETWORKING)
+		logg("Resolved %i host names (%i changed, %i failed)", n, changed, failed);
+
+	pthread_mutex_unlock(&resolvelock);
 }
 
 void *DNSclient_thread(void *val)
@@ -185,24 +657,11 @@ void *DNSclient_thread(void *val)
 
 	while(!killed)
 	{
-		// Run every minute to resolve only new clients and upstream servers
+		// Run every minute to resolve new clients and upstream servers
+		// and names whose TTL expired (at least once an hour)
 		if(time(NULL) % RESOLVE_INTERVAL == 0)
 		{
-			// Try to resolve new client host names (onlynew=true)
-			resolveClients(true);
-			// Try to resolve new upstream destination host names (onlynew=true)
-			resolveForwardDestinations(true);
-			// Prevent immediate re-run of this routine
-			sleepms(500);
-		}
-
-		// Run every hour to update possibly changed client host names
-		if(time(NULL) % RERESOLVE_INTERVAL == 0)
-		{
-			// Try to resolve all client host names (onlynew=false)
-			resolveClients(false);
-			// Try to resolve all upstream destination host names (onlynew=false)
-			resolveForwardDestinations(false);
+			resolveNames(true);
 			// Prevent immediate re-run of this routine
 			sleepms(500);
 		}
@@ -17,6 +17,10 @@ char * getUserName(void);
 void removepid(void);
 
 void open_FTL_log(bool test);
+void start_log_writer(void);
+void stop_log_writer(void);
+void flush_FTL_log(void);
+void reopen_FTL_log(void);
 void logg(const char* format, ...) __attribute__ ((format (gnu_printf, 1, 2)));
 void logg_struct_resize(const char* str, int to, int step);
 void log_counter_info(void);
@@ -33,12 +37,19 @@ bool isValidIPv6(const char *addr);
 const char *getDomainString(int queryID);
 const char *getClientIPString(int queryID);
 const char *getClientNameString(int queryID);
+void add_query_postings(int queryID);
+int next_posting(int *chunk, int *pos, int ibeg);
+void gc_postings(void);
+void stream_query(int queryID);
 
 void close_telnet_socket(void);
 void close_unix_socket(void);
 void seom(int sock);
 void ssend(int sock, const char *format, ...) __attribute__ ((format (gnu_printf, 2, 3)));
 void swrite(int sock, const void* value, size_t size);
+void capture_output(void);
+void discard_output(void);
+void flush_output(int sock);
 void *telnet_listening_thread_IPv4(void *args);
 void *telnet_listening_thread_IPv6(void *args);
 
@@ -52,14 +63,15 @@ bool matchesEndpoint(char *client_message, const char *cmd);
 
 // grep.c
 int countlines(const char* fname);
-int countlineswith(const char* str, const char* fname);
+void refresh_auditlist(void);
+bool in_auditlist(const char *domain) __attribute__((pure));
 void check_blocking_status(void);
 
 void check_setupVarsconf(void);
 char * read_setupVarsconf(const char * key);
-void getSetupVarsArray(const char * input);
 void clearSetupVarsArray(void);
-bool insetupVarsArray(const char * str);
+bool getSetupVarsList(const int list);
+bool insetupVarsList(const int list, const char * str);
 bool getSetupVarsBool(const char * input) __attribute__((pure));
 
 void parse_args(int argc, char* argv[]);
@@ -88,6 +100,7 @@ bool db_set_FTL_property(unsigned int ID, int value);
 bool dbquery(const char *format, ...);
 bool dbopen(void);
 void dbclose(void);
+struct sqlite3 *dbhandle(void);
 int db_query_int(const char*);
 void SQLite3LogCallback(void *pArg, int iErrCode, const char *zMsg);
 
@@ -106,13 +119,16 @@ void handle_signals(void);
 
 // resolve.c
 void *DNSclient_thread(void *val);
-void resolveClients(bool onlynew);
-void resolveForwardDestinations(bool onlynew);
+void resolveNames(bool onlynew);
+void set_local_name(const char *ip, const char *name, const bool dhcp);
+void clear_local_names(const bool dhcp);
+void apply_local_name(const int clientID);
 
 // regex.c
 bool match_regex(char *input);
 void free_regex(void);
 void read_regex_from_file(void);
+bool regex_test(const char *domain);
 bool in_whitelist(char *domain) __attribute__((pure));
 
 // shmem.c
@@ -137,6 +153,8 @@ void addOverTimeClientSlot(void);
 // overTime.c
 void initOverTime(void);
 unsigned int getOverTimeID(time_t timestamp);
+void add_client_overTime(int clientID, unsigned int timeidx, int amount);
+int get_client_overTime(int *chunk, int *pos, unsigned int timeidx);
 
 /**
  * Move the overTime slots so the oldest interval starts with mintime. The time
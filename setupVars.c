@@ -9,10 +9,7 @@
 *  Please see LICENSE file for your rights under this license. */
 
 #include "FTL.h"
-
-
-int setupVarsElements = 0;
-char ** setupVarsArray = NULL;
+#include "hash.h"
 
 void check_setupVarsconf(void)
 {
@@ -58,166 +55,277 @@ void trim_whitespace(char *string)
 		*modified = '\0';
 }
 
-// This will hold the read string
-// in memory and will serve the space
-// we will point to in the rest of the
-// process (e.g. setupVarsArray will
-// actually point to memory addresses
-// which we allocate for this buffer.
-char * linebuffer = NULL;
-size_t linebuffersize = 0;
+// setupVars.conf is parsed once into a hashed key/value store which is
+// only rebuilt when the file changes (detected by comparing inode, size
+// and modification time). The exclusion lists are additionally split
+// into hash sets such that filtering the API output costs one lookup
+// per domain/client instead of a linear scan over all entries.
+#define SETUPVARS_BUCKETS 64
 
-char * read_setupVarsconf(const char * key)
+typedef struct setupVarsEntry {
+	struct setupVarsEntry *next;
+	unsigned int hash;
+	char *key;
+	char *value;
+} setupVarsEntry;
+
+typedef struct {
+	// Hash set of exact entries
+	hashSet exact;
+	// Entries starting with '*' match anywhere in the string
+	char **wildcards;
+	unsigned int nwildcards;
+	unsigned int elements;
+} setupVarsList;
+
+static const char *listkeys[SETUPVARS_LISTS] = { "API_EXCLUDE_DOMAINS", "API_EXCLUDE_CLIENTS" };
+
+static setupVarsEntry *store[SETUPVARS_BUCKETS] = { NULL };
+static setupVarsList lists[SETUPVARS_LISTS];
+static struct stat store_st;
+static bool store_valid = false;
+static pthread_rwlock_t store_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void free_list(setupVarsList *list)
 {
-	FILE *setupVarsfp;
-	if((setupVarsfp = fopen(files.setupVars, "r")) == NULL)
+	hash_set_free(&list->exact);
+	for(unsigned int i = 0; i < list->nwildcards; i++)
+		free(list->wildcards[i]);
+	if(list->wildcards != NULL)
+		free(list->wildcards);
+	memset(list, 0, sizeof(*list));
+}
+
+static void free_store(void)
+{
+	for(unsigned int i = 0; i < SETUPVARS_BUCKETS; i++)
 	{
-		logg("WARN: Reading setupVars.conf failed: %s", strerror(errno));
-		return NULL;
+		setupVarsEntry *entry = store[i];
+		while(entry != NULL)
+		{
+			setupVarsEntry *next = entry->next;
+			free(entry->key);
+			free(entry->value);
+			free(entry);
+			entry = next;
+		}
+		store[i] = NULL;
+	}
+	for(unsigned int i = 0; i < SETUPVARS_LISTS; i++)
+		free_list(&lists[i]);
+	store_valid = false;
+}
+
+static setupVarsEntry * __attribute__((pure)) find_entry(const char *key)
+{
+	const unsigned int hash = hash_string(key);
+	for(setupVarsEntry *entry = store[hash % SETUPVARS_BUCKETS]; entry != NULL; entry = entry->next)
+		if(entry->hash == hash && strcmp(entry->key, key) == 0)
+			return entry;
+	return NULL;
+}
+
+// split string in form
+//   abc,def,*ghi
+// into a hash set (abc, def) and an array of wildcards (ghi)
+static void build_list(setupVarsList *list, const char *value)
+{
+	char *copy = strdup(value);
+	if(copy == NULL)
+		return;
+
+	// Count elements to size the array of wildcards
+	unsigned int count = 0;
+	for(const char *c = value; *c; c++)
+		if(*c == ',')
+			count++;
+	list->exact = (hashSet)HASH_SET(hashKey, NULL, NULL);
+	list->wildcards = calloc(count + 1, sizeof(char*));
+	if(list->wildcards == NULL)
+	{
+		free(copy);
+		free_list(list);
+		return;
 	}
 
-	// Allocate keystr
-	char * keystr = calloc(strlen(key)+2, sizeof(char));
-	if(keystr == NULL)
+	char *saveptr = NULL;
+	for(char *p = strtok_r(copy, ",", &saveptr); p != NULL; p = strtok_r(NULL, ",", &saveptr))
 	{
-		logg("WARN: read_setupVarsconf failed: could not allocate memory for keystr");
-		fclose(setupVarsfp);
-		return NULL;
+		if(p[0] == '*')
+		{
+			if((list->wildcards[list->nwildcards] = strdup(p+1)) != NULL)
+			{
+				list->nwildcards++;
+				list->elements++;
+			}
+			continue;
+		}
+
+		bool added;
+		if(hash_set_insert(&list->exact, p, &added) != NULL && added)
+			list->elements++;
+	}
+
+	free(copy);
+}
+
+static void load_store(const struct stat *st)
+{
+	free_store();
+
+	FILE *setupVarsfp;
+	if((setupVarsfp = fopen(files.setupVars, "r")) == NULL)
+	{
+		logg("WARN: Reading setupVars.conf failed: %s", strerror(errno));
+		return;
 	}
-	sprintf(keystr, "%s=", key);
 
+	char *buffer = NULL;
+	size_t size = 0;
 	errno = 0;
-	while(getline(&linebuffer, &linebuffersize, setupVarsfp) != -1)
+	while(getline(&buffer, &size, setupVarsfp) != -1)
 	{
 		// Strip (possible) newline
-		linebuffer[strcspn(linebuffer, "\n")] = '\0';
+		buffer[strcspn(buffer, "\n")] = '\0';
 
 		// Skip comment lines
-		if(linebuffer[0] == '#' || linebuffer[0] == ';')
+		if(buffer[0] == '#' || buffer[0] == ';')
 			continue;
 
-		// Skip lines with other keys
-		if((strstr(linebuffer, keystr)) == NULL)
+		// Skip lines without a key
+		char *equals = find_equals(buffer);
+		if(*equals == '\0' || equals == buffer)
 			continue;
+		*equals = '\0';
 
-		// otherwise: key found
-		fclose(setupVarsfp);
-		free(keystr);
-		return (find_equals(linebuffer) + 1);
+		// The first occurrence of a key wins
+		if(find_entry(buffer) != NULL)
+			continue;
+
+		setupVarsEntry *entry = calloc(1, sizeof(setupVarsEntry));
+		if(entry == NULL)
+			break;
+		entry->key = strdup(buffer);
+		entry->value = strdup(equals + 1);
+		if(entry->key == NULL || entry->value == NULL)
+		{
+			if(entry->key != NULL)
+				free(entry->key);
+			if(entry->value != NULL)
+				free(entry->value);
+			free(entry);
+			break;
+		}
+		entry->hash = hash_string(entry->key);
+		entry->next = store[entry->hash % SETUPVARS_BUCKETS];
+		store[entry->hash % SETUPVARS_BUCKETS] = entry;
 	}
 
 	if(errno == ENOMEM)
 		logg("WARN: read_setupVarsconf failed: could not allocate memory for getline");
 
-	// Key not found -> return NULL
+	if(buffer != NULL)
+		free(buffer);
 	fclose(setupVarsfp);
 
-	// Freeing keystr, not setting to NULL, since not used outside of this routine
-	free(keystr);
-
-	// Freeing and setting to NULL to prevent a dangling pointer
-	if(linebuffer != NULL)
+	// Pre-split the exclusion lists
+	for(unsigned int i = 0; i < SETUPVARS_LISTS; i++)
 	{
-		free(linebuffer);
-		linebuffersize = 0;
-		linebuffer = NULL;
+		const setupVarsEntry *entry = find_entry(listkeys[i]);
+		if(entry != NULL)
+			build_list(&lists[i], entry->value);
 	}
 
-	return NULL;
+	store_st = *st;
+	store_valid = true;
 }
 
-// split string in form:
-//   abc,def,ghi
-// into char ** array:
-// setupVarsArray[0] = abc
-// setupVarsArray[1] = def
-// setupVarsArray[2] = ghi
-// setupVarsArray[3] = NULL
-void getSetupVarsArray(const char * input)
+// Reload the store if setupVars.conf has been changed since we read it
+static void refresh_store(void)
 {
-	char * p = strtok((char*)input, ",");
+	struct stat st;
+	if(stat(files.setupVars, &st) != 0)
+	{
+		pthread_rwlock_wrlock(&store_lock);
+		if(store_valid)
+			free_store();
+		pthread_rwlock_unlock(&store_lock);
+		return;
+	}
 
-	/* split string and append tokens to 'res' */
+	pthread_rwlock_rdlock(&store_lock);
+	const bool current = store_valid &&
+	                     st.st_ino == store_st.st_ino && st.st_dev == store_st.st_dev &&
+	                     st.st_size == store_st.st_size &&
+	                     st.st_mtim.tv_sec == store_st.st_mtim.tv_sec &&
+	                     st.st_mtim.tv_nsec == store_st.st_mtim.tv_nsec;
+	pthread_rwlock_unlock(&store_lock);
+	if(current)
+		return;
 
-	while (p) {
-		setupVarsArray = realloc(setupVarsArray, sizeof(char*) * ++setupVarsElements);
-		if(setupVarsArray == NULL) return;
-		setupVarsArray[setupVarsElements-1] = p;
-		p = strtok(NULL, ",");
-	}
+	pthread_rwlock_wrlock(&store_lock);
+	load_store(&st);
+	pthread_rwlock_unlock(&store_lock);
+}
+
+// This will hold a copy of the most recently read value of the calling
+// thread. Callers may modify it, it is valid until clearSetupVarsArray()
+static __thread char * linebuffer = NULL;
+
+char * read_setupVarsconf(const char * key)
+{
+	refresh_store();
+
+	clearSetupVarsArray();
+	pthread_rwlock_rdlock(&store_lock);
+	const setupVarsEntry *entry = find_entry(key);
+	if(entry != NULL)
+		linebuffer = strdup(entry->value);
+	pthread_rwlock_unlock(&store_lock);
 
-	/* realloc one extra element for the last NULL */
-	setupVarsArray = realloc(setupVarsArray, sizeof(char*) * (setupVarsElements+1));
-	if(setupVarsArray == NULL) return;
-	setupVarsArray[setupVarsElements] = NULL;
+	return linebuffer;
 }
 
 void clearSetupVarsArray(void)
 {
-	setupVarsElements = 0;
-	// setting unused pointers to NULL
-	// protecting against dangling pointer bugs
-	// free only if not already NULL
-	if(setupVarsArray != NULL)
-	{
-		free(setupVarsArray);
-		setupVarsArray = NULL;
-	}
+	// Freeing and setting to NULL to prevent a dangling pointer
 	if(linebuffer != NULL)
 	{
 		free(linebuffer);
-		linebuffersize = 0;
 		linebuffer = NULL;
 	}
 }
 
-/* Example
-	char * iface = read_setupVarsconf("API_EXCLUDE_DOMAINS");
-	if(iface != NULL)
-		logg_str("Interface: ",iface);
-	getSetupVarsArray(iface);
-	int i;
-	for (i = 0; i <= setupVarsElements; ++i)
-		printf ("[%d] = %s\n", i, setupVarsArray[i]);
-	clearSetupVarsArray();
-*/
+// Returns true if the given list has at least one element
+bool getSetupVarsList(const int list)
+{
+	refresh_store();
+
+	pthread_rwlock_rdlock(&store_lock);
+	const bool nonempty = lists[list].elements > 0;
+	pthread_rwlock_unlock(&store_lock);
+
+	return nonempty;
+}
 
-bool insetupVarsArray(const char * str)
+bool insetupVarsList(const int list, const char * str)
 {
 	// Check for possible NULL pointer
 	// (this is valid input, e.g. if clients[i].name is unspecified)
 	if(str == NULL)
 		return false;
 
-	// Loop over all entries in setupVarsArray
-	for (int i = 0; i < setupVarsElements; ++i)
-		if(setupVarsArray[i][0] == '*')
-		{
-			// Copying strlen-1 chars into buffer of size strlen: OK
-			size_t lenght = strlen(setupVarsArray[i]);
-			char * domain = calloc(lenght, sizeof(char));
-			if(domain == NULL) return false;
-			// strncat() NULL-terminates the copied string (strncpy() doesn't!)
-			strncat(domain, setupVarsArray[i]+1, lenght-1);
-
-			if(strstr(str, domain) != NULL)
-			{
-				free(domain);
-				return true;
-			}
-			else
-			{
-				free(domain);
-			}
-		}
-		else
-		{
-			if(strcmp(setupVarsArray[i], str) == 0)
-				return true;
-		}
+	pthread_rwlock_rdlock(&store_lock);
+	const setupVarsList *l = &lists[list];
+	bool found = hash_set_find(&l->exact, str) != NULL;
+
+	// Wildcard entries match anywhere in the string
+	for(unsigned int i = 0; !found && i < l->nwildcards; i++)
+		if(strstr(str, l->wildcards[i]) != NULL)
+			found = true;
+	pthread_rwlock_unlock(&store_lock);
 
-	// If not found
-	return false;
+	return found;
 }
 
 bool __attribute__((pure)) getSetupVarsBool(const char * input)
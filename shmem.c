@@ -12,7 +12,7 @@
 #include "shmem.h"
 
 /// The version of shared memory used
-#define SHARED_MEMORY_VERSION 6
+#define SHARED_MEMORY_VERSION 15
 
 /// The name of the shared memory. Use this when connecting to the shared memory.
 #define SHARED_LOCK_NAME "/FTL-lock"
@@ -24,6 +24,9 @@
 #define SHARED_FORWARDED_NAME "/FTL-forwarded"
 #define SHARED_OVERTIME_NAME "/FTL-overTime"
 #define SHARED_SETTINGS_NAME "/FTL-settings"
+#define SHARED_POSTINGS_NAME "/FTL-postings"
+#define SHARED_CLIENT_OVERTIME_NAME "/FTL-client-overTime"
+#define SHARED_STREAM_NAME "/FTL-stream"
 
 /// The pointer in shared memory to the shared string buffer
 static SharedMemory shm_lock = { 0 };
@@ -35,14 +38,30 @@ static SharedMemory shm_queries = { 0 };
 static SharedMemory shm_forwarded = { 0 };
 static SharedMemory shm_overTime = { 0 };
 static SharedMemory shm_settings = { 0 };
+static SharedMemory shm_postings = { 0 };
+static SharedMemory shm_clientOverTime = { 0 };
+static SharedMemory shm_stream = { 0 };
 
 typedef struct {
 	pthread_mutex_t lock;
 	bool waitingForLock;
+	// Lock statistics are only ever modified while holding the lock
+	int holder;
+	unsigned long long acquired;
+	lockSite sites[LOCK_SITES];
+	// Odd while the lock is held
+	unsigned int seq;
+	// Odd while data is being moved or removed
+	unsigned int generation;
 } ShmLock;
 static ShmLock *shmLock = NULL;
 static ShmSettings *shmSettings = NULL;
 
+// Lock-free readers of this process. Mappings may only move once an object
+// outgrew its reservation and all readers active at that time are done
+static int active_readers = 0;
+static bool moving_maps = false;
+
 static int pagesize;
 static unsigned int local_shm_counter = 0;
 
@@ -136,6 +155,10 @@ static void remap_shm(void)
 	clients = (clientsDataStruct*)shm_clients.ptr;
 	realloc_shm(&shm_forwarded, counters->forwarded_MAX*sizeof(forwardedDataStruct), false);
 	forwarded = (forwardedDataStruct*)shm_forwarded.ptr;
+	realloc_shm(&shm_postings, counters->postings_MAX*sizeof(postingsDataStruct), false);
+	postings = (postingsDataStruct*)shm_postings.ptr;
+	realloc_shm(&shm_clientOverTime, counters->clientOverTime_MAX*sizeof(clientOverTimeDataStruct), false);
+	clientOverTime = (clientOverTimeDataStruct*)shm_clientOverTime.ptr;
 	realloc_shm(&shm_strings, counters->strings_MAX, false);
 	// strings are not exposed by a global pointer
 
@@ -143,6 +166,60 @@ static void remap_shm(void)
 	local_shm_counter = shmSettings->global_shm_counter;
 }
 
+static unsigned long long lock_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void account_lock_time(lockTiming *timing, const unsigned long long ns)
+{
+	const unsigned long long us = ns / 1000ULL;
+	unsigned int bin = us == 0 ? 0 : 64 - __builtin_clzll(us);
+	if(bin >= LOCK_HIST_BINS)
+		bin = LOCK_HIST_BINS - 1;
+
+	timing->count++;
+	timing->total_ns += ns;
+	if(ns > timing->max_ns)
+		timing->max_ns = ns;
+	timing->hist[bin]++;
+}
+
+// Call sites are identified by the address of their __FILE__ literal and
+// their line. Both are the same in all processes as FTL forks but never
+// execs, so the table can live in the shared lock object
+static int get_lock_site(const char *function, const char *file, const int line)
+{
+	unsigned int idx = (unsigned int)(((unsigned long)file >> 3) * 31U + line) % LOCK_SITES;
+	for(unsigned int i = 0; i < LOCK_SITES; i++, idx = (idx + 1) % LOCK_SITES)
+	{
+		lockSite *site = &shmLock->sites[idx];
+		if(site->file == file && site->line == line)
+			return idx;
+		if(site->file == NULL)
+		{
+			site->function = function;
+			site->file = file;
+			site->line = line;
+			return idx;
+		}
+	}
+
+	// Table full, this call site is not accounted
+	return -1;
+}
+
+unsigned int get_lock_stats(lockSite *sites)
+{
+	unsigned int n = 0;
+	for(unsigned int i = 0; i < LOCK_SITES; i++)
+		if(shmLock->sites[i].file != NULL)
+			sites[n++] = shmLock->sites[i];
+	return n;
+}
+
 void _lock_shm(const char* function, const int line, const char * file) {
 	// Signal that FTL is waiting for a lock
 	shmLock->waitingForLock = true;
@@ -150,7 +227,9 @@ void _lock_shm(const char* function, const int line, const char * file) {
 	if(config.debug & DEBUG_LOCKS)
 		logg("Waiting for lock in %s() (%s:%i)", function, file, line);
 
+	const unsigned long long waiting = lock_clock();
 	int result = pthread_mutex_lock(&shmLock->lock);
+	const unsigned long long acquired = lock_clock();
 
 	if(config.debug & DEBUG_LOCKS)
 		logg("Obtained lock for %s() (%s:%i)", function, file, line);
@@ -176,10 +255,34 @@ void _lock_shm(const char* function, const int line, const char * file) {
 	}
 
 	if(result != 0)
+	{
 		logg("Failed to obtain SHM lock: %s", strerror(result));
+		return;
+	}
+
+	// Invalidate lock-free reads running in parallel
+	__atomic_store_n(&shmLock->seq, shmLock->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	shmLock->holder = get_lock_site(function, file, line);
+	shmLock->acquired = acquired;
+	if(shmLock->holder >= 0)
+		account_lock_time(&shmLock->sites[shmLock->holder].wait, acquired - waiting);
 }
 
 void _unlock_shm(const char* function, const int line, const char * file) {
+	// Account the hold time to the call site that obtained the lock
+	const unsigned long long held = lock_clock() - shmLock->acquired;
+	const lockSite *holder = NULL;
+	if(shmLock->holder >= 0)
+	{
+		holder = &shmLock->sites[shmLock->holder];
+		account_lock_time(&shmLock->sites[shmLock->holder].hold, held);
+		shmLock->holder = -1;
+	}
+
+	__atomic_store_n(&shmLock->seq, shmLock->seq + 1, __ATOMIC_RELEASE);
+
 	int result = pthread_mutex_unlock(&shmLock->lock);
 
 	if(config.debug & DEBUG_LOCKS)
@@ -187,6 +290,52 @@ void _unlock_shm(const char* function, const int line, const char * file) {
 
 	if(result != 0)
 		logg("Failed to unlock SHM lock: %s", strerror(result));
+
+	// Log slow critical sections only after the lock has been released
+	if(holder != NULL && config.lockthreshold > 0 &&
+	   held > config.lockthreshold * 1000000ULL)
+		logg("WARNING: Lock held for %.1f ms by %s() (%s:%i)",
+		     1e-6*held, holder->function, holder->file, holder->line);
+}
+
+bool read_begin(readSnapshot *snapshot)
+{
+	__atomic_add_fetch(&active_readers, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&moving_maps, __ATOMIC_SEQ_CST))
+	{
+		__atomic_sub_fetch(&active_readers, 1, __ATOMIC_SEQ_CST);
+		return false;
+	}
+
+	snapshot->seq = __atomic_load_n(&shmLock->seq, __ATOMIC_ACQUIRE);
+	snapshot->generation = __atomic_load_n(&shmLock->generation, __ATOMIC_ACQUIRE);
+	return true;
+}
+
+bool read_end(const readSnapshot *snapshot, const bool listing)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	bool valid;
+	if(listing)
+		valid = snapshot->generation % 2 == 0 &&
+		        __atomic_load_n(&shmLock->generation, __ATOMIC_RELAXED) == snapshot->generation;
+	else
+		valid = snapshot->seq % 2 == 0 &&
+		        __atomic_load_n(&shmLock->seq, __ATOMIC_RELAXED) == snapshot->seq;
+
+	__atomic_sub_fetch(&active_readers, 1, __ATOMIC_SEQ_CST);
+	return valid;
+}
+
+void move_shm_begin(void)
+{
+	__atomic_store_n(&shmLock->generation, shmLock->generation + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void move_shm_end(void)
+{
+	__atomic_store_n(&shmLock->generation, shmLock->generation + 1, __ATOMIC_RELEASE);
 }
 
 bool init_shmem(void)
@@ -196,26 +345,29 @@ bool init_shmem(void)
 
 	/****************************** shared memory lock ******************************/
 	// Try to create shared memory object
-	shm_lock = create_shm(SHARED_LOCK_NAME, sizeof(ShmLock));
+	shm_lock = create_shm(SHARED_LOCK_NAME, sizeof(ShmLock), 0);
 	shmLock = (ShmLock*) shm_lock.ptr;
 	shmLock->lock = create_mutex();
 	shmLock->waitingForLock = false;
+	shmLock->holder = -1;
+	shmLock->seq = 0;
+	shmLock->generation = 0;
 
 	/****************************** shared counters struct ******************************/
 	// Try to create shared memory object
-	shm_counters = create_shm(SHARED_COUNTERS_NAME, sizeof(countersStruct));
+	shm_counters = create_shm(SHARED_COUNTERS_NAME, sizeof(countersStruct), 0);
 	counters = (countersStruct*)shm_counters.ptr;
 
 	/****************************** shared settings struct ******************************/
 	// Try to create shared memory object
-	shm_settings = create_shm(SHARED_SETTINGS_NAME, sizeof(ShmSettings));
+	shm_settings = create_shm(SHARED_SETTINGS_NAME, sizeof(ShmSettings), 0);
 	shmSettings = (ShmSettings*)shm_settings.ptr;
 	shmSettings->version = SHARED_MEMORY_VERSION;
 	shmSettings->global_shm_counter = 0;
 
 	/****************************** shared strings buffer ******************************/
 	// Try to create shared memory object
-	shm_strings = create_shm(SHARED_STRINGS_NAME, pagesize);
+	shm_strings = create_shm(SHARED_STRINGS_NAME, pagesize, SHM_RESERVE);
 	counters->strings_MAX = pagesize;
 
 	// Initialize shared string object with an empty string at position zero
@@ -224,37 +376,63 @@ bool init_shmem(void)
 
 	/****************************** shared domains struct ******************************/
 	// Try to create shared memory object
-	shm_domains = create_shm(SHARED_DOMAINS_NAME, pagesize*sizeof(domainsDataStruct));
+	shm_domains = create_shm(SHARED_DOMAINS_NAME, pagesize*sizeof(domainsDataStruct), SHM_RESERVE);
 	domains = (domainsDataStruct*)shm_domains.ptr;
 	counters->domains_MAX = pagesize;
 
 	/****************************** shared clients struct ******************************/
 	size_t size = get_optimal_object_size(sizeof(clientsDataStruct), 1);
 	// Try to create shared memory object
-	shm_clients = create_shm(SHARED_CLIENTS_NAME, size*sizeof(clientsDataStruct));
+	shm_clients = create_shm(SHARED_CLIENTS_NAME, size*sizeof(clientsDataStruct), SHM_RESERVE);
 	clients = (clientsDataStruct*)shm_clients.ptr;
 	counters->clients_MAX = size;
 
 	/****************************** shared forwarded struct ******************************/
 	size = get_optimal_object_size(sizeof(forwardedDataStruct), 1);
 	// Try to create shared memory object
-	shm_forwarded = create_shm(SHARED_FORWARDED_NAME, size*sizeof(forwardedDataStruct));
+	shm_forwarded = create_shm(SHARED_FORWARDED_NAME, size*sizeof(forwardedDataStruct), SHM_RESERVE);
 	forwarded = (forwardedDataStruct*)shm_forwarded.ptr;
 	counters->forwarded_MAX = size;
 
 	/****************************** shared queries struct ******************************/
 	// Try to create shared memory object
-	shm_queries = create_shm(SHARED_QUERIES_NAME, pagesize*sizeof(queriesDataStruct));
+	shm_queries = create_shm(SHARED_QUERIES_NAME, pagesize*sizeof(queriesDataStruct), SHM_RESERVE);
 	queries = (queriesDataStruct*)shm_queries.ptr;
 	counters->queries_MAX = pagesize;
 
 	/****************************** shared overTime struct ******************************/
 	size = get_optimal_object_size(sizeof(overTimeDataStruct), OVERTIME_SLOTS);
 	// Try to create shared memory object
-	shm_overTime = create_shm(SHARED_OVERTIME_NAME, size*sizeof(overTimeDataStruct));
+	shm_overTime = create_shm(SHARED_OVERTIME_NAME, size*sizeof(overTimeDataStruct), 0);
 	overTime = (overTimeDataStruct*)shm_overTime.ptr;
 	initOverTime();
 
+	/****************************** shared postings struct ******************************/
+	size = get_optimal_object_size(sizeof(postingsDataStruct), 1);
+	// Try to create shared memory object
+	shm_postings = create_shm(SHARED_POSTINGS_NAME, size*sizeof(postingsDataStruct), SHM_RESERVE);
+	postings = (postingsDataStruct*)shm_postings.ptr;
+	counters->postings_MAX = size;
+	// Chunk 0 marks the end of a list
+	counters->postings = 1;
+	counters->postings_free = 0;
+
+	/****************************** shared client overTime struct ******************************/
+	size = get_optimal_object_size(sizeof(clientOverTimeDataStruct), 1);
+	// Try to create shared memory object
+	shm_clientOverTime = create_shm(SHARED_CLIENT_OVERTIME_NAME, size*sizeof(clientOverTimeDataStruct), SHM_RESERVE);
+	clientOverTime = (clientOverTimeDataStruct*)shm_clientOverTime.ptr;
+	counters->clientOverTime_MAX = size;
+	// Chunk 0 marks the end of a list
+	counters->clientOverTime = 1;
+	counters->clientOverTime_free = 0;
+
+	/****************************** shared query stream ******************************/
+	// Try to create shared memory object
+	shm_stream = create_shm(SHARED_STREAM_NAME, sizeof(streamDataStruct), 0);
+	querystream = (streamDataStruct*)shm_stream.ptr;
+	querystream->head = 0;
+
 	return true;
 }
 
@@ -272,9 +450,12 @@ void destroy_shmem(void)
 	delete_shm(&shm_forwarded);
 	delete_shm(&shm_overTime);
 	delete_shm(&shm_settings);
+	delete_shm(&shm_postings);
+	delete_shm(&shm_clientOverTime);
+	delete_shm(&shm_stream);
 }
 
-SharedMemory create_shm(const char *name, size_t size)
+SharedMemory create_shm(const char *name, size_t size, size_t reserve)
 {
 	if(config.debug & DEBUG_SHMEM)
 		logg("Creating shared memory with name \"%s\" and size %zu", name, size);
@@ -282,6 +463,7 @@ SharedMemory create_shm(const char *name, size_t size)
 	SharedMemory sharedMemory = {
 		.name = name,
 		.size = size,
+		.reserved = reserve > size ? reserve : size,
 		.ptr = NULL
 	};
 
@@ -317,8 +499,10 @@ SharedMemory create_shm(const char *name, size_t size)
 		exit(EXIT_FAILURE);
 	}
 
-	// Create shared memory mapping
-	void *shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	// Create shared memory mapping covering the full reservation. Pages
+	// beyond the end of the object become usable once the object grows
+	void *shm = mmap(NULL, sharedMemory.reserved, PROT_READ | PROT_WRITE,
+	                 MAP_SHARED | MAP_NORESERVE, fd, 0);
 
 	// Check for `mmap` error
 	if(shm == MAP_FAILED)
@@ -369,6 +553,18 @@ void *enlarge_shmem_struct(char type)
 			sizeofobj = sizeof(forwardedDataStruct);
 			counter = &counters->forwarded_MAX;
 			break;
+		case POSTINGS:
+			sharedMemory = &shm_postings;
+			allocation_step = get_optimal_object_size(sizeof(postingsDataStruct), 1);
+			sizeofobj = sizeof(postingsDataStruct);
+			counter = &counters->postings_MAX;
+			break;
+		case CLIENTOVERTIME:
+			sharedMemory = &shm_clientOverTime;
+			allocation_step = get_optimal_object_size(sizeof(clientOverTimeDataStruct), 1);
+			sizeofobj = sizeof(clientOverTimeDataStruct);
+			counter = &counters->clientOverTime_MAX;
+			break;
 		default:
 			logg("Invalid argument in enlarge_shmem_struct(): %i", type);
 			return 0;
@@ -426,7 +622,25 @@ bool realloc_shm(SharedMemory *sharedMemory, size_t size, bool resize)
 		local_shm_counter++;
 	}
 
-	void *new_ptr = mremap(sharedMemory->ptr, sharedMemory->size, size, MREMAP_MAYMOVE);
+	// The whole reservation is mapped already, only the size changes
+	if(size <= sharedMemory->reserved)
+	{
+		sharedMemory->size = size;
+		return true;
+	}
+
+	// The object outgrew its reservation and the mapping has to move. Stop
+	// lock-free reading in this process and wait for the active readers
+	if(!__atomic_load_n(&moving_maps, __ATOMIC_SEQ_CST))
+	{
+		logg("Notice: \"%s\" exceeds its reserved size of %zu bytes, API readers will lock from now on",
+		     sharedMemory->name, sharedMemory->reserved);
+		__atomic_store_n(&moving_maps, true, __ATOMIC_SEQ_CST);
+	}
+	while(__atomic_load_n(&active_readers, __ATOMIC_SEQ_CST) > 0)
+		sched_yield();
+
+	void *new_ptr = mremap(sharedMemory->ptr, sharedMemory->reserved, size, MREMAP_MAYMOVE);
 	if(new_ptr == MAP_FAILED)
 	{
 		logg("FATAL: realloc_shm(): mremap(%p, %zu, %zu, MREMAP_MAYMOVE): Failed to reallocate \"%s\": %s",
@@ -437,6 +651,7 @@ bool realloc_shm(SharedMemory *sharedMemory, size_t size, bool resize)
 
 	sharedMemory->ptr = new_ptr;
 	sharedMemory->size = size;
+	sharedMemory->reserved = size;
 
 	return true;
 }
@@ -445,9 +660,9 @@ void delete_shm(SharedMemory *sharedMemory)
 {
 	// Unmap shared memory
 	int ret;
-	ret = munmap(sharedMemory->ptr, sharedMemory->size);
+	ret = munmap(sharedMemory->ptr, sharedMemory->reserved);
 	if(ret != 0)
-		logg("delete_shm(): munmap(%p, %zu) failed: %s", sharedMemory->ptr, sharedMemory->size, strerror(errno));
+		logg("delete_shm(): munmap(%p, %zu) failed: %s", sharedMemory->ptr, sharedMemory->reserved, strerror(errno));
 
 	// Now you can no longer `shm_open` the memory,
 	// and once all others unlink, it will be destroyed.
@@ -18,16 +18,27 @@
 typedef struct {
     const char *name;
     size_t size;
+    size_t reserved;
     void *ptr;
 } SharedMemory;
 
+/// Address space reserved for objects which grow at runtime. The object
+/// can grow up to this size without its mapping moving
+#if __SIZEOF_POINTER__ >= 8
+#define SHM_RESERVE (4ULL << 30)
+#else
+#define SHM_RESERVE (64U << 20)
+#endif
+
 /// Create shared memory
 ///
 /// \param name the name of the shared memory
 /// \param size the size to allocate
+/// \param reserve the size of the address range to map, the object can grow
+/// up to this size without moving. Values smaller than size are ignored
 /// \return a structure with a pointer to the mounted shared memory. The pointer
 /// will always be valid, because if it failed FTL will have exited.
-SharedMemory create_shm(const char *name, size_t size);
+SharedMemory create_shm(const char *name, size_t size, size_t reserve);
 
 /// Reallocate shared memory
 ///
@@ -42,6 +53,62 @@ bool realloc_shm(SharedMemory *sharedMemory, size_t size, bool resize);
 /// \param sharedMemory the shared memory struct
 void delete_shm(SharedMemory *sharedMemory);
 
+/// Lock statistics are kept per lock_shm() call site. Histogram bin 0
+/// counts times below 1 µs, bin k counts [2^(k-1), 2^k) µs, the last bin
+/// everything above
+#define LOCK_SITES 256
+#define LOCK_HIST_BINS 24
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned int hist[LOCK_HIST_BINS];
+} lockTiming;
+
+typedef struct {
+    const char *function;
+    const char *file;
+    int line;
+    lockTiming wait;
+    lockTiming hold;
+} lockSite;
+
+/// Copy the lock statistics of all call sites seen so far. Hold times are
+/// accounted to the site that obtained the lock. Call this with the lock held.
+///
+/// \param sites array with room for LOCK_SITES entries
+/// \return the number of sites copied
+unsigned int get_lock_stats(lockSite *sites);
+
+/// API readers do not need to take the lock. They note the state of the
+/// shared memory before reading and check afterwards that no conflicting
+/// write happened in the meantime. A snapshot is invalidated by every
+/// locked write, a listing only by writers moving or removing data
+typedef struct {
+    unsigned int seq;
+    unsigned int generation;
+} readSnapshot;
+
+/// Start reading without the lock
+///
+/// \param snapshot state of the shared memory to compare against later
+/// \return false if the shared memory can currently not be read without the
+/// lock, read_end() must not be called in this case
+bool read_begin(readSnapshot *snapshot);
+
+/// Finish reading without the lock
+///
+/// \param snapshot state returned by read_begin()
+/// \param listing whether only moved or removed data invalidates the read
+/// \return true if no conflicting write happened while reading
+bool read_end(const readSnapshot *snapshot, const bool listing);
+
+/// Enclose code moving or removing data from the shared memory objects to
+/// invalidate lock-free listings running in parallel. Call with the lock held
+void move_shm_begin(void);
+void move_shm_end(void);
+
 /// Block until a lock can be obtained
 #define lock_shm() _lock_shm(__FUNCTION__, __LINE__, __FILE__);
 void _lock_shm(const char* func, const int line, const char* file);
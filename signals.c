@@ -16,6 +16,9 @@ time_t FTLstarttime = 0;
 
 static void SIGSEGV_handler(int sig, siginfo_t *si, void *unused)
 {
+	// Write pending log lines and bypass the writer thread from now on
+	flush_FTL_log();
+
 	logg("!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!");
 	logg("---------------------------->  FTL crashed!  <----------------------------");
 	logg("!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!");
@@ -209,6 +209,72 @@ void seom(int sock)
 		pack_eom(sock);
 }
 
+// The output of a request can be held back while it is produced. API
+// readers not holding the lock discard it when the data they were
+// reading changed in the meantime and start over
+static __thread struct {
+	bool active;
+	char *data;
+	size_t len;
+	size_t size;
+} capture = { false, NULL, 0, 0 };
+
+void capture_output(void)
+{
+	capture.active = true;
+	capture.len = 0;
+}
+
+void discard_output(void)
+{
+	capture.len = 0;
+}
+
+void flush_output(int sock)
+{
+	capture.active = false;
+	for(size_t done = 0; done < capture.len; )
+	{
+		const ssize_t ret = write(sock, capture.data + done, capture.len - done);
+		if(ret <= 0)
+		{
+			logg("WARNING: Socket write returned error %s (%i)", strerror(errno), errno);
+			break;
+		}
+		done += ret;
+	}
+
+	if(capture.data != NULL)
+		free(capture.data);
+	capture.data = NULL;
+	capture.len = capture.size = 0;
+}
+
+static ssize_t sock_write(int sock, const void *buffer, size_t len)
+{
+	if(!capture.active)
+		return write(sock, buffer, len);
+
+	if(capture.len + len > capture.size)
+	{
+		size_t size = capture.size > 0 ? capture.size : 4096;
+		while(size < capture.len + len)
+			size *= 2;
+		char *data = realloc(capture.data, size);
+		if(data == NULL)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+		capture.data = data;
+		capture.size = size;
+	}
+
+	memcpy(capture.data + capture.len, buffer, len);
+	capture.len += len;
+	return len;
+}
+
 void __attribute__ ((format (gnu_printf, 2, 3))) ssend(int sock, const char *format, ...)
 {
 	char *buffer;
@@ -218,14 +284,14 @@ void __attribute__ ((format (gnu_printf, 2, 3))) ssend(int sock, const char *for
 	va_end(args);
 	if(ret > 0)
 	{
-		if(!write(sock, buffer, strlen(buffer)))
+		if(!sock_write(sock, buffer, strlen(buffer)))
 			logg("WARNING: Socket write returned error %s (%i)", strerror(errno), errno);
 		free(buffer);
 	}
 }
 
 void swrite(int sock, const void *value, size_t size) {
-	if(write(sock, value, size) == -1)
+	if(sock_write(sock, value, size) == -1)
 		logg("WARNING: Socket write returned error code %i", errno);
 }
 
@@ -0,0 +1,276 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2019 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Synthetic replay benchmark for the resolver hooks
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "dnsmasq_interface.h"
+#include "shmem.h"
+#include "timing.h"
+#include <getopt.h>
+#include <math.h>
+
+// Replays a synthetic query mix through the same FTL_* hooks dnsmasq
+// calls and reports the time spent in each of them. No sockets, no
+// upstream servers: only FTL's own bookkeeping is measured.
+
+enum { HOOK_NEW_QUERY, HOOK_FORWARDED, HOOK_REPLY, HOOK_CACHE, HOOK_MAX };
+static const char *hooknames[HOOK_MAX] = { "new_query", "forwarded", "reply", "cache" };
+
+typedef struct {
+	unsigned long calls;
+	unsigned long long ns;
+} hookStats;
+
+static hookStats stats[HOOK_MAX];
+
+static unsigned long long rng_state = 0x9E3779B97F4A7C15ULL;
+
+// xorshift64*
+static unsigned long long rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static double rng_unit(void)
+{
+	return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Cumulative Zipf distribution over n items (s = 0 is uniform)
+static double *zipf_cdf(const unsigned int n, const double s)
+{
+	double *cdf = calloc(n, sizeof(double));
+	if(cdf == NULL)
+		return NULL;
+
+	double sum = 0.0;
+	for(unsigned int k = 0; k < n; k++)
+	{
+		sum += 1.0 / pow(k + 1, s);
+		cdf[k] = sum;
+	}
+	for(unsigned int k = 0; k < n; k++)
+		cdf[k] /= sum;
+
+	return cdf;
+}
+
+static unsigned int __attribute__((pure)) zipf_pick(const double *cdf, const unsigned int n, const double u)
+{
+	unsigned int lo = 0, hi = n - 1;
+	while(lo < hi)
+	{
+		const unsigned int mid = (lo + hi) / 2;
+		if(cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Passes over the query log when measuring the scan speed
+#define SCAN_ROUNDS 20
+
+#define TIMED(hook, call) do { \
+	const unsigned long long t0 = now_ns(); \
+	call; \
+	stats[hook].ns += now_ns() - t0; \
+	stats[hook].calls++; \
+} while(0)
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options]\n", name);
+	printf("  -n <queries>    number of queries to replay (default 1000000)\n");
+	printf("  -d <domains>    number of distinct domains (default 10000)\n");
+	printf("  -c <clients>    number of distinct clients (default 50)\n");
+	printf("  -z <exponent>   Zipf exponent of the domain popularity, 0 = uniform (default 1.0)\n");
+	printf("  -m <c:f:b>      ratio of cached:forwarded:blocked queries (default 40:45:15)\n");
+	printf("  -s <seed>       random seed\n");
+	printf("  -l <file>       log file (default /dev/null)\n");
+	printf("  -t              also record and print FTL's own per-stage timing (HOOK_TIMING)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int nqueries = 1000000, ndomains = 10000, nclients = 50;
+	unsigned int mix[3] = { 40, 45, 15 };
+	double zipf = 1.0;
+	const char *logfile = "/dev/null";
+	bool stages = false;
+	int opt;
+
+	while((opt = getopt(argc, argv, "n:d:c:z:m:s:l:th")) != -1)
+	{
+		switch(opt)
+		{
+			case 'n': nqueries = strtoul(optarg, NULL, 10); break;
+			case 'd': ndomains = strtoul(optarg, NULL, 10); break;
+			case 'c': nclients = strtoul(optarg, NULL, 10); break;
+			case 'z': zipf = atof(optarg); break;
+			case 'm':
+				if(sscanf(optarg, "%u:%u:%u", &mix[0], &mix[1], &mix[2]) != 3)
+				{
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 's': rng_state = strtoull(optarg, NULL, 10) | 1; break;
+			case 'l': logfile = optarg; break;
+			case 't': stages = true; break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	const unsigned int mixsum = mix[0] + mix[1] + mix[2];
+	if(nqueries == 0 || ndomains == 0 || nclients == 0 || nclients > 65536 || mixsum == 0)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// Set up FTL the way main() does, minus the resolver and the database
+	FTLfiles.log = strdup(logfile);
+	open_FTL_log(false);
+	read_FTLconf();
+	if(!init_shmem())
+		return EXIT_FAILURE;
+	if(stages)
+		config.hooktiming = true;
+
+	// Pre-generate names and addresses so only the hooks are timed
+	char **domainnames = calloc(ndomains, sizeof(char*));
+	struct all_addr *clientaddr = calloc(nclients, sizeof(struct all_addr));
+	double *cdf = zipf_cdf(ndomains, zipf);
+	if(domainnames == NULL || clientaddr == NULL || cdf == NULL)
+		return EXIT_FAILURE;
+	for(unsigned int i = 0; i < ndomains; i++)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "host%u.domain%u.example", i, i % 97);
+		domainnames[i] = strdup(name);
+	}
+	for(unsigned int i = 0; i < nclients; i++)
+		clientaddr[i].addr.addr4.s_addr = htonl(0x0A000000 | (i + 1));
+
+	struct all_addr upstream, answer, nulladdr;
+	memset(&upstream, 0, sizeof(upstream));
+	memset(&answer, 0, sizeof(answer));
+	memset(&nulladdr, 0, sizeof(nulladdr));
+	upstream.addr.addr4.s_addr = htonl(0x08080808);
+	answer.addr.addr4.s_addr = htonl(0xC0000201);
+	char query_A[] = "query[A]";
+	char gravity[] = "/etc/pihole/gravity.list";
+
+	const unsigned long long start = now_ns();
+	for(unsigned int id = 1; id <= nqueries; id++)
+	{
+		char *domain = domainnames[zipf_pick(cdf, ndomains, rng_unit())];
+		struct all_addr *client = &clientaddr[rng() % nclients];
+		const unsigned int kind = rng() % mixsum;
+
+		TIMED(HOOK_NEW_QUERY, FTL_new_query(F_QUERY | F_IPV4 | F_FORWARD, domain, client, query_A, id, UDP));
+
+		if(kind < mix[0])
+			// Answered from the cache
+			TIMED(HOOK_CACHE, FTL_cache(F_FORWARD | F_IPV4, domain, &answer, NULL, id));
+		else if(kind < mix[0] + mix[1])
+		{
+			// Forwarded and answered by the upstream server
+			TIMED(HOOK_FORWARDED, FTL_forwarded(F_SERVER | F_IPV4 | F_FORWARD, domain, &upstream, id));
+			TIMED(HOOK_REPLY, FTL_reply(F_FORWARD | F_IPV4, domain, &answer, id));
+		}
+		else
+			// Blocked by gravity
+			TIMED(HOOK_CACHE, FTL_cache(F_HOSTS | F_IMMORTAL | F_IPV4, domain, &nulladdr, gravity, id));
+	}
+	const unsigned long long elapsed = now_ns() - start;
+
+	// Timer overhead, subtracted from the per-hook numbers
+	unsigned long long overhead = now_ns();
+	for(int i = 0; i < 100000; i++)
+		now_ns();
+	overhead = (now_ns() - overhead) / 100000;
+
+	unsigned long long hookns = 0;
+	printf("%-12s %12s %12s\n", "hook", "calls", "ns/op");
+	for(int i = 0; i < HOOK_MAX; i++)
+	{
+		const double per = stats[i].calls > 0 ?
+		                   (double)stats[i].ns / stats[i].calls - overhead : 0.0;
+		printf("%-12s %12lu %12.1f\n", hooknames[i], stats[i].calls, per);
+		hookns += stats[i].ns - stats[i].calls * overhead;
+	}
+
+	if(stages)
+	{
+		timingStats timing[TIMING_MAX];
+		get_timing(timing);
+		printf("\n%-14s %12s %12s %12s\n", "stage", "calls", "ns/op", "max ns");
+		for(int i = 0; i < TIMING_MAX; i++)
+			printf("%-14s %12llu %12.1f %12llu\n", timingnames[i], timing[i].count,
+			       timing[i].count > 0 ? (double)timing[i].total_ns / timing[i].count : 0.0,
+			       timing[i].max_ns);
+	}
+
+	// Walk the query log like filtered API requests and the garbage
+	// collector do, looking at the timestamp, client and status of each row
+	const time_t mintime = time(NULL) - 3600;
+	unsigned long matches = 0;
+	const unsigned long long scanstart = now_ns();
+	for(unsigned int r = 0; r < SCAN_ROUNDS; r++)
+		for(int i = 0; i < counters->queries; i++)
+			if(queries[i].timestamp > mintime &&
+			   queries[i].clientID == (int)(r % nclients) &&
+			   queries[i].status != QUERY_UNKNOWN)
+				matches++;
+	const double scanns = (double)(now_ns() - scanstart) / SCAN_ROUNDS / counters->queries;
+
+	// Mapped shared memory, as sized by FTL's own growth logic
+	const size_t shmbytes = (size_t)counters->strings_MAX +
+	                        counters->domains_MAX * sizeof(domainsDataStruct) +
+	                        counters->clients_MAX * sizeof(clientsDataStruct) +
+	                        counters->queries_MAX * sizeof(queriesDataStruct) +
+	                        counters->forwarded_MAX * sizeof(forwardedDataStruct) +
+	                        counters->postings_MAX * sizeof(postingsDataStruct) +
+	                        counters->clientOverTime_MAX * sizeof(clientOverTimeDataStruct) +
+	                        OVERTIME_SLOTS * sizeof(overTimeDataStruct) +
+	                        sizeof(countersStruct);
+
+	printf("\nqueries: %u (domains %i, clients %i, forward destinations %i)\n",
+	       nqueries, counters->domains, counters->clients, counters->forwarded);
+	printf("counted: %i blocked, %i cached, %i forwarded, %i unknown\n",
+	       counters->blocked, counters->cached, counters->forwardedqueries, counters->unknown);
+	printf("hook time: %.1f ns/query, %.0f queries/s\n",
+	       (double)hookns / nqueries, nqueries / (hookns / 1e9));
+	printf("wall time: %.1f ns/query, %.0f queries/s\n",
+	       (double)elapsed / nqueries, nqueries / (elapsed / 1e9));
+	printf("shared memory: %zu bytes, %.1f bytes/query\n",
+	       shmbytes, (double)shmbytes / nqueries);
+	printf("log scan: %.2f ns/query (%lu matches in %u rounds)\n",
+	       scanns, matches, SCAN_ROUNDS);
+
+	destroy_shmem();
+	return EXIT_SUCCESS;
+}
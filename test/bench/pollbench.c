@@ -0,0 +1,140 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2019 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Benchmark for the main loop's poll_* wrapper
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "dnsmasq/dnsmasq.h"
+#include <getopt.h>
+#include <sys/resource.h>
+
+// Runs full poll_reset()/poll_listen()/do_poll()/poll_check() rounds
+// over N idle socketpairs plus one readable socket, with a zero timeout,
+// the way dnsmasq's main loop does. Linked once against dnsmasq/poll.c
+// as built (poll() backend) and once built with -DHAVE_EPOLL.
+
+// util.c
+void *whine_malloc(size_t size)
+{
+	return calloc(1, size);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options]\n", name);
+	printf("  -f <n,n,...>    numbers of idle socketpairs to poll (default 10,100,1000,5000)\n");
+	printf("  -r <rounds>     poll rounds per measurement (default 2000)\n");
+}
+
+static int bench_fds(const int nfds, const unsigned int rounds)
+{
+	int *fds = calloc(2*nfds + 2, sizeof(int));
+	if(fds == NULL)
+		return -1;
+
+	int opened = 0;
+	for(int i = 0; i < nfds + 1; i++, opened += 2)
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[2*i]) == -1)
+		{
+			perror("socketpair");
+			break;
+		}
+
+	unsigned long hits = 0;
+	unsigned long long elapsed = 0;
+	if(opened == 2*nfds + 2)
+	{
+		// The last pair has data waiting
+		const int ready = fds[2*nfds];
+		if(write(fds[2*nfds + 1], "x", 1) != 1)
+			perror("write");
+
+		// One warm-up round, then the measured ones
+		for(unsigned int r = 0; r <= rounds; r++)
+		{
+			const unsigned long long t0 = now_ns();
+			poll_reset();
+			for(int i = 0; i <= nfds; i++)
+				poll_listen(fds[2*i], POLLIN);
+			do_poll(0);
+			for(int i = 0; i <= nfds; i++)
+				if(poll_check(fds[2*i], POLLIN))
+					hits += fds[2*i] == ready;
+			if(r == 0)
+				hits = 0;
+			else
+				elapsed += now_ns() - t0;
+		}
+
+		printf("%8i %12.2f %10lu\n", nfds, (double)elapsed / rounds / 1000.0, hits);
+	}
+
+	for(int i = 0; i < opened; i++)
+	{
+		poll_forget(fds[i]);
+		close(fds[i]);
+	}
+	free(fds);
+
+	return opened == 2*nfds + 2 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	char defaultfds[] = "10,100,1000,5000";
+	char *fdlist = defaultfds;
+	unsigned int rounds = 2000;
+	int opt;
+
+	while((opt = getopt(argc, argv, "f:r:h")) != -1)
+	{
+		switch(opt)
+		{
+			case 'f': fdlist = optarg; break;
+			case 'r': rounds = strtoul(optarg, NULL, 10); break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if(rounds == 0)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// Two descriptors per socketpair
+	struct rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+#ifdef HAVE_EPOLL
+	printf("backend: epoll\n");
+#else
+	printf("backend: poll\n");
+#endif
+	printf("%8s %12s %10s\n", "fds", "us/round", "hits");
+
+	for(char *tok = strtok(fdlist, ","); tok != NULL; tok = strtok(NULL, ","))
+	{
+		const int nfds = atoi(tok);
+		if(nfds < 0 || bench_fds(nfds, rounds) != 0)
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
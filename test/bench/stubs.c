@@ -0,0 +1,95 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2019 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Stand-ins for the resolver and database parts not linked into the benchmark
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "sqlite3.h"
+
+// main.c
+static char benchuser[] = "bench";
+char * username = benchuser;
+
+// args.c (keep the log off stdout)
+bool daemonmode = true;
+
+// database.c
+bool database = false;
+bool DBdeleteoldqueries = false;
+long int lastdbindex = 0;
+
+int __attribute__((const)) get_number_of_queries_in_DB(void)
+{
+	return 0;
+}
+
+void * __attribute__((const)) DB_thread(void *val)
+{
+	return NULL;
+}
+
+const char * __attribute__((const)) sqlite3_libversion(void)
+{
+	return "none";
+}
+
+// networktable.c
+void updateMACVendorRecords(void)
+{
+}
+
+// dnsmasq.c
+static struct daemon bench_daemon;
+struct daemon *daemon = &bench_daemon;
+
+// cache.c (the prototypes are local to dnsmasq_interface.c)
+void add_hosts_entry(struct crec *cache, struct all_addr *addr, int addrlen, unsigned int index, struct crec **rhash, int hashsz);
+void rehash(int size);
+
+const struct cache_shard * __attribute__((const)) cache_get_shard(int shard)
+{
+	static struct cache_shard empty;
+	return &empty;
+}
+
+void add_hosts_entry(struct crec *cache, struct all_addr *addr, int addrlen, unsigned int index, struct crec **rhash, int hashsz)
+{
+}
+
+void rehash(int size)
+{
+}
+
+// Keep the shared memory objects of the benchmark apart from a
+// pihole-FTL possibly running on the same machine. The real functions
+// are reached via the linker's --wrap option
+int __real_shm_open(const char *name, int oflag, mode_t mode);
+int __real_shm_unlink(const char *name);
+int __wrap_shm_open(const char *name, int oflag, mode_t mode);
+int __wrap_shm_unlink(const char *name);
+
+static const char *bench_shm_name(const char *name, char *buffer, size_t len)
+{
+	snprintf(buffer, len, "/FTL-bench-%ld-%s", (long)getpid(), name + 1);
+	return buffer;
+}
+
+int __wrap_shm_open(const char *name, int oflag, mode_t mode)
+{
+	char buffer[64];
+	return __real_shm_open(bench_shm_name(name, buffer, sizeof(buffer)), oflag, mode);
+}
+
+int __wrap_shm_unlink(const char *name)
+{
+	char buffer[64];
+	return __real_shm_unlink(bench_shm_name(name, buffer, sizeof(buffer)));
+}
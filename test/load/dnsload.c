@@ -0,0 +1,1384 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2019 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  End-to-end DNS load generator with a stand-in upstream resolver
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../../hash.h"
+
+// Starts pihole-FTL in a scratch directory, points it at a fake upstream
+// resolver running inside this process and drives UDP and TCP queries
+// through it at a fixed rate. Queries come either from a synthetic
+// domain/client distribution or from a pcap written by dnsmasq's
+// --dumpfile. Afterwards, FTL's >stats counters are compared against what
+// was actually sent.
+
+#define MAXPACKET 4096
+#define MAXCLIENTS 1000
+#define MAXANSWERS 64
+#define STARTUP_TIMEOUT 30
+
+typedef struct {
+	// Load
+	unsigned long queries;
+	double rate;
+	double duration;
+	unsigned int domains;
+	unsigned int clients;
+	double zipf;
+	double blocked;
+	double aaaa;
+	double tcp;
+	unsigned int tcpworkers;
+	unsigned int timeout_ms;
+	unsigned long long seed;
+	const char *pcap;
+	double speed;
+	// Stand-in upstream
+	double latency_ms;
+	double jitter_ms;
+	double loss;
+	double nxdomain;
+	unsigned int ttl;
+	// pihole-FTL
+	const char *ftl;
+	const char *workdir;
+	bool keep;
+	bool external;
+	unsigned short dnsport;
+	unsigned short upstreamport;
+	unsigned short apiport;
+} loadConfig;
+
+static loadConfig conf = {
+	.rate = 1000.0, .duration = 10.0, .domains = 10000, .clients = 20, .zipf = 1.0,
+	.blocked = 10.0, .aaaa = 0.0, .tcp = 0.0, .tcpworkers = 4, .timeout_ms = 2000,
+	.seed = 0x9E3779B97F4A7C15ULL, .speed = 0.0, .latency_ms = 20.0, .jitter_ms = 0.0,
+	.loss = 0.0, .nxdomain = 0.0, .ttl = 300, .ftl = "./pihole-FTL",
+	.dnsport = 5355, .upstreamport = 5356, .apiport = 4712
+};
+
+// Answer sets of the stand-in upstream
+static struct in_addr answers4[MAXANSWERS];
+static struct in6_addr answers6[MAXANSWERS];
+static unsigned int nanswers4 = 0, nanswers6 = 0;
+
+static volatile sig_atomic_t interrupted = 0;
+
+/* ---------------------------------------------------------------------
+ * Helpers
+ * ------------------------------------------------------------------- */
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(const unsigned long long ns)
+{
+	struct timespec ts = { .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL };
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !interrupted);
+}
+
+// xorshift64*, one state per thread
+static unsigned long long rng(unsigned long long *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+static double rng_unit(unsigned long long *state)
+{
+	return (rng(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Case-insensitive variant of FTL's hash_string() over len bytes
+static uint32_t fnv1a(const unsigned char *s, const size_t len)
+{
+	uint32_t hash = HASH_FNV_OFFSET;
+	for(size_t i = 0; i < len; i++)
+		hash = hash_byte(hash, (unsigned char)tolower(s[i]));
+	return hash;
+}
+
+// Cumulative Zipf distribution over n items (s = 0 is uniform)
+static double *zipf_cdf(const unsigned int n, const double s)
+{
+	double *cdf = calloc(n, sizeof(double));
+	if(cdf == NULL)
+		return NULL;
+	double sum = 0.0;
+	for(unsigned int i = 0; i < n; i++)
+	{
+		sum += 1.0 / pow(i + 1, s);
+		cdf[i] = sum;
+	}
+	for(unsigned int i = 0; i < n; i++)
+		cdf[i] /= sum;
+	return cdf;
+}
+
+static unsigned int __attribute__((pure)) zipf_pick(const double *cdf, const unsigned int n, const double u)
+{
+	unsigned int lo = 0, hi = n - 1;
+	while(lo < hi)
+	{
+		const unsigned int mid = (lo + hi) / 2;
+		if(cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static bool read_all(const int fd, void *buf, const size_t len)
+{
+	size_t done = 0;
+	while(done < len)
+	{
+		const ssize_t ret = read(fd, (char*)buf + done, len - done);
+		if(ret <= 0)
+			return false;
+		done += ret;
+	}
+	return true;
+}
+
+static bool write_all(const int fd, const void *buf, const size_t len)
+{
+	size_t done = 0;
+	while(done < len)
+	{
+		const ssize_t ret = write(fd, (const char*)buf + done, len - done);
+		if(ret <= 0)
+			return false;
+		done += ret;
+	}
+	return true;
+}
+
+static struct sockaddr_in loopback(const uint32_t addr, const unsigned short port)
+{
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(addr);
+	sa.sin_port = htons(port);
+	return sa;
+}
+
+// Clients live in 127.1.0.0/16 so that they show up as distinct hosts
+static uint32_t client_addr(const unsigned int client)
+{
+	return 0x7F010000U + client + 1;
+}
+
+/* ---------------------------------------------------------------------
+ * Stand-in upstream resolver
+ * ------------------------------------------------------------------- */
+
+static unsigned long upstream_udp = 0, upstream_tcp = 0, upstream_dropped = 0;
+
+// Length of the question section starting at offset 12, 0 if malformed
+static size_t question_len(const unsigned char *pkt, const size_t len, size_t *namelen)
+{
+	size_t pos = 12;
+	while(pos < len && pkt[pos] != 0)
+	{
+		if((pkt[pos] & 0xC0) != 0)
+			return 0;
+		pos += pkt[pos] + 1;
+	}
+	if(pos + 5 > len)
+		return 0;
+	*namelen = pos - 12;
+	return pos + 5 - 12;
+}
+
+// Builds the answer to a query in place, returns its length or 0 to drop it
+static size_t upstream_answer(unsigned char *pkt, const size_t len, const size_t size)
+{
+	size_t namelen = 0;
+	const size_t qlen = len >= 12 ? question_len(pkt, len, &namelen) : 0;
+	if(qlen == 0 || (pkt[2] & 0x80) != 0)
+		return 0;
+
+	const unsigned char *qtail = pkt + 12 + qlen - 4;
+	const unsigned short qtype = (qtail[0] << 8) | qtail[1];
+	const uint32_t hash = fnv1a(pkt + 12, namelen);
+
+	// Keep the question, strip anything that followed it (e.g. EDNS0)
+	size_t pos = 12 + qlen;
+	pkt[2] = 0x80 | (pkt[2] & 0x79); // QR, keep opcode and RD
+	pkt[3] = 0x80; // RA, NOERROR
+	memset(pkt + 6, 0, 6); // AN, NS, AR counts
+
+	if((hash % 10000) < conf.nxdomain * 100.0)
+	{
+		pkt[3] |= 3; // NXDOMAIN
+		return pos;
+	}
+
+	const void *rdata = NULL;
+	unsigned short rdlen = 0;
+	if(qtype == 1 && nanswers4 > 0)
+	{
+		rdata = &answers4[hash % nanswers4];
+		rdlen = 4;
+	}
+	else if(qtype == 28 && nanswers6 > 0)
+	{
+		rdata = &answers6[hash % nanswers6];
+		rdlen = 16;
+	}
+
+	// Anything else is answered with NODATA
+	if(rdata == NULL || pos + 12 + rdlen > size)
+		return pos;
+
+	pkt[7] = 1;
+	const unsigned char rr[10] = {
+		0xC0, 0x0C, qtype >> 8, qtype & 0xFF, 0x00, 0x01,
+		conf.ttl >> 24, (conf.ttl >> 16) & 0xFF, (conf.ttl >> 8) & 0xFF, conf.ttl & 0xFF
+	};
+	memcpy(pkt + pos, rr, sizeof(rr));
+	pos += sizeof(rr);
+	pkt[pos++] = rdlen >> 8;
+	pkt[pos++] = rdlen & 0xFF;
+	memcpy(pkt + pos, rdata, rdlen);
+	return pos + rdlen;
+}
+
+static unsigned long long upstream_delay(unsigned long long *state)
+{
+	double ms = conf.latency_ms;
+	if(conf.jitter_ms > 0.0)
+		ms += (2.0 * rng_unit(state) - 1.0) * conf.jitter_ms;
+	return ms > 0.0 ? (unsigned long long)(ms * 1e6) : 0ULL;
+}
+
+// Delayed UDP answers are kept in a min-heap ordered by due time
+typedef struct {
+	unsigned long long due;
+	struct sockaddr_in to;
+	size_t len;
+	unsigned char *pkt;
+} delayedAnswer;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	delayedAnswer *heap;
+	size_t count, size;
+	int fd;
+} delayq = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static void delayq_push(const delayedAnswer *item)
+{
+	pthread_mutex_lock(&delayq.lock);
+	if(delayq.count == delayq.size)
+	{
+		const size_t size = delayq.size ? 2 * delayq.size : 1024;
+		delayedAnswer *heap = realloc(delayq.heap, size * sizeof(delayedAnswer));
+		if(heap == NULL)
+		{
+			pthread_mutex_unlock(&delayq.lock);
+			free(item->pkt);
+			return;
+		}
+		delayq.heap = heap;
+		delayq.size = size;
+	}
+	size_t i = delayq.count++;
+	while(i > 0 && delayq.heap[(i - 1) / 2].due > item->due)
+	{
+		delayq.heap[i] = delayq.heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	delayq.heap[i] = *item;
+	pthread_cond_signal(&delayq.cond);
+	pthread_mutex_unlock(&delayq.lock);
+}
+
+static void *delayq_thread(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&delayq.lock);
+	while(true)
+	{
+		if(delayq.count == 0)
+		{
+			pthread_cond_wait(&delayq.cond, &delayq.lock);
+			continue;
+		}
+		const unsigned long long now = now_ns();
+		if(delayq.heap[0].due > now)
+		{
+			// The condition variable uses CLOCK_REALTIME
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			const unsigned long long wait = delayq.heap[0].due - now;
+			ts.tv_sec += (ts.tv_nsec + wait) / 1000000000ULL;
+			ts.tv_nsec = (ts.tv_nsec + wait) % 1000000000ULL;
+			pthread_cond_timedwait(&delayq.cond, &delayq.lock, &ts);
+			continue;
+		}
+
+		const delayedAnswer top = delayq.heap[0];
+		const delayedAnswer last = delayq.heap[--delayq.count];
+		size_t i = 0;
+		while(2 * i + 1 < delayq.count)
+		{
+			size_t child = 2 * i + 1;
+			if(child + 1 < delayq.count && delayq.heap[child + 1].due < delayq.heap[child].due)
+				child++;
+			if(last.due <= delayq.heap[child].due)
+				break;
+			delayq.heap[i] = delayq.heap[child];
+			i = child;
+		}
+		if(delayq.count > 0)
+			delayq.heap[i] = last;
+
+		pthread_mutex_unlock(&delayq.lock);
+		sendto(delayq.fd, top.pkt, top.len, 0, (const struct sockaddr*)&top.to, sizeof(top.to));
+		free(top.pkt);
+		pthread_mutex_lock(&delayq.lock);
+	}
+	return NULL;
+}
+
+static void *upstream_udp_thread(void *arg)
+{
+	const int fd = *(int*)arg;
+	unsigned long long state = conf.seed ^ 0x5DEECE66DULL;
+	unsigned char pkt[MAXPACKET];
+
+	while(true)
+	{
+		struct sockaddr_in from;
+		socklen_t fromlen = sizeof(from);
+		const ssize_t len = recvfrom(fd, pkt, sizeof(pkt), 0, (struct sockaddr*)&from, &fromlen);
+		if(len < 0)
+			continue;
+		__atomic_add_fetch(&upstream_udp, 1, __ATOMIC_RELAXED);
+
+		if(rng_unit(&state) * 100.0 < conf.loss)
+		{
+			__atomic_add_fetch(&upstream_dropped, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		const size_t anslen = upstream_answer(pkt, len, sizeof(pkt));
+		if(anslen == 0)
+			continue;
+
+		const unsigned long long delay = upstream_delay(&state);
+		if(delay == 0)
+		{
+			sendto(fd, pkt, anslen, 0, (struct sockaddr*)&from, fromlen);
+			continue;
+		}
+
+		delayedAnswer item = { .due = now_ns() + delay, .to = from, .len = anslen };
+		if((item.pkt = malloc(anslen)) == NULL)
+			continue;
+		memcpy(item.pkt, pkt, anslen);
+		delayq_push(&item);
+	}
+	return NULL;
+}
+
+static void *upstream_tcp_conn(void *arg)
+{
+	const int fd = (int)(intptr_t)arg;
+	static unsigned long conns = 0;
+	unsigned long long state = conf.seed ^ (__atomic_add_fetch(&conns, 1, __ATOMIC_RELAXED) * 0x9E3779B97F4A7C15ULL);
+	rng(&state);
+	unsigned char pkt[MAXPACKET + 2];
+
+	while(true)
+	{
+		if(!read_all(fd, pkt, 2))
+			break;
+		const size_t len = (pkt[0] << 8) | pkt[1];
+		if(len > MAXPACKET || !read_all(fd, pkt + 2, len))
+			break;
+		__atomic_add_fetch(&upstream_tcp, 1, __ATOMIC_RELAXED);
+
+		// A lost TCP answer is a dropped connection
+		if(rng_unit(&state) * 100.0 < conf.loss)
+		{
+			__atomic_add_fetch(&upstream_dropped, 1, __ATOMIC_RELAXED);
+			break;
+		}
+
+		const size_t anslen = upstream_answer(pkt + 2, len, MAXPACKET);
+		if(anslen == 0)
+			break;
+
+		const unsigned long long delay = upstream_delay(&state);
+		if(delay > 0)
+			sleep_until(now_ns() + delay);
+
+		pkt[0] = anslen >> 8;
+		pkt[1] = anslen & 0xFF;
+		if(!write_all(fd, pkt, anslen + 2))
+			break;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *upstream_tcp_thread(void *arg)
+{
+	const int fd = *(int*)arg;
+	while(true)
+	{
+		const int conn = accept(fd, NULL, NULL);
+		if(conn < 0)
+			continue;
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if(pthread_create(&thread, &attr, upstream_tcp_conn, (void*)(intptr_t)conn) != 0)
+			close(conn);
+		pthread_attr_destroy(&attr);
+	}
+	return NULL;
+}
+
+static bool start_upstream(void)
+{
+	static int udpfd = -1, tcpfd = -1;
+	const struct sockaddr_in sa = loopback(INADDR_LOOPBACK, conf.upstreamport);
+	const int one = 1;
+
+	udpfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	tcpfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(udpfd < 0 || tcpfd < 0)
+		return false;
+	setsockopt(tcpfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if(bind(udpfd, (const struct sockaddr*)&sa, sizeof(sa)) != 0 ||
+	   bind(tcpfd, (const struct sockaddr*)&sa, sizeof(sa)) != 0 ||
+	   listen(tcpfd, 128) != 0)
+	{
+		fprintf(stderr, "Cannot bind stand-in upstream to 127.0.0.1#%u: %s\n",
+		        conf.upstreamport, strerror(errno));
+		return false;
+	}
+	delayq.fd = udpfd;
+
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, delayq_thread, NULL) != 0 ||
+	   pthread_create(&thread, NULL, upstream_udp_thread, &udpfd) != 0 ||
+	   pthread_create(&thread, NULL, upstream_tcp_thread, &tcpfd) != 0)
+		return false;
+	return true;
+}
+
+/* ---------------------------------------------------------------------
+ * Query sources
+ * ------------------------------------------------------------------- */
+
+typedef struct {
+	unsigned char *pkt;
+	unsigned short len;
+	unsigned short client;
+	unsigned long long ts;
+} capturedQuery;
+
+static capturedQuery *captured = NULL;
+static size_t ncaptured = 0;
+
+static uint32_t swap32(const uint32_t x, const bool swap)
+{
+	return swap ? __builtin_bswap32(x) : x;
+}
+
+// Reads the queries (QR = 0) out of a DLT_RAW pcap as written by dump.c
+static bool load_pcap(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL)
+	{
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	struct {
+		uint32_t magic;
+		uint16_t major, minor;
+		uint32_t zone, sigfigs, snaplen, network;
+	} header;
+	if(fread(&header, sizeof(header), 1, fp) != 1 ||
+	   (header.magic != 0xa1b2c3d4 && header.magic != 0xd4c3b2a1))
+	{
+		fprintf(stderr, "%s is not a pcap file\n", path);
+		fclose(fp);
+		return false;
+	}
+	const bool swap = header.magic == 0xd4c3b2a1;
+	const uint32_t network = swap32(header.network, swap);
+	if(network != 101 && network != 1)
+	{
+		fprintf(stderr, "%s: unsupported link type %u\n", path, network);
+		fclose(fp);
+		return false;
+	}
+
+	size_t size = 0;
+	unsigned char buf[65536];
+	struct { uint32_t sec, usec, incl, orig; } rec;
+	while(fread(&rec, sizeof(rec), 1, fp) == 1)
+	{
+		const uint32_t incl = swap32(rec.incl, swap);
+		if(incl > sizeof(buf) || fread(buf, incl, 1, fp) != 1)
+			break;
+
+		size_t off = network == 1 ? 14 : 0;
+		if(off + 1 > incl)
+			continue;
+		const unsigned char *src;
+		size_t srclen;
+		if((buf[off] >> 4) == 4 && off + 20 <= incl && buf[off + 9] == IPPROTO_UDP)
+		{
+			src = buf + off + 12;
+			srclen = 4;
+			off += (buf[off] & 0x0F) * 4;
+		}
+		else if((buf[off] >> 4) == 6 && off + 40 <= incl && buf[off + 6] == IPPROTO_UDP)
+		{
+			src = buf + off + 8;
+			srclen = 16;
+			off += 40;
+		}
+		else
+			continue;
+
+		// Skip the UDP header, keep only queries
+		off += 8;
+		if(off + 12 > incl || (buf[off + 2] & 0x80) != 0)
+			continue;
+
+		if(ncaptured == size)
+		{
+			size = size ? 2 * size : 1024;
+			capturedQuery *grown = realloc(captured, size * sizeof(capturedQuery));
+			if(grown == NULL)
+				break;
+			captured = grown;
+		}
+		capturedQuery *q = &captured[ncaptured];
+		q->len = incl - off;
+		q->client = fnv1a(src, srclen) % conf.clients;
+		q->ts = swap32(rec.sec, swap) * 1000000000ULL + swap32(rec.usec, swap) * 1000ULL;
+		if((q->pkt = malloc(q->len)) == NULL)
+			break;
+		memcpy(q->pkt, buf + off, q->len);
+		ncaptured++;
+	}
+	fclose(fp);
+
+	if(ncaptured == 0)
+	{
+		fprintf(stderr, "%s contains no DNS queries\n", path);
+		return false;
+	}
+	return true;
+}
+
+static size_t encode_name(unsigned char *pkt, const char *name)
+{
+	size_t pos = 0;
+	while(*name)
+	{
+		const char *dot = strchr(name, '.');
+		const size_t len = dot ? (size_t)(dot - name) : strlen(name);
+		pkt[pos++] = len;
+		memcpy(pkt + pos, name, len);
+		pos += len;
+		name += len + (dot ? 1 : 0);
+	}
+	pkt[pos++] = 0;
+	return pos;
+}
+
+static size_t synthetic_query(unsigned char *pkt, const unsigned int domain, const bool blocked,
+                              const bool aaaa)
+{
+	char name[64];
+	snprintf(name, sizeof(name), blocked ? "ad%u.blocked.load.test" : "d%u.load.test", domain);
+	memset(pkt, 0, 12);
+	pkt[2] = 0x01; // RD
+	pkt[5] = 1; // QDCOUNT
+	size_t pos = 12 + encode_name(pkt + 12, name);
+	pkt[pos++] = 0;
+	pkt[pos++] = aaaa ? 28 : 1;
+	pkt[pos++] = 0;
+	pkt[pos++] = 1;
+	return pos;
+}
+
+/* ---------------------------------------------------------------------
+ * Load generator
+ * ------------------------------------------------------------------- */
+
+// Latencies in microseconds indexed by query number, UINT32_MAX while pending
+static uint32_t *latency = NULL;
+static bool *viatcp = NULL;
+static unsigned long sent_udp = 0, sent_tcp = 0, answered = 0, errors = 0, sent_blocked = 0;
+static unsigned long long first_send = 0, last_send = 0, last_answer = 0;
+
+// UDP queries in flight, indexed by DNS ID
+static struct {
+	unsigned long long sent;
+	unsigned long qnum;
+} inflight[65536];
+
+static int clientfd[MAXCLIENTS];
+
+static void record_answer(const unsigned long qnum, const unsigned long long sent)
+{
+	const unsigned long long now = now_ns();
+	latency[qnum] = (now - sent) / 1000;
+	__atomic_add_fetch(&answered, 1, __ATOMIC_RELAXED);
+	unsigned long long prev = __atomic_load_n(&last_answer, __ATOMIC_RELAXED);
+	while(prev < now && !__atomic_compare_exchange_n(&last_answer, &prev, now, false,
+	                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void *udp_receiver(void *arg)
+{
+	(void)arg;
+	struct pollfd *pfd = calloc(conf.clients, sizeof(struct pollfd));
+	if(pfd == NULL)
+		return NULL;
+	for(unsigned int i = 0; i < conf.clients; i++)
+	{
+		pfd[i].fd = clientfd[i];
+		pfd[i].events = POLLIN;
+	}
+
+	unsigned char pkt[MAXPACKET];
+	while(!interrupted)
+	{
+		if(poll(pfd, conf.clients, 100) <= 0)
+			continue;
+		for(unsigned int i = 0; i < conf.clients; i++)
+		{
+			if(!(pfd[i].revents & POLLIN))
+				continue;
+			ssize_t len;
+			while((len = recv(clientfd[i], pkt, sizeof(pkt), MSG_DONTWAIT)) >= 12)
+			{
+				const unsigned short id = (pkt[0] << 8) | pkt[1];
+				const unsigned long long sent = __atomic_exchange_n(&inflight[id].sent, 0, __ATOMIC_ACQUIRE);
+				if(sent != 0)
+					record_answer(inflight[id].qnum, sent);
+			}
+		}
+	}
+	free(pfd);
+	return NULL;
+}
+
+// TCP queries are handed to a small pool of workers, one connection per query
+typedef struct {
+	unsigned long qnum;
+	unsigned long long sent;
+	unsigned int client;
+	unsigned short len;
+	unsigned char pkt[MAXPACKET];
+} tcpJob;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	tcpJob *jobs;
+	size_t head, tail, size;
+	bool done;
+} tcpq = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static bool tcp_query(const tcpJob *job)
+{
+	const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+		return false;
+
+	const struct timeval tv = { .tv_sec = conf.timeout_ms / 1000, .tv_usec = (conf.timeout_ms % 1000) * 1000 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	const struct sockaddr_in local = loopback(client_addr(job->client), 0);
+	const struct sockaddr_in server = loopback(INADDR_LOOPBACK, conf.dnsport);
+	unsigned char buf[MAXPACKET + 2];
+	buf[0] = job->len >> 8;
+	buf[1] = job->len & 0xFF;
+	memcpy(buf + 2, job->pkt, job->len);
+
+	bool ok = bind(fd, (const struct sockaddr*)&local, sizeof(local)) == 0 &&
+	          connect(fd, (const struct sockaddr*)&server, sizeof(server)) == 0 &&
+	          write_all(fd, buf, job->len + 2) &&
+	          read_all(fd, buf, 2);
+	if(ok)
+	{
+		const size_t len = (buf[0] << 8) | buf[1];
+		ok = len <= MAXPACKET && read_all(fd, buf + 2, len);
+	}
+	close(fd);
+	return ok;
+}
+
+static void *tcp_worker(void *arg)
+{
+	(void)arg;
+	tcpJob job;
+	while(true)
+	{
+		pthread_mutex_lock(&tcpq.lock);
+		while(tcpq.head == tcpq.tail && !tcpq.done)
+			pthread_cond_wait(&tcpq.cond, &tcpq.lock);
+		if(tcpq.head == tcpq.tail)
+		{
+			pthread_mutex_unlock(&tcpq.lock);
+			break;
+		}
+		job = tcpq.jobs[tcpq.head++ % tcpq.size];
+		pthread_cond_broadcast(&tcpq.cond);
+		pthread_mutex_unlock(&tcpq.lock);
+
+		if(tcp_query(&job))
+			record_answer(job.qnum, job.sent);
+		else
+			__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void tcpq_push(const tcpJob *job)
+{
+	pthread_mutex_lock(&tcpq.lock);
+	// Block the generator rather than grow without bound
+	while(tcpq.tail - tcpq.head == tcpq.size)
+		pthread_cond_wait(&tcpq.cond, &tcpq.lock);
+	tcpq.jobs[tcpq.tail++ % tcpq.size] = *job;
+	pthread_cond_broadcast(&tcpq.cond);
+	pthread_mutex_unlock(&tcpq.lock);
+}
+
+static bool open_clients(void)
+{
+	for(unsigned int i = 0; i < conf.clients; i++)
+	{
+		const struct sockaddr_in sa = loopback(client_addr(i), 0);
+		clientfd[i] = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if(clientfd[i] < 0 || bind(clientfd[i], (const struct sockaddr*)&sa, sizeof(sa)) != 0)
+		{
+			fprintf(stderr, "Cannot bind client socket to %s: %s\n",
+			        inet_ntoa(sa.sin_addr), strerror(errno));
+			return false;
+		}
+	}
+	return true;
+}
+
+static void generate(void)
+{
+	unsigned long long state = conf.seed;
+	double *cdf = NULL;
+	if(captured == NULL && (cdf = zipf_cdf(conf.domains, conf.zipf)) == NULL)
+		return;
+
+	const struct sockaddr_in server = loopback(INADDR_LOOPBACK, conf.dnsport);
+	const unsigned long long interval = conf.rate > 0.0 ? (unsigned long long)(1e9 / conf.rate) : 0ULL;
+	const unsigned long long start = now_ns();
+	first_send = start;
+	tcpJob job;
+
+	for(unsigned long i = 0; i < conf.queries && !interrupted; i++)
+	{
+		// Pace the queries: either at the configured rate or, for
+		// captures replayed with -S, following the original timing
+		unsigned long long due = start + i * interval;
+		if(captured != NULL && conf.speed > 0.0)
+		{
+			const capturedQuery *first = &captured[0], *q = &captured[i % ncaptured];
+			const unsigned long long loop = captured[ncaptured - 1].ts - first->ts + 1;
+			const unsigned long long offset = (i / ncaptured) * loop + q->ts - first->ts;
+			due = start + (unsigned long long)(offset / conf.speed);
+		}
+		if(due > now_ns())
+			sleep_until(due);
+
+		if(captured != NULL)
+		{
+			const capturedQuery *q = &captured[i % ncaptured];
+			memcpy(job.pkt, q->pkt, q->len);
+			job.len = q->len;
+			job.client = q->client;
+		}
+		else
+		{
+			const bool blocked = rng_unit(&state) * 100.0 < conf.blocked;
+			const bool aaaa = rng_unit(&state) * 100.0 < conf.aaaa;
+			const unsigned int domain = zipf_pick(cdf, conf.domains, rng_unit(&state));
+			job.len = synthetic_query(job.pkt, domain, blocked, aaaa);
+			job.client = rng(&state) % conf.clients;
+			if(blocked)
+				sent_blocked++;
+		}
+
+		const unsigned short id = i & 0xFFFF;
+		job.pkt[0] = id >> 8;
+		job.pkt[1] = id & 0xFF;
+		job.qnum = i;
+		latency[i] = UINT32_MAX;
+
+		if(rng_unit(&state) * 100.0 < conf.tcp)
+		{
+			viatcp[i] = true;
+			job.sent = now_ns();
+			tcpq_push(&job);
+			sent_tcp++;
+		}
+		else
+		{
+			inflight[id].qnum = i;
+			__atomic_store_n(&inflight[id].sent, now_ns(), __ATOMIC_RELEASE);
+			if(sendto(clientfd[job.client], job.pkt, job.len, 0,
+			          (const struct sockaddr*)&server, sizeof(server)) < 0)
+			{
+				__atomic_store_n(&inflight[id].sent, 0, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+			}
+			sent_udp++;
+		}
+	}
+	last_send = now_ns();
+	free(cdf);
+}
+
+/* ---------------------------------------------------------------------
+ * pihole-FTL
+ * ------------------------------------------------------------------- */
+
+static pid_t ftlpid = -1;
+static char workdir[256];
+
+static bool write_file(const char *name, void (*writer)(FILE*))
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s", workdir, name);
+	FILE *fp = fopen(path, "w");
+	if(fp == NULL)
+	{
+		fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	if(writer != NULL)
+		writer(fp);
+	fclose(fp);
+	return true;
+}
+
+static void write_FTLconf(FILE *fp)
+{
+	fprintf(fp, "LOGFILE=%s/pihole-FTL.log\n", workdir);
+	fprintf(fp, "DBFILE=%s/pihole-FTL.db\n", workdir);
+	fprintf(fp, "MAXDBDAYS=0\n");
+	fprintf(fp, "PIDFILE=%s/pihole-FTL.pid\n", workdir);
+	fprintf(fp, "PORTFILE=%s/pihole-FTL.port\n", workdir);
+	fprintf(fp, "SOCKETFILE=%s/FTL.sock\n", workdir);
+	fprintf(fp, "FTLPORT=%u\n", conf.apiport);
+	fprintf(fp, "SETUPVARSFILE=%s/setupVars.conf\n", workdir);
+	fprintf(fp, "GRAVITYFILE=%s/gravity.list\n", workdir);
+	fprintf(fp, "BLACKLISTFILE=%s/black.list\n", workdir);
+	fprintf(fp, "WHITELISTFILE=%s/whitelist.txt\n", workdir);
+	fprintf(fp, "REGEXLISTFILE=%s/regex.list\n", workdir);
+	fprintf(fp, "PRIVACYLEVEL=0\n");
+	fprintf(fp, "RESOLVE_IPV4=no\n");
+	fprintf(fp, "RESOLVE_IPV6=no\n");
+}
+
+static void write_gravity(FILE *fp)
+{
+	if(captured != NULL)
+		return;
+	for(unsigned int i = 0; i < conf.domains; i++)
+		fprintf(fp, "0.0.0.0 ad%u.blocked.load.test\n", i);
+}
+
+static int api_connect(void)
+{
+	const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	const struct sockaddr_in sa = loopback(INADDR_LOOPBACK, conf.apiport);
+	if(fd < 0)
+		return -1;
+	if(connect(fd, (const struct sockaddr*)&sa, sizeof(sa)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool start_FTL(void)
+{
+	if(conf.workdir != NULL)
+	{
+		snprintf(workdir, sizeof(workdir), "%s", conf.workdir);
+		mkdir(workdir, 0755);
+	}
+	else
+	{
+		snprintf(workdir, sizeof(workdir), "/tmp/pihole-FTL-load.XXXXXX");
+		if(mkdtemp(workdir) == NULL)
+		{
+			fprintf(stderr, "Cannot create scratch directory: %s\n", strerror(errno));
+			return false;
+		}
+	}
+
+	if(!write_file("pihole-FTL.conf", write_FTLconf) ||
+	   !write_file("gravity.list", write_gravity) ||
+	   !write_file("black.list", NULL) ||
+	   !write_file("whitelist.txt", NULL) ||
+	   !write_file("regex.list", NULL) ||
+	   !write_file("setupVars.conf", NULL))
+		return false;
+
+	char port[16], server[64], addnhosts[300], cachesize[] = "--cache-size=10000";
+	snprintf(port, sizeof(port), "%u", conf.dnsport);
+	snprintf(server, sizeof(server), "--server=127.0.0.1#%u", conf.upstreamport);
+	snprintf(addnhosts, sizeof(addnhosts), "--addn-hosts=%s/gravity.list", workdir);
+
+	ftlpid = fork();
+	if(ftlpid < 0)
+		return false;
+	if(ftlpid == 0)
+	{
+		// FTL falls back to ./pihole-FTL.conf when there is none in /etc/pihole
+		if(chdir(workdir) != 0)
+			_exit(1);
+		char *ftl = realpath(conf.ftl, NULL);
+		if(ftl == NULL)
+			_exit(1);
+		const char *args[] = { ftl, "no-daemon", "--", "-C", "/dev/null", "-p", port,
+		                       "--listen-address=127.0.0.1", "--bind-interfaces", "--no-resolv",
+		                       "--no-hosts", "--pid-file=", server, addnhosts, cachesize,
+		                       // Don't drop privileges to nobody, the scratch files belong to us
+		                       geteuid() == 0 ? "--user=root" : NULL, NULL };
+		execv(ftl, (char* const*)args);
+		_exit(127);
+	}
+
+	// Wait for the API to come up
+	for(int i = 0; i < 10 * STARTUP_TIMEOUT; i++)
+	{
+		int status;
+		if(waitpid(ftlpid, &status, WNOHANG) == ftlpid)
+		{
+			fprintf(stderr, "pihole-FTL exited during startup, see %s/pihole-FTL.log\n", workdir);
+			ftlpid = -1;
+			return false;
+		}
+		const int fd = api_connect();
+		if(fd >= 0)
+		{
+			close(fd);
+			return true;
+		}
+		usleep(100000);
+	}
+	fprintf(stderr, "pihole-FTL did not open its API port %u within %is\n", conf.apiport, STARTUP_TIMEOUT);
+	return false;
+}
+
+static void stop_FTL(void)
+{
+	if(ftlpid > 0)
+	{
+		kill(ftlpid, SIGTERM);
+		waitpid(ftlpid, NULL, 0);
+		ftlpid = -1;
+	}
+	if(conf.external || conf.keep || workdir[0] == '\0')
+		return;
+
+	DIR *dir = opendir(workdir);
+	if(dir == NULL)
+		return;
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL)
+		if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+			unlinkat(dirfd(dir), entry->d_name, 0);
+	closedir(dir);
+	rmdir(workdir);
+}
+
+// Waits until the resolver answers queries, the API alone is not enough
+static bool wait_for_dns(void)
+{
+	const struct sockaddr_in server = loopback(INADDR_LOOPBACK, conf.dnsport);
+	unsigned char pkt[MAXPACKET];
+	for(int i = 0; i < 10 * STARTUP_TIMEOUT; i++)
+	{
+		const size_t len = synthetic_query(pkt, 0, false, false);
+		sendto(clientfd[0], pkt, len, 0, (const struct sockaddr*)&server, sizeof(server));
+		struct pollfd pfd = { .fd = clientfd[0], .events = POLLIN };
+		if(poll(&pfd, 1, 100) > 0 && recv(clientfd[0], pkt, sizeof(pkt), 0) >= 12)
+			return true;
+	}
+	fprintf(stderr, "No DNS answers from 127.0.0.1#%u\n", conf.dnsport);
+	return false;
+}
+
+enum { STAT_QUERIES, STAT_BLOCKED, STAT_FORWARDED, STAT_CACHED, STAT_MAX };
+static const char *statnames[STAT_MAX] = {
+	"dns_queries_today", "ads_blocked_today", "queries_forwarded", "queries_cached"
+};
+
+static bool get_stats(long stats[STAT_MAX])
+{
+	const int fd = api_connect();
+	if(fd < 0)
+		return false;
+	const char request[] = ">stats >quit";
+	if(!write_all(fd, request, sizeof(request) - 1))
+	{
+		close(fd);
+		return false;
+	}
+
+	char buf[8192];
+	size_t len = 0;
+	ssize_t ret;
+	while(len < sizeof(buf) - 1 && (ret = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += ret;
+	buf[len] = '\0';
+	close(fd);
+
+	unsigned int found = 0;
+	for(unsigned int i = 0; i < STAT_MAX; i++)
+	{
+		const char *line = strstr(buf, statnames[i]);
+		if(line != NULL && sscanf(line + strlen(statnames[i]), "%li", &stats[i]) == 1)
+			found++;
+	}
+	return found == STAT_MAX;
+}
+
+/* ---------------------------------------------------------------------
+ * Report
+ * ------------------------------------------------------------------- */
+
+static int cmp_uint32(const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static void print_latency(const char *label, const bool tcp)
+{
+	uint32_t *sorted = malloc(conf.queries * sizeof(uint32_t));
+	if(sorted == NULL)
+		return;
+	size_t n = 0;
+	double sum = 0.0;
+	for(unsigned long i = 0; i < conf.queries; i++)
+	{
+		if(viatcp[i] != tcp || latency[i] == UINT32_MAX)
+			continue;
+		sorted[n++] = latency[i];
+		sum += latency[i];
+	}
+	if(n > 0)
+	{
+		qsort(sorted, n, sizeof(uint32_t), cmp_uint32);
+		printf("%-4s %9zu answers   mean %8.1f  p50 %8u  p90 %8u  p99 %8u  p99.9 %8u  max %8u us\n",
+		       label, n, sum / n, sorted[n / 2], sorted[n * 90 / 100], sorted[n * 99 / 100],
+		       sorted[n * 999 / 1000], sorted[n - 1]);
+	}
+	free(sorted);
+}
+
+static bool report(const long before[STAT_MAX], const long after[STAT_MAX], const bool havestats)
+{
+	const unsigned long sent = sent_udp + sent_tcp;
+	const double sendtime = (last_send - first_send) / 1e9;
+	const double total = ((last_answer > last_send ? last_answer : last_send) - first_send) / 1e9;
+
+	printf("Sent %lu queries (%lu UDP, %lu TCP) in %.2fs: offered %.0f qps\n",
+	       sent, sent_udp, sent_tcp, sendtime, sendtime > 0.0 ? sent / sendtime : 0.0);
+	printf("Answered %lu (%.2f%%), %lu timed out, %lu errors: achieved %.0f qps\n",
+	       answered, sent > 0 ? 100.0 * answered / sent : 0.0,
+	       sent - answered - errors, errors, total > 0.0 ? answered / total : 0.0);
+	printf("Upstream saw %lu UDP and %lu TCP queries, dropped %lu\n",
+	       upstream_udp, upstream_tcp, upstream_dropped);
+	print_latency("UDP", false);
+	print_latency("TCP", true);
+
+	if(!havestats)
+	{
+		printf(">stats not available, skipping consistency checks\n");
+		return true;
+	}
+
+	long delta[STAT_MAX];
+	for(unsigned int i = 0; i < STAT_MAX; i++)
+		delta[i] = after[i] - before[i];
+	printf("FTL counted %li queries: %li forwarded, %li cached, %li blocked\n",
+	       delta[STAT_QUERIES], delta[STAT_FORWARDED], delta[STAT_CACHED], delta[STAT_BLOCKED]);
+
+	// Every query that reached FTL must be counted exactly once and
+	// classified at most once
+	bool ok = true;
+	if(delta[STAT_QUERIES] != (long)(sent - errors))
+	{
+		printf("MISMATCH: FTL counted %li queries, %lu were sent\n", delta[STAT_QUERIES], sent - errors);
+		ok = false;
+	}
+	if(delta[STAT_FORWARDED] + delta[STAT_CACHED] + delta[STAT_BLOCKED] > delta[STAT_QUERIES])
+	{
+		printf("MISMATCH: forwarded + cached + blocked exceeds the number of queries\n");
+		ok = false;
+	}
+	if(captured == NULL && delta[STAT_BLOCKED] != (long)sent_blocked)
+	{
+		printf("MISMATCH: FTL counted %li blocked queries, %lu were sent\n", delta[STAT_BLOCKED], sent_blocked);
+		ok = false;
+	}
+	if(!conf.external && delta[STAT_FORWARDED] < (long)(upstream_udp + upstream_tcp))
+	{
+		printf("MISMATCH: upstream saw %lu queries but FTL counted %li as forwarded\n",
+		       upstream_udp + upstream_tcp, delta[STAT_FORWARDED]);
+		ok = false;
+	}
+	printf(">stats consistency: %s\n", ok ? "OK" : "FAILED");
+	return ok;
+}
+
+/* ---------------------------------------------------------------------
+ * Main
+ * ------------------------------------------------------------------- */
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options]\n\n", name);
+	printf("Load:\n");
+	printf("\t-r <qps>      Target query rate, 0 = as fast as possible (%.0f)\n", conf.rate);
+	printf("\t-t <seconds>  Duration, used when -n is not given (%.0f)\n", conf.duration);
+	printf("\t-n <count>    Number of queries to send\n");
+	printf("\t-d <count>    Distinct domains (%u)\n", conf.domains);
+	printf("\t-c <count>    Distinct clients, 127.1.0.1 upwards (%u)\n", conf.clients);
+	printf("\t-z <s>        Zipf exponent of the domain popularity (%.1f)\n", conf.zipf);
+	printf("\t-b <percent>  Queries for gravity-blocked domains (%.0f)\n", conf.blocked);
+	printf("\t-6 <percent>  AAAA instead of A queries (%.0f)\n", conf.aaaa);
+	printf("\t-T <percent>  Queries sent over TCP (%.0f)\n", conf.tcp);
+	printf("\t-W <count>    Concurrent TCP clients (%u)\n", conf.tcpworkers);
+	printf("\t-o <ms>       Client timeout (%u)\n", conf.timeout_ms);
+	printf("\t-s <seed>     Random seed\n");
+	printf("\t-R <file>     Replay the queries in a pcap written by --dumpfile\n");
+	printf("\t-S <factor>   Replay the pcap with its own timing, sped up by <factor>\n");
+	printf("Stand-in upstream:\n");
+	printf("\t-L <ms>       Answer latency (%.0f)\n", conf.latency_ms);
+	printf("\t-J <ms>       Uniform latency jitter (%.0f)\n", conf.jitter_ms);
+	printf("\t-l <percent>  Dropped queries (%.0f)\n", conf.loss);
+	printf("\t-N <percent>  Names answered with NXDOMAIN (%.0f)\n", conf.nxdomain);
+	printf("\t-a <list>     Comma-separated IPv4/IPv6 answer set (192.0.2.1,2001:db8::1)\n");
+	printf("\t-e <seconds>  Answer TTL (%u)\n", conf.ttl);
+	printf("\t-u <port>     Upstream port (%u)\n", conf.upstreamport);
+	printf("pihole-FTL:\n");
+	printf("\t-f <binary>   pihole-FTL to start (%s)\n", conf.ftl);
+	printf("\t-x            Don't start pihole-FTL, use the running one\n");
+	printf("\t-p <port>     DNS port (%u)\n", conf.dnsport);
+	printf("\t-P <port>     API port (%u)\n", conf.apiport);
+	printf("\t-w <dir>      Working directory (a temporary one)\n");
+	printf("\t-k            Keep the working directory\n");
+	printf("\nThe stand-in upstream only answers A and AAAA queries from the answer set,\n");
+	printf("everything else gets NODATA. Shared memory is shared with any other running\n");
+	printf("pihole-FTL, so stop that first unless -x is used.\n");
+}
+
+static bool parse_answers(char *list)
+{
+	for(char *tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ","))
+	{
+		if(nanswers4 < MAXANSWERS && inet_pton(AF_INET, tok, &answers4[nanswers4]) == 1)
+			nanswers4++;
+		else if(nanswers6 < MAXANSWERS && inet_pton(AF_INET6, tok, &answers6[nanswers6]) == 1)
+			nanswers6++;
+		else
+		{
+			fprintf(stderr, "Invalid answer address: %s\n", tok);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void sighandler(const int sig)
+{
+	(void)sig;
+	interrupted = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while((opt = getopt(argc, argv, "r:t:n:d:c:z:b:6:T:W:o:s:R:S:L:J:l:N:a:e:u:f:xp:P:w:kh")) != -1)
+	{
+		switch(opt)
+		{
+			case 'r': conf.rate = atof(optarg); break;
+			case 't': conf.duration = atof(optarg); break;
+			case 'n': conf.queries = strtoul(optarg, NULL, 10); break;
+			case 'd': conf.domains = strtoul(optarg, NULL, 10); break;
+			case 'c': conf.clients = strtoul(optarg, NULL, 10); break;
+			case 'z': conf.zipf = atof(optarg); break;
+			case 'b': conf.blocked = atof(optarg); break;
+			case '6': conf.aaaa = atof(optarg); break;
+			case 'T': conf.tcp = atof(optarg); break;
+			case 'W': conf.tcpworkers = strtoul(optarg, NULL, 10); break;
+			case 'o': conf.timeout_ms = strtoul(optarg, NULL, 10); break;
+			case 's': conf.seed = strtoull(optarg, NULL, 10) | 1; break;
+			case 'R': conf.pcap = optarg; break;
+			case 'S': conf.speed = atof(optarg); break;
+			case 'L': conf.latency_ms = atof(optarg); break;
+			case 'J': conf.jitter_ms = atof(optarg); break;
+			case 'l': conf.loss = atof(optarg); break;
+			case 'N': conf.nxdomain = atof(optarg); break;
+			case 'a': if(!parse_answers(optarg)) return EXIT_FAILURE; break;
+			case 'e': conf.ttl = strtoul(optarg, NULL, 10); break;
+			case 'u': conf.upstreamport = atoi(optarg); break;
+			case 'f': conf.ftl = optarg; break;
+			case 'x': conf.external = true; break;
+			case 'p': conf.dnsport = atoi(optarg); break;
+			case 'P': conf.apiport = atoi(optarg); break;
+			case 'w': conf.workdir = optarg; break;
+			case 'k': conf.keep = true; break;
+			default: usage(argv[0]); return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if(conf.domains == 0 || conf.clients == 0 || conf.clients > MAXCLIENTS || conf.tcpworkers == 0)
+	{
+		fprintf(stderr, "Need 1-%u clients, at least one domain and one TCP worker\n", MAXCLIENTS);
+		return EXIT_FAILURE;
+	}
+	if(nanswers4 == 0 && nanswers6 == 0)
+	{
+		char defaults[] = "192.0.2.1,2001:db8::1";
+		parse_answers(defaults);
+	}
+	if(conf.pcap != NULL && !load_pcap(conf.pcap))
+		return EXIT_FAILURE;
+	if(conf.queries == 0)
+	{
+		if(captured != NULL && conf.speed > 0.0)
+			conf.queries = ncaptured;
+		else
+			conf.queries = conf.rate > 0.0 ? (unsigned long)(conf.rate * conf.duration) : 100000UL;
+	}
+
+	latency = calloc(conf.queries, sizeof(uint32_t));
+	viatcp = calloc(conf.queries, sizeof(bool));
+	tcpq.size = 4096;
+	tcpq.jobs = calloc(tcpq.size, sizeof(tcpJob));
+	if(latency == NULL || viatcp == NULL || tcpq.jobs == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	int ret = EXIT_FAILURE;
+	if(!start_upstream() || !open_clients())
+		return EXIT_FAILURE;
+	if(!conf.external && !start_FTL())
+		goto end;
+	if(!wait_for_dns())
+		goto end;
+
+	long before[STAT_MAX] = { 0 }, after[STAT_MAX] = { 0 };
+	bool havestats = get_stats(before);
+	// The probe above already went upstream
+	const unsigned long probed = upstream_udp + upstream_tcp;
+
+	pthread_t receiver;
+	pthread_t *workers = calloc(conf.tcpworkers, sizeof(pthread_t));
+	if(workers == NULL || pthread_create(&receiver, NULL, udp_receiver, NULL) != 0)
+		goto end;
+	for(unsigned int i = 0; i < conf.tcpworkers; i++)
+		pthread_create(&workers[i], NULL, tcp_worker, NULL);
+
+	printf("Sending %lu queries to 127.0.0.1#%u from %u clients\n", conf.queries, conf.dnsport, conf.clients);
+	generate();
+
+	pthread_mutex_lock(&tcpq.lock);
+	tcpq.done = true;
+	pthread_cond_broadcast(&tcpq.cond);
+	pthread_mutex_unlock(&tcpq.lock);
+	for(unsigned int i = 0; i < conf.tcpworkers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	// Give late UDP answers the client timeout to arrive
+	const unsigned long long deadline = now_ns() + conf.timeout_ms * 1000000ULL;
+	while(!interrupted && __atomic_load_n(&answered, __ATOMIC_RELAXED) + errors < sent_udp + sent_tcp &&
+	      now_ns() < deadline)
+		usleep(10000);
+	interrupted = 1;
+	pthread_join(receiver, NULL);
+
+	upstream_udp -= probed < upstream_udp ? probed : upstream_udp;
+	if(havestats)
+		havestats = get_stats(after);
+	ret = report(before, after, havestats) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+end:
+	stop_FTL();
+	return ret;
+}
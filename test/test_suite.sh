@@ -51,6 +51,16 @@ load 'libs/bats-support/load'
   [[ ${lines[4]} == "---EOM---" ]]
 }
 
+@test "Clients over time (most active)" {
+  run bash -c 'echo ">ClientsoverTime (2)" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} == "2" ]]
+  [[ ${lines[2]} =~ "192.168.2.208" ]]
+  [[ ${lines[3]} =~ "127.0.0.1" ]]
+  [[ ${lines[@]: -1} == "---EOM---" ]]
+}
+
 @test "Top Domains (descending, default)" {
   run bash -c 'echo ">top-domains" | nc -v 127.0.0.1 4711'
   echo "output: ${lines[@]}"
@@ -99,6 +109,14 @@ load 'libs/bats-support/load'
   [[ ${lines[2]} == "---EOM---" ]]
 }
 
+@test "Over Time (hourly rollup)" {
+  run bash -c 'echo ">overTime resolution=3600" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} =~ "7 2" ]]
+  [[ ${lines[2]} == "---EOM---" ]]
+}
+
 @test "Forward Destinations" {
   run bash -c 'echo ">forward-dest" | nc -v 127.0.0.1 4711'
   echo "output: ${lines[@]}"
@@ -176,6 +194,16 @@ load 'libs/bats-support/load'
   [[ ${lines[2]} == "---EOM---" ]]
 }
 
+@test "Get all queries (paginated)" {
+  run bash -c 'echo ">getallqueries after=1 limit=2" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} =~ "IPv4 example.com" ]]
+  [[ ${lines[2]} =~ "IPv4 play.google.com" ]]
+  [[ ${lines[3]} == "cursor 3" ]]
+  [[ ${lines[4]} == "---EOM---" ]]
+}
+
 @test "Memory" {
   run bash -c 'echo ">memory" | nc -v 127.0.0.1 4711'
   echo "output: ${lines[@]}"
@@ -201,6 +229,25 @@ load 'libs/bats-support/load'
   [[ ${lines[2]} == "---EOM---" ]]
 }
 
+@test "Lock statistics" {
+  run bash -c 'echo ">lockstats" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} =~ "# site function wait|hold count total_ms max_ms histogram" ]]
+  [[ ${lines[2]} =~ "() wait " ]]
+  [[ ${lines[2]} =~ " hold " ]]
+}
+
+@test "Hook timing" {
+  run bash -c 'echo ">timing" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} =~ "# hook count mean_ns p50_ns p90_ns p99_ns max_ns histogram" ]]
+  [[ ${lines[2]} =~ "new_query " ]]
+  [[ ${lines[12]} =~ "overtime " ]]
+  [[ ${lines[13]} == "---EOM---" ]]
+}
+
 # @test "IPv6 socket connection" {
 #   run bash -c 'echo ">recentBlocked" | nc -v ::1 4711'
 #   echo "output: ${lines[@]}"
@@ -221,6 +268,24 @@ load 'libs/bats-support/load'
   [[ "${lines[@]}" == *"CREATE INDEX idx_queries_timestamps ON queries (timestamp);"* ]]
 }
 
+@test "DB test: Hourly aggregates match the stored queries" {
+  run bash -c 'sqlite3 pihole-FTL.db "SELECT COUNT(*) FROM (SELECT timestamp - timestamp % 3600, status, type, COUNT(*) FROM queries GROUP BY 1, 2, 3 EXCEPT SELECT hour, status, type, count FROM hourly_counts);"'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "0" ]]
+  run bash -c 'sqlite3 pihole-FTL.db "SELECT COUNT(*) FROM (SELECT hour, status, type, count FROM hourly_counts EXCEPT SELECT timestamp - timestamp % 3600, status, type, COUNT(*) FROM queries GROUP BY 1, 2, 3);"'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "0" ]]
+  run bash -c 'sqlite3 pihole-FTL.db "SELECT COUNT(*) FROM (SELECT timestamp - timestamp % 3600, client, COUNT(*) FROM queries GROUP BY 1, 2 EXCEPT SELECT hour, client, count FROM hourly_clients);"'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "0" ]]
+  run bash -c 'sqlite3 pihole-FTL.db "SELECT COUNT(*) FROM (SELECT timestamp - timestamp % 3600, forward, COUNT(*) FROM queries WHERE forward IS NOT NULL GROUP BY 1, 2 EXCEPT SELECT hour, upstream, count FROM hourly_upstreams);"'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "0" ]]
+  run bash -c 'sqlite3 pihole-FTL.db "SELECT COUNT(*) FROM (SELECT timestamp - timestamp % 3600, COUNT(*) FROM queries GROUP BY 1 EXCEPT SELECT hour, SUM(count) FROM hourly_domains GROUP BY 1);"'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "0" ]]
+}
+
 @test "Arguments check: Invalid option" {
   run bash -c './pihole-FTL abc'
   echo "output: ${lines[@]}"
@@ -242,6 +307,17 @@ load 'libs/bats-support/load'
   [[ ${lines[2]} == "d2 ff ff ff ff d2 00 00 00 07 d2 00 00 00 02 ca 41 e4 92 49 d2 00 00 00 06 d2 00 00 00 03 d2 00 00 00 02 d2 00 00 00 03 d2 00 00 00 03 cc 02 c1 " ]]
 }
 
+@test "Regex: suffix rules and wildcard.list block what regexec() would" {
+  dir="$(mktemp -d)"
+  printf '(^|\\.)suffix\\.com$\n^exact\\.org$\n\\.subonly\\.net$\n' > "${dir}/regex.list"
+  printf 'wild.com\r\n  spaced.io  \nfqdn.de.\n*.star.com\n' > "${dir}/wildcard.list"
+  printf 'REGEXLISTFILE=%s/regex.list\nWILDCARDLISTFILE=%s/wildcard.list\n' "${dir}" "${dir}" > "${dir}/pihole-FTL.conf"
+  run bash -c "cd ${dir} && for d in suffix.com a.suffix.com xsuffix.com exact.org a.exact.org subonly.net a.subonly.net wild.com a.wild.com spaced.io a.fqdn.de star.com a.star.com; do $(pwd)/pihole-FTL regex-test \$d || echo \"mismatch \$d\"; done"
+  echo "output: ${lines[@]}"
+  [[ "${lines[*]}" == "match match match match no-match no-match match match no-match no-match no-match no-match match match match match match match match match match match no-match no-match no-match no-match" ]]
+  rm -r "${dir}"
+}
+
 @test "Verify no FATAL warnings are present in the generated log" {
   run bash -c 'grep -c "FATAL" pihole-FTL.log'
   echo "output: ${lines[@]}"
@@ -0,0 +1,80 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2019 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Latency histograms of the resolver hooks
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "timing.h"
+
+const char *timingnames[TIMING_MAX] = {
+	"new_query", "forwarded", "reply", "cache", "dnssec", "upstream_error",
+	"lowercase", "domain_lookup", "client_lookup", "regex", "overtime"
+};
+
+// Updated by the resolver, read and reset by the API threads
+static timingStats timings[TIMING_MAX];
+
+static unsigned long long timing_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long long timing_start(void)
+{
+	// The only cost when timing is disabled
+	if(!config.hooktiming)
+		return 0;
+
+	return timing_clock();
+}
+
+void timing_stop(const int what, const unsigned long long start)
+{
+	if(start == 0)
+		return;
+
+	const unsigned long long ns = timing_clock() - start;
+	unsigned int bin = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+	if(bin >= TIMING_BINS)
+		bin = TIMING_BINS - 1;
+
+	timingStats *t = &timings[what];
+	__atomic_add_fetch(&t->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&t->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&t->hist[bin], 1, __ATOMIC_RELAXED);
+
+	unsigned long long max = __atomic_load_n(&t->max_ns, __ATOMIC_RELAXED);
+	while(ns > max && !__atomic_compare_exchange_n(&t->max_ns, &max, ns, false,
+	                                               __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void get_timing(timingStats *copy)
+{
+	for(int i = 0; i < TIMING_MAX; i++)
+	{
+		copy[i].count = __atomic_load_n(&timings[i].count, __ATOMIC_RELAXED);
+		copy[i].total_ns = __atomic_load_n(&timings[i].total_ns, __ATOMIC_RELAXED);
+		copy[i].max_ns = __atomic_load_n(&timings[i].max_ns, __ATOMIC_RELAXED);
+		for(int j = 0; j < TIMING_BINS; j++)
+			copy[i].hist[j] = __atomic_load_n(&timings[i].hist[j], __ATOMIC_RELAXED);
+	}
+}
+
+void reset_timing(void)
+{
+	for(int i = 0; i < TIMING_MAX; i++)
+	{
+		__atomic_store_n(&timings[i].count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&timings[i].total_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&timings[i].max_ns, 0, __ATOMIC_RELAXED);
+		for(int j = 0; j < TIMING_BINS; j++)
+			__atomic_store_n(&timings[i].hist[j], 0, __ATOMIC_RELAXED);
+	}
+}
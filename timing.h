@@ -0,0 +1,44 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2019 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Hook latency histograms header
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+/// Hooks and hook stages that are timed
+enum { TIMING_NEW_QUERY, TIMING_FORWARDED, TIMING_REPLY, TIMING_CACHE, TIMING_DNSSEC, TIMING_UPSTREAM_ERROR,
+       TIMING_LOWERCASE, TIMING_DOMAIN_LOOKUP, TIMING_CLIENT_LOOKUP, TIMING_REGEX, TIMING_OVERTIME, TIMING_MAX };
+
+/// Bin 0 counts 0 ns, bin k counts [2^(k-1), 2^k) ns, the last bin everything above
+#define TIMING_BINS 32
+
+typedef struct {
+	unsigned long long count;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+	unsigned long long hist[TIMING_BINS];
+} timingStats;
+
+extern const char *timingnames[TIMING_MAX];
+
+/// Start timing a hook or stage
+///
+/// \return the start time, 0 if timing is disabled (config.hooktiming)
+unsigned long long timing_start(void);
+
+/// Account the time since start. Does nothing if start is 0
+void timing_stop(const int what, const unsigned long long start);
+
+/// Copy the statistics of all TIMING_MAX hooks and stages
+void get_timing(timingStats *copy);
+
+/// Zero all statistics
+void reset_timing(void);
+
+#endif //TIMING_H
@@ -0,0 +1,5 @@
+#define GIT_VERSION "bedb5c0-dirty"
+#define GIT_DATE "2026-10-18 17:07:54 +0000"
+#define GIT_BRANCH "master"
+#define GIT_TAG ""
+#define GIT_HASH "bedb5c0-dirty"